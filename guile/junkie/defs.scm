@@ -275,12 +275,14 @@
                                proto (exact->inexact coll-avg) new-h-size new-max-children)
                          (set-mux-hash-size proto new-h-size)
                          (set-max-children proto new-max-children)))))
-      (if (< coll-avg coll-avg-min) ; then make future hashes smaller
-          (if (> h-size h-size-min)
-              (resize coll-avg (max h-size-min (round (/ h-size 2))))))
-      (if (> coll-avg coll-avg-max) ; then make future hashes bigger
-          (if (< h-size h-size-max)
-              (resize coll-avg (min h-size-max (* h-size 2))))))))
+      (if (> h-size 0) ; otherwise parsers use an index that resizes itself
+          (begin
+            (if (< coll-avg coll-avg-min) ; then make future hashes smaller
+                (if (> h-size h-size-min)
+                    (resize coll-avg (max h-size-min (round (/ h-size 2))))))
+            (if (> coll-avg coll-avg-max) ; then make future hashes bigger
+                (if (< h-size h-size-max)
+                    (resize coll-avg (min h-size-max (* h-size 2))))))))))
 
 ;; A thread that will limit UDP/TCP muxers to some hash size and collision rates
 
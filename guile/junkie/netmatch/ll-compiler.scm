@@ -6,6 +6,9 @@
 ;;; Some type checking happened earlier, and more will happen when compiling the generated C code.
 
 (use-modules (ice-9 format)
+             (ice-9 threads) ; for par-map
+             (rnrs bytevectors)
+             ((rnrs io ports) #:select (open-file-input-port get-bytevector-all))
              (srfi srfi-1)
              ((junkie netmatch types) :renamer (symbol-prefix-proc 'type:))
              (junkie tools)
@@ -76,30 +79,214 @@
       (type:stub-code stub)
       "\n/* end */\n")))
 
-; Given a stub, returns the name of the corresponding dynlib
-(define (stub->so stub)
-  (let* ((srcname     (string-copy "/tmp/netmatch-ll.c.XXXXXX"))
-         (srcport     (mkstemp! srcname))
-         (libname     (string-append srcname ".so"))
-         (code        (stub->C stub)))
-    (display code srcport)
+;;; Compiling C takes time (and a compiler), so compiled dynlibs are cached on disk under a name
+;;; that's a digest of all they depend upon: the key given by the caller (typically, the netmatch
+;;; expression), the compiler flags, the version of junkie and its installed headers (which
+;;; define the structures the dynlibs dig into). Thus restarting with an unchanged configuration
+;;; neither generates nor compiles anything.
+;;; What the generation of a stub records for the following ones (such as the types of the
+;;; registers it binds) is saved next to the dynlib, to be replayed when it's found in the cache.
+;;; Additionally, NETMATCH_BUNDLES can list (colon separated) directories of prebuilt dynlibs,
+;;; such as the cache directory of a host running the same junkie (same version and headers),
+;;; so that a sensor without a compiler can load them.
+
+(define cache-dir
+  (or (getenv "NETMATCH_CACHE_DIR") (string-append cachedir "/netmatch")))
+
+(define bundle-dirs
+  (let ((bundles (getenv "NETMATCH_BUNDLES")))
+    (if bundles
+        (filter (lambda (d) (not (string-null? d))) (string-split bundles #\:))
+        '())))
+
+; Returns the cache directory if it's usable, #f otherwise (then we merely compile into /tmp)
+(define writable-cache-dir
+  (let ((dir 'unknown))
+    (lambda ()
+      (if (eq? dir 'unknown)
+          (set! dir (false-if-exception
+                      (begin
+                        (ensure-directories-exist cache-dir)
+                        (and (access? cache-dir W_OK) cache-dir)))))
+      dir)))
+
+(define (compiler-flags)
+  (let ((cppflags (or (getenv "NETMATCH_CPPFLAGS") (string-append build-cppflags " -I" includedir " -D_GNU_SOURCE")))
+        (cflags   (or (getenv "NETMATCH_CFLAGS")   (string-append "-std=c99 " build-cflags)))
+        (ldflags  (or (getenv "NETMATCH_LDFLAGS")  build-ldflags)))
+    (string-append cppflags " " cflags " " ldflags " -fPIC -shared")))
+
+(define (compiler-command srcname libname)
+  (let ((cc (or (getenv "NETMATCH_CC") build-cc)))
+    (string-append cc " " (compiler-flags) " -o " libname " -xc " srcname)))
+
+; FNV-1a on 128 bits, which is plenty to tell our dynlibs apart
+(define digest-init #x6c62272e07bb014262b821756295c58d)
+
+(define (digest-update h bv)
+  (let ((prime (+ (ash 1 88) #x13b))
+        (mask  (1- (ash 1 128))))
+    (fold (lambda (byte h)
+            (logand (* (logxor h byte) prime) mask))
+          h
+          (bytevector->u8-list bv))))
+
+(define (digest->string h)
+  (format #f "~32,'0x" h))
+
+(define (digest str)
+  (digest->string (digest-update digest-init (string->utf8 str))))
+
+; The digest of the names and content of all headers installed under dir (in a stable order)
+(define (headers-digest dir)
+  (let ((paths '()))
+    (letrec ((walk (lambda (dir)
+                     (for-each-entry-in dir
+                       (lambda (path)
+                         (let ((type (stat:type (stat path))))
+                           (cond ((and (eq? type 'directory)
+                                       (not (string-suffix? "/." path))
+                                       (not (string-suffix? "/.." path)))
+                                  (walk path))
+                                 ((and (eq? type 'regular) (string-suffix? ".h" path))
+                                  (set! paths (cons path paths))))))))))
+      (walk dir))
+    (digest->string
+      (fold (lambda (path h)
+              (let* ((port (open-file-input-port path))
+                     (content (get-bytevector-all port)))
+                (close-port port)
+                (digest-update (digest-update h (string->utf8 path))
+                               (if (eof-object? content) (make-bytevector 0) content))))
+            digest-init
+            (sort paths string<?)))))
+
+; The same version of junkie can be installed with other headers (other build options, local patches...)
+(define abi-key
+  (let ((key #f))
+    (lambda ()
+      (if (not key)
+          (set! key (or (false-if-exception (headers-digest (string-append includedir "/junkie")))
+                        "unknown")))
+      key)))
+
+; Given the key of a dynlib, return its name in the cache
+(define (key->cachename key)
+  (string-append
+    (digest (simple-format #f "~s" (list junkie-version (abi-key) (compiler-flags) key)))
+    ".so"))
+
+; Where the replayable effects of generating the stub of a dynlib are saved
+(define (so->effectsname so)
+  (string-append so ".effects"))
+
+; Look for this dynlib in the cache and the bundles (along with its effects if we need them)
+(define (cached-so cachename need-effects)
+  (find (lambda (so)
+          (and (file-exists? so)
+               (or (not need-effects) (file-exists? (so->effectsname so)))))
+        (map (lambda (dir) (string-append dir "/" cachename))
+             (cons cache-dir bundle-dirs))))
+
+(define (read-effects so)
+  (with-input-from-file (so->effectsname so) read))
+
+; Save the effects next to the (temporary) dynlib, and return the name of this temporary file
+(define (write-effects libname effects)
+  (let* ((tmpname (string-append libname ".effects.XXXXXX"))
+         (port    (mkstemp! tmpname)))
+    (write effects port)
+    (close-port port)
+    tmpname))
+
+; Write the C source of the given stub into a new temporary file, and return its name
+(define (stub->srcname stub)
+  (let* ((srcname (string-copy "/tmp/netmatch-ll.c.XXXXXX"))
+         (srcport (mkstemp! srcname)))
+    (display (stub->C stub) srcport)
     (close-port srcport)
-    (let* ((cc       (or (getenv "NETMATCH_CC")       build-cc))
-           (cppflags (or (getenv "NETMATCH_CPPFLAGS") (string-append build-cppflags " -I" includedir " -D_GNU_SOURCE")))
-           (cflags   (or (getenv "NETMATCH_CFLAGS")   (string-append "-std=c99 " build-cflags)))
-           (ldflags  (or (getenv "NETMATCH_LDFLAGS")  build-ldflags))
-           (cmd      (string-append cc " " cppflags " " cflags " " ldflags " -fPIC -shared -o " libname " -xc " srcname))
-           (status   (system cmd)))
-      (if (eqv? 0 (status:exit-val status))
-          (begin
-            ;(delete-file srcname)
-            libname)
-          (throw 'compilation-error
-                 (simple-format #f "Cannot exec ~s: exit-val=~s, term-sig=~s stop-sig=~s~%"
-                                cmd
-                                (status:exit-val status)
-                                (status:term-sig status)
-                                (status:stop-sig status)))))))
+    srcname))
+
+; Return a fresh name for the dynlib of this source file, in the cache if possible
+(define (srcname->libname srcname cachename)
+  (let ((dir (and cachename (writable-cache-dir))))
+    (if dir
+        (let* ((libname (string-append dir "/" cachename ".XXXXXX"))
+               (port    (mkstemp! libname)))
+          (close-port port)
+          libname)
+        (string-append srcname ".so"))))
+
+; Given a list of (key . stub-thunk), returns the list of the names of the corresponding dynlibs.
+; Stubs of the dynlibs that are not in the cache are generated in order (since stub generation is
+; not reentrant), then compiled in parallel. A key of #f means no caching.
+; If given, record is called after each stub generation and returns what this generation left
+; for the following ones (as a printable datum), which is then given to replay for cached dynlibs.
+(define* (keyed-stubs->sos keyed-stubs #:key (record #f) (replay #f))
+  (let* ((jobs    (map (lambda (keyed-stub)
+                         (let* ((cachename (and (car keyed-stub) (key->cachename (car keyed-stub))))
+                                (cached    (and cachename (cached-so cachename record))))
+                           (if cached
+                               (begin
+                                 (if replay (replay (read-effects cached)))
+                                 (list cached))
+                               (let* ((srcname (stub->srcname ((cdr keyed-stub))))
+                                      (effects (and record (record))))
+                                 (list #f srcname cachename effects)))))
+                       keyed-stubs))
+         (todo     (filter (lambda (job) (not (car job))) jobs))
+         (libnames (map (lambda (job) (srcname->libname (cadr job) (caddr job))) todo))
+         (delete-libnames (lambda ()
+                            (for-each (lambda (libname)
+                                        (false-if-exception (delete-file libname)))
+                                      libnames)))
+         (statuses (par-map (lambda (job libname)
+                              (let ((cmd (compiler-command (cadr job) libname)))
+                                (cons cmd (system cmd))))
+                            todo libnames)))
+    (for-each
+      (lambda (job cmd-status)
+        (let ((cmd    (car cmd-status))
+              (status (cdr cmd-status)))
+          (if (not (eqv? 0 (status:exit-val status)))
+              (begin
+                ; do not leave temporary dynlibs behind, in the cache especially
+                (delete-libnames)
+                (throw 'compilation-error
+                       (simple-format #f "Cannot exec ~s: exit-val=~s, term-sig=~s stop-sig=~s~%"
+                                      cmd
+                                      (status:exit-val status)
+                                      (status:term-sig status)
+                                      (status:stop-sig status)))))))
+      todo statuses)
+    (let ((job-libnames (map cons todo libnames)))
+      (map (lambda (job)
+             (or (car job)
+                 (let ((libname   (assq-ref job-libnames job))
+                       (cachename (caddr job))
+                       (effects   (cadddr job)))
+                   ;(delete-file (cadr job))
+                   (if (and cachename (writable-cache-dir))
+                       (let ((final (string-append (writable-cache-dir) "/" cachename)))
+                         ; effects first, so that a cached dynlib always comes with them
+                         (if record
+                             (rename-file (write-effects libname effects) (so->effectsname final)))
+                         (rename-file libname final) ; atomically, in case several junkies share the cache
+                         final)
+                       libname))))
+           jobs))))
+
+(export keyed-stubs->sos)
+
+; Same as above, for a single dynlib
+(define (keyed-stub->so key stub-thunk)
+  (car (keyed-stubs->sos (list (cons key stub-thunk)))))
+
+(export keyed-stub->so)
+
+; Given a stub, returns the name of the corresponding dynlib (bypassing the cache)
+(define (stub->so stub)
+  (keyed-stub->so #f (lambda () stub)))
 
 (export stub->so)
 
@@ -614,21 +614,106 @@
 
 (export function->stub)
 
-; takes an expression and return a pair (libname . nb-regs)
-(define (compile otype protos expr)
+; takes an expression and return the stub of the whole netmatch library
+(define (expr->library-stub otype protos expr)
   (let* ((funname "match")
-         (stub    (function->stub otype protos expr #f))
-         (stub    (type:make-stub
-                    (string-append
-                      (type:stub-code stub)
-                      "\n"
-                      "uintptr_t " funname "(struct proto_info const *info, struct npc_register rest, struct npc_register const *prev_regfile, struct npc_register *new_regfile)\n"
-                      "{\n"
-                      "    return " (type:stub-result stub) "(info, rest, prev_regfile, new_regfile);\n"
-                      "}\n")
-                    funname
-                    (type:stub-regnames stub))))
-    (ll:stub->so stub)))
+         (stub    (function->stub otype protos expr #f)))
+    (type:make-stub
+      (string-append
+        (type:stub-code stub)
+        "\n"
+        "uintptr_t " funname "(struct proto_info const *info, struct npc_register rest, struct npc_register const *prev_regfile, struct npc_register *new_regfile)\n"
+        "{\n"
+        "    return " (type:stub-result stub) "(info, rest, prev_regfile, new_regfile);\n"
+        "}\n")
+      funname
+      (type:stub-regnames stub))))
+
+; The register types known once a library stub was generated, in a form that can be saved along the library
+(define (recorded-register-types)
+  (map (lambda (r) (cons (car r) (type:type-name (cdr r))))
+       (fluid-ref register-types)))
+
+; When a library is found in the cache, set the register types as if its stub had been generated
+(define (replay-register-types recorded)
+  (for-each (lambda (r)
+              (set-register-type (car r)
+                                 (module-ref (resolve-module '(junkie netmatch types)) (cdr r))))
+            (reverse recorded)))
+
+; The compiled library depends on the expression but also on the types we know of the registers
+(define (compilation-key otype protos expr)
+  (list 'netmatch (type:type-name otype) protos expr (recorded-register-types)))
+
+; takes a list of (otype protos expr) and return the list of libnames, compiling in parallel
+; whatever is not in the cache already. Notice that all keys are computed beforehand, so these
+; expressions should not depend on the register types bound by one another.
+(define (compile-many compilations)
+  (ll:keyed-stubs->sos
+    (map (lambda (args)
+           (cons (apply compilation-key args)
+                 (lambda () (apply expr->library-stub args))))
+         compilations)
+    #:record recorded-register-types
+    #:replay replay-register-types))
+
+(export compile-many)
+
+; takes an expression and return the libname
+(define (compile otype protos expr)
+  (car (compile-many (list (list otype protos expr)))))
 
 (export compile)
 
+
+;;; Payload prefixes
+;;;
+;;; For the protocol discovery we'd like to know, without calling the compiled function, what
+;;; the payload ('rest') must start with for an expression to be true. This is only a conservative
+;;; approximation: we return either a list of strings (of latin1 chars, one per byte) one of
+;;; which the payload must start with, or #f if we do not know (or the payload can be anything).
+
+(define (bytes-symbol->string s)
+  (list->string (map (lambda (h) (integer->char (string->number h 16)))
+                     (string-split (symbol->string s) #\,))))
+
+; Only keep the prefixes that are compatible with both lists (the longest of each pair)
+(define (intersect-prefixes ps1 ps2)
+  (let ((compatible (lambda (p1 p2)
+                      (cond ((string-prefix? p1 p2) p2)
+                            ((string-prefix? p2 p1) p1)
+                            (else #f)))))
+    (delete-duplicates
+      (append-map (lambda (p1)
+                    (filter-map (lambda (p2) (compatible p1 p2)) ps2))
+                  ps1))))
+
+(define (expr->prefixes expr)
+  (let ((and-op? (lambda (op) (memq op '(and && log-and))))
+        (or-op?  (lambda (op) (memq op '(or || log-or))))
+        (eq-op?  (lambda (op) (memq op '(== = =B =b))))
+        (bytes?  (lambda (x) (and (symbol? x) (type:looks-like-bytes? x))))
+        (byte?   (lambda (x) (and (integer? x) (exact? x) (<= 0 x 255)))))
+    (match expr
+           ; conjunction: the payload must satisfy all known prefixes
+           (((? and-op?) . clauses)
+            (fold (lambda (clause prev)
+                    (let ((ps (expr->prefixes clause)))
+                      (cond ((not ps) prev)
+                            ((not prev) ps)
+                            (else (intersect-prefixes prev ps)))))
+                  #f clauses))
+           ; disjunction: any of them, if we know them all
+           (((? or-op?) . clauses)
+            (let ((pss (map expr->prefixes clauses)))
+              (and (every identity pss)
+                   (delete-duplicates (concatenate pss)))))
+           (('starts-with 'rest (? string? s)) (list s))
+           (('starts-with 'rest (? bytes? b))  (list (bytes-symbol->string b)))
+           ((('firsts (? integer?) 'rest) (? eq-op?) (? bytes? b)) (list (bytes-symbol->string b)))
+           (((? eq-op?) ('firsts (? integer?) 'rest) (? bytes? b)) (list (bytes-symbol->string b)))
+           ((('rest '@ 0) (? eq-op?) (? byte? n)) (list (string (integer->char n))))
+           (((? eq-op?) ('@ 'rest 0) (? byte? n))  (list (string (integer->char n))))
+           (_ #f))))
+
+(export expr->prefixes)
@@ -200,8 +200,8 @@
                   "unsigned nb_edge_defs = " (number->string nb-edges) ";\n\n")
                 "edge_defs" '()))])))
 
-; takes a nettrack expression and returns the nettrack SMOB
-(define (compile name expr)
+; takes a nettrack expression and returns the stub of the whole library
+(define (expr->library-stub expr)
   (slog log-debug "Nettrack compiling expression ~s" expr)
   (netmatch:reset-register-types) ; since we are going to call test->ll-test (FIXME: test->ll-test is too much hassle just for obtaining the proto!)
   (let ((decls     (car expr)) ; some type declarations to preset some register types
@@ -220,9 +220,28 @@
                    "unsigned default_index_size = 1;\n\n" ; FIXME
                    "" '()))
            (v-stub (vertices->stub vertices))
-           (e-stub (edges->stub edges))
-           (stub   (type:stub-concat
-                     init v-stub e-stub)))
-      (make-nettrack name (ll:stub->so stub)))))
+           (e-stub (edges->stub edges)))
+      (type:stub-concat
+        init v-stub e-stub))))
+
+; takes a list of (name expr) and returns the list of nettrack SMOBs, compiling in parallel
+; whatever is not in the cache already
+(define (compile-many compilations)
+  (let ((libnames (ll:keyed-stubs->sos
+                    (map (lambda (compilation)
+                           (let ((expr (cadr compilation)))
+                             ; the expression gives all register types
+                             (cons (list 'nettrack expr)
+                                   (lambda () (expr->library-stub expr)))))
+                         compilations))))
+    (map (lambda (compilation libname)
+           (make-nettrack (car compilation) libname))
+         compilations libnames)))
+
+(export compile-many)
+
+; takes a nettrack expression and returns the nettrack SMOB
+(define (compile name expr)
+  (car (compile-many (list (list name expr)))))
 
 (export compile)
@@ -8,33 +8,35 @@
 
 (nm:reset-register-types)
 
-(add-proto-signature "SSLv2" 1 'medium
-                     (nm:compile
-                       type:bool '(tcp) '(and ((nb-bytes rest) >= 3)
-                                              ((rest @ 2) == 4)
-                                              (((rest @ 0) & #xc0) == #x40)
-                                              (((((rest @ 0) & #x3f) << 8) + (rest @ 1)) == (nb-bytes rest))))) ; FIXME: we'd rather compare with wire-length!
+; Signatures are compiled all at once at the end (in parallel, and only if they are not in the cache)
+(define signatures '())
+(define (add-signature name id trust otype protos expr)
+  (set! signatures (cons (list name id trust otype protos expr) signatures)))
 
-(add-proto-signature "TLS" 3 'medium
-                     (nm:compile
-                       type:bool '(tcp) '(and ((nb-bytes rest) >= 3)
-                                              (or
-                                                ((rest @ 0) == 22) ; handshake
-                                                ((rest @ 0) == 23)) ; application data
-                                              ((rest @ 1) == 3)
-                                              (or
-                                                ((rest @ 2) == 1) ; TLS v3.1
-                                                ((rest @ 2) == 0))))) ; TLS v3.0
+(add-signature "SSLv2" 1 'medium
+               type:bool '(tcp) '(and ((nb-bytes rest) >= 3)
+                                      ((rest @ 2) == 4)
+                                      (((rest @ 0) & #xc0) == #x40)
+                                      (((((rest @ 0) & #x3f) << 8) + (rest @ 1)) == (nb-bytes rest)))) ; FIXME: we'd rather compare with wire-length!
 
-(add-proto-signature "bittorrent" 4 'medium
-                     (nm:compile
-                       type:bool '(tcp) '(or
-                                           (and ((nb-bytes rest) >= 6)
-                                                ((firsts 6 rest) == 00,00,00,0d,06,00))
-                                           (and ((nb-bytes rest) >= 8)
-                                                ((firsts 8 rest) == 00,00,40,09,07,00,00,00))
-                                           (str-in-bytes rest "BitTorrent Protocol")
-                                           (str-in-bytes rest "/announce"))))
+(add-signature "TLS" 3 'medium
+               type:bool '(tcp) '(and ((nb-bytes rest) >= 3)
+                                      (or
+                                        ((rest @ 0) == 22) ; handshake
+                                        ((rest @ 0) == 23)) ; application data
+                                      ((rest @ 1) == 3)
+                                      (or
+                                        ((rest @ 2) == 1) ; TLS v3.1
+                                        ((rest @ 2) == 0)))) ; TLS v3.0
+
+(add-signature "bittorrent" 4 'medium
+               type:bool '(tcp) '(or
+                                   (and ((nb-bytes rest) >= 6)
+                                        ((firsts 6 rest) == 00,00,00,0d,06,00))
+                                   (and ((nb-bytes rest) >= 8)
+                                        ((firsts 8 rest) == 00,00,40,09,07,00,00,00))
+                                   (str-in-bytes rest "BitTorrent Protocol")
+                                   (str-in-bytes rest "/announce")))
 
 ; Adapted from http://protocolinfo.org/
 
@@ -42,88 +44,91 @@
 ; (define (string->numbers s) (map char->integer (string->list s)))
 ; (define (string->hexstr s) (string-join (map (lambda (n) (format #f "~2,'0x" n)) (string->numbers s)) ",") )
 
-(add-proto-signature "gnutella" 5 'low ; until proven otherwise
-                     (nm:compile
-                       type:bool '(tcp) '(or
-                                           (and ((nb-bytes rest) >= 4)
-                                                ((firsts 3 rest) == 67,6e,64)
-                                                (or ((rest @ 3) == 1)
-                                                    ((rest @ 3) == 2)))
-                                           (and ((nb-bytes rest) >= 22)
-                                                ; "gnutella connect/[012]\.[0-9]\x0d\x0a"
-                                                ((firsts 17 rest) == 67,6e,75,74,65,6c,6c,61,20,63,6f,6e,6e,65,63,74,2f)
-                                                ((rest @ 17) >= 48)
-                                                ((rest @ 17) <= 50)
-                                                ((rest @ 19) >= 48)
-                                                ((rest @ 19) <= 57)
-                                                ((rest @ 20) == 13)
-                                                ((rest @ 21) == 10))
-                                           (and ((nb-bytes rest) >= 26)
-                                                ; "get /uri-res/n2r\?urn:sha1:"
-                                                ((firsts 26 rest) == 67,65,74,20,2f,75,72,69,2d,72,65,73,2f,6e,32,72,3f,75,72,6e,3a,73,68,61,31,3a))
-                                           (and ((nb-bytes rest) >= 44)
-                                                ; gnutella.*content-type: application/x-gnutella
-                                                ((firsts 8 rest) == 67,6e,75,74,65,6c,6c,61)
-                                                (str-in-bytes rest "content-type: application/x-gnutella"))
-                                           (and ((nb-bytes rest) >= 5)
-                                                ((firsts 5 rest) == 67,65,74,20,2f)
-                                                (or (str-in-bytes rest "content-type: application/x-gnutella-packets")
-                                                    (str-in-bytes rest "user-agent: gtk-gnutella")
-                                                    (str-in-bytes rest "user-agent: bearshare")
-                                                    (str-in-bytes rest "user-agent: mactella")
-                                                    (str-in-bytes rest "user-agent: gnucleus")
-                                                    (str-in-bytes rest "user-agent: gnotella")
-                                                    (str-in-bytes rest "user-agent: limewire")
-                                                    (str-in-bytes rest "user-agent: imesh"))))))
+(add-signature "gnutella" 5 'low ; until proven otherwise
+               type:bool '(tcp) '(or
+                                   (and ((nb-bytes rest) >= 4)
+                                        ((firsts 3 rest) == 67,6e,64)
+                                        (or ((rest @ 3) == 1)
+                                            ((rest @ 3) == 2)))
+                                   (and ((nb-bytes rest) >= 22)
+                                        ; "gnutella connect/[012]\.[0-9]\x0d\x0a"
+                                        ((firsts 17 rest) == 67,6e,75,74,65,6c,6c,61,20,63,6f,6e,6e,65,63,74,2f)
+                                        ((rest @ 17) >= 48)
+                                        ((rest @ 17) <= 50)
+                                        ((rest @ 19) >= 48)
+                                        ((rest @ 19) <= 57)
+                                        ((rest @ 20) == 13)
+                                        ((rest @ 21) == 10))
+                                   (and ((nb-bytes rest) >= 26)
+                                        ; "get /uri-res/n2r\?urn:sha1:"
+                                        ((firsts 26 rest) == 67,65,74,20,2f,75,72,69,2d,72,65,73,2f,6e,32,72,3f,75,72,6e,3a,73,68,61,31,3a))
+                                   (and ((nb-bytes rest) >= 44)
+                                        ; gnutella.*content-type: application/x-gnutella
+                                        ((firsts 8 rest) == 67,6e,75,74,65,6c,6c,61)
+                                        (str-in-bytes rest "content-type: application/x-gnutella"))
+                                   (and ((nb-bytes rest) >= 5)
+                                        ((firsts 5 rest) == 67,65,74,20,2f)
+                                        (or (str-in-bytes rest "content-type: application/x-gnutella-packets")
+                                            (str-in-bytes rest "user-agent: gtk-gnutella")
+                                            (str-in-bytes rest "user-agent: bearshare")
+                                            (str-in-bytes rest "user-agent: mactella")
+                                            (str-in-bytes rest "user-agent: gnucleus")
+                                            (str-in-bytes rest "user-agent: gnotella")
+                                            (str-in-bytes rest "user-agent: limewire")
+                                            (str-in-bytes rest "user-agent: imesh")))))
 
-(add-proto-signature "RTP" 6 'medium
-                     (nm:compile
-                       type:bool '(udp) '(and ((udp.src-port & 1) == 0)
-                                              ((udp.dst-port & 1) == 0)
-                                              ; ^\x80[\x01-"`-\x7f\x80-\xa2\xe0-\xff]?..........*\x80
-                                              ((nb-bytes rest) >= 11)
-                                              ((rest @ 0) == #x80)))) ; the rest does not worth the trouble
+(add-signature "RTP" 6 'medium
+               type:bool '(udp) '(and ((udp.src-port & 1) == 0)
+                                      ((udp.dst-port & 1) == 0)
+                                      ; ^\x80[\x01-"`-\x7f\x80-\xa2\xe0-\xff]?..........*\x80
+                                      ((nb-bytes rest) >= 11)
+                                      ((rest @ 0) == #x80))) ; the rest does not worth the trouble
 
 ; Discovery of HTTP payload
-(add-proto-signature "HTTP" 7 'medium
-                     (nm:compile
-                       type:bool '(tcp) '(or (starts-with rest "HTTP/1")
-                                             (starts-with rest "GET ")
-                                             (starts-with rest "HEAD ")
-                                             (starts-with rest "POST ")
-                                             (starts-with rest "CONNECT ")
-                                             (starts-with rest "PUT ")
-                                             (starts-with rest "OPTIONS ")
-                                             (starts-with rest "TRACE ")
-                                             (starts-with rest "DELETE "))))
+(add-signature "HTTP" 7 'medium
+               type:bool '(tcp) '(or (starts-with rest "HTTP/1")
+                                     (starts-with rest "GET ")
+                                     (starts-with rest "HEAD ")
+                                     (starts-with rest "POST ")
+                                     (starts-with rest "CONNECT ")
+                                     (starts-with rest "PUT ")
+                                     (starts-with rest "OPTIONS ")
+                                     (starts-with rest "TRACE ")
+                                     (starts-with rest "DELETE ")))
 
 ; Discovery of FTP payload
-(add-proto-signature "FTP" 8 'medium
-                     (nm:compile
-                       type:bool '(tcp) '(or (starts-with rest "220-")
-                                             (starts-with rest "220 ")
-                                             (starts-with rest "USER ")
-                                             (starts-with rest "FEAT ")
-                                             (starts-with rest "OPTS "))))
+(add-signature "FTP" 8 'medium
+               type:bool '(tcp) '(or (starts-with rest "220-")
+                                     (starts-with rest "220 ")
+                                     (starts-with rest "USER ")
+                                     (starts-with rest "FEAT ")
+                                     (starts-with rest "OPTS ")))
 
 ; Discovery of SIP payload
-(add-proto-signature "SIP" 9 'medium
-                     (nm:compile
-                       type:bool '(udp) '(or (starts-with rest "INVITE ")
-                                             (starts-with rest "SIP/2.0")
-                                             (starts-with rest "REGISTER ")
-                                             (starts-with rest "ACK ")
-                                             (starts-with rest "OPTIONS ")
-                                             (starts-with rest "CANCEL "))))
+(add-signature "SIP" 9 'medium
+               type:bool '(udp) '(or (starts-with rest "INVITE ")
+                                     (starts-with rest "SIP/2.0")
+                                     (starts-with rest "REGISTER ")
+                                     (starts-with rest "ACK ")
+                                     (starts-with rest "OPTIONS ")
+                                     (starts-with rest "CANCEL ")))
 
 ; Discovery of MGCP payload
-(add-proto-signature "MGCP" 10 'medium
-                     (nm:compile
-                       type:bool '(udp) '(or (starts-with rest "NTFY ")
-                                             (starts-with rest "RQNT ")
-                                             (starts-with rest "MDCX ")
-                                             (starts-with rest "DLCX ")
-                                             (starts-with rest "EPCF ")
-                                             (starts-with rest "CRCX ")
-                                             (starts-with rest "RSIP "))))
+(add-signature "MGCP" 10 'medium
+               type:bool '(udp) '(or (starts-with rest "NTFY ")
+                                     (starts-with rest "RQNT ")
+                                     (starts-with rest "MDCX ")
+                                     (starts-with rest "DLCX ")
+                                     (starts-with rest "EPCF ")
+                                     (starts-with rest "CRCX ")
+                                     (starts-with rest "RSIP ")))
 
+; The payload prefixes of each signature, when known, allow discovery to test only the few
+; signatures that may match a given payload.
+(let ((sigs (reverse signatures)))
+  (for-each
+    (lambda (sig libname)
+      (add-proto-signature (car sig) (cadr sig) (caddr sig) libname
+                           (nm:expr->prefixes (list-ref sig 5))))
+    sigs
+    (nm:compile-many (map cdddr sigs))))
@@ -15,6 +15,7 @@
  * - a_la_printf_, to check parameters according to a format string,
  * - packed_, to pack data structures.
  * - sentinel_, to check a variadic list is NULL terminated
+ * - prefetch_, to fetch some memory into the cache before we need it
  *
  * Of these, only the last one must be implemented in a way or another
  * in order for junkie to work properly.
@@ -31,6 +32,7 @@
 #   define a_la_printf_(str_i, arg_i) __attribute__((__format__(__printf__, str_i, arg_i)))
 #   define packed_ __attribute__((__packed__))
 #   define sentinel_ __attribute__((__sentinel__))
+#   define prefetch_(addr) __builtin_prefetch(addr)
 #else
 #   define pure_
 #   define hot_
@@ -42,6 +44,7 @@
 #   define a_la_printf_
 #   define packed_
 #   define sentinel_
+#   define prefetch_(addr) ((void)(addr))
 #endif
 
 #endif
@@ -5,13 +5,14 @@
 #include <stdlib.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/mutex.h>
+#include <junkie/tools/ip_addr.h>
 #include <junkie/proto/proto.h>
 
 /** @file
  * @brief Packet capture
  *
  * We want to be able to save a selected portion of all listened packets either
- * in a pcap file or in a CSV file.
+ * in a pcap file, in a pcapng file (with an index of the flows) or in a CSV file.
  */
 
 struct capfile {
@@ -47,6 +48,23 @@ struct capfile *capfile_new_pcap(
     struct timeval const *now  ///< Start time of the file
 );
 
+/** start a new capture in pcapng, with a sidecar index (same path with ".idx" appended)
+ * giving for each chunk of the file its time range and the offsets of the packets of each flow. */
+struct capfile *capfile_new_pcapng(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t caplen, unsigned rotation, struct timeval const *start);
+
+/// What to look for in the index of a pcapng file (unset fields match everything)
+struct capfile_index_query {
+    struct ip_addr addr;            ///< Any end of the flow (if family is not AF_UNSPEC)
+    uint16_t port;                  ///< Any end of the flow (if not 0), on the same side than addr if both are set
+    struct timeval start, stop;     ///< Only the chunks overlapping this time range (if set)
+};
+
+/** Look into the index of this pcapng file for the packets matching this query.
+ * Since the index is per chunk, packets slightly outside the time range may be returned.
+ * @return the number of packets found (or -1 on error), which offsets in the pcapng file are
+ * stored in increasing order in *offsets (malloced, to be freed by the caller). */
+ssize_t capfile_index_lookup(char const *path, struct capfile_index_query const *, off_t **offsets);
+
 struct capfile *capfile_new_csv(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t caplen, unsigned rotation, struct timeval const *start);
 char *capfile_csv_from_info(struct proto_info const *);
 
@@ -8,23 +8,42 @@
 #include <junkie/tools/timeval.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/ref.h>
-#include <junkie/tools/hash.h>
 
 #define DIGEST_SIZE MD4_DIGEST_LENGTH
 
-struct digest_qcell;
+/** A stored digest.
+ * A slot is claimed by setting key[0] with a compare-and-swap, then published
+ * by setting ts (so that a slot with key[0] set but no ts is being written). */
+struct digest_slot {
+    uint64_t volatile key[2];       ///< The digest itself (key[0] = 0 for a free slot)
+    uint64_t volatile ts;           ///< Timestamp of the frame, in microseconds since the Epoch, plus one (0 until published)
+};
+
+/** Digests are stored in an open addressing table made of several slabs,
+ * each one receiving the digests of the frames which timestamp falls into a
+ * given max_dup_delay window. Slabs are recycled as a whole once their window
+ * is too old, so that no digest is ever freed individually. */
+struct digest_slab {
+#   define DIGEST_EPOCH_NONE      INT64_MIN         ///< Slab is empty
+#   define DIGEST_EPOCH_RECYCLING (INT64_MIN + 1)   ///< Slab is being emptied
+    int64_t volatile epoch;         ///< Timestamp / max_dup_delay of the frames stored here (or one of the above)
+    unsigned volatile nb_users;     ///< Number of threads using this slab for the current epoch
+    struct digest_slot *slots;      ///< The slab_size slots of this slab
+};
 
 struct digest_queue {
     struct ref ref;
     LIST_ENTRY(digest_queue) entry; // All existing digest_queues are chained together
-#   define NB_QUEUES (MIN(CPU_MAX, 256))   /* Must not be greater that 256 since we use only one byte from digest to hash */
-    struct digest_queue_ {
-        struct mutex mutex; // protecting this queue
-        // Previously received packets, indexed by their digests
-        HASH_TABLE(qcells, digest_qcell) qcells;
-    } queues[NB_QUEUES];    // The queue is chosen according to digest hash, so that several distinct threads can perform lookups simultaneously.
+#   define NB_DIGEST_SLABS 4        /* previous, current and next windows, plus the one to be recycled */
+    struct digest_slab slabs[NB_DIGEST_SLABS];
+    unsigned slab_size;             // Number of slots per slab (a power of 2)
     // Some stats for the user
     uint_least64_t nb_dup_found, nb_nodup_found;
+    // Contention counters
+    uint_least64_t nb_cas_failures; // slot claimed by another thread under our feet
+    uint_least64_t nb_waits;        // had to wait for another thread to publish a slot or recycle a slab
+    uint_least64_t nb_overflows;    // frames which digest could not be stored since the slab was full
+    uint_least64_t nb_late;         // frames which window was already recycled
     uint8_t dev_id;
 };
 
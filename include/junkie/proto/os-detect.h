@@ -10,16 +10,23 @@
  * This function can detect the operating system used by the emmiter of the given
  * TCP SYN or SYN+ACK.
  *
- * It is automatically generated from p0f.fp database of signatures, and should be quite fast.
+ * It uses the TCP signatures of a p0f.fp database, loaded at init from the installed
+ * one (or later with os_detect_load()), which are indexed so that only a few of them
+ * are tested for each packet. The last result of each host is also cached.
  */
 
 /** @return an id identifying the OS, or 0 if unknown. */
 unsigned os_detect(struct ip_proto_info const *ip, struct tcp_proto_info const *tcp);
 
-/** @return the name associated with the above id. */
+/** @return the name associated with the above id.
+ * Notice that ids are only valid until another database is loaded. */
 char const *os_name(unsigned id);
 
-// Dummy function called by junkie init code so that the linker include this unused (as far as the linker can tell) unit
+/** Replace the current signature database with the one read from this p0f.fp file.
+ * @return 0 on success, or -1 if the file cannot be read (then previous signatures are kept). */
+int os_detect_load(char const *filename);
+
 void os_detect_init(void);
+void os_detect_fini(void);
 
 #endif
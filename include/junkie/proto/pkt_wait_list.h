@@ -9,6 +9,8 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/proto/proto.h>
 
+struct arena;
+
 /** @file
  * @brief Waiting lists for packets
  *
@@ -52,8 +54,12 @@
  * must be called whatever the fate of this pkt_wait (parsed, timeouted,
  * deleted in any way...). */
 struct pkt_wait {
-    /// Entry in the pkt_wait_list
-    LIST_ENTRY(pkt_wait) entry;
+    /// Node in the pkt_wait_list tree
+    struct pkt_wait_node {
+        struct pkt_wait *left, *right, *up;
+        unsigned height;            ///< Height of the subtree rooted here (1 for a leaf)
+        unsigned max_next_offset;   ///< Max next_offset of the subtree rooted here
+    } node;
     /// Where in the "stream" this packet is located. When offset = list->next_offset, then the packet is parsable.
     unsigned offset;
     /// Next expected offset following this packet
@@ -78,6 +84,8 @@ struct pkt_wait {
      * - the list is deleted, for instance when timeouted. */
     /// Current proto_info at the time when the packet was put on hold
     struct proto_info *parent;
+    /// The arena where parent (and its parents) are stored (we own a ref to it)
+    struct arena *arena;
     /// Current way at the time when the packet was put on hold
     unsigned way;
     /// The copy of the total captured packet
@@ -137,12 +145,17 @@ void pkt_wl_config_dtor(struct pkt_wl_config *);
  * order, until the missing bits are received. Top of the list packets are
  * dequeued as soon as their position in the stream match the waited one, and
  * inserted in the list according to their location in the stream.
+ * The list is a balanced tree so that inserting is O(log n) even when hundreds
+ * of segments are pending, and packets whose content is already covered by the
+ * list (retransmissions) are not even stored.
  * We do also store a ref to the intended subparser despite the pkt_wait_lists
  * being stored in a mux_subparser leading to it, both for simplicity and
  * generality. */
 struct pkt_wait_list {
-    /// The list of pkt_wait
-    LIST_HEAD(pkt_waits, pkt_wait) pkts;
+    /// The pkt_waits, in an AVL tree ordered by offset (then by order of arrival) and augmented with their max next_offset
+    struct pkt_wait *root;
+    /// The pkt_wait with the smallest offset (NULL if empty)
+    struct pkt_wait *first;
     /// The global configuration for this pkt_wait_list (never changes during the lifetime of the object)
     struct pkt_wl_config *config;
     /// The list into this config where this pkt_list is queued
@@ -198,6 +211,28 @@ enum proto_parse_status pkt_wait_list_add(
     uint8_t const *tot_packet       ///< The whole packet (as given to subscribers)
 );
 
+/// Parse a packet at once, without locking anything, if this is the one we are waiting for and nothing is pending.
+/** This is the fast path of pkt_wait_list_add() for in order streams, which
+ * can be used only if no other thread can add packets to this list nor to the
+ * one it's synced with (for instance because the caller owns a lock on both).
+ * @return true if the packet was parsed (then *status is set), false if it must be given to pkt_wait_list_add() instead. */
+bool pkt_wait_list_parse_in_order(
+    struct pkt_wait_list *pkt_wl,   ///< The packet list this packet belongs to
+    enum proto_parse_status *status,///< Output parameter set to the result of the parse, if any
+    unsigned offset,                ///< Offset in the stream of this packet
+    unsigned next_offset,           ///< Offset in the stream of the following packet
+    bool sync,                      ///< Set to false to disable syncing (even when wl->sync_with is set)
+    unsigned sync_offset,           ///< If sync, do not parse until the other WL we sync with reach at least this point
+    struct proto_info *parent,      ///< The proto_info of its parent (likely the caller of this function)
+    unsigned way,                   ///< Direction identifier (see proto_parse())
+    uint8_t const *packet,          ///< The origin packet
+    size_t cap_len,                 ///< It's length
+    size_t wire_len,                ///< It's actual length on the wire
+    struct timeval const *now,      ///< The current time
+    size_t tot_cap_len,             ///< The capture length of the whole packet
+    uint8_t const *tot_packet       ///< The whole packet (as given to subscribers)
+);
+
 /// Try to parse (or timeout) the head of the list.
 /** @return true if some parsing was done. */
 bool pkt_wait_list_try(
@@ -16,6 +16,7 @@
 #include <junkie/tools/mutex.h>
 #include <junkie/tools/ref.h>
 #include <junkie/tools/bench.h>
+#include <junkie/tools/timer_wheel.h>
 
 /** @file
  * @brief Packet inspection
@@ -93,6 +94,7 @@ char const *proto_parse_status_2_str(enum proto_parse_status status);
 struct parser;
 struct proto;
 struct proto_info;
+struct arena;
 struct proto_subscriber;
 
 typedef enum proto_parse_status parse_fun(
@@ -118,19 +120,53 @@ typedef void proto_cb_t(struct proto_subscriber *, struct proto_info const *, si
 struct proto_subscriber {
     LIST_ENTRY(proto_subscriber) entry; ///< In the list of all proto subscribers
     proto_cb_t *cb;
+    struct hook_async *async;           ///< If the subscriber is called asynchronously (see hook_subscriber_ctor_async())
 };
 
-/// A hook is composed of a list of subscribers and a mutex.
+/// An immutable snapshot of the subscribers of a hook, replaced as a whole whenever they change.
+struct hook_subscribers {
+    struct ref ref;                         ///< Retired snapshots are deleted by the doomer
+    unsigned nb_subscribers;
+    struct proto_subscriber *subscribers[];
+};
+
+/// A hook is composed of a list of subscribers and of the snapshot of this list that's actually called.
+/** Calling the subscribers thus takes no lock, only subscribing and unsubscribing does. */
 struct hook {
     char const *name;
-    LIST_HEAD(proto_subscribers, proto_subscriber) subscribers;
-    struct rwlock lock;
+    LIST_HEAD(proto_subscribers, proto_subscriber) subscribers; ///< Protected by the mutex
+    struct hook_subscribers *volatile snapshot; ///< NULL when there are no subscribers
+    struct mutex mutex;                         ///< Serializes subscriptions
 };
 
 void hook_ctor(struct hook *, char const *);
 void hook_dtor(struct hook *);
 int hook_subscriber_ctor(struct hook *, struct proto_subscriber *, proto_cb_t *cb);
+
+/// Same as hook_subscriber_ctor, but the callback will be called by a dedicated thread.
+/** Instead of calling the subscriber, the parsing threads then merely copy the
+ * proto_info stack and the packet into a ring from which this thread dequeues
+ * them by batches, so that a slow subscriber does not slow down parsing.
+ * If the ring is full, or the copies would take more than max_bytes, events are
+ * dropped (see hook_subscriber_async_stats()).
+ * Notice that the callback is then always called from the same thread, in the
+ * order the events were queued, but possibly long after the packet was parsed,
+ * and from outside of the multi region (enter it if you need to).
+ * Also, events without parser (as for the dup_hook) can not be copied and are dropped. */
+int hook_subscriber_ctor_async(
+    struct hook *,
+    struct proto_subscriber *,
+    proto_cb_t *cb,
+    unsigned ring_size,     ///< How many events can be queued (rounded up to a power of 2)
+    size_t max_bytes,       ///< How many bytes the queued copies can take (0 for no bound)
+    char const *name        ///< To name the thread
+);
+
+/// Unsubscribe (for an asynchronous subscriber, once all queued events are processed)
 void hook_subscriber_dtor(struct hook *, struct proto_subscriber *);
+
+/// Report how many events were queued (delivered or not yet) and dropped for an asynchronous subscriber.
+void hook_subscriber_async_stats(struct proto_subscriber const *, uint64_t *nb_queued, uint64_t *nb_dropped);
 void hook_subscribers_call(struct hook *, struct proto_info *, size_t, uint8_t const *, struct timeval const *);
 
 /// Call all subscribers of given proto (same as normal hook_subscribers_call but ensure we call it no more than once per packet)
@@ -275,6 +311,18 @@ void proto_info_serialize(struct proto_info const *, uint8_t **);
 /// Deserializer for base proto_info struct.
 void proto_info_deserialize(struct proto_info *, uint8_t const **);
 
+/// Copy a whole proto_info stack out of the stack, for when it must outlive the parse.
+/** The copies (which own a ref to their parsers) are allocated from an arena,
+ * with extra bytes left available for the caller.
+ * @return the copy of info (NULL on error), and *arena which is then
+ * referenced and must be unrefed by the caller. */
+struct proto_info *proto_info_copy_stack(struct proto_info const *, size_t extra, struct arena **arena);
+
+/// Same as proto_info_copy_stack, but the arena is of its own and of the exact size needed.
+/** Use it when the copy is to be kept long, since the arena of the current packet would
+ * then stay pinned with all its bytes. The size of the arena is returned in *size (if not NULL). */
+struct proto_info *proto_info_copy_stack_exact(struct proto_info const *, size_t extra, struct arena **arena, size_t *size);
+
 /// Helper for metric modules.
 /** @returns the last proto_info owned by the given proto, or NULL if not found.
  */
@@ -371,6 +419,7 @@ void parser_unref(struct parser **parser);
 
 struct mux_parser;
 struct mux_subparser;
+struct mux_index;
 
 /// If your proto parsers are multiplexer, inherit from mux_proto instead of a mere proto
 /** Multiplexers are the most complicated parsers.
@@ -440,20 +489,21 @@ struct mux_proto {
     size_t key_size;                ///< The size of the key used to multiplex
     /// Following 3 fields are protected by proto->lock
     LIST_ENTRY(mux_proto) entry;    ///< Entry in the list of mux protos
-    unsigned hash_size;             ///< The required size for the hash used to store subparsers
+    unsigned hash_size;             ///< The required size for the hash used to store subparsers (0 for a resizable open addressing index)
     unsigned nb_max_children;       ///< The max number of subparsers (after which old ones are deleted)
     uint64_t nb_infanticide;        ///< Nb children that were deleted because of the previous limitation
     uint64_t nb_collisions;         ///< Nb collisions in the hashes since last change of hash size
     uint64_t nb_lookups;            ///< Nb lookups in the hashes since last change of hash size
     uint64_t nb_timeouts;           ///< Nb subparsers timeouted from the hashes (ie. not how many parsers of this proto were timeouted!)
+    uint64_t nb_resizes;            ///< Nb times a shard of an open addressing index was grown (see mux_index)
     time_t last_used;               ///< last time we had traffic (used to give time to timeouter thread)
     /** A pool of mutexes so that we have enough for all the subparsers hash lines
      * but not one per hash line (would require too much memory). Also, we turn this
-     * into profit by having only a few timeout queues that can be visited often in order
-     * to timeout subparsers quickly. */
+     * into profit by having only a few timer wheels, advanced by the lookups that
+     * already own the mutex, so that subparsers are timeouted as packets flow. */
     struct per_mutex {
         struct mutex mutex;
-        TAILQ_HEAD(timeout_queue, mux_subparser) timeout_queue;
+        struct timer_wheel wheel;   ///< The timers of all subparsers protected by this mutex
     } mutexes[CPU_MAX];
 };
 
@@ -497,15 +547,15 @@ struct proto *proto_of_scm_name(SCM name);
  * @note Remember to add the packed_ attribute to your keys ! */
 struct mux_subparser {
     struct ref ref;
-    TAILQ_ENTRY(mux_subparser) to_entry;    ///< Its entry in its timeout queue (sorted in least recently used first)
-    STAILQ_ENTRY(mux_subparser) h_entry;    ///< Its entry in the hash (sorted in more recently used first - so that lookups are faster)
+    struct timer timer;                     ///< Its timer in the wheel of its mutex (checks last_used when it fires)
+    STAILQ_ENTRY(mux_subparser) h_entry;    ///< Its entry in the hash (sorted in more recently used first - so that lookups are faster), unused with a mux_index
     struct parser *parser;                  ///< The actual parser
     struct timeval last_used;               ///< Last time we call it's parse method
     struct proto *requestor;                ///< The proto that requested its creation
     struct mux_parser *mux_parser;          ///< Backlink to our mux_parser
     struct mux_proto *mux_proto;            ///< Backlink to our mux_proto, for when mux_parser cannot be used (see mux_subparser_del_as_ref())
 #   define NOT_HASHED UNSET
-    unsigned h_idx;                         ///< Our hash index into mux_parser->subparsers (NO_HASHED if not queued in any list)
+    unsigned h_idx;                         ///< Our hash index into mux_parser->subparsers, or our shard in mux_parser->index (NOT_HASHED if not indexed)
     char key[];                             ///< The key used to identify it (beware of the variable size)
 };
 
@@ -536,6 +586,8 @@ struct mux_parser {
     unsigned hash_size;                                     ///< The hash size for this particular mux_parser (taken from mux_proto at creation time, constant)
     unsigned nb_max_children;                               ///< The max number of children allowed (0 if not limited)
     unsigned nb_children;                                   ///< Current number of children
+    /// If hash_size is 0, subparsers are stored in this resizable index instead (and subparsers[] is empty)
+    struct mux_index *index;
     /// The hash of subparsers (Beware of the variable size)
     struct subparsers {
         /// These two fields are protected by one of the mux_proto->mutexes
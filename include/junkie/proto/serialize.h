@@ -3,18 +3,53 @@
 #ifndef SERIALIZE_H_111031
 #define SERIALIZE_H_111031
 #include <stdint.h>
+#include "junkie/config.h"
 #include "junkie/proto/proto.h"
 #include "junkie/tools/serialization.h"
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/ip_addr.h"
 
+/** @file
+ * @brief Wire format of the serializer
+ *
+ * Each message (ie. datagram) starts with a header:
+ *
+ * - MSG_MAGIC (1 byte), to tell it from the unframed messages of former versions;
+ * - MSG_VERSION (1 byte), to be incremented whenever this format or any proto serializer changes;
+ * - flags (1 byte), see MSG_LZ4;
+ * - source (4 bytes), identifying the sender (a process and a thread);
+ * - sequence number (4 bytes) of this message for this source, so that receivers can count losses;
+ * - payload length (2 bytes), once uncompressed.
+ *
+ * The payload, which may be LZ4 compressed, is a sequence of frames made of a type (1 byte),
+ * a length (2 bytes) and a body of that length, so that a receiver can skip what it does not
+ * know.  All integers are little endian (see tools/serialization.h).
+ */
+
+#if defined(HAVE_LIBLZ4) && defined(HAVE_LZ4_H)
+#   define WITH_LZ4
+#endif
+
+#define MSG_MAGIC 0x4a
+#define MSG_VERSION 3
+#define MSG_HEADER_SIZE 13
+#define MSG_FRAME_HEADER_SIZE 3
+
+/// Flag telling that the payload is LZ4 (block) compressed
+#define MSG_LZ4 0x01
+
+/// Max size of a frame
 #define MSG_MAX_SIZE 5000
-#define MSG_PROTO_INFO 1
-#define MSG_PROTO_STATS 2
+
+/// Frame types
+#define MSG_PROTO_INFO 1    ///< A proto stack (see serialize_proto_stack())
+#define MSG_PROTO_STATS 2   ///< How many MSG_PROTO_INFO were sent by this source (8 bytes)
+
 #define SERIALIZER_DEFAULT_SERVICE "28999"
 
 void serialize_proto_stack(uint8_t **buf, struct proto_info const *last, struct timeval const *now);
-void deserialize_proto_stack(uint8_t const **buf);
+/// Reports the proto stack at *buf to subscribers, not reading past end. Returns -1 if it does not fit.
+int deserialize_proto_stack(uint8_t const **buf, uint8_t const *end);
 
 void serialize_init(void);
 void serialize_fini(void);
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <junkie/proto/proto.h>
 #include <junkie/tools/mutex.h>
+#include <junkie/tools/queue.h>
 
 /** @file
  * @brief Stream payload buffering
@@ -29,21 +30,65 @@
  * continue, leave the streambuf_cursor to where you would like to resume
  * parsing. Next time (provided you returned PROTO_OK) you will be called with
  * more data, starting to this byte.
+ *
+ * Payload that must be kept for later is stored as a chain of segments (one
+ * per packet, roughly), so that each new packet is copied only once whatever
+ * the amount of payload already buffered. This chain is made contiguous only
+ * when the parser is called. If your parser knows it won't be able to progress
+ * until some condition is met (typically, when it waits for the end of a
+ * message which length is given in its header) then it should use
+ * streambuf_set_restart_ready() instead of streambuf_set_restart(), with a
+ * function that inspects the buffered segments with a streambuf_cursor, so
+ * that the payload is not made contiguous (and the parser not called) for
+ * nothing.
  */
 
+/// A chunk of buffered payload
+struct streambuf_seg {
+    STAILQ_ENTRY(streambuf_seg) entry;  ///< In the chain of its streambuf_unidir
+    uint8_t const *data;        ///< Where the payload starts (either within bytes[] or in the packet being parsed)
+    size_t size;                ///< Size of the payload
+    size_t room;                ///< How many bytes can be appended after data+size
+    bool is_malloced;           ///< False if data references the packet being parsed (then room is 0)
+    uint8_t bytes[];            ///< Our copy of the payload
+};
+
+/// A cursor to read the buffered payload across segments
+struct streambuf_cursor {
+    struct streambuf_seg const *seg;    ///< Current segment (NULL once at the end)
+    size_t offset;              ///< Offset of the next byte in seg
+    size_t rem_size;            ///< How many bytes are left to read up to the end of the buffer
+};
+
+/// Copy len bytes from the cursor into dst, and advance it.
+/** @returns -1 if less than len bytes are available (and then the cursor is left untouched). */
+int streambuf_cursor_read(struct streambuf_cursor *, void *dst, size_t len);
+
+/// Advance the cursor of len bytes (@returns -1 if less than len bytes are available)
+int streambuf_cursor_drop(struct streambuf_cursor *, size_t len);
+
+/// @returns the bytes that can be read from the cursor without crossing a segment boundary (and set len to their number), or NULL at end.
+uint8_t const *streambuf_cursor_peek(struct streambuf_cursor const *, size_t *len);
+
+/// Tells whether the parser can progress with the payload that's available from the cursor
+typedef bool streambuf_ready(struct streambuf_cursor *);
+
 struct streambuf {
     parse_fun *parse;       ///< The user parse function
     size_t max_size;        ///< The max buffered size
     struct mutex *mutex;    ///< Protect the buffers
     /// We want actually one buffer for each direction
     struct streambuf_unidir {
-        uint8_t const *buffer;      ///< The buffer itself.
-        size_t buffer_size;         ///< The size of the buffer. must be 0 if !buffer.
-        /** The offset where to start parsing from (don't store a pointer to buffer since buffer will be reallocated).
+        STAILQ_HEAD(streambuf_segs, streambuf_seg) segs;    ///< The buffered payload.
+        size_t buffer_size;         ///< Total size of the segments.
+        /** The contiguous payload given to the parser (only valid while the parser is running).
+         * Either the packet itself or the data of the only segment. */
+        uint8_t const *buffer;
+        /** The offset where to start parsing from (from the beginning of the first segment).
          * Note that restart_offset is allowed to be outside of the buffer (in case you intend to skip a portion of payload). */
         size_t restart_offset;
-        bool buffer_is_malloced;    ///< True if the buffer was malloced, false if it references the original packet. unset if !buffer.
         bool wait;                  ///< Wait for more data before restarting.
+        streambuf_ready *ready;     ///< If set (and wait), wait until it returns true before restarting.
     } dir[2];
 };
 
@@ -55,6 +100,11 @@ void streambuf_dtor(struct streambuf *);
  *  @param way direction of the stream (@see struct mux_proto) */
 void streambuf_set_restart(struct streambuf *, unsigned way, uint8_t const *, bool wait);
 
+/// Same as streambuf_set_restart with wait, but restart only once ready is happy with the buffered payload.
+/** ready is called with a cursor set at the restart position each time some more payload is received.
+ * Notice that the parser won't be called meanwhile, so the streambuf will ack the packets on its behalf. */
+void streambuf_set_restart_ready(struct streambuf *, unsigned way, uint8_t const *, streambuf_ready *ready);
+
 /// Add the new payload to the buffered payload, then call the parse callback
 enum proto_parse_status streambuf_add(struct streambuf *, struct parser *, struct proto_info *, unsigned, uint8_t const *, size_t, size_t, struct timeval const *, size_t tot_cap_len, uint8_t const *tot_packet);
 
@@ -0,0 +1,81 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef ARENA_130614
+#define ARENA_130614
+#include <stddef.h>
+#include <junkie/cpp.h>
+
+/** @file
+ * @brief Reference counted bump allocators.
+ *
+ * An arena is a block of memory from which objects are carved one after the
+ * other and which are all released at once, when the last reference to the
+ * arena is dropped. Arenas of the default size are then kept on a per-thread
+ * free list so that the next packets can reuse them without calling malloc.
+ *
+ * While a packet is being parsed (ie. between arena_packet_begin and
+ * arena_packet_end) arena_packet() returns an arena that lives at least as long
+ * as the packet. Whatever must outlive the parse of the packet (for instance the
+ * proto_infos of a segment put on hold) can be stored there, and the holder then
+ * merely keeps a reference to the arena.
+ */
+
+/// Default size of an arena (bigger arenas can be requested but are not recycled)
+#define ARENA_SIZE 16384
+
+/// Alignment of the allocated objects (so each allocation may use up to ARENA_ALIGN-1 more bytes)
+#define ARENA_ALIGN 16U
+
+struct arena_cleanup;
+
+struct arena {
+    unsigned nb_refs;               ///< Number of references to this arena
+    size_t size;                    ///< Size of the bytes array
+    size_t used;                    ///< How many bytes were given already
+    struct arena_cleanup *cleanups; ///< What to do when the arena is released (last added first)
+    struct arena *next;             ///< Entry in the per-thread list of free arenas
+    char bytes[];
+};
+
+/// @return a new arena with at least size bytes available, with one reference (or NULL)
+struct arena *arena_new(size_t size);
+
+/// @return a new arena of exactly size bytes, with one reference (or NULL).
+/** Unlike those of arena_new, it's never recycled, but it does not waste memory when long lived. */
+struct arena *arena_new_exact(size_t size);
+
+/// @return a new reference to the arena
+struct arena *arena_ref(struct arena *);
+
+/// Drop a reference to the arena, and release it if it was the last one.
+void arena_unref(struct arena **);
+
+/// @return size bytes (aligned to ARENA_ALIGN) from the arena, or NULL if there is not enough room left
+void *arena_alloc(struct arena *, size_t size);
+
+/// @return the number of bytes that can still be allocated from this arena
+size_t arena_avail(struct arena const *);
+
+/// Register a function to be called with data when the arena is released.
+/** The cleanup record itself is allocated from the arena.
+ * @return 0 on success, -1 if there is not enough room left. */
+int arena_add_cleanup(struct arena *, void (*fun)(void *), void *data);
+
+/// Room needed in the arena by arena_add_cleanup
+size_t arena_cleanup_size(void);
+
+/// Mark the beginning of a new packet for this thread
+void arena_packet_begin(void);
+
+/// Mark the end of the current packet, dropping our reference to the packet arena
+void arena_packet_end(void);
+
+/// @return an arena that will live at least until arena_packet_end, with at least size bytes available (alignment included).
+/** The returned arena is borrowed : take a reference if you need it longer.
+ * @return NULL if we are not in between arena_packet_begin and arena_packet_end (or if we are out of memory). */
+struct arena *arena_packet(size_t size);
+
+void arena_init(void);
+void arena_fini(void);
+
+#endif
@@ -21,6 +21,9 @@ struct mutex {
 };
 
 void mutex_lock(struct mutex *);
+/// Lock the mutex only if it's free.
+/** @returns 0 if the mutex was locked, -1 if it was busy (or on error). */
+int mutex_trylock(struct mutex *);
 void mutex_unlock(struct mutex *);
 /// Grab the two mutexes, first the one with smaller address.
 /** Useful to avoid some deadlocks. */
@@ -3,6 +3,7 @@
 #ifndef REDIM_ARRAY_H_100907
 #define REDIM_ARRAY_H_100907
 #include <stdarg.h>
+#include <stdint.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/mutex.h>
 
@@ -29,6 +30,9 @@ struct redim_array {
     struct mutex chunks_mutex;  ///< Mutex to protect the above chunks list (and the various counters)
     LIST_ENTRY(redim_array) entry;  ///< Entry in the list of all redim_arrays
     char const *name;       ///< Name of the array, for stats purpose
+    int cache_idx;          ///< Index of this array in the per-thread caches of its user (-1 if not cached)
+    uint64_t nb_cache_hits;     ///< Number of cells got from or given back to a per-thread cache (reported by the cache owner)
+    uint64_t nb_cache_misses;   ///< Number of times a per-thread cache had to be refilled or flushed
 };
 
 /// Construct a new redim_array
@@ -45,6 +49,15 @@ void *redim_array_get(struct redim_array *);
 /// Free this entry (and try to compact the redim_array by getting rid of empty chunks)
 void redim_array_free(struct redim_array *, void *);
 
+/// Same as redim_array_get, for nb cells at once (taking the lock only once). @return the number of cells actually got.
+unsigned redim_array_get_bulk(struct redim_array *, void **cells, unsigned nb);
+
+/// Same as redim_array_free, for nb cells at once (taking the lock only once).
+void redim_array_free_bulk(struct redim_array *, void **cells, unsigned nb);
+
+/// Report some activity of a per-thread cache of cells of this array (for stats only)
+void redim_array_cache_report(struct redim_array *, unsigned nb_hits, unsigned nb_misses);
+
 /// Empty the array.
 void redim_array_clear(struct redim_array *);
 
@@ -3,6 +3,7 @@
 #ifndef REF_H_110324
 #define REF_H_110324
 #include <assert.h>
+#include <stdbool.h>
 #include <junkie/config.h>
 #include <junkie/tools/queue.h>
 #include <junkie/tools/mutex.h>
@@ -20,10 +21,12 @@
  *
  * - then we prevent a thread to delete an object which count reaches 0, since
  * this object address may be known by another thread that is about to inc the
- * count.  Refcounted object deletions are thus delayed until a safe point in
- * the program where all threads meet together without any pointer to any
- * refcounted object. As a consequence, it is not impossible for an object
- * count to be raised from 0 to 1.
+ * count.  Refcounted object deletions are thus delayed until every thread that
+ * was in the multi region when the object became unreachable have left it (a
+ * thread must not keep any pointer to a refcounted object without a ref once
+ * out of the multi region). This is tracked with epochs, so that threads never
+ * have to wait for each others. As a consequence, it is not impossible for an
+ * object count to be raised from 0 to 1.
  *
  * Note: ref counters gives you the assurance that a refed object won't
  * disapear, but does not prevent in any way another thread than yours to
@@ -33,6 +36,7 @@ struct ref {
     unsigned count;             ///< The count itself
 #   define NOT_IN_DEATH_ROW ((void *)1)
     SLIST_ENTRY(ref) entry;     ///< If already on the death row, or NOT_IN_DEATH_ROW
+    unsigned long doom_epoch;   ///< Epoch since which it's known to be unreachable (0 if not known yet), protected by death_row_mutex
 #   ifndef __GNUC__
     struct mutex mutex;         ///< In dire circumstances when we can't use atomic operations
 #   endif
@@ -43,6 +47,7 @@ static inline void ref_ctor(struct ref *ref, void (*del)(struct ref *))
 {
     ref->count = 1; // for the caller
     ref->entry.sle_next = NOT_IN_DEATH_ROW;
+    ref->doom_epoch = 0;
     ref->del = del;
 #   ifndef __GNUC__
     mutex_ctor(&ref->mutex, "ref");
@@ -81,45 +86,69 @@ static inline void unref(struct ref *ref)
 {
     if (! ref) return;
 
+    /* The count is only downed to 0 with the death_row_mutex, so that the doomer sees
+     * the count and the doom_epoch change at once. */
 #   ifdef __GNUC__
-    unsigned const c = __sync_fetch_and_sub(&ref->count, 1);
+    unsigned c = ref->count;
+    while (c > 1) {
+        unsigned const prev = __sync_val_compare_and_swap(&ref->count, c, c-1);
+        if (prev == c) return;
+        c = prev;
+    }
     assert(c > 0);  // or where did this ref came from ?
+    mutex_lock(&death_row_mutex);
+    c = __sync_fetch_and_sub(&ref->count, 1);   // may have been raised in between
+    assert(c > 0);
     bool const unreachable = c == 1;
 #   else
     mutex_lock(&ref->mutex);
     assert(ref->count > 0);
     bool const unreachable = ref->count == 1;
+    if (unreachable) mutex_lock(&death_row_mutex);
     ref->count --;
     mutex_unlock(&ref->mutex);
+    if (! unreachable) return;
 #   endif
 
     if (unreachable) {
         /* The thread that downs the count to 0 is responsible for queuing the object onto the death row.
-         * But two threads may try to perform this at the same time for the same object !
-         * (ex: thread 1 unref to 0, thread 2 ref from 0 to 1, then unref from 1 to 0, so queue the object,
-         * then thread 1 is scheduled by and queue again the object onto the death row...)
+         * But the object may be on the death row already !
+         * (ex: thread 1 unref to 0 and queue the object, then thread 2 ref from 0 to 1 before the
+         * doomer had a chance to delete it, then unref from 1 to 0...)
          * Or we merely unref a thing already on the death row (for instance while cascading deletion).
-         * To handle this we merely check for NOT_IN_DEATH_ROW. */
-        mutex_lock(&death_row_mutex);
+         * To handle this we merely check for NOT_IN_DEATH_ROW. In any case the object is unreachable
+         * only since now, so its grace period must start over. */
         if (ref->entry.sle_next == NOT_IN_DEATH_ROW) SLIST_INSERT_HEAD(&death_row, ref, entry);
         assert(ref->entry.sle_next != NOT_IN_DEATH_ROW);
-        mutex_unlock(&death_row_mutex);
+        ref->doom_epoch = 0;
     }
+    mutex_unlock(&death_row_mutex);
 }
 
-/// Enter the region where multiple threads can enter
+/// Enter the region where multiple threads can enter (and use refcounted objects without holding a ref)
+/** This merely publishes the current epoch for this thread and never waits, unless another thread is in the mono region.
+ * Calls can be nested. */
 void enter_multi_region(void);
 
 /// Enter the region where only this thread can enter
+/** This waits for all other threads to leave the multi region and stops them from entering it again.
+ * Stops all parsing, so use sparingly. */
 void enter_mono_region(void);
 
-/// Leave the protected region (ie. all threads allowed)
+/// Leave the protected region (ie. all threads allowed). Leaving the multi region is a quiescent state for this thread.
 void leave_protected_region(void);
 
+/// Wait until every other thread that is in the multi region has left it at least once.
+/** Thus, any pointer to an unreachable object these threads were holding is gone.
+ * Must not be called from the mono region. */
+void wait_grace_period(void);
+
 /// Will stop the doomer_thread (must be called bedore ref_fini(), and probably before any parser_fini()
 void doomer_stop(void);
 
-/// Will run the doomer thread to kill all unreachable objects (safe for multithread)
+/// Will run the doomer to kill all unreachable objects which grace period is over (safe for multithread)
+/** Since deleting an object can make others unreachable, this proceeds as long as objects are deleted and
+ * no other thread prevent the epoch from moving on. */
 void doomer_run(void);
 
 void ref_init(void);
@@ -58,24 +58,29 @@ static inline uint_least8_t deserialize_1(uint8_t const **buf)
     return *((*buf)++);
 }
 
+// Note: operands of + are unsequenced, so bytes must be read in distinct statements
 static inline uint_least16_t deserialize_2(uint8_t const **buf)
 {
-    return deserialize_1(buf) + ((uint_least16_t)deserialize_1(buf)<<8U);
+    uint_least16_t const lo = deserialize_1(buf);
+    return lo + ((uint_least16_t)deserialize_1(buf)<<8U);
 }
 
 static inline uint_least32_t deserialize_3(uint8_t const **buf)
 {
-    return deserialize_2(buf) + ((uint_least32_t)deserialize_1(buf)<<16U);
+    uint_least32_t const lo = deserialize_2(buf);
+    return lo + ((uint_least32_t)deserialize_1(buf)<<16U);
 }
 
 static inline uint_least32_t deserialize_4(uint8_t const **buf)
 {
-    return deserialize_2(buf) + ((uint_least32_t)deserialize_2(buf)<<16U);
+    uint_least32_t const lo = deserialize_2(buf);
+    return lo + ((uint_least32_t)deserialize_2(buf)<<16U);
 }
 
 static inline uint_least64_t deserialize_8(uint8_t const **buf)
 {
-    return deserialize_4(buf) + ((uint_least64_t)deserialize_4(buf)<<32ULL);
+    uint_least64_t const lo = deserialize_4(buf);
+    return lo + ((uint_least64_t)deserialize_4(buf)<<32ULL);
 }
 
 static inline void deserialize_n(uint8_t const **buf, void *dst, size_t n)
@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>  // for struct iovec
 #include <sys/un.h>
 #include <sys/select.h> // for fd_set
 #include <netinet/in.h>
@@ -48,6 +49,8 @@ typedef int sock_receiver(struct sock *, size_t, uint8_t const *, struct ip_addr
 struct sock {
     struct sock_ops {
         int (*send)(struct sock *, void const *, size_t);
+        /// send several messages at once (optional, use sock_send_batch()). Returns how many were sent.
+        unsigned (*send_batch)(struct sock *, struct iovec const *, unsigned nb_msgs);
         /// sender will be set to 127.0.0.1 for UNIX domain/files sockets.
         int (*recv)(struct sock *, fd_set *, sock_receiver *, void *user_data);
         /// add all selectable fds in this set, return the max
@@ -66,6 +69,9 @@ struct sock *sock_tcp_server_new(char const *service, size_t buf_size);
 
 struct sock *sock_udp_client_new(char const *host, char const *service, size_t buf_size);
 struct sock *sock_udp_server_new(char const *service, size_t buf_size);
+/** Several of these can serve the same port, the kernel spreading the datagrams among them
+ * according to their sender (SO_REUSEPORT). */
+struct sock *sock_udp_server_new_shared(char const *service, size_t buf_size);
 
 struct sock *sock_unix_client_new(char const *file);
 struct sock *sock_unix_server_new(char const *file);
@@ -95,6 +101,11 @@ int sock_buf_ctor(struct sock_buf *, size_t mtu, struct sock *);
  * Also, the buffer will be flushed before its lost. */
 void sock_buf_dtor(struct sock_buf *);
 
+/** Send each iovec as a message, in as few syscalls as the sock allows.
+ * Returns how many were sent: the others were lost (for instance because the sock could not
+ * take more without blocking). */
+unsigned sock_send_batch(struct sock *, struct iovec const *msgs, unsigned nb_msgs);
+
 /// Simple select for single sock. the fd_set is an output parameter
 int sock_select_single(struct sock *, fd_set *);
 
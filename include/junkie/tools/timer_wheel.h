@@ -0,0 +1,71 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#ifndef TIMER_WHEEL_130620
+#define TIMER_WHEEL_130620
+#include <stdbool.h>
+#include <time.h>
+#include <junkie/tools/queue.h>
+
+/** @file
+ * @brief Hierarchical timing wheels, with a resolution of one second.
+ *
+ * Timers are stored into one of TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS
+ * slots each, according to how far in the future they expire. Each second the
+ * slot of the first wheel is fired, and every TIMER_WHEEL_SLOTS seconds a slot
+ * of the next wheel is spread over the previous one (and so on), so that adding,
+ * deleting and firing a timer is O(1) (amortized).
+ *
+ * A timer_wheel is not protected against concurrent accesses in any way: the
+ * caller must serialize all operations on a given wheel (and its timers).
+ * Time is not taken from the system but given by the caller (typically, the
+ * timestamp of the packet being processed).
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+/// Timers further than this are stored on the last wheel and rescheduled when they come up
+#define TIMER_WHEEL_SPAN ((time_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer {
+    LIST_ENTRY(timer) entry;    ///< Entry in its slot
+    time_t expiry;              ///< When this timer is due
+    bool set;                   ///< Is this timer in a wheel?
+};
+
+struct timer_wheel {
+    time_t now;                 ///< Timers were fired up to this time
+    unsigned nb_timers;         ///< How many timers are set
+    LIST_HEAD(timers, timer) slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_ctor(struct timer_wheel *, time_t now);
+/// Timers that are still set are merely forgotten
+void timer_wheel_dtor(struct timer_wheel *);
+
+void timer_ctor(struct timer *);
+
+/// Set the timer to expire at the given time (or the next second if that's already in the past).
+/** If the timer was already set it's rescheduled. */
+void timer_add(struct timer_wheel *, struct timer *, time_t expiry);
+
+/// Unset the timer (no-op if it's not set)
+void timer_del(struct timer_wheel *, struct timer *);
+
+static inline bool timer_is_set(struct timer const *timer)
+{
+    return timer->set;
+}
+
+/// Callback for expired timers, which are unset before the call (so the callback may set them again).
+typedef void timer_cb(struct timer *, time_t now, void *userdata);
+
+/// Move the time forward to now, calling cb for every timer that expires in the meantime.
+/** @return the number of expired timers. */
+unsigned timer_wheel_advance(struct timer_wheel *, time_t now, timer_cb *cb, void *userdata);
+
+/// Unset every timers of the wheel, calling cb for each of them regardless of their expiry.
+/** @return the number of timers. */
+unsigned timer_wheel_expire_all(struct timer_wheel *, timer_cb *cb, void *userdata);
+
+#endif
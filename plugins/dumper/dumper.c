@@ -37,10 +37,12 @@ static void dump_frame_rec(struct proto_info const *info)
 
 static void pkt_callback(struct proto_subscriber unused_ *s, struct proto_info const *last, size_t cap_len, uint8_t const unused_ *packet, struct timeval const unused_ *now)
 {
+    flockfile(stdout);  // so that the stacks dumped by several parsing threads do not mix
     if (display_caplen) printf("Captured length: %zu\n", cap_len);
     dump_frame_rec(last);
     printf("\n");
     fflush(stdout);
+    funlockfile(stdout);
 }
 
 static struct proto_subscriber subscription;
@@ -20,107 +20,330 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h> // for getpid()
+#include <pthread.h>
 #include <regex.h>
 #include "junkie/cpp.h"
 #include "junkie/tools/cli.h"
+#include "junkie/tools/ext.h"
 #include "junkie/tools/sock.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/proto/serialize.h"
 #include "junkie/proto/proto.h"
 #include "junkie/proto/capfile.h"
+#ifdef WITH_LZ4
+#   include <lz4.h>
+#endif
 
 static char *opt_dest_name = "localhost";
 static char *opt_dest_port = "28999";
 static unsigned opt_msg_size = 1500;
+static unsigned opt_batch = 16;
+static bool opt_lz4 = false;
 static struct sock *sock;
-static bool inited = false;
-/* Since there is a largest protocol stack, there is no need to check for any size in the serialization process, IFF
- * this buffer is larger than the corresponding info stack. */
-static uint8_t *ser_buf;
-static unsigned ser_cursor;
-static uint64_t ser_nb_msgs;
-static uint32_t ser_source;
-static struct mutex ser_buf_lock;   // protect ser_buf and ser_cursor
-
-static void ser_send(void)
+static bool volatile inited = false;
+static struct mutex ser_lock;   // protects inited and ser_bufs
+static pthread_t flusher_pth;
+static bool volatile flusher_quit;
+
+/* Each parsing thread serializes into its own buffer, made of opt_batch messages that are sent
+ * together when they are all full (or too old). Since there is a largest protocol stack, there is
+ * no need to check for any size in the serialization process, IFF there is MSG_MAX_SIZE room left
+ * in the current message. Each thread is a distinct source, so that receivers can still count
+ * the lost messages.
+ * The mutex of a buffer is only ever contended by the flusher thread, which sends the messages
+ * of the threads that did not serialize anything for a while. */
+struct ser_buf {
+    LIST_ENTRY(ser_buf) entry;  ///< In the list of all ser_bufs
+    pthread_mutex_t mutex;      ///< Owned by our thread while it serializes, or by the flusher
+    uint32_t source;            ///< Our source identifier
+    uint32_t seqnum;            ///< Sequence number of the next message
+    uint64_t nb_msgs;           ///< How many proto stacks we serialized so far
+    uint64_t nb_msgs_seen;      ///< nb_msgs when the flusher last had a look
+    uint64_t nb_sent;           ///< How many messages we sent
+    uint64_t nb_dropped;        ///< How many messages could not be sent
+    unsigned nb_full;           ///< How many of the messages are ready to be sent
+    unsigned cursor;            ///< Where to write in the current message payload
+    struct timeval oldest;      ///< Timestamp of the first proto stack that was not sent yet
+    uint8_t *payload;           ///< Where we serialize the payload of the current message, if compressed
+    struct iovec *iov;          ///< The messages, opt_msg_size large each
+};
+
+static LIST_HEAD(ser_bufs, ser_buf) ser_bufs;
+static __thread struct ser_buf *ser_buf;
+static unsigned ser_nb_bufs;
+
+// Where to serialize the payload of the current message
+static uint8_t *ser_payload(struct ser_buf *buf)
+{
+    return buf->payload ? buf->payload : (uint8_t *)buf->iov[buf->nb_full].iov_base + MSG_HEADER_SIZE;
+}
+
+static struct ser_buf *ser_buf_new(void)
+{
+    struct ser_buf *buf = malloc(sizeof(*buf)); // long lived: no need for objalloc
+    if (! buf) goto err0;
+
+    buf->iov = malloc(opt_batch * (sizeof(*buf->iov) + opt_msg_size));
+    if (! buf->iov) goto err1;
+    uint8_t *msgs = (uint8_t *)(buf->iov + opt_batch);
+    for (unsigned m = 0; m < opt_batch; m++) {
+        buf->iov[m].iov_base = msgs + m * opt_msg_size;
+        buf->iov[m].iov_len = 0;
+    }
+    buf->payload = NULL;
+    if (opt_lz4) {
+        buf->payload = malloc(opt_msg_size);
+        if (! buf->payload) goto err2;
+    }
+    buf->seqnum = 0;
+    buf->nb_msgs = buf->nb_msgs_seen = 0;
+    buf->nb_sent = buf->nb_dropped = 0;
+    pthread_mutex_init(&buf->mutex, NULL);
+    buf->nb_full = 0;
+    buf->cursor = 0;
+    timeval_reset(&buf->oldest);
+
+    WITH_LOCK(&ser_lock) {
+        // pids fit in 22 bits
+        buf->source = getpid() | (ser_nb_bufs++ << 22);
+        LIST_INSERT_HEAD(&ser_bufs, buf, entry);
+    }
+    return buf;
+
+err2:
+    free(buf->iov);
+err1:
+    free(buf);
+err0:
+    SLOG(LOG_ERR, "Cannot malloc serializer buffer (%u messages of %u bytes)", opt_batch, opt_msg_size);
+    return NULL;
+}
+
+static void ser_buf_del(struct ser_buf *buf)
+{
+    LIST_REMOVE(buf, entry);
+    pthread_mutex_destroy(&buf->mutex);
+    free(buf->payload);
+    free(buf->iov);
+    free(buf);
+}
+
+// Close the current message (with its header)
+static void ser_buf_close_msg(struct ser_buf *buf)
 {
-    sock->ops->send(sock, ser_buf, ser_cursor);
-    ser_cursor = 0;
+    assert(buf->nb_full < opt_batch);
+    assert(buf->cursor > 0);
+    struct iovec *const iov = buf->iov + buf->nb_full;
+    uint8_t *ptr = iov->iov_base;
+    uint8_t flags = 0;
+    size_t wire_len = buf->cursor;
+
+#   ifdef WITH_LZ4
+    if (buf->payload) {
+        int const l = LZ4_compress_default((char const *)buf->payload, (char *)ptr + MSG_HEADER_SIZE, buf->cursor, opt_msg_size - MSG_HEADER_SIZE);
+        if (l > 0 && (unsigned)l < buf->cursor) {
+            flags |= MSG_LZ4;
+            wire_len = l;
+        } else {
+            memcpy(ptr + MSG_HEADER_SIZE, buf->payload, buf->cursor);
+        }
+    }
+#   endif
+
+    serialize_1(&ptr, MSG_MAGIC);
+    serialize_1(&ptr, MSG_VERSION);
+    serialize_1(&ptr, flags);
+    serialize_4(&ptr, buf->source);
+    serialize_4(&ptr, buf->seqnum++);
+    serialize_2(&ptr, buf->cursor);
+    iov->iov_len = MSG_HEADER_SIZE + wire_len;
+
+    buf->nb_full ++;
+    buf->cursor = 0;
+}
+
+static void ser_buf_flush(struct ser_buf *buf)
+{
+    if (buf->cursor > 0) ser_buf_close_msg(buf);
+    if (buf->nb_full == 0) return;
+
+    SLOG(LOG_DEBUG, "Sending %u messages from source %"PRIu32, buf->nb_full, buf->source);
+    unsigned const sent = sock_send_batch(sock, buf->iov, buf->nb_full);
+    buf->nb_sent += sent;
+    buf->nb_dropped += buf->nb_full - sent;
+    buf->nb_full = 0;
+    timeval_reset(&buf->oldest);
+}
+
+// Send the messages of the threads that were idle since last time we looked
+static void *flusher_thread(void unused_ *dummy)
+{
+    set_thread_name("J-ser-flusher");
+
+    unsigned ticks = 0;
+    while (! flusher_quit) {
+        usleep(100000);
+        if (++ticks < 10) continue;
+        ticks = 0;
+
+        WITH_LOCK(&ser_lock) {
+            struct ser_buf *buf;
+            LIST_FOREACH(buf, &ser_bufs, entry) {
+                if (0 != pthread_mutex_trylock(&buf->mutex)) continue;  // busy serializing, thus not idle
+                if (buf->nb_msgs == buf->nb_msgs_seen) ser_buf_flush(buf);
+                buf->nb_msgs_seen = buf->nb_msgs;
+                pthread_mutex_unlock(&buf->mutex);
+            }
+        }
+    }
+
+    return NULL;
 }
 
 /* Some init is not performed until we receive some traffic.
  * Actually, we just want to wait for the command line parsing is over. */
 static void ser_init(void)
 {
-    if (inited) return;
-    ser_source = getpid();
+    if (likely_(inited)) return;
+
+    mutex_lock(&ser_lock);
+    if (inited) goto quit;
+
     sock = sock_udp_client_new(opt_dest_name, opt_dest_port, 0);
     if (! sock) {
         SLOG(LOG_ERR, "Cannot connect to %s:%s", opt_dest_name, opt_dest_port);
-        return;
+        // so be it
     }
-    if (opt_msg_size < MSG_MAX_SIZE) {
-        SLOG(LOG_ERR, "Made serializer buffer "STRIZE(MSG_MAX_SIZE)" bytes large");
-        opt_msg_size = MSG_MAX_SIZE;
+    unsigned const min_size = MSG_HEADER_SIZE + MSG_FRAME_HEADER_SIZE + MSG_MAX_SIZE;
+    if (opt_msg_size < min_size) {
+        SLOG(LOG_ERR, "Made serializer messages %u bytes large", min_size);
+        opt_msg_size = min_size;
+    } else if (opt_msg_size > SOCK_MAX_MSG_SIZE) {
+        SLOG(LOG_ERR, "Made serializer messages "STRIZE(SOCK_MAX_MSG_SIZE)" bytes large");
+        opt_msg_size = SOCK_MAX_MSG_SIZE;
     }
-    ser_buf = malloc(opt_msg_size);
-    if (! ser_buf) {
-        SLOG(LOG_ERR, "Cannot malloc serializer buffer (%u bytes)", opt_msg_size);
-        // so be it
+    if (opt_batch == 0) opt_batch = 1;
+#   ifndef WITH_LZ4
+    if (opt_lz4) {
+        SLOG(LOG_ERR, "LZ4 support was not compiled in, sending uncompressed messages");
+        opt_lz4 = false;
+    }
+#   endif
+    flusher_quit = false;
+    int const err = sock ? pthread_create(&flusher_pth, NULL, flusher_thread, NULL) : 0;
+    if (err) {
+        SLOG(LOG_ERR, "Cannot start flusher thread: %s (messages of idle threads will be delayed)", strerror(err));
+        flusher_quit = true;
     }
+    __sync_synchronize();
     inited = true;
+
+quit:
+    mutex_unlock(&ser_lock);
 }
 
 static void ser_fini(void)
 {
-    if (inited) {
-        if (ser_cursor > 0) {
-            SLOG(LOG_DEBUG, "Flushing last message");
-            ser_send();
-        }
-        sock->ops->del(sock);
-        if (ser_buf) {
-            free(ser_buf);
-            ser_buf = NULL;
-        }
+    if (! inited) return;
+
+    if (sock && ! flusher_quit) {
+        flusher_quit = true;
+        (void)pthread_join(flusher_pth, NULL);
+    }
+
+    struct ser_buf *buf;
+    while (NULL != (buf = LIST_FIRST(&ser_bufs))) {
+        SLOG(LOG_DEBUG, "Flushing last messages of source %"PRIu32, buf->source);
+        ser_buf_flush(buf);
+        SLOG(LOG_INFO, "Source %"PRIu32" serialized %"PRIu64" infos, sent %"PRIu64" messages and dropped %"PRIu64,
+            buf->source, buf->nb_msgs, buf->nb_sent, buf->nb_dropped);
+        ser_buf_del(buf);
     }
+    if (sock) sock->ops->del(sock);
 }
 
 static void pkt_callback(struct proto_subscriber unused_ *s, struct proto_info const *info, size_t unused_ cap_len, uint8_t const unused_ *packet, struct timeval const *now)
 {
-    mutex_lock(&ser_buf_lock);
-
     ser_init();
+    if (! sock) return;
+
+    if (unlikely_(! ser_buf)) {
+        ser_buf = ser_buf_new();
+        if (! ser_buf) return;
+    }
+    struct ser_buf *const buf = ser_buf;
+    pthread_mutex_lock(&buf->mutex);
 
-    if (! ser_buf) goto quit;
+    uint8_t *const start = ser_payload(buf);
+    uint8_t *ptr = start + buf->cursor;
 
-    uint8_t *ptr = ser_buf + ser_cursor;
-    serialize_1(&ptr, MSG_PROTO_INFO);
-    serialize_4(&ptr, ser_source);
+    uint8_t *frame = ptr;
+    ptr += MSG_FRAME_HEADER_SIZE;
     serialize_proto_stack(&ptr, info, now);
-    ser_nb_msgs ++;
-    if (0 == (ser_nb_msgs % 32)) {  // from time to time, insert some stats about how many packets were sent by this source
+    serialize_1(&frame, MSG_PROTO_INFO);
+    serialize_2(&frame, ptr - frame - 2);
+    buf->nb_msgs ++;
+
+    if (0 == (buf->nb_msgs % 32)) {  // from time to time, insert some stats about how many packets were sent by this source
         serialize_1(&ptr, MSG_PROTO_STATS);
-        serialize_4(&ptr, ser_source);
-        serialize_8(&ptr, ser_nb_msgs);
+        serialize_2(&ptr, 8);
+        serialize_8(&ptr, buf->nb_msgs);
     }
-    ser_cursor = ptr - ser_buf;
-    SLOG(LOG_DEBUG, "New buffer cursor = %u", ser_cursor);
-    assert(ser_cursor < opt_msg_size);
 
-    if (opt_msg_size - ser_cursor < MSG_MAX_SIZE) ser_send();
+    buf->cursor = ptr - start;
+    SLOG(LOG_DEBUG, "New buffer cursor = %u", buf->cursor);
+    assert(MSG_HEADER_SIZE + buf->cursor <= opt_msg_size);
 
-quit:
-    mutex_unlock(&ser_buf_lock);
+    if (! timeval_is_set(&buf->oldest)) buf->oldest = *now;
+
+    if (opt_msg_size - MSG_HEADER_SIZE - buf->cursor < MSG_FRAME_HEADER_SIZE + MSG_MAX_SIZE) {
+        ser_buf_close_msg(buf);
+        if (buf->nb_full >= opt_batch) ser_buf_flush(buf);
+    }
+
+    // Do not delay messages for too long
+    if (timeval_sub(now, &buf->oldest) > 1000000) ser_buf_flush(buf);
+    pthread_mutex_unlock(&buf->mutex);
+}
+
+/*
+ * Extensions
+ */
+
+static SCM nb_infos_sym;
+static SCM nb_sent_sym;
+static SCM nb_dropped_sym;
+
+static struct ext_function sg_serializer_stats;
+static SCM g_serializer_stats(void)
+{
+    uint64_t nb_infos = 0, nb_sent = 0, nb_dropped = 0;
+    WITH_LOCK(&ser_lock) {
+        struct ser_buf *buf;
+        LIST_FOREACH(buf, &ser_bufs, entry) {
+            nb_infos += buf->nb_msgs;
+            nb_sent += buf->nb_sent;
+            nb_dropped += buf->nb_dropped;
+        }
+    }
+
+    return scm_list_3(
+        scm_cons(nb_infos_sym,   scm_from_uint64(nb_infos)),
+        scm_cons(nb_sent_sym,    scm_from_uint64(nb_sent)),
+        scm_cons(nb_dropped_sym, scm_from_uint64(nb_dropped)));
 }
 
 // Extension of the command line:
 static struct cli_opt serializer_opts[] = {
-    { { "dest", NULL },     "hostname", "peer where to send infos", CLI_DUP_STR,  { .str = &opt_dest_name } },
-    { { "port", NULL },     "port",     "destination port",         CLI_DUP_STR,  { .str = &opt_dest_port } },
-    { { "msg-size", NULL }, NEEDS_ARG,  "max message size",         CLI_SET_UINT, { .uint = &opt_msg_size } },
+    { { "dest", NULL },     "hostname", "peer where to send infos",          CLI_DUP_STR,  { .str = &opt_dest_name } },
+    { { "port", NULL },     "port",     "destination port",                  CLI_DUP_STR,  { .str = &opt_dest_port } },
+    { { "msg-size", NULL }, NEEDS_ARG,  "max message size",                  CLI_SET_UINT, { .uint = &opt_msg_size } },
+    { { "batch", NULL },    NEEDS_ARG,  "how many messages to send at once", CLI_SET_UINT, { .uint = &opt_batch } },
+    { { "lz4", NULL },      NULL,       "compress messages",                 CLI_SET_BOOL, { .boolean = &opt_lz4 } },
 };
 
 static struct proto_subscriber subscription;
@@ -129,7 +352,18 @@ void on_load(void)
 {
     SLOG(LOG_INFO, "Loading serializer");
     cli_register("Serializer plugin", serializer_opts, NB_ELEMS(serializer_opts));
-    mutex_ctor(&ser_buf_lock, "Serializer buffer lock");
+    mutex_ctor(&ser_lock, "Serializer lock");
+    LIST_INIT(&ser_bufs);
+
+    nb_infos_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-infos"));
+    nb_sent_sym    = scm_permanent_object(scm_from_latin1_symbol("nb-sent"));
+    nb_dropped_sym = scm_permanent_object(scm_from_latin1_symbol("nb-dropped"));
+
+    ext_function_ctor(&sg_serializer_stats,
+        "serializer-stats", 0, 0, 0, g_serializer_stats,
+        "(serializer-stats): return how many infos were serialized, and how many messages were\n"
+        "    sent and dropped (because the socket could not take them without blocking).\n");
+
     hook_subscriber_ctor(&pkt_hook, &subscription, pkt_callback);
 }
 
@@ -139,5 +373,5 @@ void on_unload(void)
     hook_subscriber_dtor(&pkt_hook, &subscription);
     cli_unregister(serializer_opts);
     ser_fini();
-    mutex_dtor(&ser_buf_lock);
+    mutex_dtor(&ser_lock);
 }
@@ -49,7 +49,7 @@ struct capture_conf {
     LIST_ENTRY(capture_conf) entry;
     bool listed;    // if in conf_captures list
     bool paused;
-    enum file_type { PCAP, CSV } method;
+    enum file_type { PCAP, CSV, PCAPNG } method;
     unsigned max_pkts;
     unsigned max_size;
     unsigned max_secs;
@@ -155,6 +155,9 @@ static void conf_capture_start(struct capture_conf *conf, struct timeval const *
         case CSV:
             conf->capfile = capfile_new_csv(conf->file, conf->max_pkts, conf->max_size, conf->max_secs, conf->cap_len, conf->rotation, now);
             break;
+        case PCAPNG:
+            conf->capfile = capfile_new_pcapng(conf->file, conf->max_pkts, conf->max_size, conf->max_secs, conf->cap_len, conf->rotation, now);
+            break;
     }
 }
 
@@ -257,7 +260,7 @@ static int print_conf(SCM conf_smob, SCM port, scm_print_state unused_ *pstate)
 
     scm_puts("#<capture-conf ", port);
     scm_display(scm_from_locale_string(conf->file ? conf->file : "no file"), port);
-    scm_puts(conf->method == PCAP ? " method=PCAP":" method=CSV", port);
+    scm_puts(conf->method == PCAP ? " method=PCAP": conf->method == CSV ? " method=CSV":" method=PCAPNG", port);
     if (! conf->capfile) scm_puts(" NotStarted", port);
     if (conf->paused) scm_puts(" Paused", port);
     scm_puts(">", port);
@@ -281,13 +284,13 @@ static SCM g_make_capture_conf(SCM file_, SCM method_, SCM match_re_, SCM netmat
     }
 
     int method = SCM_UNBNDP(method_) || scm_is_false(method_) ?
-                    0 : cli_2_enum(false, scm_to_latin1_string(scm_symbol_to_string(method_)), "pcap", "csv", NULL);
+                    0 : cli_2_enum(false, scm_to_latin1_string(scm_symbol_to_string(method_)), "pcap", "csv", "pcapng", NULL);
     if (method < 0) {
         scm_throw(scm_from_latin1_symbol("no-such-method"), scm_list_1(method_));
         assert(!"Not reached");
     }
 
-    SLOG(LOG_DEBUG, "Constructing a capture conf for file %s and method %s", file, method==PCAP ? "pcap":"csv");
+    SLOG(LOG_DEBUG, "Constructing a capture conf for file %s and method %s", file, method==PCAP ? "pcap": method==CSV ? "csv":"pcapng");
     struct capture_conf *conf = scm_gc_malloc(sizeof(*conf), "capture-conf");
     conf->listed = false;
     conf->paused = false;
@@ -380,6 +383,7 @@ static SCM g_capture_resume(SCM conf_smob)
 static SCM unset_sym;
 static SCM pcap_sym;
 static SCM csv_sym;
+static SCM pcapng_sym;
 static SCM paused_sym;
 static SCM filetype_sym;
 static SCM max_pkts_sym;
@@ -398,7 +402,7 @@ static SCM g_capture_stats(SCM conf_smob)
     struct capture_conf *conf = (struct capture_conf *)SCM_SMOB_DATA(conf_smob);
     return scm_list_n(
             scm_cons(paused_sym,   scm_from_bool(conf->paused)),
-            scm_cons(filetype_sym, conf->method == PCAP ? pcap_sym : csv_sym),
+            scm_cons(filetype_sym, conf->method == PCAP ? pcap_sym : conf->method == CSV ? csv_sym : pcapng_sym),
             scm_cons(max_pkts_sym, conf->max_pkts ? scm_from_uint(conf->max_pkts) : unset_sym),
             scm_cons(max_size_sym, conf->max_size ? scm_from_uint(conf->max_size) : unset_sym),
             scm_cons(max_secs_sym, conf->max_secs ? scm_from_uint(conf->max_secs) : unset_sym),
@@ -416,10 +420,34 @@ static SCM g_capture_stats(SCM conf_smob)
  * Init
  */
 
+static struct proto_subscriber subscription;
+
+// Queued packets may take as many bytes as this many full size Ethernet frames with their infos
+#define ASYNC_EVENT_BYTES 2048
+
+// Called by the CLI parser to deliver packets to the writer from its own thread
+static int cli_async_queue(char const *value)
+{
+    char *end;
+    unsigned long const ring_size = strtoul(value, &end, 0);
+    if (*end != '\0' || ring_size == 0) {
+        SLOG(LOG_ERR, "Invalid queue size: %s", value);
+        return -1;
+    }
+
+    hook_subscriber_dtor(&pkt_hook, &subscription);
+    if (0 != hook_subscriber_ctor_async(&pkt_hook, &subscription, pkt_callback, ring_size, ring_size * ASYNC_EVENT_BYTES, "writer")) {
+        // Fallback to synchronous delivery
+        hook_subscriber_ctor(&pkt_hook, &subscription, pkt_callback);
+        return -1;
+    }
+    return 0;
+}
+
 // Extension of the command line:
 static struct cli_opt writer_opts[] = {
     { { "file", NULL },     "file",    "name of the capture file",                 CLI_DUP_STR,  { .str = &cli_conf.file } },
-    { { "method", NULL },   NEEDS_ARG, "pcap|csv",                                 CLI_SET_ENUM, { .uint = &cli_conf.method } },
+    { { "method", NULL },   NEEDS_ARG, "pcap|csv|pcapng",                          CLI_SET_ENUM, { .uint = &cli_conf.method } },
     { { "match-re", NULL }, "regex",   "save only packets matching this "
                                        "regular expression",                       CLI_CALL,     { .call = &cli_match_re } },
     { { "netmatch", NULL }, "s-expr",  "save only packets matching this "
@@ -431,10 +459,10 @@ static struct cli_opt writer_opts[] = {
     { { "rotation", NULL }, NEEDS_ARG, "when a file is done, opens another one, "
                                        "up to this number after which rotates. "
                                        "will create files suffixed with numbers.", CLI_SET_UINT, { .uint = &cli_conf.rotation } },
+    { { "async-queue", NULL }, NEEDS_ARG, "write packets from a dedicated thread, "
+                                       "queuing up to this many packets",          CLI_CALL,     { .call = &cli_async_queue } },
 };
 
-static struct proto_subscriber subscription;
-
 void on_load(void)
 {
     log_category_writer_init();
@@ -447,6 +475,7 @@ void on_load(void)
 	unset_sym    = scm_permanent_object(scm_from_latin1_symbol("unset"));
 	pcap_sym     = scm_permanent_object(scm_from_latin1_symbol("PCAP"));
 	csv_sym      = scm_permanent_object(scm_from_latin1_symbol("CSV"));
+	pcapng_sym   = scm_permanent_object(scm_from_latin1_symbol("PCAPNG"));
 	paused_sym   = scm_permanent_object(scm_from_latin1_symbol("paused"));
 	filetype_sym = scm_permanent_object(scm_from_latin1_symbol("file-type"));
 	max_pkts_sym = scm_permanent_object(scm_from_latin1_symbol("max-pkts"));
@@ -465,7 +494,7 @@ void on_load(void)
     ext_function_ctor(&sg_make_capture_conf,
         "make-capture-conf", 1, 8, 0, g_make_capture_conf,
         "(make-capture-conf \"some/file\"\n"
-        "                   'csv ; method, either 'csv or 'pcap\n"
+        "                   'csv ; method, either 'csv, 'pcap or 'pcapng (indexed)\n"
         "                   \"some regex\" ; optional, regular expression\n"
         "                   \"some netmatch filter\" : optional, netmatch filter\n"
         "                   max-pkts max-size max-secs caplen rotation) ; optional as well\n"
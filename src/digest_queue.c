@@ -32,16 +32,12 @@
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/queue.h"
 #include "junkie/tools/ext.h"
-#include "junkie/tools/hash.h"
+#include "junkie/tools/mallocer.h"
 #include "junkie/proto/cap.h"   // for collapse_ifaces
 #include "junkie/proto/eth.h"   // for collapse_vlans
 #include "junkie/proto/deduplication.h"
 #include "junkie/cpp.h"
 
-// We use directly the MD4 as a hash key
-#undef HASH_FUNC
-#define HASH_FUNC(key) ((key)->hash_key)
-
 LOG_CATEGORY_DEF(digest);
 #undef LOG_CAT
 #define LOG_CAT digest_log_category
@@ -52,53 +48,146 @@ struct hook dup_hook;
 unsigned max_dup_delay = 100000; // microseconds
 EXT_PARAM_RW(max_dup_delay, "max-dup-delay", uint, "Number of microseconds between two packets that can not be duplicates (set to 0 to disable deduplication altogether)")
 
+static bool fast_digests = true;
+EXT_PARAM_RW(fast_digests, "fast-digests", bool, "Use a fast non cryptographic hash instead of MD4 to compute frame digests (frames received while switching from one to the other will not be deduplicated)")
+
+static unsigned slab_size = 65536;
+EXT_PARAM_RW(slab_size, "dedup-slab-size", uint, "Number of digests that can be stored per max-dup-delay window and per packet source (rounded up to a power of 2, taken into account for new packet sources)")
+
 static LIST_HEAD(digest_queues, digest_queue) digest_queues;    // FIXME: Please do not share me with other threads!
 
 /*
- * Individual digest (digest_qcell)
+ * Slabs
  */
 
-struct digest_qcell {
-    HASH_ENTRY(digest_qcell) entry;
-    union {
-        unsigned char digest[DIGEST_SIZE];
-        uint32_t hash_key;
-    } u;
-    struct timeval tv;
-};
-
-// Caller must own q->mutex
-static void digest_qcell_ctor(struct digest_qcell *qc, struct digest_queue_ *q, struct timeval const *tv)
+static void incr_stat(uint_least64_t *stat)
+{
+#   ifdef __GNUC__
+    __sync_add_and_fetch(stat, 1);
+#   else
+    (*stat) ++;
+#   endif
+    // as all stats are 64 bits we don't fear a wrap around
+}
+
+static void cpu_relax(void)
 {
-    qc->tv = *tv;
-    HASH_INSERT(&q->qcells, qc, &qc->u, entry);
+#   if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+    __asm__ __volatile__ ("pause");
+#   endif
 }
 
-// Note: there is no qcell_new since the qcell is allocated before construction to avoid copying the digest
+#define MAX_LATE_EPOCHS 64
 
-// Caller must own q->mutex
-static void digest_qcell_dtor(struct digest_qcell *qc, struct digest_queue_ *q)
+/* Take a slab for the given epoch, recycling it if it holds an older one.
+ * Returns NULL if the slab was already recycled for a more recent epoch
+ * (or is not for this epoch and we must not recycle it). */
+static struct digest_slab *slab_acquire(struct digest_queue *dq, int64_t epoch, bool recycle)
 {
-    HASH_REMOVE(&q->qcells, qc, entry);
+    struct digest_slab *slab = dq->slabs + (uint64_t)epoch % NB_DIGEST_SLABS;
+    bool waited = false;    // so that we count each wait only once
+
+    while (1) {
+        int64_t const cur = slab->epoch;
+        if (cur == epoch) {
+            __sync_add_and_fetch(&slab->nb_users, 1);
+            if (likely_(slab->epoch == epoch)) return slab;
+            // Recycled under our feet
+            __sync_sub_and_fetch(&slab->nb_users, 1);
+            continue;
+        }
+        if (! recycle) return NULL;
+        if (cur == DIGEST_EPOCH_RECYCLING) {
+            if (! waited) incr_stat(&dq->nb_waits);
+            waited = true;
+            cpu_relax();
+            continue;
+        }
+        if (cur != DIGEST_EPOCH_NONE && cur > epoch && cur - epoch < MAX_LATE_EPOCHS) {
+            // This slab is already used for a more recent window, this frame is too old
+            return NULL;
+        }   // else the clock went backward (or max_dup_delay was changed): start over
+        if (! __sync_bool_compare_and_swap(&slab->epoch, cur, DIGEST_EPOCH_RECYCLING)) {
+            incr_stat(&dq->nb_cas_failures);
+            continue;
+        }
+        // We are the only one to recycle this slab, but previous users may still be in there
+        if (slab->nb_users > 0) {
+            incr_stat(&dq->nb_waits);
+            while (slab->nb_users > 0) cpu_relax();
+        }
+        SLOG(LOG_DEBUG, "dev=%"PRIu8": recycling slab %u for epoch %"PRId64, dq->dev_id, (unsigned)(slab - dq->slabs), epoch);
+        memset((void *)slab->slots, 0, dq->slab_size * sizeof(*slab->slots));
+        __sync_synchronize();
+        slab->epoch = epoch;
+    }
 }
 
-// Caller must own q->mutex
-static void digest_qcell_del(struct digest_qcell *qc, struct digest_queue_ *q)
+static void slab_release(struct digest_slab *slab)
 {
-    digest_qcell_dtor(qc, q);
-    objfree(qc);
+    __sync_sub_and_fetch(&slab->nb_users, 1);
 }
 
-static void reset_digests(struct digest_queue *dq)
+// Wait until this slot is published and return its timestamp
+static uint64_t slot_wait_ts(struct digest_queue *dq, struct digest_slot const *slot)
+{
+    uint64_t ts = slot->ts;
+    if (0 == ts) {
+        incr_stat(&dq->nb_waits);
+        while (0 == (ts = slot->ts)) cpu_relax();
+    }
+    __sync_synchronize();   // read key[1] after ts
+    return ts;
+}
+
+#define MAX_PROBES 32
+
+/* Look for the key in this slab, and store it at the first free slot if store is set.
+ * Returns the timestamp (+1) of the stored key if found, 0 otherwise. */
+static uint64_t slab_find(struct digest_queue *dq, struct digest_slab *slab, uint64_t const key[2], uint64_t ts, bool store)
 {
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
-        mutex_lock(&q->mutex);
-        struct digest_qcell *qc, *tmp;
-        HASH_FOREACH_SAFE(qc, &q->qcells, entry, tmp) {
-            digest_qcell_del(qc, q);
+    unsigned const mask = dq->slab_size - 1;
+    unsigned idx = key[0] & mask;
+
+    for (unsigned p = 0; p < MAX_PROBES; p++, idx = (idx + 1) & mask) {
+        struct digest_slot *slot = slab->slots + idx;
+        uint64_t k0 = slot->key[0];
+        if (k0 == 0) {
+            // No deletions within a slab, so our key is not stored further away
+            if (! store) return 0;
+            if (! __sync_bool_compare_and_swap(&slot->key[0], 0, key[0])) {
+                incr_stat(&dq->nb_cas_failures);
+                k0 = slot->key[0];  // then check this one as any other
+            } else {
+                slot->key[1] = key[1];
+                __sync_synchronize();   // publish the whole key before the timestamp
+                slot->ts = ts;
+                return 0;
+            }
         }
-        mutex_unlock(&q->mutex);
+        if (k0 != key[0]) continue;
+        uint64_t const stored_ts = slot_wait_ts(dq, slot);
+        if (slot->key[1] == key[1]) return stored_ts;
+    }
+
+    if (store) {
+        SLOG(LOG_DEBUG, "dev=%"PRIu8": slab is full", dq->dev_id);
+        incr_stat(&dq->nb_overflows);
+    }
+    return 0;
+}
+
+static void reset_digests(struct digest_queue *dq)
+{
+    for (unsigned i = 0; i < NB_ELEMS(dq->slabs); i++) {
+        struct digest_slab *const slab = dq->slabs + i;
+        // Will be recycled by next user
+        int64_t cur;
+        do {
+            cur = slab->epoch;
+        } while (
+            cur != DIGEST_EPOCH_RECYCLING &&    // already being cleared
+            ! __sync_bool_compare_and_swap(&slab->epoch, cur, DIGEST_EPOCH_NONE));
     }
 }
 
@@ -108,28 +197,49 @@ static void reset_digests(struct digest_queue *dq)
 
 static void digest_queue_del_by_ref(struct ref *);
 
-static void digest_queue_ctor(struct digest_queue *dq, uint8_t dev_id)
+static int digest_queue_ctor(struct digest_queue *dq, uint8_t dev_id)
 {
     SLOG(LOG_DEBUG, "Constructing digest_queue@%p for dev_id=%"PRIu8, dq, dev_id);
 
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
-
-        mutex_ctor(&q->mutex, "digest queue");
-        HASH_INIT(&q->qcells, 1024, "digest queue");
+    EXT_LOCK(slab_size);
+    dq->slab_size = MAX_PROBES;
+    while (dq->slab_size < slab_size) dq->slab_size <<= 1;
+    EXT_UNLOCK(slab_size);
+
+    MALLOCER(digest_slabs);
+    for (unsigned i = 0; i < NB_ELEMS(dq->slabs); i++) {
+        struct digest_slab *const slab = dq->slabs + i;
+        slab->epoch = DIGEST_EPOCH_NONE;
+        slab->nb_users = 0;
+        slab->slots = MALLOC(digest_slabs, dq->slab_size * sizeof(*slab->slots));
+        if (! slab->slots) goto err;
     }
 
+    dq->nb_dup_found = dq->nb_nodup_found = 0;
+    dq->nb_cas_failures = dq->nb_waits = dq->nb_overflows = dq->nb_late = 0;
     dq->dev_id = dev_id;
 
     ref_ctor(&dq->ref, digest_queue_del_by_ref);
 
     LIST_INSERT_HEAD(&digest_queues, dq, entry);
+    return 0;
+err:
+    SLOG(LOG_ERR, "Cannot allocate slabs of %u digests for dev_id=%"PRIu8, dq->slab_size, dev_id);
+    for (unsigned i = 0; i < NB_ELEMS(dq->slabs); i++) {
+        if (dq->slabs[i].slots) FREE(dq->slabs[i].slots);
+    }
+    return -1;
 }
 
 static struct digest_queue *digest_queue_new(uint8_t dev_id)
 {
     struct digest_queue *dq = objalloc(sizeof(*dq), "digest_queue");
-    if (dq) digest_queue_ctor(dq, dev_id);
+    if (! dq) return NULL;
+    memset(dq->slabs, 0, sizeof(dq->slabs));
+    if (0 != digest_queue_ctor(dq, dev_id)) {
+        objfree(dq);
+        return NULL;
+    }
     return dq;
 }
 
@@ -139,11 +249,9 @@ static void digest_queue_dtor(struct digest_queue *dq)
 
     LIST_REMOVE(dq, entry);
 
-    reset_digests(dq);
-    for (unsigned i = 0; i < NB_ELEMS(dq->queues); i++) {
-        struct digest_queue_ *const q = dq->queues + i;
-        mutex_dtor(&q->mutex);
-        HASH_DEINIT(&q->qcells);
+    for (unsigned i = 0; i < NB_ELEMS(dq->slabs); i++) {
+        FREE(dq->slabs[i].slots);
+        dq->slabs[i].slots = NULL;
     }
 
     ref_dtor(&dq->ref);
@@ -185,59 +293,43 @@ static void reset_dedup_stats(void)
     struct digest_queue *dq;
     LIST_FOREACH(dq, &digest_queues, entry) {
         dq->nb_dup_found = dq->nb_nodup_found = 0;
+        dq->nb_cas_failures = dq->nb_waits = dq->nb_overflows = dq->nb_late = 0;
     }
 }
 
-static void incr_dup(struct digest_queue *dq)
-{
-#   ifdef __GNUC__
-    __sync_add_and_fetch(&dq->nb_dup_found, 1);
-#   else
-    dq->nb_dup_found ++;
-#   endif
-    // as nb_dup_found is 64 bits we don't fear a wrap around
-}
-
-static void incr_nodup(struct digest_queue *dq)
-{
-#   ifdef __GNUC__
-    __sync_add_and_fetch(&dq->nb_nodup_found, 1);
-#   else
-    dq->nb_nodup_found ++;
-#   endif
-    // as nb_nodup_found is 64 bits we don't fear a wrap around
-}
-
 /*
  * Digest Queue
  */
 
-static void digest_frame(unsigned char buf[DIGEST_SIZE], size_t size, uint8_t *restrict packet)
+#define BUFSIZE_TO_HASH 64
+
+#define ETHER_DST_ADDR_OFFSET   0
+#define ETHER_SRC_ADDR_OFFSET   ETHER_DST_ADDR_OFFSET + 6
+#define ETHER_ETHERTYPE_OFFSET  ETHER_SRC_ADDR_OFFSET + 6
+#define ETHER_HEADER_SIZE       ETHER_ETHERTYPE_OFFSET + 2
+
+#define IPV4_VERSION_OFFSET     0
+#define IPV4_TOS_OFFSET         IPV4_VERSION_OFFSET + 1
+#define IPV4_LEN_OFFSET         IPV4_TOS_OFFSET + 1
+#define IPV4_ID_OFFSET          IPV4_LEN_OFFSET + 2
+#define IPV4_OFF_OFFSET         IPV4_ID_OFFSET + 2
+#define IPV4_TTL_OFFSET         IPV4_OFF_OFFSET + 2
+#define IPV4_PROTO_OFFSET       IPV4_TTL_OFFSET + 1
+#define IPV4_CHECKSUM_OFFSET    IPV4_PROTO_OFFSET + 1
+#define IPV4_SRC_HOST_OFFSET    IPV4_CHECKSUM_OFFSET + 2
+#define IPV4_DST_HOST_OFFSET    IPV4_SRC_HOST_OFFSET + 4
+
+/* Copy into buf the bytes of the frame that are digested, with the fields that may be
+ * rewritten by network equipment (routers, switches, etc) masked. The rest of buf is
+ * zeroed. Returns the number of bytes to digest. The packet itself is left untouched. */
+static size_t digest_prepare(uint8_t buf[BUFSIZE_TO_HASH], size_t size, uint8_t const *packet)
 {
-#   define BUFSIZE_TO_HASH 64
-
-#   define ETHER_DST_ADDR_OFFSET   0
-#   define ETHER_SRC_ADDR_OFFSET   ETHER_DST_ADDR_OFFSET + 6
-#   define ETHER_ETHERTYPE_OFFSET  ETHER_SRC_ADDR_OFFSET + 6
-#   define ETHER_HEADER_SIZE       ETHER_ETHERTYPE_OFFSET + 2
-
-#   define IPV4_VERSION_OFFSET     0
-#   define IPV4_TOS_OFFSET         IPV4_VERSION_OFFSET + 1
-#   define IPV4_LEN_OFFSET         IPV4_TOS_OFFSET + 1
-#   define IPV4_ID_OFFSET          IPV4_LEN_OFFSET + 2
-#   define IPV4_OFF_OFFSET         IPV4_ID_OFFSET + 2
-#   define IPV4_TTL_OFFSET         IPV4_OFF_OFFSET + 2
-#   define IPV4_PROTO_OFFSET       IPV4_TTL_OFFSET + 1
-#   define IPV4_CHECKSUM_OFFSET    IPV4_PROTO_OFFSET + 1
-#   define IPV4_SRC_HOST_OFFSET    IPV4_CHECKSUM_OFFSET + 2
-#   define IPV4_DST_HOST_OFFSET    IPV4_SRC_HOST_OFFSET + 4
-
-    SLOG(LOG_DEBUG, "Compute the digest of %zu bytes frame", size);
-
     unsigned iphdr_offset = ETHER_HEADER_SIZE;
     unsigned ethertype_offset = ETHER_ETHERTYPE_OFFSET;
     unsigned hash_start = iphdr_offset;
 
+    memset(buf, 0, BUFSIZE_TO_HASH);
+
     if (
         size > ethertype_offset + 1 &&
         0x00 == packet[ethertype_offset] &&
@@ -267,83 +359,158 @@ static void digest_frame(unsigned char buf[DIGEST_SIZE], size_t size, uint8_t *r
 
     if (size < iphdr_offset + IPV4_CHECKSUM_OFFSET) {
         SLOG(LOG_DEBUG, "Small frame (%zu bytes), compute the digest on the whole data", size);
-        ASSERT_COMPILE(sizeof(uint8_t) == 1);
-        (void)MD4((unsigned char *)packet, size, buf);
-        return;
+        assert(size <= BUFSIZE_TO_HASH);
+        memcpy(buf, packet, size);
+        return size;
     }
 
-    assert(size >= iphdr_offset + IPV4_TOS_OFFSET);
-    assert(size >= iphdr_offset + IPV4_TTL_OFFSET);
-    uint8_t tos = packet[iphdr_offset + IPV4_TOS_OFFSET];
-    uint8_t ttl = packet[iphdr_offset + IPV4_TTL_OFFSET];
-    uint16_t checksum = READ_U16(&packet[iphdr_offset + IPV4_CHECKSUM_OFFSET]);
+    size_t const len = MIN(BUFSIZE_TO_HASH, size - hash_start);
+    memcpy(buf, packet + hash_start, len);
 
     uint8_t ipversion = (packet[iphdr_offset + IPV4_VERSION_OFFSET] & 0xf0) >> 4;
     if (4 == ipversion) {
         // We must mask different fields which may be rewritten by
         // network equipment (routers, switches, etc), eg. TTL, Diffserv
         // or IP Header Checksum
-        packet[iphdr_offset + IPV4_TOS_OFFSET] = 0x00;
-        packet[iphdr_offset + IPV4_TTL_OFFSET] = 0x00;
-        memset(packet + iphdr_offset + IPV4_CHECKSUM_OFFSET, 0, sizeof(uint16_t));
+        unsigned const ip = iphdr_offset - hash_start;
+        buf[ip + IPV4_TOS_OFFSET] = 0x00;
+        buf[ip + IPV4_TTL_OFFSET] = 0x00;
+        buf[ip + IPV4_CHECKSUM_OFFSET] = 0x00;
+        buf[ip + IPV4_CHECKSUM_OFFSET + 1] = 0x00;  // still within buf, even if beyond len
     }
 
-    size_t const len = MIN(BUFSIZE_TO_HASH, size - hash_start);
-    (void)MD4((unsigned char *)&packet[hash_start], len, buf);
+    return len;
+}
 
-    if (4 == ipversion) {
-        // Restore the dumped IP header fields
-        packet[iphdr_offset + IPV4_TOS_OFFSET] = tos;
-        packet[iphdr_offset + IPV4_TTL_OFFSET] = ttl;
-        memcpy(packet + iphdr_offset + IPV4_CHECKSUM_OFFSET, &checksum, sizeof checksum);
+/*
+ * Fast digest
+ *
+ * Since we always digest at most 64 bytes we can afford a simple
+ * multiply-mix over the whole (zero padded) buffer, ie. the body and
+ * finalizer of MurmurHash3 x64_128. Unlike CRC32 (even in hardware), the
+ * resulting 128 bits are all significant, which preserves the probability
+ * of false positives we had with MD4.
+ */
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static void fast_digest(unsigned char digest[DIGEST_SIZE], uint8_t const buf[BUFSIZE_TO_HASH], size_t len)
+{
+    uint64_t const c1 = 0x87c37b91114253d5ULL;
+    uint64_t const c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+
+    ASSERT_COMPILE(BUFSIZE_TO_HASH % 16 == 0);
+    for (unsigned o = 0; o < BUFSIZE_TO_HASH; o += 16) {
+        uint64_t k1, k2;
+        memcpy(&k1, buf + o, sizeof(k1));
+        memcpy(&k2, buf + o + 8, sizeof(k2));
+
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    // Since buf is zero padded, the length must be part of the digest
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    ASSERT_COMPILE(DIGEST_SIZE == 2 * sizeof(uint64_t));
+    memcpy(digest, &h1, sizeof(h1));
+    memcpy(digest + sizeof(h1), &h2, sizeof(h2));
+}
+
+static void digest_frame(unsigned char digest[DIGEST_SIZE], size_t size, uint8_t const *packet)
+{
+    SLOG(LOG_DEBUG, "Compute the digest of %zu bytes frame", size);
+
+    uint8_t buf[BUFSIZE_TO_HASH];
+    size_t const len = digest_prepare(buf, size, packet);
+
+    if (likely_(fast_digests)) {
+        fast_digest(digest, buf, len);
+    } else {
+        (void)MD4(buf, len, digest);
+    }
+}
+
+/* Look for this digest in the slabs of the previous, current and next windows.
+ * If not found, store it in the current one. Returns the timestamp (+1) of the
+ * matching digest, or 0. */
+static uint64_t digest_slabs_find(struct digest_queue *dq, unsigned char const digest[DIGEST_SIZE], uint64_t ts, unsigned delay)
+{
+    uint64_t key[2];
+    memcpy(key, digest, sizeof(key));
+    if (key[0] == 0) key[0] = 1;    // 0 is for free slots
+    ts ++;  // 0 is for unpublished slots
+
+    int64_t const epoch = (ts - 1) / delay;
+
+    struct digest_slab *cur = slab_acquire(dq, epoch, true);
+    if (! cur) {
+        SLOG(LOG_DEBUG, "dev=%"PRIu8": frame too old for its window", dq->dev_id);
+        incr_stat(&dq->nb_late);
+        return 0;
     }
+
+    uint64_t found = 0;
+    for (int e = -1; e <= 1 && !found; e += 2) {
+        struct digest_slab *slab = slab_acquire(dq, epoch + e, false);
+        if (! slab) continue;
+        found = slab_find(dq, slab, key, ts, false);
+        slab_release(slab);
+        // timeout first (so that retransmissions are eliminated)
+        if (found && found + delay < ts) found = 0;
+    }
+    if (! found) {
+        found = slab_find(dq, cur, key, ts, true);
+        if (found && found + delay < ts) found = 0;    // can't be, unless max_dup_delay was just changed
+    }
+
+    slab_release(cur);
+    return found;
 }
 
 bool digest_queue_find(struct digest_queue *dq, size_t cap_len, uint8_t *packet, struct timeval const *frame_tv)
 {
-    if (! max_dup_delay) return false;
-
-    // We allocate digest here and will reuse this memory if we keep it (likely).
-    struct digest_qcell *qc_new = objalloc(sizeof(*qc_new), "digest");
-    digest_frame(qc_new->u.digest, cap_len, packet);
-
-    unsigned const h = qc_new->u.digest[8] % NB_ELEMS(dq->queues);
-    struct digest_queue_ *const q = dq->queues + h;
-
-    mutex_lock(&q->mutex);
-
-    struct timeval min_tv = *frame_tv;
-    timeval_sub_usec(&min_tv, max_dup_delay);
-    // min_tv is set to minimal TS for a packet we want to consider for dup detection.
-    struct digest_qcell *qc, *qc_tmp;
-
-    unsigned count = 0;
-    // now look all qcells for a dup
-    HASH_FOREACH_SAME_KEY_SAFE(qc, &q->qcells, &qc_new->u, u, entry, qc_tmp) {
-        // timeout first (so that retransmissions are elimiated)
-        if (timeval_cmp(&qc->tv, &min_tv) < 0) {
-            digest_qcell_del(qc, q);
-        } else if (0 == memcmp(qc->u.digest, qc_new->u.digest, DIGEST_SIZE)) {
-            // found a dup
-            struct dedup_proto_info info;
-            proto_info_ctor(&info.info, NULL /* hum */, NULL, 0, cap_len);
-            SLOG(LOG_DEBUG, "dev=%"PRIu8",queue[%u]: Found a dup after %u", dq->dev_id, h, count);
-            // Note that we do not promote the dup in order to avoid dup + dup + dup + retrans being interpreted as 4 dups.
-            info.dt = llabs(timeval_sub(frame_tv, &qc->tv));
-            incr_dup(dq);
-            mutex_unlock(&q->mutex);
-            objfree(qc_new);
-            hook_subscribers_call(&dup_hook, &info.info, cap_len, packet, frame_tv);
-            return true;
-        }
-        count ++;
+    unsigned const delay = max_dup_delay;
+    if (! delay) return false;
+
+    unsigned char digest[DIGEST_SIZE];
+    digest_frame(digest, cap_len, packet);
+
+    uint64_t const ts = (uint64_t)frame_tv->tv_sec * 1000000ULL + frame_tv->tv_usec;
+    uint64_t const found = digest_slabs_find(dq, digest, ts, delay);
+
+    if (found) {
+        struct dedup_proto_info info;
+        proto_info_ctor(&info.info, NULL /* hum */, NULL, 0, cap_len);
+        SLOG(LOG_DEBUG, "dev=%"PRIu8": Found a dup", dq->dev_id);
+        // Note that we do not promote the dup in order to avoid dup + dup + dup + retrans being interpreted as 4 dups.
+        info.dt = llabs((int64_t)ts - (int64_t)(found - 1));
+        incr_stat(&dq->nb_dup_found);
+        hook_subscribers_call(&dup_hook, &info.info, cap_len, packet, frame_tv);
+        return true;
     }
 
-    // Here we have no dup thus we must store qc_new
-    SLOG(LOG_DEBUG, "dev=%"PRIu8",queue[%u]: No dup found after %u", dq->dev_id, h, count);
-    incr_nodup(dq);
-    digest_qcell_ctor(qc_new, q, frame_tv);
-    mutex_unlock(&q->mutex);
+    SLOG(LOG_DEBUG, "dev=%"PRIu8": No dup found", dq->dev_id);
+    incr_stat(&dq->nb_nodup_found);
     return false;
 }
 
@@ -353,6 +520,10 @@ bool digest_queue_find(struct digest_queue *dq, size_t cap_len, uint8_t *packet,
 
 static SCM dup_found_sym;
 static SCM nodup_found_sym;
+static SCM cas_failures_sym;
+static SCM waits_sym;
+static SCM overflows_sym;
+static SCM late_sym;
 
 static struct ext_function sg_dedup_stats;
 static SCM g_dedup_stats(SCM dev_id_)
@@ -362,9 +533,14 @@ static SCM g_dedup_stats(SCM dev_id_)
     LIST_LOOKUP(dq, &digest_queues, entry, dq->dev_id == dev_id);
     if (! dq) return SCM_BOOL_F;
 
-    SCM ret = scm_list_2(
+    SCM ret = scm_list_n(
         scm_cons(dup_found_sym,         scm_from_uint64(dq->nb_dup_found)),
-        scm_cons(nodup_found_sym,       scm_from_uint64(dq->nb_nodup_found)));
+        scm_cons(nodup_found_sym,       scm_from_uint64(dq->nb_nodup_found)),
+        scm_cons(cas_failures_sym,      scm_from_uint64(dq->nb_cas_failures)),
+        scm_cons(waits_sym,             scm_from_uint64(dq->nb_waits)),
+        scm_cons(overflows_sym,         scm_from_uint64(dq->nb_overflows)),
+        scm_cons(late_sym,              scm_from_uint64(dq->nb_late)),
+        SCM_UNDEFINED);
 
     return ret;
 }
@@ -396,15 +572,21 @@ void digest_init(void)
 {
     if (inited++) return;
     mutex_init();
+    mallocer_init();
     objalloc_init();
     ext_init();
-    hash_init();
 
     dup_found_sym       = scm_permanent_object(scm_from_latin1_symbol("dup-found"));
     nodup_found_sym     = scm_permanent_object(scm_from_latin1_symbol("nodup-found"));
+    cas_failures_sym    = scm_permanent_object(scm_from_latin1_symbol("cas-failures"));
+    waits_sym           = scm_permanent_object(scm_from_latin1_symbol("waits"));
+    overflows_sym       = scm_permanent_object(scm_from_latin1_symbol("overflows"));
+    late_sym            = scm_permanent_object(scm_from_latin1_symbol("late"));
 
     log_category_digest_init();
     ext_param_max_dup_delay_init();
+    ext_param_fast_digests_init();
+    ext_param_slab_size_init();
 
     LIST_INIT(&digest_queues);
 
@@ -413,6 +595,9 @@ void digest_init(void)
     ext_function_ctor(&sg_dedup_stats,
         "deduplication-stats", 1, 0, 0, g_dedup_stats,
         "(deduplication-stats 1): return some statistics about the deduplication mechanism on device 1.\n"
+        "Apart from the number of dups and non dups, tells how often threads contended for the\n"
+        "    digest store (cas-failures, waits), how many digests could not be stored because\n"
+        "    their slab was full (overflows) and how many frames were too old to be checked (late).\n"
         "See also (? 'reset-deduplication-stats).\n");
 
     ext_function_ctor(&sg_reset_dedup_stats,
@@ -436,11 +621,13 @@ void digest_fini(void)
         SLOG(LOG_WARNING, "Stopping deduplication service while some digest_queues are still alive!?");
     }
 
+    ext_param_slab_size_fini();
+    ext_param_fast_digests_fini();
     ext_param_max_dup_delay_fini();
     log_category_digest_fini();
 
-    hash_fini();
     ext_fini();
     objalloc_fini();
+    mallocer_fini();
     mutex_fini();
 }
@@ -95,7 +95,7 @@ static struct {
     I(sdp),           I(pgsql),       I(mysql),
     I(tns),           I(tls),         I(erspan),
     I(skinny),
-    I(discovery),
+    I(discovery),     I(os_detect),
     I(pkt_source),    I(capfile),     I(serialize)
 #   undef I
 };
@@ -110,7 +110,6 @@ static void all_init(void)
     ref_init(); // as all users do not init it...
     hash_init();    // as all users do not init it...
     redim_array_init(); // if there are no users then some ext functions used by the www interface won't be defined
-    os_detect_init();   // dummy function just to include os_detect in junkie (that does not use it, but plugins may want to)
 
     // Openssl don't like to be inited several times so let's do it once and for all
     SSL_load_error_strings();
@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include "junkie/proto/proto.h"
 #include "junkie/cpp.h"
 #include "junkie/tools/ext.h"
@@ -122,62 +123,235 @@ static struct npc_register *npc_regfile_merge(struct npc_register *prev_regfile,
     return merged;
 }
 
+/*
+ * Shards
+ */
+
+static unsigned nb_shards = 8;
+EXT_PARAM_RW(nb_shards, "nettrack-shards", uint, "Number of independently locked shards the states of a nettrack graph are split into (taken into account for new graphs)");
+
+static unsigned nt_shard_of(struct nt_graph const *graph, struct nt_vertex const *vertex, unsigned h_value)
+{
+    return (h_value % vertex->index_size) % graph->nb_shards;
+}
+
+// Queue this handoff onto the inbox of the shard of its state. Caller must own the graph->family_lock.
+static void nt_shard_handoff(struct nt_graph *graph, struct nt_handoff *handoff)
+{
+    struct nt_shard *shard = graph->shards + handoff->state->shard;
+    mutex_lock(&shard->inbox_lock);
+    STAILQ_INSERT_TAIL(&shard->inbox, handoff, entry);
+    mutex_unlock(&shard->inbox_lock);
+}
+
+static void nt_state_store(struct nt_state *, struct nt_graph *);
+static void nt_state_del(struct nt_state *, struct nt_graph *, bool killing);
+
+// Process what other threads handed off to this shard. Caller must own the shard.
+static void nt_shard_drain(struct nt_graph *graph, unsigned s)
+{
+    struct nt_shard *shard = graph->shards + s;
+
+    // Not thread safe, but if we miss a handoff we will process it next time
+    while (! STAILQ_EMPTY(&shard->inbox)) {
+        struct nt_handoffs inbox;
+        STAILQ_INIT(&inbox);
+        mutex_lock(&shard->inbox_lock);
+        STAILQ_CONCAT(&inbox, &shard->inbox);
+        mutex_unlock(&shard->inbox_lock);
+
+        struct nt_handoff *handoff;
+        while (NULL != (handoff = STAILQ_FIRST(&inbox))) {
+            STAILQ_REMOVE_HEAD(&inbox, entry);  // before the state, and thus the handoff, is deleted
+            assert(handoff->state->shard == s);
+            shard->nb_handoffs ++;
+            switch (handoff->type) {
+                case NT_STORE:
+                    nt_state_store(handoff->state, graph);
+                    break;
+                case NT_KILL:
+                    nt_state_del(handoff->state, graph, true);
+                    break;
+            }
+        }
+    }
+}
+
+static void nt_shard_lock(struct nt_graph *graph, unsigned s)
+{
+    mutex_lock(&graph->shards[s].lock);
+    nt_shard_drain(graph, s);
+}
+
+static void nt_shard_unlock(struct nt_graph *graph, unsigned s)
+{
+    nt_shard_drain(graph, s);   // so that killed states do not linger
+    mutex_unlock(&graph->shards[s].lock);
+}
+
 /*
  * States
  */
 
-static int nt_state_ctor(struct nt_state *state, struct nt_state *parent, struct nt_vertex *vertex, struct npc_register *regfile, struct timeval const *now, unsigned h_value, uint64_t run_id)
+// Timeout timers are set on the second following the due date, so that their state is due when they fire
+static time_t nt_expiry(struct timeval const *since, int64_t delay)
+{
+    int64_t const secs = since->tv_usec / 1000000 + (since->tv_usec % 1000000 + delay + 999999) / 1000000;
+    if (since->tv_sec > LONG_MAX - secs) return LONG_MAX;   // for END_OF_TIME
+    return since->tv_sec + secs;
+}
+
+// Age timers are set on the second of the due date, so that states age at the first packet once they are old enough
+static time_t nt_age_expiry(struct timeval const *since, int64_t delay)
+{
+    int64_t const secs = since->tv_usec / 1000000 + (since->tv_usec % 1000000 + delay) / 1000000;
+    if (since->tv_sec > LONG_MAX - secs) return LONG_MAX;   // for END_OF_TIME
+    return since->tv_sec + secs;
+}
+
+// The following functions must be called by the owner of the shard of the state.
+
+static void nt_state_unset_due_soon(struct nt_state *state)
+{
+    if (! state->due_soon) return;
+    LIST_REMOVE(state, same_due_soon);
+    state->due_soon = false;
+}
+
+static void nt_state_set_age_timer(struct nt_state *state, struct nt_graph *graph)
+{
+    struct nt_shard *const shard = graph->shards + state->shard;
+    timer_del(&shard->age_wheel, &state->age_timer);
+    nt_state_unset_due_soon(state);
+    if (state->vertex->nb_ageing_edges == 0) return;
+
+    time_t const expiry = nt_age_expiry(&state->last_enter, state->vertex->min_age);
+    if (expiry <= shard->age_wheel.now) {
+        // The wheel is already there: check this state at every packet until it's old enough
+        LIST_INSERT_HEAD(&shard->due_soon, state, same_due_soon);
+        state->due_soon = true;
+    } else {
+        timer_add(&shard->age_wheel, &state->age_timer, expiry);
+    }
+}
+
+static void nt_state_set_timeout_timer(struct nt_state *state, struct nt_graph *graph)
+{
+    struct timer_wheel *const wheel = &graph->shards[state->shard].timeout_wheel;
+    if (state->vertex->timeout > 0LL) {
+        timer_add(wheel, &state->timeout_timer, nt_expiry(&state->last_used, state->vertex->timeout));
+    } else {
+        timer_del(wheel, &state->timeout_timer);
+    }
+}
+
+// Insert the state into the index of its vertex and set its timers
+static void nt_state_store(struct nt_state *state, struct nt_graph *graph)
+{
+    struct nt_vertex *const vertex = state->vertex;
+    TAILQ_INSERT_HEAD(&vertex->index[state->h_value % vertex->index_size], state, same_index);
+    nt_state_set_age_timer(state, graph);
+    nt_state_set_timeout_timer(state, graph);
+    graph->shards[state->shard].nb_states ++;
+}
+
+static void nt_state_unstore(struct nt_state *state, struct nt_graph *graph)
+{
+    struct nt_vertex *const vertex = state->vertex;
+    struct nt_shard *const shard = graph->shards + state->shard;
+    TAILQ_REMOVE(&vertex->index[state->h_value % vertex->index_size], state, same_index);
+    timer_del(&shard->age_wheel, &state->age_timer);
+    nt_state_unset_due_soon(state);
+    timer_del(&shard->timeout_wheel, &state->timeout_timer);
+    assert(shard->nb_states > 0);
+    shard->nb_states --;
+}
+
+/* Caller must own the shard number owned (the state is handed off to its own shard if it's another one).
+ * Beware that the state must not be used once handed off. */
+static int nt_state_ctor(struct nt_state *state, struct nt_state *parent, struct nt_vertex *vertex, struct npc_register *regfile, struct timeval const *now, unsigned h_value, uint64_t run_id, struct nt_graph *graph, unsigned owned)
 {
     SLOG(LOG_DEBUG, "Construct state@%p from state@%p, in vertex %s", state, parent, vertex->name);
-    unsigned const index = h_value % vertex->index_size;
 
     state->regfile = regfile;
     state->parent = parent;
     state->vertex = vertex;
     state->h_value = h_value;
-    if (parent) LIST_INSERT_HEAD(&parent->children, state, same_parent);
-    TAILQ_INSERT_HEAD(&vertex->index[index], state, same_index);
-    TAILQ_INSERT_HEAD(&vertex->age_list, state, same_vertex);
     LIST_INIT(&state->children);
     state->last_used = state->last_enter = *now;
     state->last_moved_run = run_id;
+    timer_ctor(&state->age_timer);
+    state->due_soon = false;
+    timer_ctor(&state->timeout_timer);
+    state->shard = nt_shard_of(graph, vertex, h_value);
+    state->killed = false;
+    state->store_msg.state = state;
+    state->store_msg.type = NT_STORE;
+    state->kill_msg.state = state;
+    state->kill_msg.type = NT_KILL;
+
+    mutex_lock(&graph->family_lock);
+    if (parent) {
+        if (parent->killed) {   // no need to spawn into a dying family
+            mutex_unlock(&graph->family_lock);
+            return -1;
+        }
+        LIST_INSERT_HEAD(&parent->children, state, same_parent);
+    }
 #   ifdef __GNUC__
     __sync_fetch_and_add(&vertex->nb_states, 1);
 #   else
     vertex->nb_states ++;
 #   endif
+    bool const local = state->shard == owned;
+    if (! local) nt_shard_handoff(graph, &state->store_msg);
+    mutex_unlock(&graph->family_lock);
+
+    if (local) nt_state_store(state, graph);
 
     return 0;
 }
 
-static struct nt_state *nt_state_new(struct nt_state *parent, struct nt_vertex *vertex, struct npc_register *regfile, struct timeval const *now, unsigned h_value, uint64_t run_id)
+static struct nt_state *nt_state_new(struct nt_state *parent, struct nt_vertex *vertex, struct npc_register *regfile, struct timeval const *now, unsigned h_value, uint64_t run_id, struct nt_graph *graph, unsigned owned)
 {
     struct nt_state *state = objalloc(sizeof(*state), "nettrack states");
     if (! state) return NULL;
-    if (0 != nt_state_ctor(state, parent, vertex, regfile, now, h_value, run_id)) {
+    if (0 != nt_state_ctor(state, parent, vertex, regfile, now, h_value, run_id, graph, owned)) {
         objfree(state);
         return NULL;
     }
     return state;
 }
 
-static void nt_state_del(struct nt_state *, struct nt_graph *);
-static void nt_state_dtor(struct nt_state *state, struct nt_graph *graph)
+/* Caller must own the shard of the state.
+ * Returns false if the state was not destructed because it's already killed (then its
+ * NT_KILL handoff will destruct it, with killing set). */
+static bool nt_state_dtor(struct nt_state *state, struct nt_graph *graph, bool killing)
 {
     SLOG(LOG_DEBUG, "Destruct state@%p", state);
 
-    // start by killing our children so that they can make use of us
+    mutex_lock(&graph->family_lock);
+    if (state->killed && !killing) {
+        mutex_unlock(&graph->family_lock);
+        return false;
+    }
+
+    // Kill our children (from their own shard, which we may not own)
     struct nt_state *child;
     while (NULL != (child = LIST_FIRST(&state->children))) {
-        nt_state_del(child, graph);
+        LIST_REMOVE(child, same_parent);
+        child->parent = NULL;
+        child->killed = true;
+        nt_shard_handoff(graph, &child->kill_msg);
     }
 
     if (state->parent) {
         LIST_REMOVE(state, same_parent);
         state->parent = NULL;
     }
-    TAILQ_REMOVE(&state->vertex->age_list, state, same_vertex);
-    TAILQ_REMOVE(&state->vertex->index[state->h_value % state->vertex->index_size], state, same_index);
+    mutex_unlock(&graph->family_lock);
+
+    nt_state_unstore(state, graph);
 #   ifdef __GNUC__
     __sync_fetch_and_sub(&state->vertex->nb_states, 1);
 #   else
@@ -188,48 +362,79 @@ static void nt_state_dtor(struct nt_state *state, struct nt_graph *graph)
         npc_regfile_del(state->regfile, graph->nb_registers);
         state->regfile = NULL;
     }
+
+    return true;
 }
 
-static void nt_state_del(struct nt_state *state, struct nt_graph *graph)
+static void nt_state_del(struct nt_state *state, struct nt_graph *graph, bool killing)
 {
-    nt_state_dtor(state, graph);
-    objfree(state);
+    if (nt_state_dtor(state, graph, killing)) objfree(state);
 }
 
-static void nt_state_promote_age_list(struct nt_state *state, struct nt_vertex *to, struct timeval const *now)
+// Reset the age of this state
+static void nt_state_reset_age(struct nt_state *state, struct timeval const *now, struct nt_graph *graph)
 {
     state->last_enter = *now;
-    state->vertex = to;
-    TAILQ_REMOVE(&state->vertex->age_list, state, same_vertex);
-    TAILQ_INSERT_HEAD(&to->age_list, state, same_vertex);
+    nt_state_set_age_timer(state, graph);
 }
 
-static void nt_state_move(struct nt_state *state, struct nt_vertex *to, unsigned h_value, struct timeval const *now)
+// Caller must own the shard of the state, which must not be used anymore if it's moved to another shard.
+static void nt_state_move(struct nt_state *state, struct nt_vertex *to, unsigned h_value, struct timeval const *now, struct nt_graph *graph)
 {
     state->last_used = *now;
     struct nt_vertex *const from = state->vertex;
+
+    unsigned const shard = nt_shard_of(graph, to, h_value);
+    if (shard != state->shard) {
+        SLOG(LOG_DEBUG, "Handing state@%p off to shard %u of vertex %s", state, shard, to->name);
+        mutex_lock(&graph->family_lock);
+        if (! state->killed) {  // otherwise leave it where its NT_KILL handoff expects it
+            nt_state_unstore(state, graph);
+            if (from != to) {
+#               ifdef __GNUC__
+                __sync_fetch_and_sub(&from->nb_states, 1);
+                __sync_fetch_and_add(&to->nb_states, 1);
+#               else
+                from->nb_states --;
+                to->nb_states ++;
+#               endif
+                state->last_enter = *now;
+            }
+            state->vertex = to;
+            state->h_value = h_value;
+            state->shard = shard;
+            nt_shard_handoff(graph, &state->store_msg);
+        }
+        mutex_unlock(&graph->family_lock);
+        return;
+    }
+
     // Promote the state in index so that we find it faster next time we need it
     TAILQ_REMOVE(&from->index[state->h_value % from->index_size], state, same_index);
     TAILQ_INSERT_HEAD(&to->index[h_value % to->index_size], state, same_index);
 
-    if (state->vertex == to) {
+    if (from == to) {
         assert(state->h_value == h_value);
+        // Its timeout timer will notice it was used, but its age timer is unset if it's being aged right now
+        if (! timer_is_set(&state->age_timer) && ! state->due_soon) nt_state_set_age_timer(state, graph);
         return;
     }
 
     SLOG(LOG_DEBUG, "Moving state@%p to vertex %s", state, to->name);
 
 #   ifdef __GNUC__
-    __sync_fetch_and_sub(&state->vertex->nb_states, 1);
+    __sync_fetch_and_sub(&from->nb_states, 1);
     __sync_fetch_and_add(&to->nb_states, 1);
 #   else
-    state->vertex->nb_states --;
+    from->nb_states --;
     to->nb_states ++;
 #   endif
 
-    nt_state_promote_age_list(state, to, now);
-
+    state->vertex = to;
     state->h_value = h_value;
+    state->last_enter = *now;
+    nt_state_set_age_timer(state, graph);
+    nt_state_set_timeout_timer(state, graph);
 }
 
 /*
@@ -245,7 +450,8 @@ static int nt_vertex_ctor(struct nt_vertex *vertex, char const *name, struct nt_
     assert(vertex->index_size >= 1);
     LIST_INIT(&vertex->outgoing_edges);
     LIST_INIT(&vertex->incoming_edges);
-    TAILQ_INIT(&vertex->age_list);
+    vertex->nb_ageing_edges = 0;
+    vertex->min_age = 0;
     LIST_INSERT_HEAD(&graph->vertices, vertex, same_graph);
     for (unsigned i = 0; i < vertex->index_size; i++) {
         TAILQ_INIT(&vertex->index[i]);
@@ -258,7 +464,7 @@ static int nt_vertex_ctor(struct nt_vertex *vertex, char const *name, struct nt_
         for (unsigned i = 0; i < vertex->index_size; i++) { // actually, one state per index
             struct npc_register *regfile = npc_regfile_new(graph->nb_registers);
             if (! regfile) return -1;
-            if (! nt_state_new(NULL, vertex, regfile, &now, 0, graph->run_id)) {
+            if (! nt_state_new(NULL, vertex, regfile, &now, 0, graph->run_id, graph, nt_shard_of(graph, vertex, 0))) {
                 npc_regfile_del(regfile, graph->nb_registers);
                 return -1;
             }
@@ -294,14 +500,16 @@ static void nt_vertex_dtor(struct nt_vertex *vertex, struct nt_graph *graph)
 {
     SLOG(LOG_DEBUG, "Destruct vertex %s", vertex->name);
 
-    // Delete all our states
+    // Delete all our states (killed ones are deleted when draining their shard)
     for (unsigned i = 0; i < vertex->index_size; i++) {
+        unsigned const s = i % graph->nb_shards;
+        nt_shard_lock(graph, s);
         struct nt_state *state;
-        while (NULL != (state = TAILQ_FIRST(&vertex->index[i]))) {
-            nt_state_del(state, graph);
+        while (nt_shard_drain(graph, s), NULL != (state = TAILQ_FIRST(&vertex->index[i]))) {
+            nt_state_del(state, graph, false);
         }
+        nt_shard_unlock(graph, s);
     }
-    assert(TAILQ_EMPTY(&vertex->age_list));
 
     // Then all the edges using us
     struct nt_edge *edge;
@@ -324,6 +532,20 @@ static void nt_vertex_del(struct nt_vertex *vertex, struct nt_graph *graph)
     FREE(vertex);
 }
 
+// Set the age timers of all states of this vertex, once its ageing edges changed
+static void nt_vertex_set_age_timers(struct nt_vertex *vertex, struct nt_graph *graph)
+{
+    for (unsigned i = 0; i < vertex->index_size; i++) {
+        unsigned const s = i % graph->nb_shards;
+        nt_shard_lock(graph, s);
+        struct nt_state *state;
+        TAILQ_FOREACH(state, &vertex->index[i], same_index) {
+            nt_state_set_age_timer(state, graph);
+        }
+        nt_shard_unlock(graph, s);
+    }
+}
+
 
 /*
  * Edges
@@ -344,6 +566,11 @@ static int nt_edge_ctor(struct nt_edge *edge, struct nt_graph *graph, struct nt_
     edge->grab = grab;
     edge->nb_matches = edge->nb_tries = 0;
     edge->graph = graph;
+    if (min_age > 0) {
+        if (0 == from->nb_ageing_edges++ || min_age < from->min_age) from->min_age = min_age;
+        // States may already wait in there (those of the root vertex)
+        nt_vertex_set_age_timers(from, graph);
+    }
     LIST_INSERT_HEAD(&from->outgoing_edges, edge, same_from);
     LIST_INSERT_HEAD(&to->incoming_edges, edge, same_to);
     LIST_INSERT_HEAD(&graph->edges, edge, same_graph);
@@ -385,6 +612,18 @@ static void nt_edge_dtor(struct nt_edge *edge)
     LIST_REMOVE(edge, same_graph);
     LIST_REMOVE(edge, same_hook);
 
+    if (edge->min_age > 0) {
+        // Recompute the min_age of the remaining ageing edges (age timers set too early will be set again when they fire)
+        struct nt_vertex *const from = edge->from;
+        assert(from->nb_ageing_edges > 0);
+        from->nb_ageing_edges --;
+        from->min_age = 0;
+        struct nt_edge *e;
+        LIST_FOREACH(e, &from->outgoing_edges, same_from) {
+            if (e->min_age > 0 && (0 == from->min_age || e->min_age < from->min_age)) from->min_age = e->min_age;
+        }
+    }
+
     edge->graph = NULL;
     edge->match_fn = NULL;
 }
@@ -435,6 +674,28 @@ static int nt_graph_ctor(struct nt_graph *graph, char const *name, char const *l
         return -1;
     }
 
+    graph->nb_shards = MAX(nb_shards, 1U);
+    MALLOCER(nt_shards);    // big: no need for objalloc
+    graph->shards = MALLOC(nt_shards, graph->nb_shards * sizeof(*graph->shards));
+    if (! graph->shards) {
+        (void)lt_dlclose(graph->lib);
+        graph->lib = NULL;
+        return -1;
+    }
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        struct nt_shard *const shard = graph->shards + s;
+        mutex_ctor(&shard->lock, "nettrack shard");
+        mutex_ctor(&shard->inbox_lock, "nettrack inbox");
+        STAILQ_INIT(&shard->inbox);
+        timer_wheel_ctor(&shard->age_wheel, 0);
+        timer_wheel_ctor(&shard->timeout_wheel, 0);
+        LIST_INIT(&shard->due_soon);
+        shard->nb_states = 0;
+        shard->nb_tries = shard->nb_matches = shard->nb_handoffs = 0;
+        shard->max_nb_collisions = 16;
+    }
+    mutex_ctor(&graph->family_lock, "nettrack families");
+
     graph->name = objalloc_strdup(name);
     graph->started = false;
     graph->nb_frames = 0;
@@ -467,7 +728,16 @@ static void nt_graph_start(struct nt_graph *graph)
 }
 
 static struct npc_register empty_rest = { .size = 0, .value = (uintptr_t)NULL };
-static void edge_ageing(struct nt_edge *, struct timeval const *);
+static void nt_state_age(struct nt_state *, struct timeval const *, uint64_t run_id, struct nt_graph *);
+
+static uint64_t nt_graph_next_run(struct nt_graph *graph)
+{
+#   ifdef __GNUC__
+    return __sync_add_and_fetch(&graph->run_id, 1);
+#   else
+    return ++graph->run_id;    // FIXME
+#   endif
+}
 
 static void nt_graph_stop(struct nt_graph *graph)
 {
@@ -477,22 +747,37 @@ static void nt_graph_stop(struct nt_graph *graph)
     graph->started = false;
 
     struct timeval end_of_time = END_OF_TIME;
+    uint64_t const run_id = nt_graph_next_run(graph);
 
-    // age out all states capable of ageing
-    struct nt_edge *edge;
-    LIST_FOREACH(edge, &graph->edges, same_graph) {
-        SLOG(LOG_DEBUG, "Pass all states from %s to %s", edge->from->name, edge->to->name);
-        edge_ageing(edge, &end_of_time);
-    }
-    // timeout all states capable of timeouting
+    // age out all states capable of ageing, regardless of their timers
     struct nt_vertex *vertex;
+    LIST_FOREACH(vertex, &graph->vertices, same_graph) {
+        if (! vertex->nb_ageing_edges) continue;
+        SLOG(LOG_DEBUG, "Ageing all states from vertex %s", vertex->name);
+        for (unsigned i = 0; i < vertex->index_size; i++) {
+            unsigned const s = i % graph->nb_shards;
+            nt_shard_lock(graph, s);
+            struct nt_state *state, *tmp;
+            TAILQ_FOREACH_SAFE(state, &vertex->index[i], same_index, tmp) {  // Beware that this state may move
+                if (state->killed || state->last_moved_run == run_id) continue;
+                nt_state_age(state, &end_of_time, run_id, graph);
+            }
+            nt_shard_unlock(graph, s);
+        }
+    }
+    // timeout all states capable of timeouting (killed ones are deleted when draining their shard)
     LIST_FOREACH(vertex, &graph->vertices, same_graph) {
         if (! vertex->timeout_fn) continue;
         SLOG(LOG_DEBUG, "Timeouting from vertex %s", vertex->name);
-        struct nt_state *state;
-        while (NULL != (state = TAILQ_FIRST(&vertex->age_list))) {
-            vertex->timeout_fn(NULL, empty_rest, state->regfile, NULL);
-            nt_state_del(state, graph);
+        for (unsigned i = 0; i < vertex->index_size; i++) {
+            unsigned const s = i % graph->nb_shards;
+            nt_shard_lock(graph, s);
+            struct nt_state *state;
+            while (nt_shard_drain(graph, s), NULL != (state = TAILQ_FIRST(&vertex->index[i]))) {
+                vertex->timeout_fn(NULL, empty_rest, state->regfile, NULL);
+                nt_state_del(state, graph, false);
+            }
+            nt_shard_unlock(graph, s);
         }
     }
 }
@@ -515,6 +800,12 @@ static void nt_graph_dtor(struct nt_graph *graph)
         }
     }
 
+    // Store the states that were handed off, so that we do not miss them
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        nt_shard_lock(graph, s);
+        nt_shard_unlock(graph, s);
+    }
+
     // Delete all our vertices
     struct nt_vertex *vertex;
     while (NULL != (vertex = LIST_FIRST(&graph->vertices))) {
@@ -523,6 +814,17 @@ static void nt_graph_dtor(struct nt_graph *graph)
     // Then we are not supposed to have any edge left
     assert(LIST_EMPTY(&graph->edges));
 
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        assert(STAILQ_EMPTY(&graph->shards[s].inbox));
+        timer_wheel_dtor(&graph->shards[s].age_wheel);
+        timer_wheel_dtor(&graph->shards[s].timeout_wheel);
+        mutex_dtor(&graph->shards[s].inbox_lock);
+        mutex_dtor(&graph->shards[s].lock);
+    }
+    FREE(graph->shards);
+    graph->shards = NULL;
+    mutex_dtor(&graph->family_lock);
+
     (void)lt_dlclose(graph->lib);
     graph->lib = NULL;
 
@@ -560,204 +862,359 @@ static void destroy_merged_regfile(struct npc_register **merged_regfile, unsigne
     *merged_regfile = NULL;
 }
 
-// Test an edge for all possible transitions
-// returns false to stop the search.
-static bool edge_matching(struct nt_edge *edge, struct proto_info const *last, struct npc_register rest, struct timeval const *now)
+/* The hash value of the incoming packet only depends on the packet, yet edges of the same hook
+ * often share the same from_index_fn. So we remember the values computed for the current packet. */
+struct nt_index_memo {
+    unsigned nb_entries;
+    struct nt_index_memo_entry {
+        npc_match_fn *fn;
+        unsigned h_value;
+    } entries[8];
+};
+
+static unsigned nt_index_memo_get(struct nt_index_memo *memo, npc_match_fn *fn, struct proto_info const *last, struct npc_register rest)
 {
-    if (! edge->match_fn) return true;
+    for (unsigned e = 0; e < memo->nb_entries; e++) {
+        if (memo->entries[e].fn == fn) return memo->entries[e].h_value;
+    }
 
+    // Notice that the hash function for incomming packet is *not* allowed to use the regfile nor to bind anything
+    unsigned const h_value = fn(last, rest, NULL, NULL);
+    if (memo->nb_entries < NB_ELEMS(memo->entries)) {
+        memo->entries[memo->nb_entries].fn = fn;
+        memo->entries[memo->nb_entries].h_value = h_value;
+        memo->nb_entries ++;
+    }
+    return h_value;
+}
+
+// Test an edge for all states of this hash bucket, which shard s must be owned by the caller.
+// returns false to stop the search.
+static bool edge_matching_bucket(struct nt_edge *edge, unsigned index, bool h_value_set, unsigned h_value, struct proto_info const *last, struct npc_register rest, struct timeval const *now, uint64_t run_id, unsigned s)
+{
+    struct nt_graph *const graph = edge->graph;
+    struct nt_shard *const shard = graph->shards + s;
+    unsigned nb_collisions = 0;
     struct nt_state *state, *tmp;
 
-    bool h_value_set = false;
-    unsigned h_value;
-    unsigned index_start = 0, index_stop = edge->from->index_size;  // by default, prepare to look into all hash buckets
-    if (index_stop > 1 && edge->from_index_fn) {
-        // Notice that the hash function for incomming packet is *not* allowed to use the regfile nor to bind anything
-        h_value_set = true;
-        // too bad we recompute here the hash value of the incoming packet for every edge with many times the same from_index_fn
-        h_value = edge->from_index_fn(last, rest, NULL, NULL);
-        index_start = h_value % edge->from->index_size;
-        index_stop = index_start + 1;
-        SLOG(LOG_DEBUG, "Using index at location %u", index_start);
-    }
-    for (unsigned index = index_start; index < index_stop; index++) {
-        static unsigned max_nb_collisions = 16;
-        unsigned nb_collisions = 0;
-        TAILQ_FOREACH_SAFE(state, &edge->from->index[index], same_index, tmp) {  // Beware that this state may move
-
-            // While we are there try to timeout this state?
-            if (edge->from->timeout > 0LL && edge->from->timeout < timeval_sub(now, &state->last_used)) {
-                SLOG(LOG_DEBUG, "Timeouting state in vertex %s", edge->from->name);
-                if (edge->from->timeout_fn) {
-                    SLOG(LOG_DEBUG, "Calling timeout function for vertex '%s'", edge->from->name);
-                    edge->from->timeout_fn(NULL, rest, state->regfile, NULL);
-                }
-                nt_state_del(state, edge->graph);
-                continue;
-            }
+    TAILQ_FOREACH_SAFE(state, &edge->from->index[index], same_index, tmp) {  // Beware that this state may move
+        // Killed states are deleted by their NT_KILL handoff only
+        if (state->killed) continue;    // not protected by the family_lock but it's only a hint
+
+        // Timeouted states are deleted when their timer fires (up to a second later)
+        if (edge->from->timeout > 0LL && edge->from->timeout < timeval_sub(now, &state->last_used)) continue;
 
-            // Prevent multiple update of the same state in a single update run
-            if (state->last_moved_run == edge->graph->run_id) continue;
+        // Prevent multiple update of the same state in a single update run
+        if (state->last_moved_run == run_id) continue;
 
-            if (h_value_set && state->h_value != h_value) continue; // hopeless
+        if (h_value_set && state->h_value != h_value) continue; // hopeless
 
-            if (++nb_collisions > max_nb_collisions) {
-                max_nb_collisions = nb_collisions;
-                TIMED_SLOG(LOG_NOTICE, "%u collisions for %s->%s, size=%u, index=%u->%u/%u", nb_collisions, edge->from->name, edge->to->name, edge->from->nb_states, index_start, index_stop, edge->from->index_size);
-            }
+        if (++nb_collisions > shard->max_nb_collisions) {
+            shard->max_nb_collisions = nb_collisions;
+            TIMED_SLOG(LOG_NOTICE, "%u collisions for %s->%s, size=%u, index=%u/%u", nb_collisions, edge->from->name, edge->to->name, edge->from->nb_states, index, edge->from->index_size);
+        }
 
-            SLOG(LOG_DEBUG, "Testing state@%p from vertex %s for %s into %s",
-                    state,
-                    edge->from->name,
-                    edge->spawn ? "spawn":"move",
-                    edge->to->name);
-            edge->nb_tries ++;
-
-            /* Delayed bindings:
-             *   Matching functions do not change the bindings of the regfile while performing the tests because
-             *   we want the binding to take effect only if the tests succeed. Also, since the test order is not
-             *   specified then a given test can not both bind and reference the same register. Thus we pass it
-             *   two regfiles: one with the actual bindings (read only) and an empty one for the new bindings. On
-             *   exit, if the test succeeded, the new bindings overwrite the previous ones; otherwise they are
-             *   discarded.
-             *   We try to do this as efficiently as possible by reusing the previously boxed values whenever
-             *   possible rather than reallocing/copying them.
-             * TODO:
-             *   - a flag per node telling if the match function write into the regfile or not would comes handy;
-             *   - prevent the test expressions to read and write the same register;
-             */
-
-            /* Freres humains, qui apres nous codez, N'ayez les coeurs contre nous endurcis,
-             * Car, si pitie de nous pauvres avez, Dieu en aura plus tt de vous mercis. */
-
-            struct npc_register tmp_regfile[edge->graph->nb_registers];
-            npc_regfile_ctor(tmp_regfile, edge->graph->nb_registers);
-
-            if (edge->match_fn(last, rest, state->regfile, tmp_regfile)) {
-                SLOG(LOG_DEBUG, "Match!");
-                edge->nb_matches ++;
-                // We need the merged state in all cases but when we have no action and don't keep the result
-                struct npc_register *merged_regfile = NULL;
-
-                // Call the entry function
-                if (edge->to->entry_fn && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, edge->graph->nb_registers, !edge->spawn)) {
-                    SLOG(LOG_DEBUG, "Calling entry function for vertex '%s'", edge->to->name);
-                    // Entry function is not supposed to bind anything... for now (FIXME).
-                    edge->to->entry_fn(last, rest, merged_regfile, NULL);
+        SLOG(LOG_DEBUG, "Testing state@%p from vertex %s for %s into %s",
+                state,
+                edge->from->name,
+                edge->spawn ? "spawn":"move",
+                edge->to->name);
+        shard->nb_tries ++;
+
+        /* Delayed bindings:
+         *   Matching functions do not change the bindings of the regfile while performing the tests because
+         *   we want the binding to take effect only if the tests succeed. Also, since the test order is not
+         *   specified then a given test can not both bind and reference the same register. Thus we pass it
+         *   two regfiles: one with the actual bindings (read only) and an empty one for the new bindings. On
+         *   exit, if the test succeeded, the new bindings overwrite the previous ones; otherwise they are
+         *   discarded.
+         *   We try to do this as efficiently as possible by reusing the previously boxed values whenever
+         *   possible rather than reallocing/copying them.
+         * TODO:
+         *   - a flag per node telling if the match function write into the regfile or not would comes handy;
+         *   - prevent the test expressions to read and write the same register;
+         */
+
+        /* Freres humains, qui apres nous codez, N'ayez les coeurs contre nous endurcis,
+         * Car, si pitie de nous pauvres avez, Dieu en aura plus tt de vous mercis. */
+
+        struct npc_register tmp_regfile[graph->nb_registers];
+        npc_regfile_ctor(tmp_regfile, graph->nb_registers);
+
+        if (edge->match_fn(last, rest, state->regfile, tmp_regfile)) {
+            SLOG(LOG_DEBUG, "Match!");
+            shard->nb_matches ++;
+            // We need the merged state in all cases but when we have no action and don't keep the result
+            struct npc_register *merged_regfile = NULL;
+
+            // Call the entry function
+            if (edge->to->entry_fn && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, graph->nb_registers, !edge->spawn)) {
+                SLOG(LOG_DEBUG, "Calling entry function for vertex '%s'", edge->to->name);
+                // Entry function is not supposed to bind anything... for now (FIXME).
+                edge->to->entry_fn(last, rest, merged_regfile, NULL);
+            }
+            // Now move/spawn/dispose of the state
+            // first we need to know the location in the index
+            unsigned new_h_value = 0;
+            if (edge->to->index_size > 1) { // we'd better have a hashing function then!
+                if (edge->to_index_fn && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, graph->nb_registers, !edge->spawn)) {
+                    // Notice this hashing function can use the regfile but can still perform no bindings
+                    new_h_value = edge->to_index_fn(last, rest, merged_regfile, NULL);
+                    SLOG(LOG_DEBUG, "Will store at index location %u", new_h_value % edge->to->index_size);
+                } else if (edge->from == edge->to) {
+                    // when we stay in place we do not need rehashing
+                    new_h_value = state->h_value;
+                } else {
+                    // if not, then that's another story
+                    SLOG(LOG_WARNING, "Don't know how to store spawned state in vertex %s, missing hashing function when coming from %s", edge->to->name, edge->from->name);
+                    destroy_merged_regfile(&merged_regfile, graph->nb_registers);
+                    goto hell;
                 }
-                // Now move/spawn/dispose of the state
-                // first we need to know the location in the index
-                unsigned new_h_value = 0;
-                if (edge->to->index_size > 1) { // we'd better have a hashing function then!
-                    if (edge->to_index_fn && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, edge->graph->nb_registers, !edge->spawn)) {
-                        // Notice this hashing function can use the regfile but can still perform no bindings
-                        new_h_value = edge->to_index_fn(last, rest, merged_regfile, NULL);
-                        SLOG(LOG_DEBUG, "Will store at index location %u", new_h_value % edge->to->index_size);
-                    } else if (edge->from == edge->to) {
-                        // when we stay in place we do not need rehashing
-                        new_h_value = state->h_value;
-                    } else {
-                        // if not, then that's another story
-                        SLOG(LOG_WARNING, "Don't know how to store spawned state in vertex %s, missing hashing function when coming from %s", edge->to->name, edge->from->name);
-                        destroy_merged_regfile(&merged_regfile, edge->graph->nb_registers);
-                        goto hell;
+            }
+            // whatever we clone or move it, we must tag it
+            state->last_moved_run = run_id;
+            if (edge->spawn) {
+                if (!LIST_EMPTY(&edge->to->outgoing_edges) && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, graph->nb_registers, !edge->spawn)) { // or we do not need to spawn anything
+                    if (NULL == (state = nt_state_new(state, edge->to, merged_regfile, now, new_h_value, run_id, graph, s))) {
+                        npc_regfile_del(merged_regfile, graph->nb_registers);
+                        merged_regfile = NULL;
                     }
+                } else {
+                    destroy_merged_regfile(&merged_regfile, graph->nb_registers);
                 }
-                // whatever we clone or move it, we must tag it
-                state->last_moved_run = edge->graph->run_id;
-                if (edge->spawn) {
-                    if (!LIST_EMPTY(&edge->to->outgoing_edges) && ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, edge->graph->nb_registers, !edge->spawn)) { // or we do not need to spawn anything
-                        if (NULL == (state = nt_state_new(state, edge->to, merged_regfile, now, new_h_value, edge->graph->run_id))) {
-                            npc_regfile_del(merged_regfile, edge->graph->nb_registers);
-                            merged_regfile = NULL;
-                        }
-                    } else {
-                        destroy_merged_regfile(&merged_regfile, edge->graph->nb_registers);
-                    }
-                } else {    // move the whole state
-                    if (LIST_EMPTY(&edge->to->outgoing_edges)) {  // rather dispose of former state
-                        nt_state_del(state, edge->graph);
-                        if (merged_regfile) {
-                            npc_regfile_del(merged_regfile, edge->graph->nb_registers);
-                            merged_regfile = NULL;
-                        }
-                    } else if (ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, edge->graph->nb_registers, !edge->spawn)) {    // replace former regfile with new one
-                        npc_regfile_del(state->regfile, edge->graph->nb_registers);
-                        state->regfile = merged_regfile;
-                        nt_state_move(state, edge->to, new_h_value, now);
+            } else {    // move the whole state
+                if (LIST_EMPTY(&edge->to->outgoing_edges)) {  // rather dispose of former state
+                    nt_state_del(state, graph, false);
+                    if (merged_regfile) {
+                        npc_regfile_del(merged_regfile, graph->nb_registers);
+                        merged_regfile = NULL;
                     }
+                } else if (ensure_merged_regfile(&merged_regfile, state->regfile, tmp_regfile, graph->nb_registers, !edge->spawn)) {    // replace former regfile with new one
+                    npc_regfile_del(state->regfile, graph->nb_registers);
+                    state->regfile = merged_regfile;
+                    nt_state_move(state, edge->to, new_h_value, now, graph);
                 }
-hell:
-                npc_regfile_dtor(tmp_regfile, edge->graph->nb_registers);
-                if (edge->grab) return false;
-            } else {
-                SLOG(LOG_DEBUG, "No match");
-                npc_regfile_dtor(tmp_regfile, edge->graph->nb_registers);
             }
-        } // loop on states
-    } // loop on index
+hell:
+            npc_regfile_dtor(tmp_regfile, graph->nb_registers);
+            if (edge->grab) return false;
+        } else {
+            SLOG(LOG_DEBUG, "No match");
+            npc_regfile_dtor(tmp_regfile, graph->nb_registers);
+        }
+    } // loop on states
 
     return true;
 }
 
-// Move all states along this edge if they match the ageing rule
-static void edge_ageing(struct nt_edge *edge, struct timeval const *now)
+// Report onto the edge the tries and matches that were accounted on this shard since the given values
+static void edge_account(struct nt_edge *edge, struct nt_shard const *shard, uint64_t nb_tries, uint64_t nb_matches)
+{
+#   ifdef __GNUC__
+    __sync_fetch_and_add(&edge->nb_tries, shard->nb_tries - nb_tries);
+    __sync_fetch_and_add(&edge->nb_matches, shard->nb_matches - nb_matches);
+#   else
+    edge->nb_tries += shard->nb_tries - nb_tries;
+    edge->nb_matches += shard->nb_matches - nb_matches;
+#   endif
+}
+
+// Test an edge for all possible transitions
+// returns false to stop the search.
+static bool edge_matching(struct nt_edge *edge, struct proto_info const *last, struct npc_register rest, struct timeval const *now, uint64_t run_id, struct nt_index_memo *memo)
 {
-    if (! edge->min_age) return;
+    if (! edge->match_fn) return true;
 
-    struct nt_state *state, *tmp;
-    TAILQ_FOREACH_REVERSE_SAFE(state, &edge->from->age_list, nt_states_tq, same_vertex, tmp) {   // Beware that this state may move
-        if (timeval_sub(now, &state->last_enter) < edge->min_age) break;
+    struct nt_graph *const graph = edge->graph;
+    unsigned const index_size = edge->from->index_size;
+
+    if (index_size > 1 && edge->from_index_fn) {
+        // Only one hash bucket to look into, thus only one shard to own
+        unsigned const h_value = nt_index_memo_get(memo, edge->from_index_fn, last, rest);
+        unsigned const index = h_value % index_size;
+        unsigned const s = nt_shard_of(graph, edge->from, h_value);
+        SLOG(LOG_DEBUG, "Using index at location %u (shard %u)", index, s);
+        nt_shard_lock(graph, s);
+        struct nt_shard const *const shard = graph->shards + s;
+        uint64_t const nb_tries = shard->nb_tries, nb_matches = shard->nb_matches;
+        bool const ret = edge_matching_bucket(edge, index, true, h_value, last, rest, now, run_id, s);
+        edge_account(edge, shard, nb_tries, nb_matches);
+        nt_shard_unlock(graph, s);
+        return ret;
+    }
 
-        // Prevent multiple update of the same state in a single update run
-        if (state->last_moved_run == edge->graph->run_id) continue;
+    // Otherwise, prepare to look into all hash buckets, one shard at a time
+    for (unsigned s = 0; s < MIN(graph->nb_shards, index_size); s++) {
+        nt_shard_lock(graph, s);
+        struct nt_shard const *const shard = graph->shards + s;
+        uint64_t const nb_tries = shard->nb_tries, nb_matches = shard->nb_matches;
+        bool ret = true;
+        for (unsigned index = s; ret && index < index_size; index += graph->nb_shards) {
+            ret = edge_matching_bucket(edge, index, false, 0, last, rest, now, run_id, s);
+        }
+        edge_account(edge, shard, nb_tries, nb_matches);
+        nt_shard_unlock(graph, s);
+        if (! ret) return false;
+    }
+
+    return true;
+}
 
-        SLOG(LOG_DEBUG, "Ageing!");
-        edge->nb_matches ++;
+/* Move this state along the first of its ageing edges it's old enough for.
+ * Caller must own the shard of the state, which may be moved or deleted. */
+static void nt_state_age(struct nt_state *state, struct timeval const *now, uint64_t run_id, struct nt_graph *graph)
+{
+    struct nt_edge *edge;
+    LIST_FOREACH(edge, &state->vertex->outgoing_edges, same_from) {
+        if (edge->min_age > 0 && timeval_sub(now, &state->last_enter) >= edge->min_age) break;
+    }
+    if (! edge) {   // not old enough yet (its vertex lost an ageing edge)
+        nt_state_set_age_timer(state, graph);
+        return;
+    }
 
-        if (edge->to->entry_fn) {
-            SLOG(LOG_DEBUG, "Calling entry function for vertex '%s'", edge->to->name);
-            // Entry function is not supposed to bind anything... for now (FIXME).
-            // Additionally, since we are ageing, then it's not allowed to use
-            // packet data as well (logical,although not enforced).
-            edge->to->entry_fn(NULL, empty_rest, state->regfile, NULL);
+    SLOG(LOG_DEBUG, "Ageing!");
+    graph->shards[state->shard].nb_matches ++;
+#   ifdef __GNUC__
+    __sync_fetch_and_add(&edge->nb_matches, 1);
+#   else
+    edge->nb_matches ++;
+#   endif
+
+    if (edge->to->entry_fn) {
+        SLOG(LOG_DEBUG, "Calling entry function for vertex '%s'", edge->to->name);
+        // Entry function is not supposed to bind anything... for now (FIXME).
+        // Additionally, since we are ageing, then it's not allowed to use
+        // packet data as well (logical,although not enforced).
+        edge->to->entry_fn(NULL, empty_rest, state->regfile, NULL);
+    }
+    // Now move/spawn/dispose of the state
+    // first we need to know the location in the index
+    unsigned new_h_value = 0;
+    if (edge->to->index_size > 1) { // we'd better have a hashing function then!
+        if (edge->to_index_fn) {
+            // Notice this hashing function can use the regfile but can still perform no bindings
+            // Also, it better not use the incoming packet (NULL) when aging out states!
+            new_h_value = edge->to_index_fn(NULL, empty_rest, state->regfile, NULL);
+            SLOG(LOG_DEBUG, "Will store at index location %u", new_h_value % edge->to->index_size);
+        } else if (edge->from == edge->to) {
+            new_h_value = state->h_value;
+        } else {
+            SLOG(LOG_WARNING, "Don't know how to store spawned state in vertex %s, missing hashing function when coming from %s", edge->to->name, edge->from->name);
+            goto hell;
         }
-        // Now move/spawn/dispose of the state
-        // first we need to know the location in the index
-        unsigned new_h_value = 0;
-        if (edge->to->index_size > 1) { // we'd better have a hashing function then!
-            if (edge->to_index_fn) {
-                // Notice this hashing function can use the regfile but can still perform no bindings
-                // Also, it better not use the incoming packet (NULL) when aging out states!
-                new_h_value = edge->to_index_fn(NULL, empty_rest, state->regfile, NULL);
-                SLOG(LOG_DEBUG, "Will store at index location %u", new_h_value % edge->to->index_size);
-            } else if (edge->from == edge->to) {
-                new_h_value = state->h_value;
-            } else {
-                SLOG(LOG_WARNING, "Don't know how to store spawned state in vertex %s, missing hashing function when coming from %s", edge->to->name, edge->from->name);
-                goto hell;
+    }
+    // whatever we clone or move it, we must tag it
+    state->last_moved_run = run_id;
+    if (edge->spawn) {
+        if (!LIST_EMPTY(&edge->to->outgoing_edges)) { // or we do not need to spawn anything
+            struct npc_register *copy = npc_regfile_copy(state->regfile, graph->nb_registers);
+            if (! copy) goto hell;
+            if (NULL == nt_state_new(state, edge->to, copy, now, new_h_value, run_id, graph, state->shard)) {
+                npc_regfile_del(copy, graph->nb_registers);
             }
+            // reset the age of the parent, or it would spawn again on next run
+            nt_state_reset_age(state, now, graph);
+            return;
         }
-        // whatever we clone or move it, we must tag it
-        state->last_moved_run = edge->graph->run_id;
-        if (edge->spawn) {
-            if (!LIST_EMPTY(&edge->to->outgoing_edges)) { // or we do not need to spawn anything
-                struct npc_register *copy = npc_regfile_copy(state->regfile, edge->graph->nb_registers);
-                if (! copy) goto hell;
-                if (NULL == (state = nt_state_new(state, edge->to, copy, now, new_h_value, edge->graph->run_id))) {
-                    npc_regfile_del(copy, edge->graph->nb_registers);
-                }
-                // reset the age of this state
-                nt_state_promote_age_list(state, edge->to, now);
-            }
-        } else {    // move the whole state
-            if (LIST_EMPTY(&edge->to->outgoing_edges)) {  // rather dispose of former state
-                nt_state_del(state, edge->graph);
-            } else {
-                nt_state_move(state, edge->to, new_h_value, now);
-            }
+    } else {    // move the whole state
+        if (LIST_EMPTY(&edge->to->outgoing_edges)) {  // rather dispose of former state
+            nt_state_del(state, graph, false);
+        } else {
+            nt_state_move(state, edge->to, new_h_value, now, graph);
         }
-hell:;
+        return;
+    }
+hell:
+    // Try again later
+    nt_state_set_age_timer(state, graph);
+}
+
+// What the timer callbacks need to know about the current run
+struct nt_timer_ctx {
+    struct nt_graph *graph;
+    struct timeval const *now;
+    uint64_t run_id;
+};
+
+// Called with the shard lock when the age timer of a state fires
+static void nt_age_timer_cb(struct timer *timer, time_t unused_ now, void *ctx_)
+{
+    struct nt_state *state = DOWNCAST(timer, age_timer, nt_state);
+    struct nt_timer_ctx const *ctx = ctx_;
+
+    // Killed states are deleted by their NT_KILL handoff only
+    if (state->killed) return;
+
+    // Prevent multiple update of the same state in a single update run
+    if (state->last_moved_run == ctx->run_id) {
+        nt_state_set_age_timer(state, ctx->graph);
+        return;
+    }
+
+    nt_state_age(state, ctx->now, ctx->run_id, ctx->graph);
+}
+
+// Called with the shard lock when the timeout timer of a state fires
+static void nt_timeout_timer_cb(struct timer *timer, time_t unused_ now, void *ctx_)
+{
+    struct nt_state *state = DOWNCAST(timer, timeout_timer, nt_state);
+    struct nt_timer_ctx const *ctx = ctx_;
+    struct nt_vertex *const vertex = state->vertex;
+
+    if (state->killed || vertex->timeout <= 0LL) return;
+
+    // The timer was set when the state was stored: check it was not used since then
+    if (vertex->timeout >= timeval_sub(ctx->now, &state->last_used)) {
+        nt_state_set_timeout_timer(state, ctx->graph);
+        return;
+    }
+
+    SLOG(LOG_DEBUG, "Timeouting state in vertex %s", vertex->name);
+    if (vertex->timeout_fn) {
+        SLOG(LOG_DEBUG, "Calling timeout function for vertex '%s'", vertex->name);
+        vertex->timeout_fn(NULL, empty_rest, state->regfile, NULL);
+    }
+    nt_state_del(state, ctx->graph, false);
+}
+
+// Age the states that become old enough during the current second, if they are by now. Caller must own the shard.
+static void nt_shard_age_due_soon(struct nt_graph *graph, unsigned s, struct nt_timer_ctx *ctx)
+{
+    struct nt_shard *const shard = graph->shards + s;
+
+    // Those still too young are put back onto the shard list
+    struct nt_states due_soon;
+    LIST_INIT(&due_soon);
+    struct nt_state *state;
+    while (NULL != (state = LIST_FIRST(&shard->due_soon))) {
+        LIST_REMOVE(state, same_due_soon);
+        LIST_INSERT_HEAD(&due_soon, state, same_due_soon);
+    }
+
+    while (NULL != (state = LIST_FIRST(&due_soon))) {
+        LIST_REMOVE(state, same_due_soon);
+        state->due_soon = false;
+        nt_age_timer_cb(&state->age_timer, ctx->now->tv_sec, ctx);
+    }
+}
+
+/* Fire the timers that are due. Thus each packet only visits the states that must age or timeout.
+ * Like ageing used to be, this is done once the packet went through the edges. */
+static void nt_graph_expire(struct nt_graph *graph, struct timeval const *now, uint64_t run_id)
+{
+    struct nt_timer_ctx ctx = { .graph = graph, .now = now, .run_id = run_id };
+
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        struct nt_shard *const shard = graph->shards + s;
+        // Not thread safe, but then the next packet will advance the wheels
+        if (now->tv_sec <= shard->age_wheel.now && LIST_EMPTY(&shard->due_soon)) continue;
+        nt_shard_lock(graph, s);
+        // Timeouts first, so that we do not bother ageing timeouted states
+        (void)timer_wheel_advance(&shard->timeout_wheel, now->tv_sec, nt_timeout_timer_cb, &ctx);
+        (void)timer_wheel_advance(&shard->age_wheel, now->tv_sec, nt_age_timer_cb, &ctx);
+        nt_shard_age_due_soon(graph, s, &ctx);
+        nt_shard_unlock(graph, s);
     }
 }
 
@@ -775,16 +1232,15 @@ static void parser_hook(struct proto_subscriber *subscriber, struct proto_info c
 
     SLOG(LOG_DEBUG, "Updating graph %s with inner info from %s", hook->graph->name, last->parser->proto->name);
 
-    hook->graph->run_id ++;
+    uint64_t const run_id = nt_graph_next_run(hook->graph);
 
+    struct nt_index_memo memo = { .nb_entries = 0 };
     struct nt_edge *edge;
     LIST_FOREACH(edge, &hook->edges, same_hook) {
-        if (! edge_matching(edge, last, rest, now)) break;
+        if (! edge_matching(edge, last, rest, now, run_id, &memo)) break;
     }
 
-    LIST_FOREACH(edge, &hook->edges, same_hook) {
-        edge_ageing(edge, now);
-    }
+    nt_graph_expire(hook->graph, now, run_id);
 }
 
 /*
@@ -817,7 +1273,7 @@ static int print_graph_smob(SCM graph_smob, SCM port, scm_print_state unused_ *p
 {
     struct nt_graph *graph = (struct nt_graph *)SCM_SMOB_DATA(graph_smob);
 
-    char const *head = tempstr_printf("#<nettrack-graph %s with %u regs", graph->name, graph->nb_registers);
+    char const *head = tempstr_printf("#<nettrack-graph %s with %u regs and %u shards", graph->name, graph->nb_registers, graph->nb_shards);
     scm_puts(head, port);
 
     struct nt_vertex *vertex;
@@ -923,14 +1379,49 @@ static SCM g_nettrack_stop(SCM graph_smob)
  * Init
  */
 
+static SCM nb_states_sym;
+static SCM nb_tries_sym;
+static SCM nb_matches_sym;
+static SCM nb_handoffs_sym;
+
+static struct ext_function sg_nettrack_shard_stats;
+static SCM g_nettrack_shard_stats(SCM graph_smob)
+{
+    scm_assert_smob_type(graph_tag, graph_smob);
+    struct nt_graph *graph = (struct nt_graph *)SCM_SMOB_DATA(graph_smob);
+
+    SCM ret = SCM_EOL;
+    for (unsigned s = graph->nb_shards; s-- > 0; ) {
+        struct nt_shard *shard = graph->shards + s;
+        mutex_lock(&shard->lock);
+        SCM stats = scm_list_n(
+            scm_cons(nb_states_sym,     scm_from_uint(shard->nb_states)),
+            scm_cons(nb_tries_sym,      scm_from_uint64(shard->nb_tries)),
+            scm_cons(nb_matches_sym,    scm_from_uint64(shard->nb_matches)),
+            scm_cons(nb_handoffs_sym,   scm_from_uint64(shard->nb_handoffs)),
+            SCM_UNDEFINED);
+        mutex_unlock(&shard->lock);
+        ret = scm_cons(stats, ret);
+    }
+
+    return ret;
+}
+
 static unsigned inited;
 void nettrack_init(void)
 {
     if (inited++) return;
     log_category_nettrack_init();
     ext_init();
+    mutex_init();
     mallocer_init();
     objalloc_init();
+    ext_param_nb_shards_init();
+
+    nb_states_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-states"));
+    nb_tries_sym    = scm_permanent_object(scm_from_latin1_symbol("nb-tries"));
+    nb_matches_sym  = scm_permanent_object(scm_from_latin1_symbol("nb-matches"));
+    nb_handoffs_sym = scm_permanent_object(scm_from_latin1_symbol("nb-handoffs"));
 
     LIST_INIT(&started_graphs);
 
@@ -952,6 +1443,13 @@ void nettrack_init(void)
         "nettrack-stop", 1, 0, 0, g_nettrack_stop,
         "(nettrack-stop graph): stop listening events for this graph.\n"
         "See also (? 'nettrack-start)\n");
+
+    ext_function_ctor(&sg_nettrack_shard_stats,
+        "nettrack-shard-stats", 1, 0, 0, g_nettrack_shard_stats,
+        "(nettrack-shard-stats graph): return, for each shard of this graph, how many states it holds,\n"
+        "    how many states were tested and matched, and how many states were handed off to it by\n"
+        "    other shards.\n"
+        "See also (? 'set-nettrack-shards)\n");
 }
 
 void nettrack_fini(void)
@@ -965,8 +1463,10 @@ void nettrack_fini(void)
         nt_graph_stop(graph);
     }
 
+    ext_param_nb_shards_fini();
     objalloc_fini();
     mallocer_fini();
+    mutex_fini();
     ext_fini();
     log_category_nettrack_fini();
 }
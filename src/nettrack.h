@@ -7,16 +7,37 @@
 #include "junkie/tools/queue.h"
 #include "junkie/tools/log.h"
 #include "junkie/tools/timeval.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/timer_wheel.h"
 #include "junkie/netmatch.h"
 
 LOG_CATEGORY_DEC(nettrack);
 
-// FIXME: some locks for all these lists
+/* Locking:
+ * States are sharded according to the index location they occupy in their vertex
+ * (see nt_shard_of()). Each shard has its own lock, protecting the index buckets and
+ * the age lists of its states, and whoever owns this lock owns these states. Since a
+ * parser thread only ever owns one shard at a time, operations touching a state of
+ * another shard (storing a state that moved or was spawned in there, or killing the
+ * descendant of a deleted state) are handed off to that shard through its inbox, which
+ * is processed by the next thread owning that shard.
+ * Parent/children relationships, the shard and the killed flag of states are protected
+ * by the graph family_lock (taken after a shard lock, and before an inbox lock).
+ * Each shard also has the timer wheels of its states, so that ageing and timeouting
+ * only visit the states that are due. */
+
+struct nt_state;
+
+/// An operation on a state queued onto the inbox of another shard
+struct nt_handoff {
+    STAILQ_ENTRY(nt_handoff) entry;
+    struct nt_state *state;
+    enum nt_handoff_type { NT_STORE, NT_KILL } type;
+};
 
 struct nt_state {
     LIST_ENTRY(nt_state) same_parent;
     TAILQ_ENTRY(nt_state) same_index;
-    TAILQ_ENTRY(nt_state) same_vertex;
     /* When a new state is spawned we keep a relationship with parent/children,
      * so that it's possible to terminate a whole family. */
     struct nt_state *parent;
@@ -25,7 +46,11 @@ struct nt_state {
     LIST_HEAD(nt_states, nt_state) children;
     struct npc_register *regfile;
     struct timeval last_used;   // states on same_index are ordered according to this filed (more recently used at head)
-    struct timeval last_enter;  // used to find out the age of a state. states are ordered on same_vertex list according to this field (more recently entered at head)
+    struct timeval last_enter;  // used to find out the age of a state
+    struct timer age_timer;     // set on the second the state will be old enough for the youngest ageing edge of its vertex
+    LIST_ENTRY(nt_state) same_due_soon; // once this second has come, until the state is old enough
+    bool due_soon;              // is the state on its shard due_soon list?
+    struct timer timeout_timer; // set when the state may timeout (if it's not used in between)
     /* As a similar mecanism, we'd like to know if a state already moved in a run
      * (so that we can avoid moving several times the same state in a single updating run).
      * TODO: Ultimately we'd like to allow this on a node by node basis.
@@ -33,8 +58,13 @@ struct nt_state {
      * increase between two updating run, which happen often since a single packet
      * (thus a single timestamp) can trigger several runs. */
     uint64_t last_moved_run;    // See also graph->run_id
+    unsigned shard;             // the shard owning this state (or that will own it once its inbox is processed)
+    bool killed;                // once a NT_KILL handoff is queued for it, only that handoff can delete it
+    struct nt_handoff store_msg, kill_msg;  // so that handing off never fails
 };
 
+TAILQ_HEAD(nt_states_tq, nt_state);
+
 struct nt_vertex {
     char *name;
     LIST_ENTRY(nt_vertex) same_graph;
@@ -45,7 +75,8 @@ struct nt_vertex {
     int64_t timeout;   // if >0, number of seconds to keep an inactive state in here
     unsigned index_size;   // the index size (>=1)
     unsigned nb_states;
-    TAILQ_HEAD(nt_states_tq, nt_state) age_list;    // states are ordered here according to their date of entry
+    unsigned nb_ageing_edges;  // how many outgoing edges have a min_age
+    int64_t min_age;   // the smallest min_age of these edges
     struct nt_states_tq index[];  // the states currently waiting in this node (BEWARE: variable size!)
 };
 
@@ -57,7 +88,7 @@ struct nt_edge {
     LIST_ENTRY(nt_edge) same_hook;
     npc_match_fn *match_fn;
     npc_match_fn *from_index_fn, *to_index_fn;
-    int64_t min_age;    // if != 0, cross the edge only if its age is greater than this
+    int64_t min_age;    // if > 0, cross the edge only if its age is greater than this
     // what to do when taken
     bool spawn;  // ie create a new child (otherwise bring the matching state right here)
     bool grab;   // stop looking for other possible transitions
@@ -76,6 +107,19 @@ struct nt_graph {
     lt_dlhandle lib;
     unsigned default_index_size;    // index size if not specified in the vertex
     uint64_t run_id;                // to uniquely (hum) identifies the successive updating runs
+    unsigned nb_shards;
+    struct nt_shard {
+        struct mutex lock;          // protects the states of this shard
+        struct mutex inbox_lock;    // protects the inbox only
+        STAILQ_HEAD(nt_handoffs, nt_handoff) inbox;
+        struct timer_wheel age_wheel, timeout_wheel;    // protected by lock, and advanced together
+        struct nt_states due_soon;  // states becoming old enough during the current second (protected by lock)
+        // for statistics (protected by lock)
+        unsigned nb_states;
+        uint64_t nb_tries, nb_matches, nb_handoffs;
+        unsigned max_nb_collisions; // above which collisions are reported
+    } *shards;
+    struct mutex family_lock;
     // for statistics
     uint64_t nb_frames;
     // The hooks
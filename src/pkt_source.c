@@ -18,6 +18,9 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <stdbool.h>
 #include <limits.h>
 #include <stdint.h>
@@ -27,13 +30,29 @@
 #include <signal.h>
 #include <pcap.h>
 #include <libguile.h>
+#include "junkie/config.h"
+#ifdef HAVE_TPACKET_V3
+#   include <unistd.h>
+#   include <poll.h>
+#   include <sys/socket.h>
+#   include <sys/mman.h>
+#   include <sys/ioctl.h>
+#   include <net/if.h>
+#   include <arpa/inet.h>
+#   include <linux/if_packet.h>
+#   include <linux/if_ether.h>
+#   include <linux/filter.h>
+#endif
 #include "pkt_source.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/tools/tempstr.h"
 #include "junkie/tools/mutex.h"
 #include "junkie/tools/queue.h"
 #include "junkie/tools/ref.h"
+#include "junkie/tools/jhash.h"
+#include "junkie/tools/arena.h"
 #include "junkie/proto/cap.h"
+#include "junkie/proto/capfile.h"
 #include "junkie/proto/proto.h"
 #include "junkie/proto/deduplication.h"
 #include "junkie/tools/ext.h"
@@ -100,21 +119,97 @@ static char const *pkt_source_guile_name(struct pkt_source *pkt_source)
  * For now both iface and files are treated the same.
  */
 
-static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
+static bool is_duplicate(struct pkt_source *pkt_source, struct frame *frame)
 {
-    if (want_exit) return;
+    // drop the frame if we previously saw it in the last 5ms.
+    if (
+        // Per iface dedup
+        (pkt_source->digests && digest_queue_find(pkt_source->digests, frame->cap_len, frame->data, &frame->tv)) ||
+        // Additional pass if we collapse ifaces
+        (collapse_ifaces && global_digests && digest_queue_find(global_digests, frame->cap_len, frame->data, &frame->tv))
+    ) {
+        SLOG(LOG_DEBUG, "Drop duplicated packet");
+        (void)__sync_add_and_fetch(&pkt_source->nb_duplicates, 1);   // workers may race for this one
+        return true;
+    }
+    return false;
+}
 
-    struct pkt_source *pkt_source = (struct pkt_source *)pkt_source_;
+/* Deduplicate then parse a batch of frames. Called either from the sniffer thread or from one of its workers.
+ * The protected region is entered only once for the whole batch (the frames array is modified). */
+static void parse_frames(struct pkt_source *pkt_source, struct frame *frames, unsigned nb_frames)
+{
+    unsigned nb_parsed = 0;
+    for (unsigned f = 0; f < nb_frames; f++) {
+        if (is_duplicate(pkt_source, frames + f)) continue;
+        if (nb_parsed != f) frames[nb_parsed] = frames[f];
+        nb_parsed ++;
+    }
+    if (nb_parsed == 0) return;
+
+#   ifdef WITH_GIANT_LOCK
+    mutex_lock(&giant_lock);
+#   endif
+
+    static struct bench_event waiting_for_multi = BENCH("parser waiting for multi region");
+    uint64_t start_wait = bench_event_start();
+    enter_multi_region();
+    bench_event_stop(&waiting_for_multi, start_wait);
+
+    assert(cap_parser);
+    for (unsigned f = 0; f < nb_parsed && !want_exit; f++) {
+        struct frame *frame = frames + f;
+        if (f + 1 < nb_parsed) {    // so that the headers of the next frame are in cache once we are done with this one
+            prefetch_(frame[1].data);
+            prefetch_(frame[1].data + 64);
+        }
+
+        arena_packet_begin();
+        (void)proto_parse(cap_parser, NULL, 0, (uint8_t *)frame, frame->cap_len, frame->wire_len, &frame->tv, frame->cap_len, frame->data);
+        arena_packet_end();
+
+        if (pkt_count > 0) {
+            if (0 ==
+#               ifdef __GNUC__
+                __sync_sub_and_fetch(&pkt_count, 1)
+#               else
+                --pkt_count
+#               endif
+            ) want_exit = 1; // we cannot call exit from pcap callback (since we cannot destroy this pkt_source from pcap callback)
+        }
+    }
+
+    leave_protected_region();
+
+#   ifdef WITH_GIANT_LOCK
+    mutex_unlock(&giant_lock);
+#   endif
+}
+
+// Update pkt_source stats for this new packet. Returns the actual capture length, or 0 if the packet must be ignored.
+static size_t account_packet(struct pkt_source *pkt_source, const struct pcap_pkthdr *header)
+{
     SLOG(LOG_DEBUG, "------------------------------------------------------------------------------------------");
     SLOG(LOG_DEBUG, "Received a new packet from packet source %s, wire-len: %u", pkt_source_name(pkt_source), header->len);
 
-    if (header->len == 0) return;   // should not happen, but does occur sometime
+    if (header->len == 0) return 0;   // should not happen, but does occur sometime
     size_t const caplen = MIN(header->caplen, header->len); // caplen > len was seen in the wild - the correct behavior was to consider caplen was off by a few bytes.
 
     pkt_source->nb_packets ++;
     pkt_source->nb_cap_bytes += caplen;
     pkt_source->nb_wire_bytes += header->len;
 
+    return caplen;
+}
+
+static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    if (want_exit) return;
+
+    struct pkt_source *pkt_source = (struct pkt_source *)pkt_source_;
+    size_t const caplen = account_packet(pkt_source, header);
+    if (! caplen) return;
+
     struct frame frame = {
         .tv = header->ts,
         .cap_len = caplen,
@@ -125,45 +220,385 @@ static void parse_packet(u_char *pkt_source_, const struct pcap_pkthdr *header,
 
     if (pkt_source->patch_ts) timeval_set_now(&frame.tv);
 
-    // drop the frame if we previously saw it in the last 5ms.
-    if (
-        // Per iface dedup
-        (pkt_source->digests && digest_queue_find(pkt_source->digests, caplen, (uint8_t *)packet, &header->ts)) ||
-        // Additional pass if we collapse ifaces
-        (collapse_ifaces && global_digests && digest_queue_find(global_digests, caplen, (uint8_t *)packet, &header->ts))
-    ) {
-        SLOG(LOG_DEBUG, "Drop duplicated packet");
-        pkt_source->nb_duplicates ++;
-        return;
+    parse_frames(pkt_source, &frame, 1);
+}
+
+/*
+ * Batches of frames
+ *
+ * Instead of parsing each frame from the capture callback, we gather them
+ * into a batch that's parsed once the capture library returns (or once the
+ * batch is full). Frames that the capture library does not keep for us are
+ * copied into the batch buffer.
+ */
+
+#define BATCH_MAX 100               // same as the count given to pcap_dispatch
+#define BATCH_BUF_SIZE (256*1024)
+
+struct frame_batch {
+    unsigned nb_frames;
+    size_t buf_len;                 // how many bytes of buf are used
+    struct frame frames[BATCH_MAX];
+    uint8_t buf[BATCH_BUF_SIZE];    // copy of the frames (when they are copied)
+};
+
+static void batch_flush(struct pkt_source *pkt_source)
+{
+    struct frame_batch *batch = pkt_source->batch;
+    if (! batch->nb_frames) return;
+    SLOG(LOG_DEBUG, "Parsing a batch of %u frames", batch->nb_frames);
+    parse_frames(pkt_source, batch->frames, batch->nb_frames);
+    batch->nb_frames = 0;
+    batch->buf_len = 0;
+}
+
+static void batch_add(struct pkt_source *pkt_source, const struct pcap_pkthdr *header, const u_char *packet, bool copy)
+{
+    if (want_exit) return;
+
+    struct frame_batch *batch = pkt_source->batch;
+    size_t const caplen = account_packet(pkt_source, header);
+    if (! caplen) return;
+
+    if (batch->nb_frames >= BATCH_MAX || (copy && batch->buf_len + caplen > sizeof(batch->buf))) {
+        batch_flush(pkt_source);
     }
 
-#   ifdef WITH_GIANT_LOCK
-    mutex_lock(&giant_lock);
-#   endif
+    struct frame *frame = batch->frames + batch->nb_frames;
+    frame->tv = header->ts;
+    frame->cap_len = caplen;
+    frame->wire_len = header->len;
+    frame->pkt_source = pkt_source;
+    if (copy) {
+        frame->data = batch->buf + batch->buf_len;
+        memcpy(frame->data, packet, caplen);
+        batch->buf_len += caplen;
+    } else {
+        frame->data = (uint8_t *)packet;
+    }
 
-    static struct bench_event waiting_for_multi = BENCH("parser waiting for multi region");
-    uint64_t start_wait = bench_event_start();
-    enter_multi_region();
-    bench_event_stop(&waiting_for_multi, start_wait);
+    if (pkt_source->patch_ts) timeval_set_now(&frame->tv);
+    batch->nb_frames ++;
+}
 
-    assert(cap_parser);
-    (void)proto_parse(cap_parser, NULL, 0, (uint8_t *)&frame, frame.cap_len, frame.wire_len, &frame.tv, frame.cap_len, frame.data);
+// For capture libraries that reuse the packet memory once the callback returns
+static void batch_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    batch_add((struct pkt_source *)pkt_source_, header, packet, true);
+}
 
-    leave_protected_region();
+// For capture libraries that keep the packets until we flush the batch
+static void batch_packet_ref(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    batch_add((struct pkt_source *)pkt_source_, header, packet, false);
+}
 
-    if (pkt_count > 0) {
-        if (0 ==
-#           ifdef __GNUC__
-            __sync_sub_and_fetch(&pkt_count, 1)
-#           else
-            --pkt_count
-#           endif
-        ) want_exit = 1; // we cannot call exit from pcap callback (since we cannot destroy this pkt_source from pcap callback)
+static struct frame_batch *batch_new(void)
+{
+    struct frame_batch *batch = malloc(sizeof(*batch));    // big and long lived: no need for objalloc
+    if (! batch) return NULL;
+    batch->nb_frames = 0;
+    batch->buf_len = 0;
+    return batch;
+}
+
+/*
+ * Fan out of frames to several parser threads
+ *
+ * The sniffer thread hashes each frame on its addresses and ports (the same
+ * way for both directions) and copies it into the ring of the corresponding
+ * worker.  Frames are stored in the ring one after the other, as a struct
+ * ring_frame followed by the captured bytes. When a frame does not fit
+ * before the end of the ring a special marker is written and the frame is
+ * stored at the beginning of the ring instead.
+ */
+
+static size_t fanout_ring_size = 8*1024*1024;
+EXT_PARAM_RW(fanout_ring_size, "fanout-ring-size", size_t, "Size in bytes of the frame queue of each parser thread, for packet sources that are parsed by several threads (taken into account when opening the packet source)")
+
+struct ring_frame {
+#   define RING_WRAP UINT32_MAX
+    uint32_t cap_len;   // or RING_WRAP if the next frame is at the beginning of the ring
+    uint32_t wire_len;
+    struct timeval tv;
+    uint8_t data[];
+};
+
+#define RING_ALIGN 8U
+#define RING_PAD(x) ((((x) + RING_ALIGN - 1) / RING_ALIGN) * RING_ALIGN)
+
+// Symmetric hash of the flow of this frame (ie. same value for both directions)
+static uint32_t frame_flow_hash(uint8_t const *packet, size_t cap_len)
+{
+    uint32_t addr[4] = { 0, 0, 0, 0 };  // xor of source and dest addresses, so that it does not depend on the direction
+    uint16_t ports = 0;                 // xor of source and dest ports, likewise
+    uint8_t ip_proto = 0;
+    size_t off = 12;    // ethertype
+
+    if (cap_len < off + 2) return 0;
+    unsigned ethertype = READ_U16N(packet + off);
+    while ((ethertype == 0x8100 || ethertype == 0x88a8) && cap_len >= off + 6) { // skip VLan tags
+        off += 4;
+        ethertype = READ_U16N(packet + off);
+    }
+    off += 2;
+
+    size_t l4_off = 0;
+    if (ethertype == 0x0800 && cap_len >= off + 20) {
+        uint8_t const *ip = packet + off;
+        ip_proto = ip[9];
+        addr[0] = READ_U32(ip + 12) ^ READ_U32(ip + 16);
+        bool const fragmented = (READ_U16N(ip + 6) & 0x3fff) != 0;  // MF flag or offset
+        if (! fragmented) l4_off = off + (ip[0] & 0xf) * 4;         // or we'd send fragments to different workers
+    } else if (ethertype == 0x86dd && cap_len >= off + 40) {
+        uint8_t const *ip = packet + off;
+        ip_proto = ip[6];
+        for (unsigned w = 0; w < 4; w++) addr[w] = READ_U32(ip + 8 + 4*w) ^ READ_U32(ip + 24 + 4*w);
+        l4_off = off + 40;  // we do not look beyond extension headers
+    } else {    // Not IP: use MAC addresses
+        addr[0] = READ_U32(packet) ^ READ_U32(packet + 6);
+        addr[1] = READ_U16(packet + 4) ^ READ_U16(packet + 10);
+        ip_proto = ethertype;
     }
 
-#   ifdef WITH_GIANT_LOCK
-    mutex_unlock(&giant_lock);
-#   endif
+    if (l4_off && (ip_proto == 6 || ip_proto == 17 || ip_proto == 132) && cap_len >= l4_off + 4) {
+        ports = READ_U16(packet + l4_off) ^ READ_U16(packet + l4_off + 2);
+    }
+
+    addr[3] ^= ((uint32_t)ports << 8) | ip_proto;
+    return hashword(addr, NB_ELEMS(addr), 0x9e3779b9U);
+}
+
+// Only called by the sniffer thread. Returns false if the frame had to be dropped.
+static bool pkt_worker_push(struct pkt_worker *worker, const struct pcap_pkthdr *header, size_t cap_len, uint8_t const *packet, struct timeval const *tv)
+{
+    size_t const rec_size = RING_PAD(sizeof(struct ring_frame) + cap_len);
+    if (rec_size > worker->ring_size / 2) return false;
+
+    uint64_t head = worker->head;
+    size_t pos = head % worker->ring_size;
+    size_t needed = rec_size;
+    if (pos + rec_size > worker->ring_size) needed += worker->ring_size - pos;  // we will have to wrap
+    if (needed > worker->ring_size - (head - worker->tail)) return false;
+
+    if (pos + rec_size > worker->ring_size) {
+        ((struct ring_frame *)(worker->ring + pos))->cap_len = RING_WRAP;
+        head += worker->ring_size - pos;
+        pos = 0;
+    }
+
+    struct ring_frame *rec = (struct ring_frame *)(worker->ring + pos);
+    rec->cap_len = cap_len;
+    rec->wire_len = header->len;
+    rec->tv = *tv;
+    memcpy(rec->data, packet, cap_len);
+
+    __sync_synchronize();   // the frame must be written before the worker can see it
+    worker->head = head + rec_size;
+    worker->nb_queued ++;
+
+    if (worker->sleeping) {
+        WITH_PTH_MUTEX(&worker->mutex) {
+            pthread_cond_signal(&worker->cond);
+        }
+    }
+
+    return true;
+}
+
+static void fanout_packet(u_char *pkt_source_, const struct pcap_pkthdr *header, const u_char *packet)
+{
+    if (want_exit) return;
+
+    struct pkt_source *pkt_source = (struct pkt_source *)pkt_source_;
+    size_t const caplen = account_packet(pkt_source, header);
+    if (! caplen) return;
+
+    struct timeval tv = header->ts;
+    if (pkt_source->patch_ts) timeval_set_now(&tv);
+
+    struct pkt_worker *worker = pkt_source->workers + frame_flow_hash(packet, caplen) % pkt_source->nb_workers;
+    if (! pkt_worker_push(worker, header, caplen, packet, &tv)) {
+        SLOG(LOG_DEBUG, "Queue of worker %u is full, dropping packet", worker->idx);
+        worker->nb_drops ++;
+    }
+}
+
+// Wait until the sniffer queues something (or ask us to quit)
+static void pkt_worker_wait(struct pkt_worker *worker)
+{
+    WITH_PTH_MUTEX(&worker->mutex) {
+        worker->sleeping = true;
+        __sync_synchronize();
+        if (worker->head == worker->tail && !worker->quit) {
+            // Timed so that we do not care much about lost wakeups
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10000000;
+            if (ts.tv_nsec >= 1000000000) { ts.tv_sec ++; ts.tv_nsec -= 1000000000; }
+            (void)pthread_cond_timedwait(&worker->cond, &worker->mutex, &ts);
+        }
+        worker->sleeping = false;
+    }
+}
+
+static void *pkt_worker_thread_(void *worker_)
+{
+    struct pkt_worker *worker = worker_;
+    struct pkt_source *pkt_source = worker->pkt_source;
+    set_thread_name(tempstr_printf("J-work-%s[%u]/%u", pkt_source->name, pkt_source->instance, worker->idx));
+
+    while (1) {
+        uint64_t head = worker->head;
+        uint64_t tail = worker->tail;
+        if (head == tail) {
+            if (worker->quit) {
+                // The sniffer may have queued its last frames between our reading of head and quit
+                __sync_synchronize();
+                head = worker->head;
+                if (head == tail) break;    // the sniffer won't queue anything anymore and we are done
+            } else {
+                pkt_worker_wait(worker);
+                continue;
+            }
+        }
+        __sync_synchronize();   // read the frames only once we have read head
+
+        while (tail != head) {
+            // Parse the frames from the ring by batches, without copying them
+            struct frame frames[BATCH_MAX];
+            unsigned nb_frames = 0;
+            while (tail != head && nb_frames < NB_ELEMS(frames)) {
+                size_t const pos = tail % worker->ring_size;
+                struct ring_frame *rec = (struct ring_frame *)(worker->ring + pos);
+                if (rec->cap_len == RING_WRAP) {
+                    tail += worker->ring_size - pos;
+                    continue;
+                }
+                frames[nb_frames ++] = (struct frame) {
+                    .tv = rec->tv,
+                    .cap_len = rec->cap_len,
+                    .wire_len = rec->wire_len,
+                    .pkt_source = pkt_source,
+                    .data = rec->data,
+                };
+                tail += RING_PAD(sizeof(*rec) + rec->cap_len);
+            }
+            if (! want_exit) parse_frames(pkt_source, frames, nb_frames);
+            worker->nb_parsed += nb_frames;
+            __sync_synchronize();   // we are done with these frames before the sniffer can reuse their room
+            worker->tail = tail;
+        }
+    }
+
+    SLOG(LOG_DEBUG, "Worker %u of packet source %s is quitting", worker->idx, pkt_source_name(pkt_source));
+    return NULL;
+}
+
+static void *pkt_worker_thread(void *worker_)
+{
+    return scm_with_guile(pkt_worker_thread_, worker_);
+}
+
+// Wait for these workers to parse what they already have in their queue and quit, then free them
+static void pkt_workers_join(struct pkt_worker *workers, unsigned nb_workers)
+{
+    if (! workers) return;
+
+    __sync_synchronize();   // the last frames must be queued before the workers can see quit
+    for (unsigned w = 0; w < nb_workers; w++) {
+        struct pkt_worker *worker = workers + w;
+        worker->quit = true;
+        WITH_PTH_MUTEX(&worker->mutex) {
+            pthread_cond_signal(&worker->cond);
+        }
+    }
+
+    for (unsigned w = 0; w < nb_workers; w++) {
+        struct pkt_worker *worker = workers + w;
+        (void)pthread_join(worker->pth, NULL);
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
+        free(worker->ring);
+    }
+
+    objfree(workers);
+}
+
+// Detach the workers from the pkt_source, so that stats readers won't see them anymore. Caller must own pkt_sources_lock.
+static struct pkt_worker *pkt_workers_detach(struct pkt_source *pkt_source, unsigned *nb_workers)
+{
+    struct pkt_worker *workers = pkt_source->workers;
+    *nb_workers = pkt_source->nb_workers;
+    pkt_source->workers = NULL;
+    pkt_source->nb_workers = 0;
+    return workers;
+}
+
+// Caller must own pkt_sources_lock
+static void pkt_workers_stop(struct pkt_source *pkt_source)
+{
+    unsigned nb_workers;
+    struct pkt_worker *workers = pkt_workers_detach(pkt_source, &nb_workers);
+    pkt_workers_join(workers, nb_workers);
+}
+
+// Returns -1 on error (then no worker is running).
+static int pkt_workers_start(struct pkt_source *pkt_source, unsigned nb_workers)
+{
+    pkt_source->nb_workers = 0;
+    pkt_source->workers = NULL;
+    if (nb_workers == 0) return 0;
+
+    EXT_LOCK(fanout_ring_size);
+    size_t const ring_size = RING_PAD(MAX(fanout_ring_size, 2*RING_PAD(sizeof(struct ring_frame) + 65535)));
+    EXT_UNLOCK(fanout_ring_size);
+
+    pkt_source->workers = objalloc(nb_workers * sizeof(*pkt_source->workers), "pkt_workers");
+    if (! pkt_source->workers) return -1;
+
+    for (unsigned w = 0; w < nb_workers; w++) {
+        struct pkt_worker *worker = pkt_source->workers + w;
+        worker->pkt_source = pkt_source;
+        worker->idx = w;
+        worker->ring_size = ring_size;
+        worker->ring = malloc(ring_size);   // big and long lived: no need for objalloc
+        worker->head = worker->tail = 0;
+        worker->nb_queued = worker->nb_parsed = worker->nb_drops = 0;
+        worker->sleeping = worker->quit = false;
+        pthread_mutex_init(&worker->mutex, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        int err = worker->ring ? pthread_create(&worker->pth, NULL, pkt_worker_thread, worker) : ENOMEM;
+        if (err) {
+            SLOG(LOG_ERR, "Cannot start worker %u for pkt_source %s: %s", w, pkt_source->name, strerror(err));
+            pthread_cond_destroy(&worker->cond);
+            pthread_mutex_destroy(&worker->mutex);
+            free(worker->ring);
+            break;
+        }
+        pkt_source->nb_workers ++;
+    }
+
+    if (pkt_source->nb_workers < nb_workers) goto err;
+
+    SLOG(LOG_INFO, "Packet source %s will be parsed by %u threads", pkt_source->name, nb_workers);
+    return 0;
+err:
+    pkt_workers_stop(pkt_source);
+    return -1;
+}
+
+// Returns the callback the sniffer thread must use: batch_callback unless frames are fanned out to workers.
+static pcap_handler sniffer_callback(struct pkt_source *pkt_source, pcap_handler batch_callback)
+{
+    if (pkt_source->nb_workers > 0) return fanout_packet;
+
+    pkt_source->batch = batch_new();
+    if (! pkt_source->batch) {
+        SLOG(LOG_WARNING, "Cannot allocate a batch for packet source %s, will parse frames one at a time", pkt_source_name(pkt_source));
+        return parse_packet;
+    }
+    return batch_callback;
 }
 
 static void pkt_source_del(struct pkt_source *);
@@ -186,7 +621,8 @@ static void *sniffer(struct pkt_source *pkt_source, pcap_handler callback)
 {
     SLOG(LOG_INFO, "Dispatching packets from packet source %s", pkt_source_name(pkt_source));
     do {
-        int nb_packets = pcap_dispatch(pkt_source->pcap_handle, 100, callback, (u_char *)pkt_source);
+        int nb_packets = pcap_dispatch(pkt_source->pcap_handle, BATCH_MAX, callback, (u_char *)pkt_source);
+        if (pkt_source->batch) batch_flush(pkt_source);
         SLOG(LOG_DEBUG, "Got a batch of %d packets", nb_packets);
         if (nb_packets < 0) {
             if (nb_packets != -2) {
@@ -277,14 +713,49 @@ static void *iface_sniffer(void *pkt_source_)
 {
     struct pkt_source *pkt_source = pkt_source_;
     set_thread_name(tempstr_printf("J-snif-%s[%u]", pkt_source->name, pkt_source->instance));
-    return sniffer(pkt_source, parse_packet);
+    return sniffer(pkt_source, sniffer_callback(pkt_source, batch_packet));
 }
 
 static void *file_sniffer(void *pkt_source_)
 {
     struct pkt_source *pkt_source = pkt_source_;
     set_thread_name(tempstr_printf("J-read-%s[%u]", pkt_source->name, pkt_source->instance));
-    return sniffer(pkt_source, parse_packet);
+    return sniffer(pkt_source, sniffer_callback(pkt_source, batch_packet));
+}
+
+// Read only the packets which offsets were found in the index
+static void *indexed_file_sniffer(void *pkt_source_)
+{
+    struct pkt_source *pkt_source = pkt_source_;
+    set_thread_name(tempstr_printf("J-read-%s[%u]", pkt_source->name, pkt_source->instance));
+    pcap_handler callback = sniffer_callback(pkt_source, batch_packet);
+
+    SLOG(LOG_INFO, "Reading %zu indexed packets from packet source %s", pkt_source->index.nb_offsets, pkt_source_name(pkt_source));
+    FILE *f = pcap_file(pkt_source->pcap_handle);
+    if (! f) SLOG(LOG_ERR, "Cannot get file handler for pcap %s", pkt_source_name(pkt_source));
+
+    for (size_t o = 0; f && o < pkt_source->index.nb_offsets && !want_exit; o++) {
+        if (-1 == fseeko(f, pkt_source->index.offsets[o], SEEK_SET)) {
+            SLOG(LOG_ERR, "Cannot seek pcap file %s: %s", pkt_source_name(pkt_source), strerror(errno));
+            break;
+        }
+        struct pcap_pkthdr *pkt_hdr;
+        const unsigned char *packet;
+        int res = pcap_next_ex(pkt_source->pcap_handle, &pkt_hdr, &packet);
+        if (res < 0) {
+            if (res != -2) SLOG(LOG_ERR, "Cannot pcap_next_ex on pkt_source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
+            break;
+        }
+        // The index only gives the time range of whole chunks
+        if (timeval_is_set(&pkt_source->index.start) && timeval_cmp(&pkt_hdr->ts, &pkt_source->index.start) < 0) continue;
+        if (timeval_is_set(&pkt_source->index.stop) && timeval_cmp(&pkt_hdr->ts, &pkt_source->index.stop) > 0) continue;
+        callback((void *)pkt_source, pkt_hdr, packet);
+    }
+    if (pkt_source->batch) batch_flush(pkt_source);
+
+    SLOG(LOG_INFO, "Stop sniffing from file %s (%"PRIuLEAST64" packets read)", pkt_source_name(pkt_source), pkt_source->nb_packets);
+    pkt_source_del(pkt_source);
+    return NULL;
 }
 
 static void *file_sniffer_rt(void *pkt_source_)
@@ -294,6 +765,134 @@ static void *file_sniffer_rt(void *pkt_source_)
     return sniffer_rt(pkt_source, parse_packet);
 }
 
+#ifdef HAVE_TPACKET_V3
+/*
+ * AF_PACKET sniffer
+ *
+ * The kernel fills a ring of blocks mmaped in our address space, and hand
+ * them over to us one block (ie. one batch of frames) at a time. We parse
+ * (or fan out) the frames directly from the ring then give the block back.
+ */
+
+struct afpacket {
+    int fd;                         // the AF_PACKET socket
+    uint8_t *map;                   // the mmaped ring
+    size_t map_size;
+    unsigned block_size, nb_blocks;
+    unsigned next_block;            // the next block we are waiting for
+    size_t snaplen;
+    bool skip_outgoing;             // on loopback we would otherwise see every packet twice
+    bool vlan_room;                 // the kernel reserved room in front of frames for reinserting VLan tags
+    bool volatile quit;             // set by pkt_source_terminate
+    uint64_t tot_recv, tot_drop;    // the kernel resets its counters each time we read them
+    uint64_t nb_blocks_read;        // how many batches we read (for stats)
+};
+
+static int afpacket_read_stats(struct afpacket *afp)
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+    if (0 != getsockopt(afp->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len)) return -1;
+    // tp_packets also counts the drops
+    afp->tot_recv += stats.tp_packets;
+    afp->tot_drop += stats.tp_drops;
+    return 0;
+}
+
+// Process a whole block. Returns the number of frames we found in it.
+static unsigned afpacket_read_block(struct pkt_source *pkt_source, struct tpacket_block_desc *block, pcap_handler callback)
+{
+    struct afpacket *afp = pkt_source->afpacket;
+    unsigned const nb_pkts = block->hdr.bh1.num_pkts;
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+
+    for (unsigned p = 0; p < nb_pkts; p++, hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset)) {
+        if (want_exit) break;
+
+        if (afp->skip_outgoing) {
+            struct sockaddr_ll const *sll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+            if (sll->sll_pkttype == PACKET_OUTGOING) continue;
+        }
+
+        uint8_t *packet = (uint8_t *)hdr + hdr->tp_mac;
+        struct pcap_pkthdr pkthdr = {
+            .ts = { .tv_sec = hdr->tp_sec, .tv_usec = hdr->tp_nsec / 1000 },
+            .caplen = hdr->tp_snaplen,
+            .len = hdr->tp_len,
+        };
+
+#       ifdef TP_STATUS_VLAN_VALID
+        /* The kernel removed the VLan tag from the frame. Put it back in place, in the room
+         * reserved with PACKET_RESERVE (as libpcap does). */
+        if (afp->vlan_room && (hdr->tp_status & TP_STATUS_VLAN_VALID) && pkthdr.caplen >= 12) {
+            uint16_t tpid = 0x8100;
+#           ifdef TP_STATUS_VLAN_TPID_VALID
+            if (hdr->tp_status & TP_STATUS_VLAN_TPID_VALID) tpid = hdr->hv1.tp_vlan_tpid;
+#           endif
+            packet -= 4;
+            memmove(packet, packet + 4, 12);
+            uint16_t const tag[2] = { htons(tpid), htons(hdr->hv1.tp_vlan_tci) };
+            memcpy(packet + 12, tag, sizeof(tag));
+            pkthdr.caplen += 4;
+            pkthdr.len += 4;
+        }
+#       endif
+
+        if (pkthdr.caplen > afp->snaplen) pkthdr.caplen = afp->snaplen;
+        callback((u_char *)pkt_source, &pkthdr, packet);
+    }
+
+    return nb_pkts;
+}
+
+static void *afpacket_sniffer_(struct pkt_source *pkt_source, pcap_handler callback)
+{
+    struct afpacket *afp = pkt_source->afpacket;
+    SLOG(LOG_INFO, "Dispatching packets from AF_PACKET ring %s", pkt_source_name(pkt_source));
+
+    while (! want_exit && ! afp->quit) {
+        struct tpacket_block_desc *block = (struct tpacket_block_desc *)(afp->map + (size_t)afp->next_block * afp->block_size);
+        if (! (block->hdr.bh1.block_status & TP_STATUS_USER)) {
+            // Wait for the kernel to retire this block (no more than 1s so that we check quit from time to time)
+            struct pollfd pfd = { .fd = afp->fd, .events = POLLIN | POLLERR };
+            int const ret = poll(&pfd, 1, 1000);
+            if (ret < 0 && errno != EINTR) {
+                SLOG(LOG_ALERT, "Cannot poll AF_PACKET socket of %s: %s", pkt_source_name(pkt_source), strerror(errno));
+                break;
+            }
+            if (pfd.revents & POLLERR) {
+                SLOG(LOG_ALERT, "Error on AF_PACKET socket of %s, stop sniffing", pkt_source_name(pkt_source));
+                break;
+            }
+            continue;
+        }
+        __sync_synchronize();   // read the block only after its status
+
+        unsigned const nb_packets = afpacket_read_block(pkt_source, block, callback);
+        SLOG(LOG_DEBUG, "Got a block of %u packets", nb_packets);
+        if (pkt_source->batch) batch_flush(pkt_source);
+        afp->nb_blocks_read ++;
+
+        // The whole batch is parsed (or copied into workers queues): give the block back to the kernel
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        afp->next_block = (afp->next_block + 1) % afp->nb_blocks;
+    }
+
+    SLOG(LOG_INFO, "Stop sniffing on packet source %s (%"PRIuLEAST64" packets received)", pkt_source_name(pkt_source), pkt_source->nb_packets);
+    pkt_source_del(pkt_source);
+    return NULL;
+}
+
+static void *afpacket_sniffer(void *pkt_source_)
+{
+    struct pkt_source *pkt_source = pkt_source_;
+    set_thread_name(tempstr_printf("J-ring-%s[%u]", pkt_source->name, pkt_source->instance));
+    // Frames stay in the ring until we release their block, so there is no need to copy them
+    return afpacket_sniffer_(pkt_source, sniffer_callback(pkt_source, batch_packet_ref));
+}
+#endif
+
 /*
  * Ctor/Dtor of pkt_sources
  */
@@ -325,7 +924,7 @@ static void *start_guile_sniffer(void *pkt_source_)
 }
 
 // TODO: add a parameter to enable/disable deduplication
-static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap_t *pcap_handle, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop)
+static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap_t *pcap_handle, struct afpacket *afpacket, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop, unsigned nb_workers, struct pkt_source_index const *index)
 {
     SLOG(LOG_DEBUG, "Construct pkt_source@%p of name %s and dev_id %"PRIu8, pkt_source, name, dev_id);
     int ret = 0;
@@ -333,6 +932,7 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     snprintf(pkt_source->name, sizeof(pkt_source->name), "%s", name);
     pkt_source->instance = 0;
     pkt_source->pcap_handle = pcap_handle;
+    pkt_source->afpacket = afpacket;
     pkt_source->nb_packets = 0;
     pkt_source->nb_duplicates = 0;
     pkt_source->nb_cap_bytes = 0;
@@ -345,6 +945,17 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     pkt_source->filter = filter ? objalloc_strdup(filter) : NULL;
     pkt_source->sniffer_fun = sniffer;
     pkt_source->digests = digest_queue_get(dev_id); // if we can't have a deduplicator, let's go without one!
+    pkt_source->nb_workers = 0;
+    pkt_source->workers = NULL;
+    pkt_source->batch = NULL;
+    if (index) {
+        pkt_source->index = *index;
+    } else {
+        pkt_source->index.offsets = NULL;
+        pkt_source->index.nb_offsets = 0;
+        timeval_reset(&pkt_source->index.start);
+        timeval_reset(&pkt_source->index.stop);
+    }
 
     mutex_lock(&pkt_sources_lock);
     if (want_exit) {
@@ -358,12 +969,19 @@ static int pkt_source_ctor(struct pkt_source *pkt_source, char const *name, pcap
     }
 
     pkt_source->dev_id = dev_id;
+
+    if (0 != pkt_workers_start(pkt_source, nb_workers)) {
+        ret = -1;
+        goto unlock_quit;
+    }
+
     LIST_INSERT_HEAD(&pkt_sources, pkt_source, entry);
 
     int err = pthread_create(&pkt_source->sniffer_pth, NULL, start_guile_sniffer, pkt_source);
     if (err) {
         SLOG(LOG_ERR, "Cannot start sniffer thread on pkt_source %s[?]@%p: %s", pkt_source->name, pkt_source, strerror(err));  // Notice that pkt_source->instance is not inited yet
         LIST_REMOVE(pkt_source, entry);
+        pkt_workers_stop(pkt_source);
         ret = -1;
         goto unlock_quit;
     }
@@ -374,12 +992,12 @@ unlock_quit:
     return ret;
 }
 
-static struct pkt_source *pkt_source_new(char const *name, pcap_t *pcap_handle, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop)
+static struct pkt_source *pkt_source_new(char const *name, pcap_t *pcap_handle, struct afpacket *afpacket, void *(*sniffer)(void *), bool is_file, bool patch_ts, uint8_t dev_id, char const *filter, bool loop, unsigned nb_workers, struct pkt_source_index const *index)
 {
     struct pkt_source *pkt_source = objalloc(sizeof(*pkt_source), "pkt_sources");
     if (! pkt_source) return NULL;
 
-    if (0 != pkt_source_ctor(pkt_source, name, pcap_handle, sniffer, is_file, patch_ts, dev_id, filter, loop)) {
+    if (0 != pkt_source_ctor(pkt_source, name, pcap_handle, afpacket, sniffer, is_file, patch_ts, dev_id, filter, loop, nb_workers, index)) {
         objfree(pkt_source);
         pkt_source = NULL;
     }
@@ -413,7 +1031,7 @@ static struct pkt_source *pkt_source_new_file(char const *filename, char const *
     }
 
     void *(*sniff)(void *) = rt ? file_sniffer_rt : file_sniffer;
-    struct pkt_source *pkt_source = pkt_source_new(basename, handle, sniff, true, patch_ts, pcap_id_seq++, filter, loop);
+    struct pkt_source *pkt_source = pkt_source_new(basename, handle, NULL, sniff, true, patch_ts, pcap_id_seq++, filter, loop, 0, NULL);
     if (! pkt_source) {
         pcap_close(handle);
     }
@@ -421,6 +1039,39 @@ static struct pkt_source *pkt_source_new_file(char const *filename, char const *
     return pkt_source;
 }
 
+static struct pkt_source *pkt_source_new_indexed(char const *filename, struct capfile_index_query const *query)
+{
+    char errbuf[PCAP_ERRBUF_SIZE] = "";
+
+    SLOG(LOG_DEBUG, "Opening indexed pcapng file '%s'", filename);
+
+    struct pkt_source_index index = { .start = query->start, .stop = query->stop };
+    ssize_t const nb_offsets = capfile_index_lookup(filename, query, &index.offsets);
+    if (nb_offsets < 0) return NULL;
+    index.nb_offsets = nb_offsets;
+
+    pcap_t *handle = pcap_open_offline(filename, errbuf);
+    if (! handle) {
+        SLOG(LOG_CRIT, "Cannot open pcap file '%s': %s", filename, errbuf);
+        goto err1;
+    }
+
+    char const *basename = filename;
+    for (char const *c = filename; *c != '\0'; c++) {
+        if (*c == '/') basename = c+1;
+    }
+
+    struct pkt_source *pkt_source = pkt_source_new(basename, handle, NULL, indexed_file_sniffer, true, false, pcap_id_seq++, NULL, false, 0, &index);
+    if (! pkt_source) goto err2;
+
+    return pkt_source;
+err2:
+    pcap_close(handle);
+err1:
+    free(index.offsets);
+    return NULL;
+}
+
 // Caller must own pkt_sources_lock
 static void may_quit(void)
 {
@@ -453,11 +1104,11 @@ static uint8_t dev_id_of_ifname(char const *ifname)
     return strtoul(c, NULL, 10);
 }
 
-static struct pkt_source *pkt_source_new_if(char const *ifname, bool promisc, char const *filter, size_t snaplen, int buffer_size)
+static struct pkt_source *pkt_source_new_if(char const *ifname, bool promisc, char const *filter, size_t snaplen, int buffer_size, unsigned nb_workers)
 {
     char errbuf[PCAP_ERRBUF_SIZE] = "";
 
-    SLOG(LOG_INFO, "Opening pcap device '%s'%s with filter %s and buffer size %d", ifname, promisc ? " in promiscuous mode":"", filter ? filter:"NONE", buffer_size);
+    SLOG(LOG_INFO, "Opening pcap device '%s'%s with filter %s, buffer size %d and %u parser threads", ifname, promisc ? " in promiscuous mode":"", filter ? filter:"NONE", buffer_size, nb_workers);
 
     if (! snaplen) snaplen = 65535;
 
@@ -498,7 +1149,7 @@ static struct pkt_source *pkt_source_new_if(char const *ifname, bool promisc, ch
     }
 
     uint8_t dev_id = dev_id_of_ifname(ifname);
-    struct pkt_source *pkt_source = pkt_source_new(ifname, handle, iface_sniffer, false, false, dev_id, filter, false);
+    struct pkt_source *pkt_source = pkt_source_new(ifname, handle, NULL, iface_sniffer, false, false, dev_id, filter, false, nb_workers, NULL);
     if (! pkt_source) goto err1;
 
     return pkt_source;
@@ -511,6 +1162,171 @@ err2:
     return NULL;
 }
 
+#ifdef HAVE_TPACKET_V3
+static unsigned fanout_id_seq;  // to give each fanout group a distinct id
+
+static void afpacket_del(struct afpacket *afp)
+{
+    if (afp->map) munmap(afp->map, afp->map_size);
+    (void)close(afp->fd);
+    objfree(afp);
+}
+
+static int afpacket_set_filter(int fd, char const *filter, size_t snaplen)
+{
+    if (filter[0] == '\0') return 0;
+
+    pcap_t *dead = pcap_open_dead(DLT_EN10MB, snaplen);
+    if (! dead) return -1;
+
+    int ret = -1;
+    struct bpf_program fp;
+    if (0 != pcap_compile(dead, &fp, filter, 1, 0)) {
+        SLOG(LOG_ERR, "Cannot parse filter %s: %s", filter, pcap_geterr(dead));
+        goto quit;
+    }
+
+    // Linux socket filters are classic BPF programs
+    struct sock_fprog prog = { .len = fp.bf_len, .filter = (struct sock_filter *)fp.bf_insns };
+    if (0 != setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+        SLOG(LOG_ERR, "Cannot install filter %s: %s", filter, strerror(errno));
+    } else {
+        ret = 0;
+    }
+    pcap_freecode(&fp);
+quit:
+    pcap_close(dead);
+    return ret;
+}
+
+// Open a new AF_PACKET socket with its ring. If fanout_id is >= 0, join this fanout group.
+static struct afpacket *afpacket_new(char const *ifname, bool promisc, char const *filter, size_t snaplen, size_t buffer_size, int fanout_id)
+{
+    struct afpacket *afp = objalloc(sizeof(*afp), "afpackets");
+    if (! afp) return NULL;
+    memset(afp, 0, sizeof(*afp));
+    afp->snaplen = snaplen;
+
+    afp->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (afp->fd < 0) {
+        SLOG(LOG_ALERT, "Cannot create AF_PACKET socket for device '%s': %s", ifname, strerror(errno));
+        objfree(afp);
+        return NULL;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    if (0 != ioctl(afp->fd, SIOCGIFINDEX, &ifr)) {
+        SLOG(LOG_ALERT, "Cannot find device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+    int const ifindex = ifr.ifr_ifindex;
+    if (0 == ioctl(afp->fd, SIOCGIFFLAGS, &ifr)) afp->skip_outgoing = !!(ifr.ifr_flags & IFF_LOOPBACK);
+
+    if (filter && 0 != afpacket_set_filter(afp->fd, filter, snaplen)) goto err;
+
+    int const version = TPACKET_V3;
+    if (0 != setsockopt(afp->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))) {
+        SLOG(LOG_ALERT, "Cannot use TPACKET_V3 for device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+
+    // Must be set before the ring is created
+    unsigned const reserve = 4; // one VLan tag
+    afp->vlan_room = 0 == setsockopt(afp->fd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof(reserve));
+    if (! afp->vlan_room) {
+        SLOG(LOG_WARNING, "Cannot reserve headroom for device '%s', VLan tags stripped by the kernel will be lost: %s", ifname, strerror(errno));
+    }
+
+    // Blocks are retired when full or after tp_retire_blk_tov ms, so a block is a batch of frames
+    afp->block_size = 1U << 20;
+    afp->nb_blocks = MAX(buffer_size / afp->block_size, 4U);
+    unsigned const frame_size = 2048;   // not really relevant with TPACKET_V3 but must be consistent
+    struct tpacket_req3 req = {
+        .tp_block_size = afp->block_size,
+        .tp_block_nr = afp->nb_blocks,
+        .tp_frame_size = frame_size,
+        .tp_frame_nr = (afp->block_size / frame_size) * afp->nb_blocks,
+        .tp_retire_blk_tov = 100,
+        .tp_feature_req_word = 0,
+    };
+    if (0 != setsockopt(afp->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+        SLOG(LOG_ALERT, "Cannot setup a ring of %u blocks for device '%s': %s", afp->nb_blocks, ifname, strerror(errno));
+        goto err;
+    }
+
+    afp->map_size = (size_t)afp->block_size * afp->nb_blocks;
+    afp->map = mmap(NULL, afp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, afp->fd, 0);
+    if (afp->map == MAP_FAILED) {   // MAP_LOCKED may be forbidden by ulimits, try without
+        afp->map = mmap(NULL, afp->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, afp->fd, 0);
+    }
+    if (afp->map == MAP_FAILED) {
+        SLOG(LOG_ALERT, "Cannot mmap the ring of device '%s': %s", ifname, strerror(errno));
+        afp->map = NULL;
+        goto err;
+    }
+
+    struct sockaddr_ll sll = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_ALL),
+        .sll_ifindex = ifindex,
+    };
+    if (0 != bind(afp->fd, (struct sockaddr *)&sll, sizeof(sll))) {
+        SLOG(LOG_ALERT, "Cannot bind AF_PACKET socket to device '%s': %s", ifname, strerror(errno));
+        goto err;
+    }
+
+    if (promisc) {
+        struct packet_mreq mr = { .mr_ifindex = ifindex, .mr_type = PACKET_MR_PROMISC };
+        if (0 != setsockopt(afp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr))) {
+            SLOG(LOG_ALERT, "Cannot set promiscuous mode for device '%s': %s", ifname, strerror(errno));
+            goto err;
+        }
+    }
+
+    if (fanout_id >= 0) {
+        int fanout = fanout_id | (PACKET_FANOUT_HASH << 16);
+#       ifdef PACKET_FANOUT_FLAG_DEFRAG
+        fanout |= PACKET_FANOUT_FLAG_DEFRAG << 16;  // or fragments of a packet could go to distinct sockets
+#       endif
+        if (0 != setsockopt(afp->fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout))) {
+            SLOG(LOG_ALERT, "Cannot join fanout group %d for device '%s': %s", fanout_id, ifname, strerror(errno));
+            goto err;
+        }
+    }
+
+    return afp;
+err:
+    afpacket_del(afp);
+    return NULL;
+}
+
+static struct pkt_source *pkt_source_new_afpacket(char const *ifname, bool promisc, char const *filter, size_t snaplen, size_t buffer_size, int fanout_id, unsigned nb_workers)
+{
+    SLOG(LOG_INFO, "Opening AF_PACKET ring on device '%s'%s with filter %s and buffer size %zu", ifname, promisc ? " in promiscuous mode":"", filter ? filter:"NONE", buffer_size);
+
+    if (! snaplen) snaplen = 65535;
+    if (! buffer_size) buffer_size = 32*1024*1024;
+
+    struct afpacket *afp = afpacket_new(ifname, promisc, filter, snaplen, buffer_size, fanout_id);
+    if (! afp) goto err;
+
+    struct pkt_source *pkt_source = pkt_source_new(ifname, NULL, afp, afpacket_sniffer, false, false, dev_id_of_ifname(ifname), filter, false, nb_workers, NULL);
+    if (! pkt_source) {
+        afpacket_del(afp);
+        goto err;
+    }
+
+    return pkt_source;
+err:
+    mutex_lock(&pkt_sources_lock);
+    may_quit();
+    mutex_unlock(&pkt_sources_lock);
+    return NULL;
+}
+#endif
+
 // Caller must own pkt_sources_lock
 static void pkt_source_dtor(struct pkt_source *pkt_source)
 {
@@ -522,22 +1338,65 @@ static void pkt_source_dtor(struct pkt_source *pkt_source)
         pcap_close(pkt_source->pcap_handle);
         pkt_source->pcap_handle = NULL;
     }
+#   ifdef HAVE_TPACKET_V3
+    if (pkt_source->afpacket) {
+        afpacket_del(pkt_source->afpacket);
+        pkt_source->afpacket = NULL;
+    }
+#   endif
     if (pkt_source->filter) {
         objfree(pkt_source->filter);
         pkt_source->filter = NULL;
     }
     digest_queue_unref(&pkt_source->digests);
+    if (pkt_source->batch) {
+        free(pkt_source->batch);
+        pkt_source->batch = NULL;
+    }
+    if (pkt_source->index.offsets) {
+        free(pkt_source->index.offsets);
+        pkt_source->index.offsets = NULL;
+    }
 }
 
 static uint64_t tot_dropped, tot_recved;
 
+// Same as pcap_stats, whatever the kind of pkt_source
+static int pkt_source_stats(struct pkt_source *pkt_source, struct pcap_stat *stats)
+{
+#   ifdef HAVE_TPACKET_V3
+    if (pkt_source->afpacket) {
+        struct afpacket *afp = pkt_source->afpacket;
+        if (0 != afpacket_read_stats(afp)) return -1;
+        stats->ps_recv = afp->tot_recv;
+        stats->ps_drop = afp->tot_drop;
+        stats->ps_ifdrop = 0;
+        return 0;
+    }
+#   endif
+    return pcap_stats(pkt_source->pcap_handle, stats);
+}
+
+static char const *pkt_source_geterr(struct pkt_source *pkt_source)
+{
+    return pkt_source->pcap_handle ? pcap_geterr(pkt_source->pcap_handle) : strerror(errno);
+}
+
 static void pkt_source_del(struct pkt_source *pkt_source)
 {
+    // The sniffer won't queue anything anymore, so let the workers finish their job
+    // (once they are out of reach of g_iface_stats, since we join them without the lock)
+    mutex_lock(&pkt_sources_lock);
+    unsigned nb_workers;
+    struct pkt_worker *workers = pkt_workers_detach(pkt_source, &nb_workers);
+    mutex_unlock(&pkt_sources_lock);
+    pkt_workers_join(workers, nb_workers);
+
     // Dump some stats
     struct pcap_stat stats;
-    bool const have_stats = 0 == pcap_stats(pkt_source->pcap_handle, &stats);
+    bool const have_stats = 0 == pkt_source_stats(pkt_source, &stats);
     if (! have_stats) {
-        SLOG(pkt_source->is_file ? LOG_DEBUG:LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
+        SLOG(pkt_source->is_file ? LOG_DEBUG:LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pkt_source_geterr(pkt_source));
     } else if (stats.ps_recv > 0) {
         tot_recved += stats.ps_recv;
         tot_dropped += stats.ps_drop;
@@ -557,6 +1416,12 @@ static void pkt_source_terminate(struct pkt_source *pkt_source)
 {
     SLOG(LOG_DEBUG, "Terminating packet source '%s' after %"PRIu64" packets (%"PRIu64" dups)", pkt_source_name(pkt_source), pkt_source->nb_packets, pkt_source->nb_duplicates);
     pkt_source->loop = false;
+#   ifdef HAVE_TPACKET_V3
+    if (pkt_source->afpacket) {
+        pkt_source->afpacket->quit = true;
+        return;
+    }
+#   endif
     pcap_breakloop(pkt_source->pcap_handle);
 }
 
@@ -608,18 +1473,54 @@ static struct pkt_source *pkt_source_of_scm(SCM ifname_)
 }
 
 static struct ext_function sg_open_iface;
-static SCM g_open_iface(SCM ifname_, SCM promisc_, SCM filter_, SCM snaplen_, SCM buffer_size_)
+static SCM g_open_iface(SCM ifname_, SCM promisc_, SCM filter_, SCM snaplen_, SCM buffer_size_, SCM nb_workers_)
 {
     char *ifname = scm_to_tempstr(ifname_);
     bool const promisc = SCM_UNBNDP(promisc_) || scm_to_bool(promisc_);
     char const *filter = SCM_UNBNDP(filter_) ? NULL : scm_to_tempstr(filter_);
     size_t const snaplen = SCM_UNBNDP(snaplen_) ? 0 : scm_to_size_t(snaplen_);
     int const buffer_size = SCM_UNBNDP(buffer_size_) ? 0 : scm_to_int(buffer_size_);
+    unsigned const nb_workers = SCM_UNBNDP(nb_workers_) ? 0 : scm_to_uint(nb_workers_);
+    if (nb_workers > CPU_MAX) {
+        SLOG(LOG_ERR, "Cannot use more than %u parser threads per packet source", CPU_MAX);
+        return SCM_UNSPECIFIED;
+    }
 
-    struct pkt_source *pkt_source = pkt_source_new_if(ifname, promisc, filter, snaplen, buffer_size);
+    struct pkt_source *pkt_source = pkt_source_new_if(ifname, promisc, filter, snaplen, buffer_size, nb_workers);
     return pkt_source ? scm_from_latin1_string(pkt_source_guile_name(pkt_source)) : SCM_UNSPECIFIED;
 }
 
+#ifdef HAVE_TPACKET_V3
+static struct ext_function sg_open_iface_afpacket;
+static SCM g_open_iface_afpacket(SCM ifname_, SCM promisc_, SCM filter_, SCM snaplen_, SCM buffer_size_, SCM nb_sockets_, SCM nb_workers_)
+{
+    char *ifname = scm_to_tempstr(ifname_);
+    bool const promisc = SCM_UNBNDP(promisc_) || scm_to_bool(promisc_);
+    char const *filter = SCM_UNBNDP(filter_) ? NULL : scm_to_tempstr(filter_);
+    size_t const snaplen = SCM_UNBNDP(snaplen_) ? 0 : scm_to_size_t(snaplen_);
+    size_t const buffer_size = SCM_UNBNDP(buffer_size_) ? 0 : scm_to_size_t(buffer_size_);
+    unsigned const nb_sockets = SCM_UNBNDP(nb_sockets_) ? 1 : scm_to_uint(nb_sockets_);
+    if (nb_sockets < 1 || nb_sockets > CPU_MAX) {
+        SLOG(LOG_ERR, "Cannot use %u sockets (must be between 1 and %u)", nb_sockets, CPU_MAX);
+        return SCM_UNSPECIFIED;
+    }
+    unsigned const nb_workers = SCM_UNBNDP(nb_workers_) ? 0 : scm_to_uint(nb_workers_);
+    if (nb_workers > CPU_MAX) {
+        SLOG(LOG_ERR, "Cannot use more than %u parser threads per packet source", CPU_MAX);
+        return SCM_UNSPECIFIED;
+    }
+    int const fanout_id = nb_sockets > 1 ? (int)(__sync_fetch_and_add(&fanout_id_seq, 1) & 0xffff) : -1;
+
+    SCM ret = SCM_EOL;
+    for (unsigned s = 0; s < nb_sockets; s++) {
+        struct pkt_source *pkt_source = pkt_source_new_afpacket(ifname, promisc, filter, snaplen, buffer_size, fanout_id, nb_workers);
+        if (! pkt_source) break;
+        ret = scm_cons(scm_from_latin1_string(pkt_source_guile_name(pkt_source)), ret);
+    }
+    return scm_reverse(ret);
+}
+#endif
+
 static struct ext_function sg_open_pcap;
 static SCM g_open_pcap(SCM filename_, SCM rt_, SCM filter_, SCM patch_ts_, SCM loop_)
 {
@@ -633,6 +1534,30 @@ static SCM g_open_pcap(SCM filename_, SCM rt_, SCM filter_, SCM patch_ts_, SCM l
     return pkt_source ? SCM_BOOL_T : SCM_BOOL_F;
 }
 
+static struct ext_function sg_open_pcap_indexed;
+static SCM g_open_pcap_indexed(SCM filename_, SCM addr_, SCM port_, SCM start_, SCM stop_)
+{
+    char const *filename = scm_to_tempstr(filename_);
+    struct capfile_index_query query = { .port = 0 };
+    query.addr.family = AF_UNSPEC;
+    timeval_reset(&query.start);
+    timeval_reset(&query.stop);
+
+    if (! SCM_UNBNDP(addr_) && scm_is_true(addr_)) {
+        char const *addr = scm_to_tempstr(addr_);
+        if (0 != ip_addr_ctor_from_str_any(&query.addr, addr)) {
+            SLOG(LOG_ERR, "Cannot parse IP address '%s'", addr);
+            return SCM_BOOL_F;
+        }
+    }
+    if (! SCM_UNBNDP(port_)) query.port = scm_to_uint16(port_);
+    if (! SCM_UNBNDP(start_)) query.start.tv_sec = scm_to_uint32(start_);
+    if (! SCM_UNBNDP(stop_)) query.stop.tv_sec = scm_to_uint32(stop_);
+
+    struct pkt_source *pkt_source = pkt_source_new_indexed(filename, &query);
+    return pkt_source ? SCM_BOOL_T : SCM_BOOL_F;
+}
+
 static struct ext_function sg_close_iface;
 static SCM g_close_iface(SCM ifname_)
 {
@@ -676,6 +1601,27 @@ static SCM nb_cap_bytes_sym;
 static SCM nb_wire_bytes_sym;
 static SCM filep_sym;
 static SCM filter_sym;
+static SCM workers_sym;
+static SCM queue_depth_sym;
+static SCM nb_parsed_sym;
+static SCM nb_drops_sym;
+
+// Caller must own pkt_sources_lock
+static SCM workers_stats(struct pkt_source *pkt_source)
+{
+    SCM ret = SCM_EOL;
+    for (unsigned w = pkt_source->nb_workers; w--; ) {
+        struct pkt_worker const *worker = pkt_source->workers + w;
+        uint64_t const nb_parsed = worker->nb_parsed;
+        ret = scm_cons(
+            scm_list_3(
+                scm_cons(queue_depth_sym, scm_from_uint64(worker->nb_queued - nb_parsed)),
+                scm_cons(nb_parsed_sym,   scm_from_uint64(nb_parsed)),
+                scm_cons(nb_drops_sym,    scm_from_uint64(worker->nb_drops))),
+            ret);
+    }
+    return ret;
+}
 
 static struct ext_function sg_iface_stats;
 static SCM g_iface_stats(SCM ifname_)
@@ -687,9 +1633,9 @@ static SCM g_iface_stats(SCM ifname_)
     if (! pkt_source) goto err;
 
     struct pcap_stat stats;
-    bool const have_stats = 0 == pcap_stats(pkt_source->pcap_handle, &stats);
+    bool const have_stats = 0 == pkt_source_stats(pkt_source, &stats);
     if (! have_stats) {
-        SLOG(LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pcap_geterr(pkt_source->pcap_handle));
+        SLOG(LOG_WARNING, "Cannot read stats for packet source %s: %s", pkt_source_name(pkt_source), pkt_source_geterr(pkt_source));
     }
 
     ret = scm_list_n(
@@ -703,6 +1649,7 @@ static SCM g_iface_stats(SCM ifname_)
         scm_cons(nb_cap_bytes_sym,  scm_from_uint64(pkt_source->nb_cap_bytes)),
         scm_cons(nb_wire_bytes_sym, scm_from_uint64(pkt_source->nb_wire_bytes)),
         scm_cons(filep_sym,         scm_from_bool(pkt_source->is_file)),
+        scm_cons(workers_sym,       workers_stats(pkt_source)),
         pkt_source->filter ?
             scm_cons(filter_sym,    scm_from_latin1_string(pkt_source->filter)) :
             SCM_UNDEFINED,
@@ -729,6 +1676,7 @@ void pkt_source_init(void)
     mutex_init();
     ext_init();
     objalloc_init();
+    arena_init();
     ref_init();
     digest_init();
 
@@ -754,8 +1702,13 @@ void pkt_source_init(void)
     nb_wire_bytes_sym     = scm_permanent_object(scm_from_latin1_symbol("nb-wire-bytes"));
     filep_sym             = scm_permanent_object(scm_from_latin1_symbol("file?"));
     filter_sym            = scm_permanent_object(scm_from_latin1_symbol("filter"));
+    workers_sym           = scm_permanent_object(scm_from_latin1_symbol("workers"));
+    queue_depth_sym       = scm_permanent_object(scm_from_latin1_symbol("queue-depth"));
+    nb_parsed_sym         = scm_permanent_object(scm_from_latin1_symbol("nb-parsed"));
+    nb_drops_sym          = scm_permanent_object(scm_from_latin1_symbol("nb-drops"));
 
     ext_param_quit_when_done_init();
+    ext_param_fanout_ring_size_init();
     log_category_pkt_sources_init();
 
     cap_parser = proto_cap->ops->parser_new(proto_cap);
@@ -768,7 +1721,7 @@ void pkt_source_init(void)
         "See also (? 'open-iface) to start sniffing an interface.\n");
 
     ext_function_ctor(&sg_open_iface,
-        "open-iface", 1, 4, 0, g_open_iface,
+        "open-iface", 1, 5, 0, g_open_iface,
         "(open-iface \"iface-name\"): open the given iface, and set it in promiscuous mode.\n"
         "(open-iface \"iface-name\" #f): open the given iface without setting it\n"
         "    in promiscuous mode.\n"
@@ -778,6 +1731,10 @@ void pkt_source_init(void)
         "    90 bytes of each packet. Use 0 for all bytes (the default).\n"
         "(open-iface \"iface-name\" #t \"[filter]\" 90 (* 10 1024 1024)): same as above, using\n"
         "    a buffer size of 10Mb (instead of system default).\n"
+        "(open-iface \"iface-name\" #t \"[filter]\" 0 0 4): same as above, but parse the packets\n"
+        "    with 4 threads instead of the sniffer thread. Packets are dispatched according to\n"
+        "    their addresses and ports so that both directions of a flow go to the same thread.\n"
+        "    See (? 'fanout-ring-size) for the size of their queues.\n"
         "Will return #t or #f depending on the success of the operation.\n"
         "See also (? 'list-ifaces) to have a list of all openable ifaces,\n"
         "    and (? 'close-iface) to close a given iface\n");
@@ -787,6 +1744,26 @@ void pkt_source_init(void)
         "(close-iface \"iface-name\"): stop sniffing a previously opened iface.\n"
         "See also (? 'open-iface).\n");
 
+#   ifdef HAVE_TPACKET_V3
+    fanout_id_seq = getpid();
+    ext_function_ctor(&sg_open_iface_afpacket,
+        "open-iface-afpacket", 1, 6, 0, g_open_iface_afpacket,
+        "(open-iface-afpacket \"iface-name\"): same as open-iface, but read the packets directly\n"
+        "    from a ring shared with the kernel (AF_PACKET socket with TPACKET_V3) instead of using\n"
+        "    libpcap. The kernel hands over the packets by blocks, which are parsed in a row and\n"
+        "    then given back to the kernel.\n"
+        "(open-iface-afpacket \"iface-name\" #t \"[filter]\" 0 (* 64 1024 1024)): set promiscuous\n"
+        "    mode, packet filter, snaplen and ring size like for open-iface (default ring size is 32Mb).\n"
+        "(open-iface-afpacket \"iface-name\" #t \"[filter]\" 0 0 4): open 4 such sockets in a fanout\n"
+        "    group, each with its own sniffer thread. The kernel dispatches the packets amongst\n"
+        "    them according to their addresses and ports.\n"
+        "(open-iface-afpacket \"iface-name\" #t \"[filter]\" 0 0 1 4): same as above with a single\n"
+        "    socket, but fan out its packets to 4 parser threads as open-iface does. Both can be\n"
+        "    combined (then each socket has its own parser threads).\n"
+        "Will return the list of the names of the opened packet sources.\n"
+        "See also (? 'open-iface).\n");
+#   endif
+
     ext_function_ctor(&sg_open_pcap,
         "open-pcap", 1, 4, 0, g_open_pcap,
         "(open-pcap \"pcap-file\"): read the content of this pcap file, full speed.\n"
@@ -797,6 +1774,17 @@ void pkt_source_init(void)
         "Will return #t or #f according to the status of the operation.\n"
         "See also (? 'open-iface)\n");
 
+    ext_function_ctor(&sg_open_pcap_indexed,
+        "open-pcap-indexed", 1, 4, 0, g_open_pcap_indexed,
+        "(open-pcap-indexed \"pcapng-file\"): read all packets of this pcapng file, using its index.\n"
+        "(open-pcap-indexed \"pcapng-file\" \"192.168.1.2\"): read only the packets to or from this address.\n"
+        "(open-pcap-indexed \"pcapng-file\" \"192.168.1.2\" 80): read only the packets to or from this address and port.\n"
+        "(open-pcap-indexed \"pcapng-file\" #f 80 start stop): read only the packets to or from this port between these times (in seconds).\n"
+        "The file must have been written with an index (see (? 'capfile-names) and the pcapng method of the writer plugin),\n"
+        "and only the chunks of the file that may contain matching packets are read.\n"
+        "Will return #t or #f according to the status of the operation.\n"
+        "See also (? 'open-pcap)\n");
+
     ext_function_ctor(&sg_iface_names,
         "iface-names", 0, 0, 0, g_iface_names,
         "(iface-names): returns the list of currently opened interfaces.\n"
@@ -805,7 +1793,11 @@ void pkt_source_init(void)
     ext_function_ctor(&sg_iface_stats,
         "iface-stats", 1, 0, 0, g_iface_stats,
         "(iface-stats \"iface-name\"): return detailed statistics about that packet source.\n"
-        "Note: all counters are reset after each read.\n"
+        "If the packet source is parsed by several threads, 'workers gives for each of them\n"
+        "    its queue depth (in frames), how many frames it parsed and how many were dropped\n"
+        "    because its queue was full.\n"
+        "Note: only new-received and new-dropped are reset after each read, all other counters\n"
+        "    (including those of 'workers) are cumulative.\n"
         "See also (? 'get-ifaces).\n");
 }
 
@@ -845,12 +1837,14 @@ void pkt_source_fini(void)
     }
 
     log_category_pkt_sources_fini();
+    ext_param_fanout_ring_size_fini();
     ext_param_quit_when_done_fini();
 
     digest_queue_unref(&global_digests);
 
     digest_fini();
     ref_fini();
+    arena_fini();
     mutex_fini();
     ext_fini();
     objalloc_fini();
@@ -12,14 +12,44 @@
 #include "junkie/tools/mutex.h"
 #include "junkie/proto/proto.h"
 
-/** A Packet Source is something that gives us packets (with libpcap).
+struct pkt_source;
+struct afpacket;
+struct frame_batch;
+
+/** When a pkt_source fans out its packets to several parser threads, each of
+ * these threads is a pkt_worker. The sniffer thread copies every frame into
+ * the ring of the worker chosen according to the frame's flow (so that both
+ * directions of a flow are parsed by the same worker), and the worker parses
+ * them in order. Each ring has a single producer (the sniffer thread) and a
+ * single consumer (the worker) so it needs no lock. */
+struct pkt_worker {
+    struct pkt_source *pkt_source;  ///< Backlink to the pkt_source we are parsing for
+    unsigned idx;                   ///< Our index in pkt_source->workers
+    pthread_t pth;                  ///< The parser thread
+    uint8_t *ring;                  ///< The ring of frames (of ring_size bytes)
+    size_t ring_size;               ///< Size of the ring, in bytes
+    uint64_t volatile head;         ///< Where the sniffer will write the next frame (only written by the sniffer)
+    char pad_[64];                  ///< So that head and tail are not on the same cache line
+    uint64_t volatile tail;         ///< Where the worker will read the next frame (only written by the worker)
+    uint64_t nb_queued;             ///< Number of frames queued for this worker (only written by the sniffer)
+    uint64_t nb_parsed;             ///< Number of frames parsed by this worker (only written by the worker)
+    uint64_t nb_drops;              ///< Number of frames dropped because the ring was full (only written by the sniffer)
+    pthread_mutex_t mutex;          ///< Protects the condition below
+    pthread_cond_t cond;            ///< Signaled by the sniffer when the worker is sleeping
+    bool volatile sleeping;         ///< Set by the worker when it waits for more frames
+    bool volatile quit;             ///< Set by the sniffer once it won't queue any more frames
+};
+
+/** A Packet Source is something that gives us packets (with libpcap, or
+ * directly from an AF_PACKET ring on Linux).
  * So basically it can be either a real interface or a file.
  */
 struct pkt_source {
     LIST_ENTRY(pkt_source) entry;   ///< Entry in the list of all packet sources
     char name[PATH_MAX];            ///< The name to identify this source
     unsigned instance;              ///< If several pkt_source uses the same name (as is frequent), distinguish them with this
-    pcap_t *pcap_handle;            ///< The handle for libpcap
+    pcap_t *pcap_handle;            ///< The handle for libpcap (NULL if we read from an AF_PACKET ring)
+    struct afpacket *afpacket;      ///< The AF_PACKET ring we read from (NULL if we use libpcap)
     pthread_t sniffer_pth;          ///< The thread sniffing this device or file
     void *(*sniffer_fun)(void *);   ///< The function that's sniffing packet (stored here for convenience)
     uint64_t nb_packets;            ///< Number of packets received from PCAP
@@ -36,6 +66,15 @@ struct pkt_source {
     uint8_t dev_id;
     char *filter;                   ///< Packet filter expression in use for this device (for reference only)
     struct digest_queue *digests;   ///< Digests queue used for deduplication on this pkt_source
+    unsigned nb_workers;            ///< Number of parser threads the frames are fanned out to (0 if the sniffer parses them itself)
+    struct pkt_worker *workers;     ///< The nb_workers parser threads, or NULL
+    struct frame_batch *batch;      ///< Frames received by the sniffer thread and not parsed yet (NULL if not batching)
+    /// For indexed pcapng files, what packets to read
+    struct pkt_source_index {
+        off_t *offsets;             ///< Offsets of the packets in the file (malloced, NULL if not indexed)
+        size_t nb_offsets;          ///< Length of the above array
+        struct timeval start, stop; ///< Packets outside this time range are skipped (if set)
+    } index;
 };
 
 /** Now the frame structure that will be given to the cap parser, since
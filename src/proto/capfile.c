@@ -19,7 +19,12 @@
  */
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -29,7 +34,11 @@
 #include "junkie/tools/ext.h"
 #include "junkie/tools/mutex.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/serialization.h"
 #include "junkie/proto/cap.h"
+#include "junkie/proto/ip.h"
+#include "junkie/proto/tcp.h"
+#include "junkie/proto/udp.h"
 #include "junkie/proto/capfile.h"
 
 #undef LOG_CAT
@@ -40,6 +49,8 @@ LOG_CATEGORY_DEF(capfile);
 static unsigned capture_files = 0;
 static unsigned max_capture_files = 1000;
 EXT_PARAM_RW(max_capture_files, "max-capture-files", uint, "The max number of files opened for captures (0 for no limit)");
+static bool async_capfiles = false;
+EXT_PARAM_RW(async_capfiles, "async-capfiles", bool, "Should pcap files be written by a dedicated thread (using a few MB of buffers each)");
 
 /*
  * Capfile ctor/dtor
@@ -156,8 +167,8 @@ static void capfile_close(struct capfile *capfile)
     mutex_unlock(&capfile->lock);
 }
 
-// Caller must own the capfile->lock
-static int capfile_open(struct capfile *capfile, char const *path, struct timeval const *now)
+// Open the file itself (does not need the capfile->lock)
+static int capfile_open_fd(struct capfile *capfile, char const *path)
 {
     if (capture_files >= max_capture_files) {   // not thread safe but if the test is not precise this is not a big deal
         SLOG(LOG_INFO, "Cannot open new capture files: %u already opened", capture_files);
@@ -170,6 +181,14 @@ static int capfile_open(struct capfile *capfile, char const *path, struct timeva
     if (capfile->fd < 0) return -1;
     inc_capture_files();
 
+    return 0;
+}
+
+// Caller must own the capfile->lock
+static int capfile_open(struct capfile *capfile, char const *path, struct timeval const *now)
+{
+    if (0 != capfile_open_fd(capfile, path)) return -1;
+
     capfile->file_size = 0;
     capfile->nb_pkts = 0;
     capfile->start = *now;
@@ -200,15 +219,15 @@ static void capfile_may_rotate(struct capfile *capfile, struct timeval const *no
  * Note: we do not use libpcap because it requires an activated pcap_t for cap_len, which does not suit our case
  */
 
-static int open_pcap(struct capfile *capfile, char const *path, struct timeval const *now)
-{
-    int ret = -1;
-
-    mutex_lock(&capfile->lock);
-
-    if (0 != capfile_open(capfile, path, now)) goto err;
+struct pcap_sf_pkthdr {
+    uint32_t ts_sec, ts_usec;
+    bpf_u_int32 caplen;
+    bpf_u_int32 len;
+};
 
-    // Write the pcap header
+// Write the pcap header, or close the file
+static int pcap_write_header(struct capfile *capfile)
+{
 #   define TCPDUMP_MAGIC 0xa1b2c3d4
     struct pcap_file_header hdr = {
         .magic         = TCPDUMP_MAGIC,
@@ -223,10 +242,22 @@ static int open_pcap(struct capfile *capfile, char const *path, struct timeval c
         file_close(capfile->fd);
         capfile->fd = -1;
         dec_capture_files();
-        goto err;
+        return -1;
     }
 
-    capfile->file_size += sizeof(hdr);
+    return 0;
+}
+
+static int open_pcap(struct capfile *capfile, char const *path, struct timeval const *now)
+{
+    int ret = -1;
+
+    mutex_lock(&capfile->lock);
+
+    if (0 != capfile_open(capfile, path, now)) goto err;
+    if (0 != pcap_write_header(capfile)) goto err;
+
+    capfile->file_size += sizeof(struct pcap_file_header);
     ret = 0;
 err:
     mutex_unlock(&capfile->lock);
@@ -245,11 +276,7 @@ static int write_pcap(struct capfile *capfile, struct proto_info const *info, si
 
     size_t cap_len = capfile->cap_len ? MIN(cap_len_, capfile->cap_len) : cap_len_;
 
-    struct pcap_sf_pkthdr {
-        uint32_t ts_sec, ts_usec;
-        bpf_u_int32 caplen;
-        bpf_u_int32 len;
-    } pkthdr = {
+    struct pcap_sf_pkthdr pkthdr = {
         .ts_sec  = cap->tv.tv_sec,
         .ts_usec = cap->tv.tv_usec,
         .caplen  = cap_len,
@@ -273,8 +300,12 @@ err:
     return err;
 }
 
+static struct capfile *capfile_new_pcap_async(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now);
+
 struct capfile *capfile_new_pcap(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now)
 {
+    if (async_capfiles) return capfile_new_pcap_async(path, max_pkts, max_size, max_secs, cap_len, rotation, now);
+
     static struct capfile_ops const capfile_pcap_ops = {
         .open  = open_pcap,
         .close = capfile_close,
@@ -284,6 +315,755 @@ struct capfile *capfile_new_pcap(char const *path, unsigned max_pkts, size_t max
     return capfile_new(&capfile_pcap_ops, path, max_pkts, max_size, max_secs, cap_len, rotation, now);
 }
 
+/*
+ * Asynchronous PCAP files
+ *
+ * Parsing threads merely copy packets into a buffer, and a full buffer is then written by a
+ * thread dedicated to this capfile, which is also the one closing, fsyncing and rotating the
+ * files. Parsing threads only decide when to rotate (so that limits are as precise as with
+ * synchronous capfiles), by marking the buffer after which the file must be closed.
+ */
+
+#define CAPFILE_BUF_SIZE (1024*1024)
+#define CAPFILE_NB_BUFS 4
+
+struct capfile_buf {
+    STAILQ_ENTRY(capfile_buf) entry;
+    size_t len;         ///< How many bytes are used
+    enum capfile_buf_then {
+        KEEP_OPEN, CLOSE, ROTATE,
+    } then;             ///< What to do with the file once this buffer is written
+    uint8_t *data;      ///< CAPFILE_BUF_SIZE bytes
+};
+
+STAILQ_HEAD(capfile_bufs, capfile_buf);
+
+struct capfile_async {
+    struct capfile capfile;
+    struct capfile_buf *cur;        ///< Where parsing threads copy packets (protected by capfile.lock)
+    bool closed;                    ///< Once the last file was closed (protected by capfile.lock)
+    pthread_t writer_pth;
+    pthread_mutex_t mutex;          ///< Protects the lists below and quit (always taken after capfile.lock)
+    pthread_cond_t to_write_cond;   ///< Signaled when a buffer is queued for writing
+    pthread_cond_t free_cond;       ///< Signaled when a buffer was written
+    struct capfile_bufs to_write, free;
+    bool quit;                      ///< Set when the writer must quit once all is written
+    struct capfile_buf bufs[CAPFILE_NB_BUFS];
+};
+
+/* Queue the current buffer for writing and get a new one.
+ * Caller must own the capfile->lock. If wait is false and there is no free buffer then do nothing
+ * and return -1. Otherwise, wait for the writer thread. */
+static int capfile_async_seal(struct capfile_async *async, enum capfile_buf_then then, bool wait)
+{
+    int ret = -1;
+
+    WITH_PTH_MUTEX(&async->mutex) {
+        if (! wait && STAILQ_EMPTY(&async->free)) continue;  // exits the WITH_PTH_MUTEX loop
+        async->cur->then = then;
+        STAILQ_INSERT_TAIL(&async->to_write, async->cur, entry);
+        pthread_cond_signal(&async->to_write_cond);
+        while (STAILQ_EMPTY(&async->free)) {
+            // The disk is slower than the network: the best we can do is to wait
+            pthread_cond_wait(&async->free_cond, &async->mutex);
+        }
+        async->cur = STAILQ_FIRST(&async->free);
+        STAILQ_REMOVE_HEAD(&async->free, entry);
+        async->cur->len = 0;
+        ret = 0;
+    }
+
+    return ret;
+}
+
+// Called by the writer thread only (which owns the fd)
+static void capfile_async_write_buf(struct capfile_async *async, struct capfile_buf *buf)
+{
+    struct capfile *capfile = &async->capfile;
+
+    if (capfile->fd >= 0 && buf->len > 0) {
+        (void)file_write(capfile->fd, buf->data, buf->len);
+    }
+
+    if (buf->then == KEEP_OPEN) return;
+
+    if (capfile->fd >= 0) {
+        if (0 != fdatasync(capfile->fd)) {
+            SLOG(LOG_ERR, "Cannot fdatasync capfile %s: %s", capfile->path, strerror(errno));
+        }
+        file_close(capfile->fd);
+        capfile->fd = -1;
+        dec_capture_files();
+    }
+
+    if (buf->then == ROTATE) {
+        SLOG(LOG_DEBUG, "Rotating capfile %s", capfile->path);
+        if (0 == capfile_open_fd(capfile, capfile_path(capfile))) {
+            (void)pcap_write_header(capfile);
+        }
+    }
+}
+
+static void *capfile_async_writer(void *async_)
+{
+    struct capfile_async *async = async_;
+    struct capfile *capfile = &async->capfile;
+    set_thread_name("J-capfile");
+
+    while (1) {
+        struct capfile_buf *buf = NULL;
+        bool quit = false;
+
+        WITH_PTH_MUTEX(&async->mutex) {
+            if (STAILQ_EMPTY(&async->to_write) && !async->quit) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec ++;
+                (void)pthread_cond_timedwait(&async->to_write_cond, &async->mutex, &ts);
+            }
+            buf = STAILQ_FIRST(&async->to_write);
+            if (buf) STAILQ_REMOVE_HEAD(&async->to_write, entry);
+            quit = async->quit;
+        }
+
+        if (! buf) {
+            if (quit) break;
+            /* Nothing came for a while: do not keep the packets of a quiet link in memory.
+             * But a parsing thread may own the lock while it waits for us to free a buffer,
+             * in which case the link is not that quiet anyway. */
+            if (0 != mutex_trylock(&capfile->lock)) continue;
+            if (async->cur->len > 0) (void)capfile_async_seal(async, KEEP_OPEN, false);
+            mutex_unlock(&capfile->lock);
+            continue;
+        }
+
+        capfile_async_write_buf(async, buf);
+
+        WITH_PTH_MUTEX(&async->mutex) {
+            STAILQ_INSERT_TAIL(&async->free, buf, entry);
+            pthread_cond_signal(&async->free_cond);
+        }
+    }
+
+    return NULL;
+}
+
+static int write_pcap_async(struct capfile *capfile, struct proto_info const *info, size_t cap_len_, uint8_t const *pkt, struct timeval const *now)
+{
+    struct capfile_async *async = DOWNCAST(capfile, capfile, capfile_async);
+
+    SLOG(LOG_DEBUG, "Add a packet of size %zu into capfile %s", cap_len_, capfile->path);
+    ASSIGN_INFO_CHK(cap, info, -1);
+
+    size_t const cap_len = MIN(capfile->cap_len ? MIN(cap_len_, capfile->cap_len) : cap_len_, CAPFILE_BUF_SIZE - sizeof(struct pcap_sf_pkthdr));
+    size_t const rec_len = sizeof(struct pcap_sf_pkthdr) + cap_len;
+    struct pcap_sf_pkthdr pkthdr = {
+        .ts_sec  = cap->tv.tv_sec,
+        .ts_usec = cap->tv.tv_usec,
+        .caplen  = cap_len,
+        .len     = cap->info.payload,
+    };
+
+    int err = -1;
+    mutex_lock(&capfile->lock);
+    if (async->closed) goto err;
+
+    if (async->cur->len + rec_len > CAPFILE_BUF_SIZE) (void)capfile_async_seal(async, KEEP_OPEN, true);
+
+    memcpy(async->cur->data + async->cur->len, &pkthdr, sizeof(pkthdr));
+    memcpy(async->cur->data + async->cur->len + sizeof(pkthdr), pkt, cap_len);
+    async->cur->len += rec_len;
+
+    capfile->nb_pkts++;
+    capfile->file_size += rec_len;
+
+    if (
+        (capfile->max_pkts && capfile->nb_pkts >= capfile->max_pkts) ||
+        (capfile->max_size && capfile->file_size >= capfile->max_size) ||
+        (capfile->max_secs && timeval_sub(now, &capfile->start) > 1000000LL * capfile->max_secs)
+    ) {
+        SLOG(LOG_DEBUG, "Closing capfile %s after %u packets", capfile->path, capfile->nb_pkts);
+        (void)capfile_async_seal(async, capfile->rotation ? ROTATE : CLOSE, true);
+        if (capfile->rotation) {
+            capfile->nb_pkts = 0;
+            capfile->file_size = sizeof(struct pcap_file_header);
+            capfile->start = *now;
+        } else {
+            async->closed = true;
+        }
+    }
+
+    err = 0;
+err:
+    mutex_unlock(&capfile->lock);
+    return err;
+}
+
+static void capfile_async_close(struct capfile *capfile)
+{
+    struct capfile_async *async = DOWNCAST(capfile, capfile, capfile_async);
+
+    mutex_lock(&capfile->lock);
+    if (! async->closed) {
+        (void)capfile_async_seal(async, CLOSE, true);
+        async->closed = true;
+    }
+    mutex_unlock(&capfile->lock);
+}
+
+static void capfile_async_del(struct capfile *capfile)
+{
+    struct capfile_async *async = DOWNCAST(capfile, capfile, capfile_async);
+
+    // Write what's left, then wait for the writer
+    mutex_lock(&capfile->lock);
+    if (async->cur->len > 0) (void)capfile_async_seal(async, KEEP_OPEN, true);
+    mutex_unlock(&capfile->lock);
+    WITH_PTH_MUTEX(&async->mutex) {
+        async->quit = true;
+        pthread_cond_signal(&async->to_write_cond);
+    }
+    (void)pthread_join(async->writer_pth, NULL);
+
+    capfile_dtor(capfile);
+    pthread_cond_destroy(&async->free_cond);
+    pthread_cond_destroy(&async->to_write_cond);
+    pthread_mutex_destroy(&async->mutex);
+    for (unsigned b = 0; b < NB_ELEMS(async->bufs); b++) free(async->bufs[b].data);
+    objfree(async);
+}
+
+static struct capfile *capfile_new_pcap_async(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now)
+{
+    static struct capfile_ops const capfile_pcap_async_ops = {
+        .open  = open_pcap,     // only used for the first file, by the ctor
+        .close = capfile_async_close,
+        .write = write_pcap_async,
+        .del   = capfile_async_del,
+    };
+
+    struct capfile_async *async = objalloc_nice(sizeof(*async), "capfiles");
+    if (! async) return NULL;
+
+    STAILQ_INIT(&async->free);
+    STAILQ_INIT(&async->to_write);
+    unsigned b;
+    for (b = 0; b < NB_ELEMS(async->bufs); b++) {
+        async->bufs[b].data = malloc(CAPFILE_BUF_SIZE); // big: no need for objalloc
+        if (! async->bufs[b].data) {
+            SLOG(LOG_ERR, "Cannot malloc capfile buffers");
+            goto err1;
+        }
+        async->bufs[b].len = 0;
+        STAILQ_INSERT_TAIL(&async->free, async->bufs+b, entry);
+    }
+    async->cur = STAILQ_FIRST(&async->free);
+    STAILQ_REMOVE_HEAD(&async->free, entry);
+    async->closed = false;
+    async->quit = false;
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->to_write_cond, NULL);
+    pthread_cond_init(&async->free_cond, NULL);
+
+    if (0 != capfile_ctor(&async->capfile, &capfile_pcap_async_ops, path, max_pkts, max_size, max_secs, cap_len, rotation, now)) goto err2;
+
+    int err = pthread_create(&async->writer_pth, NULL, capfile_async_writer, async);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot start writer thread for capfile %s: %s", path, strerror(err));
+        capfile_dtor(&async->capfile);
+        goto err2;
+    }
+
+    return &async->capfile;
+
+err2:
+    pthread_cond_destroy(&async->free_cond);
+    pthread_cond_destroy(&async->to_write_cond);
+    pthread_mutex_destroy(&async->mutex);
+err1:
+    while (b-- > 0) free(async->bufs[b].data);
+    objfree(async);
+    return NULL;
+}
+
+/*
+ * PCAPNG files, with an index
+ *
+ * Packets are written as Enhanced Packet Blocks, after a Section Header Block and a single
+ * Interface Description Block. Every PCAPNG_CHUNK_PKTS packets (and when the file is closed)
+ * a record is appended to the index file (path.idx) for this chunk of the pcapng file, with its
+ * time range and the offsets of the packets of each flow. Readers can then skip the chunks out of
+ * the time range they are interested in, and seek directly to the packets of the flows they want.
+ *
+ * The index file starts with PCAPNG_INDEX_MAGIC, followed by the chunk records, all integers
+ * being serialized in little endian:
+ * - 4 bytes: length of the rest of the record;
+ * - 8 bytes: offset of the chunk in the pcapng file;
+ * - 4 bytes: number of packets;
+ * - 4+4 bytes: timestamp (sec, usec) of the first packet, then 4+4 bytes for the last one;
+ * - 4 bytes: number of flows, then for each flow:
+ *   - 1 byte: IP protocol (0 if not IP);
+ *   - the two addresses (as ip_addr_serialize, or a single 0 byte if not IP);
+ *   - 2+2 bytes: the two ports (0 if not TCP/UDP);
+ *   - 4 bytes: number of packets, then their offsets relative to the chunk (4 bytes each).
+ */
+
+#define PCAPNG_CHUNK_PKTS 4096
+#define PCAPNG_INDEX_MAGIC "JKIDX1\0\0"
+
+struct pcapng_shb {
+    uint32_t type, len, byte_order;
+    uint16_t major, minor;
+    int64_t section_len;
+    uint32_t len_;
+} packed_;
+
+struct pcapng_idb {
+    uint32_t type, len;
+    uint16_t linktype, reserved;
+    uint32_t snaplen;
+    uint32_t len_;
+} packed_;
+
+struct pcapng_epb {
+    uint32_t type, len;
+    uint32_t iface, ts_high, ts_low;
+    uint32_t caplen, len_on_wire;
+} packed_;
+
+/// A flow, the same for both directions
+struct pcapng_flow {
+    uint8_t protocol;
+    struct ip_addr addr[2];     ///< Smallest first (family is AF_UNSPEC if not IP)
+    uint16_t port[2];           ///< In the order of addr
+};
+
+struct pcapng_posting {
+    struct pcapng_flow flow;
+    uint32_t offset;            ///< Of the packet block, relative to the chunk
+};
+
+struct capfile_pcapng {
+    struct capfile capfile;
+    int idx_fd;                 ///< The index of the current file (or -1)
+    size_t chunk_start;         ///< Offset of the current chunk in the current file
+    unsigned chunk_nb_pkts;
+    struct timeval chunk_min, chunk_max;    ///< Time bounds of the packets of the current chunk (written out of order)
+    struct pcapng_posting *postings;    ///< PCAPNG_CHUNK_PKTS of them
+};
+
+static void pcapng_flow_ctor(struct pcapng_flow *flow, struct proto_info const *info)
+{
+    memset(flow, 0, sizeof(*flow));
+    flow->addr[0].family = flow->addr[1].family = AF_UNSPEC;
+
+    ASSIGN_INFO_OPT2(ip, ip6, info);
+    if (! ip) ip = ip6;
+    if (! ip) return;
+
+    flow->protocol = ip->key.protocol;
+    flow->addr[0] = ip->key.addr[0];
+    flow->addr[1] = ip->key.addr[1];
+
+    ASSIGN_INFO_OPT2(tcp, udp, info);
+    if (tcp) {
+        flow->port[0] = tcp->key.port[0];
+        flow->port[1] = tcp->key.port[1];
+    } else if (udp) {
+        flow->port[0] = udp->key.port[0];
+        flow->port[1] = udp->key.port[1];
+    }
+
+    // Same flow for both directions
+    int const c = ip_addr_cmp(flow->addr+0, flow->addr+1);
+    if (c > 0 || (c == 0 && flow->port[0] > flow->port[1])) {
+        struct ip_addr const a = flow->addr[0];
+        flow->addr[0] = flow->addr[1];
+        flow->addr[1] = a;
+        uint16_t const p = flow->port[0];
+        flow->port[0] = flow->port[1];
+        flow->port[1] = p;
+    }
+}
+
+static int pcapng_flow_cmp(struct pcapng_flow const *a, struct pcapng_flow const *b)
+{
+    if (a->protocol != b->protocol) return a->protocol < b->protocol ? -1 : 1;
+    for (unsigned i = 0; i < 2; i++) {
+        if (a->addr[i].family != AF_UNSPEC || b->addr[i].family != AF_UNSPEC) {
+            int const c = ip_addr_cmp(a->addr+i, b->addr+i);
+            if (c) return c;
+        }
+        if (a->port[i] != b->port[i]) return a->port[i] < b->port[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static int posting_cmp(void const *a_, void const *b_)
+{
+    struct pcapng_posting const *a = a_, *b = b_;
+    int const c = pcapng_flow_cmp(&a->flow, &b->flow);
+    if (c) return c;
+    return a->offset < b->offset ? -1 : a->offset > b->offset;
+}
+
+static void pcapng_addr_serialize(struct ip_addr const *addr, uint8_t **buf)
+{
+    if (addr->family == AF_UNSPEC) serialize_1(buf, 0);
+    else ip_addr_serialize(addr, buf);
+}
+
+// Append the record of the current chunk to the index, and start a new chunk
+static void pcapng_index_chunk(struct capfile_pcapng *pcapng)
+{
+    if (pcapng->idx_fd < 0 || pcapng->chunk_nb_pkts == 0) goto reset;
+
+    qsort(pcapng->postings, pcapng->chunk_nb_pkts, sizeof(*pcapng->postings), posting_cmp);
+
+    // Worst case is one flow per packet, of two IPv6 addresses
+    size_t const max_len = 4+8+4+16+4 + pcapng->chunk_nb_pkts * (1 + 2*17 + 4 + 4 + 4);
+    uint8_t *const rec = malloc(max_len);   // short lived: no need for objalloc
+    if (! rec) {
+        SLOG(LOG_ERR, "Cannot malloc %zu bytes for indexing capfile %s", max_len, pcapng->capfile.path);
+        goto reset;
+    }
+
+    uint8_t *ptr = rec + 4; // length is written last
+    serialize_8(&ptr, pcapng->chunk_start);
+    serialize_4(&ptr, pcapng->chunk_nb_pkts);
+    serialize_4(&ptr, pcapng->chunk_min.tv_sec);
+    serialize_4(&ptr, pcapng->chunk_min.tv_usec);
+    serialize_4(&ptr, pcapng->chunk_max.tv_sec);
+    serialize_4(&ptr, pcapng->chunk_max.tv_usec);
+    uint8_t *nb_flows_ptr = ptr;
+    ptr += 4;
+
+    unsigned nb_flows = 0;
+    for (unsigned p = 0; p < pcapng->chunk_nb_pkts; ) {
+        struct pcapng_flow const *flow = &pcapng->postings[p].flow;
+        unsigned n;
+        for (n = 1; p + n < pcapng->chunk_nb_pkts && 0 == pcapng_flow_cmp(flow, &pcapng->postings[p+n].flow); n++) ;
+        serialize_1(&ptr, flow->protocol);
+        pcapng_addr_serialize(flow->addr+0, &ptr);
+        pcapng_addr_serialize(flow->addr+1, &ptr);
+        serialize_2(&ptr, flow->port[0]);
+        serialize_2(&ptr, flow->port[1]);
+        serialize_4(&ptr, n);
+        for (unsigned i = 0; i < n; i++) serialize_4(&ptr, pcapng->postings[p+i].offset);
+        nb_flows ++;
+        p += n;
+    }
+    assert((size_t)(ptr - rec) <= max_len);
+    serialize_4(&nb_flows_ptr, nb_flows);
+    size_t const len = ptr - rec;
+    ptr = rec;
+    serialize_4(&ptr, len - 4);
+
+    if (0 != file_write(pcapng->idx_fd, rec, len)) {
+        SLOG(LOG_ERR, "Cannot write index of capfile %s, giving up indexing it", pcapng->capfile.path);
+        file_close(pcapng->idx_fd);
+        pcapng->idx_fd = -1;
+    }
+    free(rec);
+
+reset:
+    pcapng->chunk_start = pcapng->capfile.file_size;
+    pcapng->chunk_nb_pkts = 0;
+}
+
+static int open_pcapng(struct capfile *capfile, char const *path, struct timeval const *now)
+{
+    struct capfile_pcapng *pcapng = DOWNCAST(capfile, capfile, capfile_pcapng);
+    int ret = -1;
+
+    mutex_lock(&capfile->lock);
+
+    if (0 != capfile_open(capfile, path, now)) goto err;
+
+    struct pcapng_shb shb = {
+        .type = 0x0A0D0D0A, .len = sizeof(shb), .byte_order = 0x1A2B3C4D,
+        .major = 1, .minor = 0, .section_len = -1, .len_ = sizeof(shb),
+    };
+    struct pcapng_idb idb = {
+        .type = 1, .len = sizeof(idb), .linktype = DLT_EN10MB, .reserved = 0,
+        .snaplen = capfile->cap_len == 0 || capfile->cap_len > 65535 ? 65535 : capfile->cap_len,
+        .len_ = sizeof(idb),
+    };
+    struct iovec iov[] = {
+        { .iov_base = &shb, .iov_len = sizeof(shb), },
+        { .iov_base = &idb, .iov_len = sizeof(idb), },
+    };
+    if (0 != file_writev(capfile->fd, iov, NB_ELEMS(iov))) {
+        file_close(capfile->fd);
+        capfile->fd = -1;
+        dec_capture_files();
+        goto err;
+    }
+    capfile->file_size += sizeof(shb) + sizeof(idb);
+
+    // Without its index the pcapng is still usable, so do not fail
+    char const *idx_path = tempstr_printf("%s.idx", path);
+    pcapng->idx_fd = file_open(idx_path, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC);
+    if (pcapng->idx_fd >= 0 && 0 != file_write(pcapng->idx_fd, PCAPNG_INDEX_MAGIC, 8)) {
+        file_close(pcapng->idx_fd);
+        pcapng->idx_fd = -1;
+    }
+    pcapng->chunk_start = capfile->file_size;
+    pcapng->chunk_nb_pkts = 0;
+
+    ret = 0;
+err:
+    mutex_unlock(&capfile->lock);
+    return ret;
+}
+
+static void close_pcapng(struct capfile *capfile)
+{
+    struct capfile_pcapng *pcapng = DOWNCAST(capfile, capfile, capfile_pcapng);
+
+    mutex_lock(&capfile->lock);
+    pcapng_index_chunk(pcapng);
+    if (pcapng->idx_fd >= 0) {
+        file_close(pcapng->idx_fd);
+        pcapng->idx_fd = -1;
+    }
+    capfile_close(capfile);
+    mutex_unlock(&capfile->lock);
+}
+
+static int write_pcapng(struct capfile *capfile, struct proto_info const *info, size_t cap_len_, uint8_t const *pkt, struct timeval const *now)
+{
+    struct capfile_pcapng *pcapng = DOWNCAST(capfile, capfile, capfile_pcapng);
+    if (capfile->fd < 0) return -1;
+
+    int err = -1;
+    SLOG(LOG_DEBUG, "Add a packet of size %zu into capfile %s", cap_len_, capfile->path);
+    ASSIGN_INFO_CHK(cap, info, -1);
+
+    mutex_lock(&capfile->lock);
+
+    size_t const cap_len = capfile->cap_len ? MIN(cap_len_, capfile->cap_len) : cap_len_;
+    size_t const pad = (4 - cap_len % 4) % 4;
+    uint32_t const block_len = sizeof(struct pcapng_epb) + cap_len + pad + 4;
+    uint64_t const ts = cap->tv.tv_sec * 1000000ULL + cap->tv.tv_usec;
+
+    struct pcapng_epb epb = {
+        .type        = 6,
+        .len         = block_len,
+        .iface       = 0,
+        .ts_high     = ts >> 32,
+        .ts_low      = ts,
+        .caplen      = cap_len,
+        .len_on_wire = cap->info.payload,
+    };
+    uint8_t trailer[3 + 4] = { 0, 0, 0 };
+    memcpy(trailer + pad, &block_len, 4);
+
+    struct iovec iov[] = {
+        { .iov_base = &epb,        .iov_len = sizeof(epb), },
+        { .iov_base = (void *)pkt, .iov_len = cap_len, },
+        { .iov_base = trailer,     .iov_len = pad + 4, },
+    };
+    if (0 != file_writev(capfile->fd, iov, NB_ELEMS(iov))) goto err;
+
+    struct pcapng_posting *posting = pcapng->postings + pcapng->chunk_nb_pkts;
+    pcapng_flow_ctor(&posting->flow, info);
+    posting->offset = capfile->file_size - pcapng->chunk_start;
+    if (pcapng->chunk_nb_pkts++ == 0) {
+        pcapng->chunk_min = pcapng->chunk_max = cap->tv;
+    } else if (timeval_cmp(&cap->tv, &pcapng->chunk_min) < 0) {
+        pcapng->chunk_min = cap->tv;
+    } else if (timeval_cmp(&cap->tv, &pcapng->chunk_max) > 0) {
+        pcapng->chunk_max = cap->tv;
+    }
+
+    capfile->nb_pkts++;
+    capfile->file_size += block_len;
+
+    if (pcapng->chunk_nb_pkts >= PCAPNG_CHUNK_PKTS) pcapng_index_chunk(pcapng);
+
+    capfile_may_rotate(capfile, now);
+
+    err = 0;
+err:
+    mutex_unlock(&capfile->lock);
+    return err;
+}
+
+static void del_pcapng(struct capfile *capfile)
+{
+    struct capfile_pcapng *pcapng = DOWNCAST(capfile, capfile, capfile_pcapng);
+
+    close_pcapng(capfile);
+    capfile_dtor(capfile);
+    free(pcapng->postings);
+    objfree(pcapng);
+}
+
+struct capfile *capfile_new_pcapng(char const *path, unsigned max_pkts, size_t max_size, unsigned max_secs, size_t cap_len, unsigned rotation, struct timeval const *now)
+{
+    static struct capfile_ops const capfile_pcapng_ops = {
+        .open  = open_pcapng,
+        .close = close_pcapng,
+        .write = write_pcapng,
+        .del   = del_pcapng,
+    };
+
+    struct capfile_pcapng *pcapng = objalloc_nice(sizeof(*pcapng), "capfiles");
+    if (! pcapng) return NULL;
+
+    pcapng->idx_fd = -1;
+    pcapng->postings = malloc(PCAPNG_CHUNK_PKTS * sizeof(*pcapng->postings));  // big: no need for objalloc
+    if (! pcapng->postings) {
+        SLOG(LOG_ERR, "Cannot malloc capfile postings");
+        goto err1;
+    }
+
+    if (0 != capfile_ctor(&pcapng->capfile, &capfile_pcapng_ops, path, max_pkts, max_size, max_secs, cap_len, rotation, now)) goto err2;
+
+    return &pcapng->capfile;
+
+err2:
+    free(pcapng->postings);
+err1:
+    objfree(pcapng);
+    return NULL;
+}
+
+/*
+ * PCAPNG index lookups
+ */
+
+// Returns -1 if there is not enough bytes left
+static int pcapng_addr_deserialize(struct ip_addr *addr, uint8_t const **ptr, uint8_t const *end)
+{
+    if (*ptr >= end) return -1;
+    unsigned const version = **ptr;
+    if (version == 0) {
+        (*ptr) ++;
+        memset(addr, 0, sizeof(*addr));
+        addr->family = AF_UNSPEC;
+        return 0;
+    }
+    if (*ptr + 1 + (version == 6 ? 16 : 4) > end) return -1;
+    ip_addr_deserialize(addr, ptr);
+    return 0;
+}
+
+static bool pcapng_flow_match(struct pcapng_flow const *flow, struct capfile_index_query const *query)
+{
+    bool const want_addr = query->addr.family != AF_UNSPEC;
+    bool const want_port = query->port != 0;
+    if (! want_addr && ! want_port) return true;
+
+    for (unsigned i = 0; i < 2; i++) {
+        if (want_addr && (flow->addr[i].family == AF_UNSPEC || ! ip_addr_eq(flow->addr+i, &query->addr))) continue;
+        if (want_port && flow->port[i] != query->port) continue;
+        return true;
+    }
+    return false;
+}
+
+static int offset_cmp(void const *a_, void const *b_)
+{
+    off_t const *a = a_, *b = b_;
+    return *a < *b ? -1 : *a > *b;
+}
+
+ssize_t capfile_index_lookup(char const *path, struct capfile_index_query const *query, off_t **offsets_)
+{
+    char const *idx_path = tempstr_printf("%s.idx", path);
+    size_t len;
+    uint8_t *idx = file_load(idx_path, &len);
+    if (! idx) return -1;
+
+    ssize_t nb_offsets = -1;
+    off_t *offsets = NULL;
+    size_t max_offsets = 0;
+
+    if (len < 8 || 0 != memcmp(idx, PCAPNG_INDEX_MAGIC, 8)) {
+        SLOG(LOG_ERR, "File %s is not a capfile index", idx_path);
+        goto quit;
+    }
+
+    nb_offsets = 0;
+    uint8_t const *ptr = idx + 8, *const idx_end = idx + len;
+    unsigned nb_chunks = 0, nb_skipped = 0;
+    while (ptr + 4 <= idx_end) {
+        size_t const rec_len = deserialize_4(&ptr);
+        if (ptr + rec_len > idx_end || rec_len < 8+4+16+4) {
+            SLOG(LOG_INFO, "Index %s is truncated after %u chunks", idx_path, nb_chunks);
+            break;
+        }
+        uint8_t const *const end = ptr + rec_len;
+        nb_chunks ++;
+
+        off_t const chunk_start = deserialize_8(&ptr);
+        (void)deserialize_4(&ptr);  // nb_pkts
+        struct timeval first, last;
+        first.tv_sec = deserialize_4(&ptr);
+        first.tv_usec = deserialize_4(&ptr);
+        last.tv_sec = deserialize_4(&ptr);
+        last.tv_usec = deserialize_4(&ptr);
+        if (
+            (timeval_is_set(&query->stop) && timeval_cmp(&first, &query->stop) > 0) ||
+            (timeval_is_set(&query->start) && timeval_cmp(&last, &query->start) < 0)
+        ) {
+            nb_skipped ++;
+            ptr = end;
+            continue;
+        }
+
+        unsigned const nb_flows = deserialize_4(&ptr);
+        for (unsigned f = 0; f < nb_flows; f++) {
+            struct pcapng_flow flow;
+            if (ptr >= end) goto corrupted;
+            flow.protocol = deserialize_1(&ptr);
+            if (0 != pcapng_addr_deserialize(flow.addr+0, &ptr, end)) goto corrupted;
+            if (0 != pcapng_addr_deserialize(flow.addr+1, &ptr, end)) goto corrupted;
+            if (ptr + 2+2+4 > end) goto corrupted;
+            flow.port[0] = deserialize_2(&ptr);
+            flow.port[1] = deserialize_2(&ptr);
+            unsigned const nb_pkts = deserialize_4(&ptr);
+            if (ptr + 4*(size_t)nb_pkts > end) goto corrupted;
+            if (! pcapng_flow_match(&flow, query)) {
+                ptr += 4*(size_t)nb_pkts;
+                continue;
+            }
+            if ((size_t)nb_offsets + nb_pkts > max_offsets) {
+                size_t const new_max = MAX(2*max_offsets, (size_t)nb_offsets + nb_pkts);
+                off_t *const new_offsets = realloc(offsets, new_max * sizeof(*offsets));
+                if (! new_offsets) {
+                    SLOG(LOG_ERR, "Cannot realloc %zu offsets", new_max);
+                    nb_offsets = -1;
+                    goto quit;
+                }
+                offsets = new_offsets;
+                max_offsets = new_max;
+            }
+            for (unsigned p = 0; p < nb_pkts; p++) offsets[nb_offsets++] = chunk_start + deserialize_4(&ptr);
+        }
+        ptr = end;
+        continue;
+corrupted:
+        SLOG(LOG_ERR, "Index %s is corrupted in chunk %u, ignoring the rest of it", idx_path, nb_chunks);
+        break;
+    }
+
+    SLOG(LOG_DEBUG, "Found %zd packets in %u chunks of %s (%u skipped)", nb_offsets, nb_chunks, path, nb_skipped);
+    // Flows are interleaved, and so are the chunks of a same flow
+    if (nb_offsets > 0) qsort(offsets, nb_offsets, sizeof(*offsets), offset_cmp);
+
+quit:
+    free(idx);
+    if (nb_offsets < 0) {
+        free(offsets);
+        offsets = NULL;
+    }
+    *offsets_ = offsets;
+    return nb_offsets;
+}
+
 /*
  * CSV files
  */
@@ -379,6 +1159,7 @@ void capfile_init(void)
 
     log_category_capfile_init();
     ext_param_max_capture_files_init();
+    ext_param_async_capfiles_init();
     mutex_ctor(&capfiles_lock, "capfiles");
 
     ext_function_ctor(&sg_capfile_names,
@@ -398,6 +1179,7 @@ void capfile_fini(void)
     mutex_unlock(&capfiles_lock);
 
     mutex_dtor(&capfiles_lock);
+    ext_param_async_capfiles_fini();
     ext_param_max_capture_files_fini();
     log_category_capfile_fini();
 
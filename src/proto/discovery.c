@@ -19,12 +19,17 @@
  */
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 #include <inttypes.h>
 #include "junkie/cpp.h"
 #include "junkie/tools/ext.h"
 #include "junkie/tools/log.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/mallocer.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/ref.h"
 #include "junkie/netmatch.h"
 #include "junkie/proto/serialize.h"
 #include "junkie/proto/cnxtrack.h"
@@ -91,22 +96,47 @@ static void discovery_deserialize(struct proto_info *info_, uint8_t const **buf)
  * Proto signatures
  */
 
+// Protects the list of signatures (which is only used to rebuild the matcher)
+static struct mutex signatures_lock;
 static LIST_HEAD(proto_signatures, proto_signature) proto_signatures;
 
+// Longer prefixes are truncated, which only makes the matcher less selective
+#define SIG_PREFIX_MAX 8
+
 struct proto_signature {
     LIST_ENTRY(proto_signature) entry;
     struct discovery_protocol protocol;
     struct netmatch_filter filter;
     struct proto *actual_proto;
+    // If not any_payload, this signature can only match payloads starting with one of these prefixes
+    bool any_payload;
+    unsigned nb_prefixes;
+    struct sig_prefix {
+        unsigned len;
+        uint8_t bytes[SIG_PREFIX_MAX];
+    } *prefixes;
+    uint64_t nb_tries, nb_matches;
 };
 
-static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname)
+static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname, bool any_payload, unsigned nb_prefixes, struct sig_prefix const *prefixes)
 {
     SLOG(LOG_DEBUG, "Constructing proto_signature@%p", sig);
     sig->protocol.id = proto_id;
     sig->protocol.trust = trust;
     snprintf(sig->protocol.name, sizeof(sig->protocol.name), "%s", proto_name);
+    sig->any_payload = any_payload;
+    sig->nb_prefixes = 0;
+    sig->prefixes = NULL;
+    sig->nb_tries = sig->nb_matches = 0;
+    if (! any_payload && nb_prefixes > 0) {
+        MALLOCER(sig_prefixes);
+        sig->prefixes = MALLOC(sig_prefixes, nb_prefixes * sizeof(*sig->prefixes));
+        if (! sig->prefixes) return -1;
+        memcpy(sig->prefixes, prefixes, nb_prefixes * sizeof(*sig->prefixes));
+        sig->nb_prefixes = nb_prefixes;
+    }
     if (0 != netmatch_filter_ctor(&sig->filter, filter_libname)) {
+        if (sig->prefixes) FREE(sig->prefixes);
         return -1;
     }
     // Look for a proper proto with same name to handle this payload
@@ -116,11 +146,11 @@ static int proto_signature_ctor(struct proto_signature *sig, uint16_t proto_id,
     return 0;
 }
 
-static struct proto_signature *proto_signature_new(uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname)
+static struct proto_signature *proto_signature_new(uint16_t proto_id, char const *proto_name, enum discovery_trust trust, char const *filter_libname, bool any_payload, unsigned nb_prefixes, struct sig_prefix const *prefixes)
 {
     struct proto_signature *sig = objalloc(sizeof(*sig), "proto_signature");
     if (! sig) return NULL;
-    if (0 != proto_signature_ctor(sig, proto_id, proto_name, trust, filter_libname)) {
+    if (0 != proto_signature_ctor(sig, proto_id, proto_name, trust, filter_libname, any_payload, nb_prefixes, prefixes)) {
         objfree(sig);
         return NULL;
     }
@@ -132,6 +162,10 @@ static void proto_signature_dtor(struct proto_signature *sig)
     SLOG(LOG_DEBUG, "Destructing proto_signature@%p", sig);
     LIST_REMOVE(sig, entry);
     netmatch_filter_dtor(&sig->filter);
+    if (sig->prefixes) {
+        FREE(sig->prefixes);
+        sig->prefixes = NULL;
+    }
 }
 
 static void proto_signature_del(struct proto_signature *sig)
@@ -140,6 +174,189 @@ static void proto_signature_del(struct proto_signature *sig)
     objfree(sig);
 }
 
+/*
+ * Signature matcher
+ *
+ * Signatures are tried in turn (most recent first) until one matches, but most of them
+ * can only match payloads starting with a few known prefixes. So we merge all these
+ * prefixes in a trie that we walk along the first bytes of the payload: each node
+ * gives the (ordered) list of the signatures that may match, ie. those which prefix
+ * ends on the path to this node and those that may match any payload. Only these
+ * candidates have their match function called.
+ * The matcher is immutable, and replaced as a whole whenever the signatures change.
+ */
+
+struct sig_matcher {
+    struct ref ref;                     // Retired matchers are deleted by the doomer
+    struct proto_signature **cands;     // candidates of all nodes
+    unsigned nb_nodes;
+    struct sig_trie_node {
+        uint16_t children[256];         // index of the node for each next byte, or 0 (the root is nobody's child)
+        uint16_t parent;
+        unsigned first_cand, nb_cands;  // the candidates of this node in cands
+    } nodes[];                          // the root first, then parents before children
+};
+
+static struct sig_matcher *volatile sig_matcher;   // NULL when there are no signatures
+
+static void sig_matcher_del(struct ref *ref)
+{
+    struct sig_matcher *matcher = DOWNCAST(ref, ref, sig_matcher);
+    ref_dtor(&matcher->ref);
+    if (matcher->cands) FREE(matcher->cands);
+    FREE(matcher);
+}
+
+static void sig_trie_node_ctor(struct sig_trie_node *node, unsigned parent)
+{
+    memset(node->children, 0, sizeof(node->children));
+    node->parent = parent;
+    node->first_cand = node->nb_cands = 0;
+}
+
+// Add this prefix to the trie, and return the node where it ends
+static unsigned sig_matcher_add_prefix(struct sig_matcher *matcher, unsigned max_nodes, struct sig_prefix const *prefix)
+{
+    unsigned n = 0;
+    for (unsigned o = 0; o < prefix->len; o++) {
+        uint16_t *const child = matcher->nodes[n].children + prefix->bytes[o];
+        if (! *child) {
+            if (matcher->nb_nodes >= max_nodes) break; // then use a shorter prefix
+            sig_trie_node_ctor(matcher->nodes + matcher->nb_nodes, n);
+            *child = matcher->nb_nodes ++;
+        }
+        n = *child;
+    }
+    return n;
+}
+
+// Build the matcher for the current list of signatures (must own signatures_lock)
+static struct sig_matcher *sig_matcher_new(void)
+{
+    MALLOCER(sig_matchers);
+
+    unsigned nb_sigs = 0, max_nodes = 1;
+    struct proto_signature *sig;
+    LIST_FOREACH(sig, &proto_signatures, entry) {
+        nb_sigs ++;
+        for (unsigned p = 0; p < sig->nb_prefixes; p++) max_nodes += sig->prefixes[p].len;
+    }
+    if (nb_sigs == 0) return NULL;
+    if (max_nodes > UINT16_MAX) max_nodes = UINT16_MAX;
+
+    struct sig_matcher *matcher = MALLOC(sig_matchers, sizeof(*matcher) + max_nodes * sizeof(matcher->nodes[0]));
+    if (! matcher) return NULL;
+    matcher->cands = NULL;
+    matcher->nb_nodes = 1;
+    sig_trie_node_ctor(matcher->nodes, 0);
+
+    // First the set of candidates of each node, as a bitmap of signature ranks
+    unsigned const nb_words = (nb_sigs + 63) / 64;
+    uint64_t *sets = MALLOC(sig_matchers, max_nodes * nb_words * sizeof(*sets));
+    struct proto_signature **sigs = MALLOC(sig_matchers, nb_sigs * sizeof(*sigs));
+    if (! sets || ! sigs) goto err;
+    memset(sets, 0, max_nodes * nb_words * sizeof(*sets));
+#   define SET_OF(n) (sets + (n) * nb_words)
+
+    unsigned rank = 0;
+    LIST_FOREACH(sig, &proto_signatures, entry) {
+        sigs[rank] = sig;
+        if (sig->any_payload) {
+            SET_OF(0)[rank / 64] |= UINT64_C(1) << (rank % 64);
+        } else {
+            for (unsigned p = 0; p < sig->nb_prefixes; p++) {
+                unsigned const n = sig_matcher_add_prefix(matcher, max_nodes, sig->prefixes + p);
+                SET_OF(n)[rank / 64] |= UINT64_C(1) << (rank % 64);
+            }
+        }
+        rank ++;
+    }
+
+    // Then inherit the candidates of the parents (which come first)
+    unsigned nb_cands = 0;
+    for (unsigned n = 0; n < matcher->nb_nodes; n++) {
+        struct sig_trie_node *const node = matcher->nodes + n;
+        for (unsigned w = 0; w < nb_words; w++) {
+            if (n > 0) SET_OF(n)[w] |= SET_OF(node->parent)[w];
+            for (uint64_t bits = SET_OF(n)[w]; bits; bits &= bits - 1) node->nb_cands ++;
+        }
+        node->first_cand = nb_cands;
+        nb_cands += node->nb_cands;
+    }
+
+    // And flatten these sets into lists, in rank order
+    if (nb_cands > 0) {
+        matcher->cands = MALLOC(sig_matchers, nb_cands * sizeof(*matcher->cands));
+        if (! matcher->cands) goto err;
+    }
+    for (unsigned n = 0; n < matcher->nb_nodes; n++) {
+        struct proto_signature **cand = matcher->cands + matcher->nodes[n].first_cand;
+        for (unsigned r = 0; r < nb_sigs; r++) {
+            if (SET_OF(n)[r / 64] & (UINT64_C(1) << (r % 64))) *cand++ = sigs[r];
+        }
+    }
+#   undef SET_OF
+
+    ref_ctor(&matcher->ref, sig_matcher_del);
+    SLOG(LOG_DEBUG, "New signature matcher for %u signatures, with %u nodes and %u candidates", nb_sigs, matcher->nb_nodes, nb_cands);
+    FREE(sigs);
+    FREE(sets);
+    return matcher;
+
+err:
+    if (sigs) FREE(sigs);
+    if (sets) FREE(sets);
+    if (matcher->cands) FREE(matcher->cands);
+    FREE(matcher);
+    return NULL;
+}
+
+// Replace the matcher after the signatures changed (must own signatures_lock)
+static int sig_matcher_update(void)
+{
+    struct sig_matcher *matcher = NULL;
+    if (! LIST_EMPTY(&proto_signatures)) {
+        matcher = sig_matcher_new();
+        if (! matcher) {
+            SLOG(LOG_ERR, "Cannot build the signature matcher, keeping previous one");
+            return -1;
+        }
+        __sync_synchronize();   // publish the matcher only once it's complete
+    }
+
+    struct sig_matcher *const prev = sig_matcher;
+    sig_matcher = matcher;
+    if (prev) unref(&prev->ref);
+    return 0;
+}
+
+// Returns the first signature matching this payload
+static struct proto_signature *sig_matcher_lookup(struct proto_info *parent, uint8_t const *packet, size_t cap_len)
+{
+    // We are in the multi region so the matcher can not be deleted under our feet
+    struct sig_matcher const *const matcher = sig_matcher;
+    if (! matcher) return NULL;
+
+    struct sig_trie_node const *node = matcher->nodes;
+    for (size_t o = 0; o < cap_len; o++) {
+        unsigned const child = node->children[packet[o]];
+        if (! child) break;
+        node = matcher->nodes + child;
+    }
+
+    struct npc_register rest = { .size = cap_len, .value = (uintptr_t)packet };
+    for (unsigned c = 0; c < node->nb_cands; c++) {
+        struct proto_signature *const sig = matcher->cands[node->first_cand + c];
+        (void)__sync_fetch_and_add(&sig->nb_tries, 1);
+        if (0 != sig->filter.match_fun(parent, rest, NULL, NULL)) {
+            (void)__sync_fetch_and_add(&sig->nb_matches, 1);
+            return sig;
+        }
+    }
+
+    return NULL;
+}
+
 static SCM high_sym, medium_sym, low_sym;
 
 static SCM scm_from_trust(enum discovery_trust t)
@@ -154,7 +371,7 @@ static SCM scm_from_trust(enum discovery_trust t)
 
 
 static struct ext_function sg_add_proto_signature;
-static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_)
+static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_, SCM prefixes_)
 {
     scm_dynwind_begin(0);
     char *name = scm_to_locale_string(name_);
@@ -174,7 +391,34 @@ static SCM g_add_proto_signature(SCM name_, SCM id_, SCM trust_, SCM filter_)
     char *libname = scm_to_locale_string(filter_);
     scm_dynwind_free(libname);
 
-    struct proto_signature *sig = proto_signature_new(id, name, trust, libname);
+    bool const any_payload = SCM_UNBNDP(prefixes_) || scm_is_false(prefixes_);
+    unsigned nb_prefixes = 0;
+    struct sig_prefix *prefixes = NULL;
+    if (! any_payload) {
+        long const len = scm_ilength(prefixes_);
+        if (len < 0) scm_wrong_type_arg_msg("add-proto-signature", 5, prefixes_, "list of strings");
+        if (len > 0) {
+            prefixes = scm_malloc(len * sizeof(*prefixes));
+            scm_dynwind_free(prefixes);
+        }
+        for (SCM p = prefixes_; ! scm_is_null(p); p = scm_cdr(p)) {
+            size_t sz;
+            char *bytes = scm_to_latin1_stringn(scm_car(p), &sz);
+            struct sig_prefix *const prefix = prefixes + nb_prefixes++;
+            prefix->len = MIN(sz, sizeof(prefix->bytes));
+            memcpy(prefix->bytes, bytes, prefix->len);
+            free(bytes);
+        }
+    }
+
+    mutex_lock(&signatures_lock);
+    struct proto_signature *sig = proto_signature_new(id, name, trust, libname, any_payload, nb_prefixes, prefixes);
+    if (sig && 0 != sig_matcher_update()) {
+        proto_signature_del(sig);
+        sig = NULL;
+    }
+    mutex_unlock(&signatures_lock);
+
     if (! sig) {
         scm_throw(scm_from_latin1_symbol("cannot-create-signature"), SCM_EOL);
     }
@@ -188,40 +432,46 @@ static SCM g_proto_signatures(void)
 {
     SCM ret = SCM_EOL;
     struct proto_signature *sig;
-    LIST_FOREACH(sig, &proto_signatures, entry) ret = scm_cons(scm_from_latin1_string(sig->protocol.name), ret);
+    WITH_LOCK(&signatures_lock) {
+        LIST_FOREACH(sig, &proto_signatures, entry) ret = scm_cons(scm_from_latin1_string(sig->protocol.name), ret);
+    }
     return ret;
 }
 
 static SCM proto_id_sym;
 static SCM proto_trust_sym;
 static SCM proto_libname_sym;
+static SCM nb_prefixes_sym;
+static SCM nb_tries_sym;
+static SCM nb_matches_sym;
 
 static struct ext_function sg_proto_signature_stats;
 static SCM g_proto_signature_stats(SCM name_)
 {
     char *name = scm_to_tempstr(name_);
+    SCM ret = SCM_UNSPECIFIED;
     struct proto_signature *sig;
-    LIST_LOOKUP(sig, &proto_signatures, entry, 0 == strcasecmp(sig->protocol.name, name));
-    if (! sig) return SCM_UNSPECIFIED;
-
-    return scm_list_3(
-        scm_cons(proto_id_sym, scm_from_uint(sig->protocol.id)),
-        scm_cons(proto_trust_sym, scm_from_trust(sig->protocol.trust)),
-        scm_cons(proto_libname_sym, scm_from_latin1_string(sig->filter.libname)));
+    WITH_LOCK(&signatures_lock) {
+        LIST_LOOKUP(sig, &proto_signatures, entry, 0 == strcasecmp(sig->protocol.name, name));
+        if (sig) ret = scm_list_n(
+            scm_cons(proto_id_sym, scm_from_uint(sig->protocol.id)),
+            scm_cons(proto_trust_sym, scm_from_trust(sig->protocol.trust)),
+            scm_cons(proto_libname_sym, scm_from_latin1_string(sig->filter.libname)),
+            scm_cons(nb_prefixes_sym, sig->any_payload ? SCM_BOOL_F : scm_from_uint(sig->nb_prefixes)),
+            scm_cons(nb_tries_sym, scm_from_uint64(sig->nb_tries)),
+            scm_cons(nb_matches_sym, scm_from_uint64(sig->nb_matches)),
+            SCM_UNDEFINED);
+    }
+    return ret;
 }
 
-
 /*
  * Parse
  */
 
 static enum proto_parse_status discovery_parse(struct parser *parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
-    // iter on all filters until one matches
-    struct proto_signature *sig;
-    struct npc_register rest = { .size = cap_len, .value = (uintptr_t)packet };
-    LIST_LOOKUP(sig, &proto_signatures, entry, 0 != sig->filter.match_fun(parent, rest, NULL, NULL));
-
+    struct proto_signature *sig = sig_matcher_lookup(parent, packet, cap_len);
     if (! sig) return PROTO_PARSE_ERR;
     SLOG(LOG_DEBUG, "Discovered protocol %s (which actual parser is %s)", sig->protocol.name, sig->actual_proto ? sig->actual_proto->name : "unknown");
 
@@ -280,7 +530,9 @@ static struct port_muxer udp_port_muxer;
 void discovery_init(void)
 {
     log_category_proto_discovery_init();
+    mutex_ctor(&signatures_lock, "signatures");
     LIST_INIT(&proto_signatures);
+    sig_matcher = NULL;
 
     static struct proto_ops const ops = {
         .parse       = discovery_parse,
@@ -301,26 +553,37 @@ void discovery_init(void)
     proto_id_sym      = scm_permanent_object(scm_from_latin1_symbol("id"));
     proto_trust_sym   = scm_permanent_object(scm_from_latin1_symbol("trust"));
     proto_libname_sym = scm_permanent_object(scm_from_latin1_symbol("libname"));
+    nb_prefixes_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-prefixes"));
+    nb_tries_sym      = scm_permanent_object(scm_from_latin1_symbol("nb-tries"));
+    nb_matches_sym    = scm_permanent_object(scm_from_latin1_symbol("nb-matches"));
 
     ext_function_ctor(&sg_add_proto_signature,
-        "add-proto-signature", 4, 0, 0, g_add_proto_signature,  // TODO: additional optional parameter indicating what regular parser to run next
-        "(add-proto-signature name id trust netmatch-filter): add this filter for given name/id with given trust level\n"
+        "add-proto-signature", 4, 1, 0, g_add_proto_signature,  // TODO: additional optional parameter indicating what regular parser to run next
+        "(add-proto-signature name id trust netmatch-filter [prefixes]): add this filter for given name/id with given trust level\n"
         "   trust can be either 'high, 'medium or 'low.\n"
-        "   netmatch-filter is the name of a sofile containing a \"match\" function (as returned by netmatch compiler)\n");
+        "   netmatch-filter is the name of a sofile containing a \"match\" function (as returned by netmatch compiler)\n"
+        "   prefixes, if given, is the list of strings one of which the payload must start with for the filter to possibly match\n"
+        "   (only the first bytes are used). Signatures sharing prefixes are tested together, so this speeds up discovery.\n");
     ext_function_ctor(&sg_proto_signatures,
         "proto-signatures", 0, 0, 0, g_proto_signatures,
         "(proto-signatures): list all currently defined protocol signatures.\n");
     ext_function_ctor(&sg_proto_signature_stats,
         "proto-signature-stats", 1, 0, 0, g_proto_signature_stats,
-        "(proto-signature-stats name): display the definition and some stats about this signature.\n");
+        "(proto-signature-stats name): display the definition and some stats about this signature:\n"
+        "   how many times its filter was tried and how many times it matched.\n");
 }
 
 void discovery_fini(void)
 {
+    if (sig_matcher) {
+        unref(&sig_matcher->ref);
+        sig_matcher = NULL;
+    }
     struct proto_signature *sig;
     while (NULL != (sig = LIST_FIRST(&proto_signatures))) {
         proto_signature_del(sig);
     }
+    mutex_dtor(&signatures_lock);
 
     port_muxer_dtor(&udp_port_muxer, &udp_port_muxers);
     port_muxer_dtor(&tcp_port_muxer, &tcp_port_muxers);
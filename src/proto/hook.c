@@ -17,16 +17,74 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
 #include "junkie/tools/log.h"
 #include "junkie/tools/mutex.h"
+#include "junkie/tools/objalloc.h"
+#include "junkie/tools/arena.h"
+#include "junkie/tools/tempstr.h"
 #include "junkie/proto/proto.h"
 
+/* Subscribers are called from every parsing thread for every packet, while they
+ * change very seldom. So callers merely read the current snapshot of the
+ * subscribers from within the multi region, while (un)subscriptions build a new
+ * snapshot and unref the previous one, which the doomer will delete once every
+ * caller is done with it. */
+
+static void hook_subscribers_del(struct ref *ref)
+{
+    struct hook_subscribers *snapshot = DOWNCAST(ref, ref, hook_subscribers);
+    ref_dtor(&snapshot->ref);
+    objfree(snapshot);
+}
+
+/* Build the snapshot of the subscribers of this hook but the one given (if any), which is NULL
+ * if there are none. Returns -1 if it cannot be allocated. Caller must own hook->mutex. */
+static int hook_snapshot_new(struct hook *hook, struct proto_subscriber const *without, struct hook_subscribers **snapshot_)
+{
+    unsigned nb_subscribers = 0;
+    struct proto_subscriber *sub;
+    LIST_FOREACH(sub, &hook->subscribers, entry) {
+        if (sub != without) nb_subscribers ++;
+    }
+
+    *snapshot_ = NULL;
+    if (nb_subscribers == 0) return 0;
+
+    struct hook_subscribers *snapshot = objalloc(sizeof(*snapshot) + nb_subscribers * sizeof(snapshot->subscribers[0]), "hook subscribers");
+    if (! snapshot) {
+        SLOG(LOG_ERR, "Cannot alloc subscribers of hook %s", hook->name);
+        return -1;
+    }
+    ref_ctor(&snapshot->ref, hook_subscribers_del);
+    snapshot->nb_subscribers = 0;
+    LIST_FOREACH(sub, &hook->subscribers, entry) {
+        if (sub != without) snapshot->subscribers[snapshot->nb_subscribers++] = sub;
+    }
+    *snapshot_ = snapshot;
+    return 0;
+}
+
+// Caller must own hook->mutex
+static void hook_snapshot_publish(struct hook *hook, struct hook_subscribers *snapshot)
+{
+    __sync_synchronize();   // publish the snapshot only once it's complete
+    struct hook_subscribers *const prev = hook->snapshot;
+    hook->snapshot = snapshot;
+    if (prev) unref(&prev->ref);
+}
+
 void hook_ctor(struct hook *hook, char const *name)
 {
     SLOG(LOG_DEBUG, "Constructing hook %s", name);
     hook->name = name;
     LIST_INIT(&hook->subscribers);
-    rwlock_ctor(&hook->lock, name);
+    hook->snapshot = NULL;
+    mutex_ctor(&hook->mutex, name);
 }
 
 void hook_dtor(struct hook *hook)
@@ -35,34 +93,320 @@ void hook_dtor(struct hook *hook)
     if (! LIST_EMPTY(&hook->subscribers)) {
         SLOG(LOG_NOTICE, "Some subscribers of hook %s are still registered", hook->name);
     }
-    rwlock_dtor(&hook->lock);
+    if (hook->snapshot) {
+        unref(&hook->snapshot->ref);
+        hook->snapshot = NULL;
+    }
+    mutex_dtor(&hook->mutex);
 }
 
-int hook_subscriber_ctor(struct hook *hook, struct proto_subscriber *sub, proto_cb_t *cb)
+static int hook_subscriber_add(struct hook *hook, struct proto_subscriber *sub, proto_cb_t *cb, struct hook_async *async)
 {
-    SLOG(LOG_DEBUG, "Construct a new subscriber for %s @%p", hook->name, sub);
+    int ret = 0;
     sub->cb = cb;
-    WITH_WRITE_LOCK(&hook->lock) {
+    sub->async = async;
+    WITH_LOCK(&hook->mutex) {
         LIST_INSERT_HEAD(&hook->subscribers, sub, entry);
+        struct hook_subscribers *snapshot;
+        if (0 != hook_snapshot_new(hook, NULL, &snapshot)) {
+            LIST_REMOVE(sub, entry);    // callers never saw it
+            ret = -1;
+        } else {
+            hook_snapshot_publish(hook, snapshot);
+        }
+    }
+    return ret;
+}
+
+int hook_subscriber_ctor(struct hook *hook, struct proto_subscriber *sub, proto_cb_t *cb)
+{
+    SLOG(LOG_DEBUG, "Construct a new subscriber for %s @%p", hook->name, sub);
+    return hook_subscriber_add(hook, sub, cb, NULL);
+}
+
+/*
+ * Asynchronous subscribers
+ */
+
+/* Each asynchronous subscriber has a ring of events, which is a bounded MPSC
+ * queue (after Dmitry Vyukov's): each slot has a seqnum telling for which
+ * position in the queue it's ready. A slot is free to be written at position
+ * pos when its seqnum is pos, and readable once its seqnum is pos+1. Parsing
+ * threads reserve a position with a CAS on tail then publish the slot, while
+ * the subscriber thread reads the slots in order and frees them for the next
+ * turn (pos + ring size).
+ * Events are merely copies of the proto_info stack and packet, which are
+ * stored in an arena of their own of the exact size needed rather than in the
+ * arena of the packet, which would stay pinned as a whole for as long as the
+ * event is queued. These bytes are accounted for, so that the queue is bounded
+ * in size as well as in number of events. */
+
+#define HOOK_ASYNC_BATCH 64
+
+struct hook_event {
+    unsigned long volatile seqnum;  ///< See above
+    struct proto_info *info;        ///< The copy of the proto_info stack
+    struct arena *arena;            ///< Where the copies are stored (we own a ref)
+    size_t size;                    ///< Bytes of this arena
+    size_t tot_cap_len;
+    uint8_t const *tot_packet;      ///< The copy of the packet
+    struct timeval now;
+};
+
+struct hook_async {
+    proto_cb_t *cb;                 ///< The actual callback
+    struct proto_subscriber *sub;
+    char const *name;
+    pthread_t pth;                  ///< The thread calling cb
+    unsigned long mask;             ///< Size of the ring - 1
+    unsigned long volatile tail;    ///< Next position to write (all parsing threads)
+    uint64_t volatile nb_dropped;   ///< Events dropped because the ring was full (or the event could not be copied)
+    size_t max_bytes;               ///< Max bytes of all queued events (0 for no bound)
+    size_t volatile nb_bytes;       ///< Bytes of the queued events
+    char pad_[64];                  ///< So that tail and head are not on the same cache line
+    unsigned long head;             ///< Next position to read (only used by our thread)
+    pthread_mutex_t mutex;          ///< Protects the condition below
+    pthread_cond_t cond;            ///< Signaled by parsing threads when our thread is sleeping
+    bool volatile sleeping;         ///< Set by our thread when it waits for more events
+    bool volatile quit;             ///< Set when no more events will be queued
+    struct hook_event ring[];
+};
+
+// The callback of asynchronous subscribers, called by the parsing threads
+static void hook_async_enqueue(struct proto_subscriber *sub, struct proto_info const *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
+{
+    struct hook_async *const async = sub->async;
+
+    struct arena *arena;
+    size_t size;
+    struct proto_info *const copy = proto_info_copy_stack_exact(info, tot_cap_len, &arena, &size);
+    if (! copy) {
+        (void)__sync_add_and_fetch(&async->nb_dropped, 1);
+        return;
+    }
+    uint8_t *packet = NULL;
+    if (tot_packet && tot_cap_len > 0) {
+        packet = arena_alloc(arena, tot_cap_len);
+        assert(packet); // proto_info_copy_stack_exact did reserve the room
+        memcpy(packet, tot_packet, tot_cap_len);
+    }
+
+    size_t const nb_bytes = __sync_add_and_fetch(&async->nb_bytes, size);
+    if (async->max_bytes && nb_bytes > async->max_bytes) {
+        SLOG(LOG_DEBUG, "Queue of asynchronous subscriber %s is over %zu bytes, dropping event", async->name, async->max_bytes);
+        goto drop;
+    }
+
+    // Reserve a slot
+    unsigned long pos = async->tail;
+    struct hook_event *ev;
+    while (1) {
+        ev = async->ring + (pos & async->mask);
+        long const dif = (long)(ev->seqnum - pos);
+        if (dif == 0) {
+            unsigned long const prev = __sync_val_compare_and_swap(&async->tail, pos, pos + 1);
+            if (prev == pos) break;
+            pos = prev;
+        } else if (dif < 0) {   // the slot was not read yet: the ring is full
+            SLOG(LOG_DEBUG, "Queue of asynchronous subscriber %s is full, dropping event", async->name);
+            goto drop;
+        } else {    // another thread took it
+            pos = async->tail;
+        }
+    }
+
+    ev->info = copy;
+    ev->arena = arena;
+    ev->size = size;
+    ev->tot_cap_len = packet ? tot_cap_len : 0;
+    ev->tot_packet = packet;
+    ev->now = *now;
+    __sync_synchronize();   // the event must be written before our thread can see it
+    ev->seqnum = pos + 1;
+
+    if (async->sleeping) {
+        WITH_PTH_MUTEX(&async->mutex) {
+            pthread_cond_signal(&async->cond);
+        }
+    }
+    return;
+
+drop:
+    (void)__sync_sub_and_fetch(&async->nb_bytes, size);
+    (void)__sync_add_and_fetch(&async->nb_dropped, 1);
+    arena_unref(&arena);
+}
+
+static bool hook_async_ready(struct hook_async const *async)
+{
+    return async->ring[async->head & async->mask].seqnum == async->head + 1;
+}
+
+/* Call the subscriber for a batch of events. Returns how many.
+ * Each event pins its data with its arena, so the callback is not called from
+ * within the multi region, which would otherwise hold back the doomer and every
+ * mono region for as long as the subscriber takes. */
+static unsigned hook_async_drain(struct hook_async *async)
+{
+    unsigned nb_events = 0;
+
+    while (nb_events < HOOK_ASYNC_BATCH && hook_async_ready(async)) {
+        struct hook_event *const ev = async->ring + (async->head & async->mask);
+        __sync_synchronize();   // read the event only once we have read its seqnum
+        async->cb(async->sub, ev->info, ev->tot_cap_len, ev->tot_packet, &ev->now);
+        arena_unref(&ev->arena);
+        (void)__sync_sub_and_fetch(&async->nb_bytes, ev->size);
+        __sync_synchronize();   // we are done with the event before it can be reused
+        ev->seqnum = async->head + async->mask + 1;
+        async->head ++;
+        nb_events ++;
+    }
+
+    return nb_events;
+}
+
+// Wait until a parsing thread queues something (or we are asked to quit)
+static void hook_async_wait(struct hook_async *async)
+{
+    WITH_PTH_MUTEX(&async->mutex) {
+        async->sleeping = true;
+        __sync_synchronize();
+        if (! hook_async_ready(async) && !async->quit) {
+            // Timed so that we do not care much about lost wakeups
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10000000;
+            if (ts.tv_nsec >= 1000000000) { ts.tv_sec ++; ts.tv_nsec -= 1000000000; }
+            (void)pthread_cond_timedwait(&async->cond, &async->mutex, &ts);
+        }
+        async->sleeping = false;
+    }
+}
+
+static void *hook_async_thread_(void *async_)
+{
+    struct hook_async *async = async_;
+    set_thread_name(tempstr_printf("J-async-%s", async->name));
+
+    while (1) {
+        if (hook_async_drain(async) > 0) continue;
+        if (async->quit) {
+            // Nothing can be queued anymore, but we may have missed the last events
+            __sync_synchronize();
+            while (hook_async_drain(async) > 0) ;
+            break;
+        }
+        hook_async_wait(async);
+    }
+
+    SLOG(LOG_DEBUG, "Asynchronous subscriber %s is quitting", async->name);
+    return NULL;
+}
+
+static void *hook_async_thread(void *async_)
+{
+    return scm_with_guile(hook_async_thread_, async_);
+}
+
+// Called once no more events can be queued
+static void hook_async_del(struct hook_async *async)
+{
+    async->quit = true;
+    WITH_PTH_MUTEX(&async->mutex) {
+        pthread_cond_signal(&async->cond);
+    }
+    (void)pthread_join(async->pth, NULL);
+
+    SLOG(LOG_INFO, "Asynchronous subscriber %s received %lu events, dropped %"PRIu64, async->name, async->tail, async->nb_dropped);
+
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    free(async);
+}
+
+int hook_subscriber_ctor_async(struct hook *hook, struct proto_subscriber *sub, proto_cb_t *cb, unsigned ring_size, size_t max_bytes, char const *name)
+{
+    SLOG(LOG_DEBUG, "Construct a new asynchronous subscriber %s for %s @%p", name, hook->name, sub);
+
+    unsigned long size = 2;
+    while (size < ring_size) size <<= 1;
+
+    struct hook_async *async = malloc(sizeof(*async) + size * sizeof(async->ring[0]));   // big and long lived: no need for objalloc
+    if (! async) {
+        SLOG(LOG_ERR, "Cannot alloc a ring of %lu events for subscriber %s", size, name);
+        return -1;
+    }
+    async->cb = cb;
+    async->sub = sub;
+    async->name = name;
+    async->mask = size - 1;
+    async->tail = async->head = 0;
+    async->nb_dropped = 0;
+    async->max_bytes = max_bytes;
+    async->nb_bytes = 0;
+    for (unsigned long s = 0; s < size; s++) {
+        async->ring[s].seqnum = s;
+        async->ring[s].arena = NULL;
+    }
+    async->sleeping = async->quit = false;
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    int err = pthread_create(&async->pth, NULL, hook_async_thread, async);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot start thread for subscriber %s: %s", name, strerror(err));
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->mutex);
+        free(async);
+        return -1;
+    }
+
+    if (0 != hook_subscriber_add(hook, sub, hook_async_enqueue, async)) {
+        hook_async_del(async);
+        sub->async = NULL;
+        return -1;
     }
     return 0;
 }
 
+void hook_subscriber_async_stats(struct proto_subscriber const *sub, uint64_t *nb_queued, uint64_t *nb_dropped)
+{
+    *nb_queued = sub->async ? sub->async->tail : 0;
+    *nb_dropped = sub->async ? sub->async->nb_dropped : 0;
+}
+
 void hook_subscriber_dtor(struct hook *hook, struct proto_subscriber *sub)
 {
     SLOG(LOG_DEBUG, "Destruct subscriber of %s @%p", hook->name, sub);
-    WITH_WRITE_LOCK(&hook->lock) {
+    WITH_LOCK(&hook->mutex) {
+        // Callers must not see it once we return, and a stale snapshot would still show it
+        struct hook_subscribers *snapshot;
+        if (0 != hook_snapshot_new(hook, sub, &snapshot)) {
+            FAIL("Cannot alloc subscribers of hook %s while unsubscribing", hook->name);
+        }
         LIST_REMOVE(sub, entry);
+        hook_snapshot_publish(hook, snapshot);
+    }
+    // Once we return the subscriber may be freed, so wait for the callers that may still see it
+    wait_grace_period();
+
+    if (sub->async) {
+        hook_async_del(sub->async);
+        sub->async = NULL;
     }
 }
 
 void hook_subscribers_call(struct hook *hook, struct proto_info *info, size_t tot_cap_len, uint8_t const *tot_packet, struct timeval const *now)
 {
-    WITH_READ_LOCK(&hook->lock) {
-        struct proto_subscriber *sub;
-        LIST_FOREACH(sub, &hook->subscribers, entry) {
+    if (likely_(! hook->snapshot)) return;
+
+    enter_multi_region();   // usually a mere nesting
+    struct hook_subscribers const *const snapshot = hook->snapshot;
+    if (snapshot) {
+        for (unsigned s = 0; s < snapshot->nb_subscribers; s++) {
+            struct proto_subscriber *const sub = snapshot->subscribers[s];
             sub->cb(sub, info, tot_cap_len, tot_packet, now);
         }
     }
+    leave_protected_region();
 }
-
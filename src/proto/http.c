@@ -469,6 +469,32 @@ static int http_extract_content_encoding(unsigned unused_ field, struct liner *l
     return 0;
 }
 
+// Tells whether we received the whole header, ie. an empty line or a lone command line (see httper_parse)
+static bool http_head_ready(struct streambuf_cursor *cursor)
+{
+    unsigned nb_lines = 0;
+    size_t line_len = 0;
+    bool last_is_cr = false;
+
+    uint8_t const *chunk;
+    size_t len;
+    while (NULL != (chunk = streambuf_cursor_peek(cursor, &len))) {
+        for (size_t c = 0; c < len; c++) {
+            if (chunk[c] != '\n') {
+                line_len ++;
+                last_is_cr = chunk[c] == '\r';
+                continue;
+            }
+            if (nb_lines > 0 && (line_len == 0 || (line_len == 1 && last_is_cr))) return true;
+            nb_lines ++;
+            line_len = 0;
+        }
+        (void)streambuf_cursor_drop(cursor, len);
+    }
+
+    return nb_lines == 1 && line_len == 0;
+}
+
 static enum proto_parse_status http_parse_header(struct http_parser *http_parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     assert(http_parser->state[way].phase == HEAD);
@@ -500,7 +526,7 @@ static enum proto_parse_status http_parse_header(struct http_parser *http_parser
         { STRING_AND_LEN("origin"),            http_extract_origin },
         { STRING_AND_LEN("content-encoding"),  http_extract_content_encoding },
     };
-    static struct httper const httper = {
+    static struct httper httper = {
         .nb_commands = NB_ELEMS(commands),
         .commands = commands,
         .nb_fields = NB_ELEMS(fields),
@@ -521,7 +547,7 @@ static enum proto_parse_status http_parse_header(struct http_parser *http_parser
             SLOG(LOG_DEBUG, "Incomplete HTTP headers, will restart later");
             // So header end must be in next packet(s)
             status = proto_parse(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);    // ack what we had so far
-            streambuf_set_restart(&http_parser->sbuf, way, packet, true);   // retry later with (hopefully) complete header this time
+            streambuf_set_restart_ready(&http_parser->sbuf, way, packet, http_head_ready);  // retry later with (hopefully) complete header this time
             return PROTO_OK;
         } else {
             // No, the header was truncated. We want to report as much as we can.
@@ -29,6 +29,77 @@
 #undef LOG_CAT
 #define LOG_CAT proto_http_log_category
 
+/*
+ * Index
+ *
+ * To avoid trying all commands and all fields in turn, we build once for each httper
+ * a bitmap of the first chars of the commands and a perfect hash of the field names
+ * (ie. a seed for which no two names share the same slot).
+ */
+
+static uint32_t field_hash(uint32_t seed, char const *name, size_t len)
+{
+    uint32_t h = seed;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)(name[i] | 0x20)) * 16777619U;   // case insensitive for letters (and harmless for others)
+    }
+    return h ^ (h >> 15);
+}
+
+static void httper_index_build(struct httper *httper)
+{
+    // Only one thread builds it, others use the slow path meanwhile
+    if (! __sync_bool_compare_and_swap(&httper->index.state, 0, 1)) return;
+
+    struct httper_index *const index = &httper->index;
+
+    memset(index->first_chars, 0, sizeof(index->first_chars));
+    for (unsigned c = 0; c < httper->nb_commands; c++) {
+        uint8_t const first = httper->commands[c].name[0];
+        index->first_chars[first / 32] |= 1U << (first % 32);
+    }
+
+    index->perfect = false;
+    if (2 * httper->nb_fields <= HTTPER_HASH_SIZE) {
+        for (uint32_t seed = 2166136261U; !index->perfect && seed < 2166136261U + 10000; seed++) {
+            memset(index->slots, 0, sizeof(index->slots));
+            index->perfect = true;
+            for (unsigned f = 0; f < httper->nb_fields; f++) {
+                struct httper_field const *field = httper->fields + f;
+                unsigned const s = field_hash(seed, field->name, field->len) & (HTTPER_HASH_SIZE-1);
+                if (index->slots[s]) {
+                    index->perfect = false;
+                    break;
+                }
+                index->slots[s] = f + 1;
+            }
+            index->seed = seed;
+        }
+    }
+    if (! index->perfect) SLOG(LOG_NOTICE, "Cannot find a perfect hash for %u fields, will look for them one by one", httper->nb_fields);
+
+    __sync_synchronize();
+    index->state = HTTPER_INDEX_READY;
+}
+
+static int httper_field_lookup(struct httper const *httper, char const *name, size_t len)
+{
+    if (likely_(httper->index.state == HTTPER_INDEX_READY && httper->index.perfect)) {
+        unsigned const s = field_hash(httper->index.seed, name, len) & (HTTPER_HASH_SIZE-1);
+        if (! httper->index.slots[s]) return -1;
+        int const f = httper->index.slots[s] - 1;
+        struct httper_field const *field = httper->fields + f;
+        if (field->len != len || 0 != strncasecmp(field->name, name, len)) return -1;
+        return f;
+    }
+
+    for (unsigned f = 0; f < httper->nb_fields; f++) {
+        struct httper_field const *field = httper->fields + f;
+        if (field->len == len && 0 == strncasecmp(field->name, name, len)) return f;
+    }
+    return -1;
+}
+
 /*
  * Parse Command
  *
@@ -39,20 +110,52 @@
  * to the callback function.
  */
 
-enum proto_parse_status httper_parse(struct httper const *httper, size_t *head_sz, uint8_t const *packet, size_t packet_len, void *user_data)
+// Find the end of the line at start, and its first colon if colon is not NULL
+static void httper_next_line(char const *start, size_t rem_size, size_t *line_len, size_t *delim_len, char const **colon)
+{
+    char const *eol = liner_scan_eol(start, rem_size, colon);
+    if (! eol) {    // then all remaining bytes are the line
+        *line_len = rem_size;
+        *delim_len = 0;
+        return;
+    }
+    bool const cr = eol > start && eol[-1] == '\r';
+    *line_len = (eol - start) - cr;
+    *delim_len = 1 + cr;
+}
+
+static int httper_field_cb(struct httper const *httper, int field_idx, struct liner *tokenizer, char const *field_end, void *user_data)
+{
+    liner_grow(tokenizer, field_end);
+    // Absorb all remaining of line onto this token
+    liner_expand(tokenizer);
+    return httper->fields[field_idx].cb(field_idx, tokenizer, user_data);
+}
+
+enum proto_parse_status httper_parse(struct httper *httper, size_t *head_sz, uint8_t const *packet, size_t packet_len, void *user_data)
 {
-    struct liner liner, tokenizer;
+    struct liner tokenizer;
     bool found = false;
+    size_t line_len, delim_len;
+
+    if (unlikely_(httper->index.state != HTTPER_INDEX_READY)) httper_index_build(httper);
+
+    if (
+        likely_(packet_len > 0) &&
+        likely_(httper->index.state == HTTPER_INDEX_READY) &&
+        !(httper->index.first_chars[packet[0] / 32] & (1U << (packet[0] % 32)))
+    ) goto no_command;  // quick reject of random traffic
 
     for (unsigned c = 0; c < httper->nb_commands; c++) {
         struct httper_command const *const cmd = httper->commands + c;
 
         // Start by looking for the command before tokenizing (tokenizing takes too much time on random traffic)
+        if (packet_len > 0 && cmd->name[0] != packet[0]) continue;
         if (0 != strncmp(cmd->name, (char const *)packet, MIN(packet_len, cmd->len))) continue;
         if (packet_len < cmd->len) return PROTO_TOO_SHORT;
 
-        liner_init(&liner, &delim_lines, (char const *)packet, packet_len);
-        liner_init(&tokenizer, &delim_blanks, liner.start, liner_tok_length(&liner));
+        httper_next_line((char const *)packet, packet_len, &line_len, &delim_len, NULL);
+        liner_init(&tokenizer, &delim_blanks, (char const *)packet, line_len);
 
         if (liner_tok_length(&tokenizer) != cmd->len) {
 no_command:
@@ -72,64 +175,54 @@ no_command:
 
     // Parse header fields
     unsigned nb_hdr_lines = 0;
+    size_t parsed = line_len + delim_len;
 
     int field_idx = -1;
     char const *field_end = NULL;
 
     while (true) {
         // Next line
-        bool const has_newline = liner.delim_size > 0;
-        liner_next(&liner);
-        if (liner_eof(&liner)) {
+        bool const has_newline = delim_len > 0;
+        if (parsed >= packet_len) {
             // As an accommodation to old HTTP implementations, we allow a single line command
             // FIXME: check line termination with "*/x.y" ?
             if (nb_hdr_lines == 0 && has_newline) break;
             return PROTO_TOO_SHORT;
         }
 
+        char const *const line = (char const *)packet + parsed;
+        char const *colon;
+        httper_next_line(line, packet_len - parsed, &line_len, &delim_len, &colon);
+        parsed += line_len + delim_len;
+
         // If empty line we reached the end of the headers
-        if (liner_tok_length(&liner) == 0) break;
+        if (line_len == 0) break;
 
         // Check if we reached the end of a multiline field.
         // FIXME: Is isspace appropriate here?
-        if (! isspace(liner.start[0])) {
+        if (! isspace(line[0])) {
             if (field_idx >= 0) {
-                liner_grow(&tokenizer, field_end);
-                // Absorb all remaining of line onto this token
-                liner_expand(&tokenizer);
-                int ret = httper->fields[field_idx].cb(field_idx, &tokenizer, user_data);
-                if (ret) return PROTO_PARSE_ERR;
+                if (0 != httper_field_cb(httper, field_idx, &tokenizer, field_end, user_data)) return PROTO_PARSE_ERR;
             }
 
-            // Tokenize the header line
-            liner_init(&tokenizer, &delim_colons, liner.start, liner_tok_length(&liner));
-
-            field_idx = -1;
-            for (unsigned f = 0; f < httper->nb_fields; f++) {
-                struct httper_field const *field = httper->fields + f;
-
-                if (liner_tok_length(&tokenizer) < field->len) continue;
-                if (0 != strncasecmp(field->name, tokenizer.start, liner_tok_length(&tokenizer))) continue;
-
-                SLOG(LOG_DEBUG, "Found field %s", field->name);
+            // The field name is everything up to the first colon
+            size_t const name_len = colon ? (size_t)(colon - line) : line_len;
+            field_idx = httper_field_lookup(httper, line, name_len);
+            if (field_idx >= 0) {
+                SLOG(LOG_DEBUG, "Found field %s", httper->fields[field_idx].name);
+                // Tokenize the header line
+                liner_init(&tokenizer, &delim_colons, line, line_len);
                 liner_next(&tokenizer);
-                field_idx = f;
-                break;
             }
         }
-        field_end = liner.start + liner.tok_size;   // save end of line position in field_end
+        field_end = line + line_len;    // save end of line position in field_end
         nb_hdr_lines ++;
     }
 
     if (field_idx >= 0) {
-        liner_grow(&tokenizer, field_end);
-        // Absorb all remaining of line onto this token
-        liner_expand(&tokenizer);
-        int ret = httper->fields[field_idx].cb(field_idx, &tokenizer, user_data);
-        if (ret) return PROTO_PARSE_ERR;
+        if (0 != httper_field_cb(httper, field_idx, &tokenizer, field_end, user_data)) return PROTO_PARSE_ERR;
     }
 
-    if (head_sz) *head_sz = liner_parsed(&liner);
+    if (head_sz) *head_sz = parsed;
     return PROTO_OK;
 }
-
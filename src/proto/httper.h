@@ -5,6 +5,10 @@
 #include <stdint.h>
 #include "proto/liner.h"
 
+#define HTTPER_HASH_SIZE 64 // must be a power of 2, and more than twice the number of fields
+
+/// Describe the commands and header fields of an HTTP-like protocol.
+/** The index is built on first use so do not declare your httper const. */
 struct httper {
     // For first command line
     unsigned nb_commands;
@@ -20,12 +24,21 @@ struct httper {
         size_t len;
         int (*cb)(unsigned field, struct liner *, void *);  // returns -1 for parse error
     } const *fields;
+    // Built by httper_parse (leave it zeroed)
+    struct httper_index {
+#       define HTTPER_INDEX_READY 2
+        int volatile state;                 // HTTPER_INDEX_READY once built
+        bool perfect;                       // set if we found a seed for which field names do not collide
+        uint32_t seed;
+        uint8_t slots[HTTPER_HASH_SIZE];    // index of the field with this hash + 1, or 0
+        uint32_t first_chars[256/32];       // bitmap of first chars of the commands
+    } index;
 };
 
 /// @returns PROTO_PARSE_ERR if none of the given command was found
 /// @returns PROTO_OK if a complete header was available
 /// @returns PROTO_TOO_SHORT if the header was not complete
 /// @note If you have several commands that share a common prefix you must order them longest first
-enum proto_parse_status httper_parse(struct httper const *, size_t *head_sz, uint8_t const *packet, size_t packet_len, void *);
+enum proto_parse_status httper_parse(struct httper *, size_t *head_sz, uint8_t const *packet, size_t packet_len, void *);
 
 #endif
@@ -18,9 +18,15 @@
  * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#if defined(__AVX2__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
 #include "junkie/tools/log.h"
 #include "junkie/tools/miscmacs.h"
 #include "junkie/proto/proto.h"
@@ -110,10 +116,72 @@ unsigned long long liner_strtoull(struct liner *liner, char const **end, int bas
     return neg ? -ret : ret;
 }
 
+/*
+ * Vectorized line scanner
+ */
+
+#if defined(__AVX2__)
+#   define VEC_SIZE 32
+typedef __m256i vec;
+#   define vec_load(p) _mm256_loadu_si256((__m256i const *)(p))
+#   define vec_set1(c) _mm256_set1_epi8(c)
+#   define vec_eq_mask(a, b) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)))
+#elif defined(__SSE2__)
+#   define VEC_SIZE 16
+typedef __m128i vec;
+#   define vec_load(p) _mm_loadu_si128((__m128i const *)(p))
+#   define vec_set1(c) _mm_set1_epi8(c)
+#   define vec_eq_mask(a, b) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)))
+#endif
+
+char const *liner_scan_eol(char const *start, size_t size, char const **colon)
+{
+    char const *col = NULL;
+    size_t o = 0;
+
+#   ifdef VEC_SIZE
+    vec const nls = vec_set1('\n'), cols = vec_set1(':');
+    for (; o + VEC_SIZE <= size; o += VEC_SIZE) {
+        vec const v = vec_load(start + o);
+        uint32_t const nl_mask = vec_eq_mask(v, nls);
+        if (colon && ! col) {
+            uint32_t col_mask = vec_eq_mask(v, cols);
+            if (nl_mask) col_mask &= (nl_mask & -nl_mask) - 1;  // only the colons before the newline
+            if (col_mask) col = start + o + __builtin_ctz(col_mask);
+        }
+        if (nl_mask) {
+            if (colon) *colon = col;
+            return start + o + __builtin_ctz(nl_mask);
+        }
+    }
+#   endif
+
+    // Scalar fallback, for the tail (memchr is probably vectorized anyway)
+    char const *eol = memchr(start + o, '\n', size - o);
+    if (colon) {
+        if (! col) col = memchr(start + o, ':', (eol ? eol : start + size) - (start + o));
+        *colon = col;
+    }
+    return eol;
+}
+
 /*
  * Parse
  */
 
+// Same as look_for_delim for delim_lines, but quicker
+static int look_for_eol(size_t *tok_len, size_t *delim_len, char const *start, size_t rem_size)
+{
+    char const *eol = liner_scan_eol(start, rem_size, NULL);
+    if (! eol) return -1;
+
+    // "\r\n" is prefered over "\n"
+    bool const cr = eol > start && eol[-1] == '\r';
+    *tok_len = (eol - start) - cr;
+    *delim_len = 1 + cr;
+    return 0;
+}
+
 static int look_for_delim(size_t *tok_len, size_t *delim_len, char const *start, size_t rem_size, struct liner_delimiter_set const *delims)
 {
     struct {
@@ -190,7 +258,10 @@ void liner_next(struct liner *liner)
     liner_skip(liner, liner->tok_size + liner->delim_size);
 
     // And look for new one
-    if (0 != look_for_delim(&liner->tok_size, &liner->delim_size, liner->start, liner->rem_size, liner->delims)) {
+    int const err = liner->delims == &delim_lines ?
+        look_for_eol(&liner->tok_size, &liner->delim_size, liner->start, liner->rem_size) :
+        look_for_delim(&liner->tok_size, &liner->delim_size, liner->start, liner->rem_size, liner->delims);
+    if (0 != err) {
         // then all remaining bytes are the next token
         liner->tok_size = liner->rem_size;
         liner->delim_size = 0;
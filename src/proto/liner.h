@@ -71,6 +71,10 @@ static inline void liner_skip(struct liner *liner, size_t len)
 
 unsigned long long liner_strtoull(struct liner *, char const **end, int base);
 
+/// @returns the first '\n' within size bytes from start (or NULL), and the first ':' before it in *colon (if colon is not NULL).
+/** Uses SSE2 or AVX2 when available. */
+char const *liner_scan_eol(char const *start, size_t size, char const **colon);
+
 // Some widely used delimiters
 struct liner_delimiter_set const delim_lines, delim_blanks, delim_spaces, delim_colons, delim_semicolons;
 
@@ -179,6 +179,14 @@ static enum proto_parse_status cursor_read_msg(struct cursor *cursor, unsigned *
     return PROTO_OK;
 }
 
+// Tells whether a whole message is available
+static bool mysql_msg_ready(struct streambuf_cursor *cursor)
+{
+    uint8_t hdr[4]; // length and packet number
+    if (0 != streambuf_cursor_read(cursor, hdr, sizeof(hdr))) return false;
+    return cursor->rem_size >= READ_U24(hdr); // same as cursor_read_msg
+}
+
 static enum proto_parse_status mysql_parse_init(struct mysql_parser *mysql_parser, struct sql_proto_info *info, unsigned way, uint8_t const *payload, size_t cap_len, size_t unused_ wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     info->msg_type = SQL_STARTUP;
@@ -313,7 +321,7 @@ static enum proto_parse_status mysql_parse_query(struct mysql_parser *mysql_pars
         if (status == PROTO_TOO_SHORT) {
             SLOG(LOG_DEBUG, "Payload too short for parsing message, will restart");
             status = proto_parse(NULL, &info->info, way, NULL, 0, 0, now, tot_cap_len, tot_packet);    // ack what we had so far
-            streambuf_set_restart(&mysql_parser->sbuf, way, msg_start, true);
+            streambuf_set_restart_ready(&mysql_parser->sbuf, way, msg_start, mysql_msg_ready);
             return PROTO_OK;
         }
 
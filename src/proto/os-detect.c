@@ -1,3285 +1,748 @@
 // -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
 // vim:sw=4 ts=4 sts=4 expandtab
-// THIS CODE WAS GENERATED BY fp_2_c.py < p0f.fp
+/* Copyright 2010, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 #include "junkie/cpp.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/log.h"
+#include "junkie/tools/mallocer.h"
+#include "junkie/tools/miscmacs.h"
+#include "junkie/tools/ref.h"
+#include "junkie/tools/mutex.h"
 #include "junkie/proto/ip.h"
 #include "junkie/proto/tcp.h"
 #include "proto/ip_hdr.h"
 #include "junkie/proto/os-detect.h"
 
-char const *os_name(unsigned id)
+#undef LOG_CAT
+#define LOG_CAT proto_os_detect_log_category
+
+LOG_CATEGORY_DEF(proto_os_detect);
+
+static char const *const default_fp_file = STRIZE(PKGDATADIR) "/p0f.fp";
+
+/*
+ * Packet features
+ *
+ * All we need to know about a SYN to look it up in the fingerprints, in a form
+ * that's compact enough to serve as a cache key.
+ */
+
+#define OS_MAX_OPTIONS 16   // as many as tcp_proto_info records
+
+enum os_quirk {
+    QUIRK_DF     = 0x001,
+    QUIRK_ID_P   = 0x002,   // id+
+    QUIRK_ID_M   = 0x004,   // id-
+    QUIRK_ECN    = 0x008,
+    QUIRK_FLOW   = 0x010,
+    QUIRK_SEQ_M  = 0x020,   // seq-
+    QUIRK_ACK_P  = 0x040,   // ack+
+    QUIRK_ACK_M  = 0x080,   // ack-
+    QUIRK_UPTR_P = 0x100,   // uptr+
+    QUIRK_URGF_P = 0x200,   // urgf+
+    QUIRK_PUSH_P = 0x400,   // pushf+
+    QUIRK_EXWS   = 0x800,
+};
+
+struct os_features {
+    uint8_t direction;      // 0 for SYNs, 1 for SYN+ACKs
+    uint8_t version;
+    uint8_t ttl;
+    uint8_t wsf;
+    int olen;
+    uint16_t window;
+    uint16_t mss;
+    unsigned quirks;        // the quirks that this packet has
+    bool mss_set, wsf_set, payload;
+    uint8_t nb_options;
+    uint8_t options[OS_MAX_OPTIONS];
+};
+
+static void os_features_ctor(struct os_features *f, struct ip_proto_info const *ip, struct tcp_proto_info const *tcp)
 {
-  switch (id) {
-    case 0: return "unknown";
-    case 1: return "s:unix:Linux:3.x";
-    case 2: return "s:unix:Linux:2.6.x";
-    case 3: return "s:unix:Linux:2.4.x";
-    case 4: return "s:unix:Linux:2.2.x";
-    case 5: return "s:unix:Linux:2.0";
-    case 6: return "s:unix:Linux:3.x (loopback)";
-    case 7: return "s:unix:Linux:2.6.x (loopback)";
-    case 8: return "s:unix:Linux:2.4.x (loopback)";
-    case 9: return "s:unix:Linux:2.2.x (loopback)";
-    case 10: return "s:unix:Linux:2.6.x (Google crawler)";
-    case 11: return "s:unix:Linux:(Android)";
-    case 12: return "g:unix:Linux:3.x";
-    case 13: return "g:unix:Linux:2.4.x-2.6.x";
-    case 14: return "g:unix:Linux:2.2.x-3.x";
-    case 15: return "g:unix:Linux:2.2.x-3.x (no timestamps)";
-    case 16: return "g:unix:Linux:2.2.x-3.x (barebone)";
-    case 17: return "s:win:Windows:XP";
-    case 18: return "s:win:Windows:7 or 8";
-    case 19: return "s:win:Windows:7 (Websense crawler)";
-    case 20: return "g:win:Windows:NT kernel 5.x";
-    case 21: return "g:win:Windows:NT kernel 6.x";
-    case 22: return "g:win:Windows:NT kernel";
-    case 23: return "s:unix:Mac OS X:10.x";
-    case 24: return "s:unix:iOS:iPhone or iPad";
-    case 25: return "g:unix:Mac OS X:";
-    case 26: return "s:unix:FreeBSD:9.x";
-    case 27: return "s:unix:FreeBSD:8.x";
-    case 28: return "g:unix:FreeBSD:";
-    case 29: return "s:unix:OpenBSD:3.x";
-    case 30: return "s:unix:OpenBSD:4.x-5.x";
-    case 31: return "s:unix:Solaris:8";
-    case 32: return "s:unix:Solaris:10";
-    case 33: return "s:unix:OpenVMS:8.x";
-    case 34: return "s:unix:OpenVMS:7.x";
-    case 35: return "s:other:NeXTSTEP:";
-    case 36: return "s:unix:Tru64:4.x";
-    case 37: return "s:!:NMap:SYN scan";
-    case 38: return "s:!:NMap:OS detection";
-    case 39: return "s:unix:p0f:sendsyn utility";
-    case 40: return "s:other:Blackberry:";
-    case 41: return "s:other:Nintendo:3DS";
-    case 42: return "s:other:Nintendo:Wii";
-    case 43: return "s:unix:BaiduSpider:";
-    case 44: return "s:unix:Linux:3.x";
-    case 45: return "s:unix:Linux:2.4-2.6";
-    case 46: return "s:unix:Linux:2.4.x";
-    case 47: return "s:unix:Linux:2.6.x";
-    case 48: return "s:win:Windows:XP";
-    case 49: return "s:win:Windows:7 or 8";
-    case 50: return "s:unix:FreeBSD:9.x";
-    case 51: return "s:unix:FreeBSD:8.x";
-    case 52: return "s:unix:FreeBSD:8.x-9.x";
-    case 53: return "s:unix:OpenBSD:5.x";
-    case 54: return "s:unix:Mac OS X:10.x";
-    case 55: return "s:unix:Solaris:6";
-    case 56: return "s:unix:Solaris:8";
-    case 57: return "s:unix:Solaris:10";
-    case 58: return "s:unix:HP-UX:11.x";
-    case 59: return "s:other:OpenVMS:7.x";
-    case 60: return "s:unix:Tru64:4.x";
-  }
-  return "INVALID";
+    memset(f, 0, sizeof(*f));   // so that we can memcmp them
+    f->direction = tcp->ack;
+    f->version = ip->version;
+    f->ttl = MIN(ip->ttl, 255U);
+    f->olen = (int)ip->info.head_len - 20;
+    f->window = tcp->window;
+    f->mss_set = !!(tcp->set_values & TCP_MSS_SET);
+    f->mss = f->mss_set ? tcp->mss : 0;
+    f->wsf_set = !!(tcp->set_values & TCP_WSF_SET);
+    f->wsf = f->wsf_set ? tcp->wsf : 0;
+    f->payload = tcp->info.payload > 0;
+    f->nb_options = MIN(tcp->nb_options, OS_MAX_OPTIONS);
+    memcpy(f->options, tcp->options, f->nb_options);
+
+    bool const v6 = ip->version == 6;
+    if (v6 || ip->fragmentation == IP_DONTFRAG) f->quirks |= QUIRK_DF;
+    if (v6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) f->quirks |= QUIRK_ID_P;
+    if (v6 || (ip->fragmentation == IP_NOFRAG && ip->id == 0)) f->quirks |= QUIRK_ID_M;
+    if (0 != (ip->traffic_class & IP_TOS_ECN_MASK)) f->quirks |= QUIRK_ECN;
+    if (ip->version == 4 || ip->id != 0) f->quirks |= QUIRK_FLOW;
+    if (tcp->seq_num == 0) f->quirks |= QUIRK_SEQ_M;
+    if (tcp->ack_num != 0 && !tcp->ack) f->quirks |= QUIRK_ACK_P;
+    if (tcp->ack_num == 0 && tcp->ack) f->quirks |= QUIRK_ACK_M;
+    if (tcp->urg_ptr != 0 && !tcp->urg) f->quirks |= QUIRK_UPTR_P;
+    if (tcp->urg) f->quirks |= QUIRK_URGF_P;
+    if (tcp->psh) f->quirks |= QUIRK_PUSH_P;
+    if (f->wsf_set && f->wsf > 14) f->quirks |= QUIRK_EXWS;
 }
 
-unsigned os_detect(struct ip_proto_info const *ip, struct tcp_proto_info const *tcp)
+/*
+ * Fingerprints database
+ *
+ * The [tcp:request] and [tcp:response] signatures of p0f.fp are grouped according to the
+ * fields that must be equal: direction, IP options length and the layout of TCP options.
+ * These groups are stored in a hash, and the signatures of a group are stored next to
+ * each other in a single array, so that only a handful of small signatures are
+ * ever tested for a given packet.
+ * Since a signature layout needs only be a prefix of the packet options, we
+ * look for the group of each prefix of the packet options in turn.
+ */
+
+struct os_sig {
+    unsigned rank;          // position in the file, the first matching signature wins
+    uint16_t label;
+    bool generic;           // generic signatures are used only when no specific one matches
+    bool ttl_bad;           // then any TTL up to ttl matches
+    uint8_t version;        // 4, 6, or 0 for any
+    uint8_t ttl;            // initial TTL
+    int32_t mss;            // or -1 for any
+    enum os_wsize { WSIZE_ANY, WSIZE_EQ, WSIZE_MOD, WSIZE_MSS } wsize_kind;
+    uint16_t wsize;
+    int16_t wsf;            // or -1 for any
+    enum os_pclass { PCLASS_ANY, PCLASS_ZERO, PCLASS_NONZERO } pclass;
+    unsigned quirks;        // the quirks that the packet must have
+};
+
+struct os_group_key {
+    uint8_t direction;
+    uint8_t nb_options;
+    int olen;
+    uint8_t options[OS_MAX_OPTIONS];
+};
+
+struct os_group {
+    struct os_group_key key;
+    uint32_t hash;
+    unsigned first_sig, nb_sigs;    // nb_sigs is 0 for unused slots
+};
+
+struct os_db {
+    struct ref ref;                 // Retired databases are deleted by the doomer
+    unsigned generation;            // to invalidate the caches
+    unsigned nb_labels;
+    char **labels;                  // labels[0] is "unknown"
+    unsigned nb_sigs;
+    struct os_sig *sigs;            // grouped
+    unsigned group_mask;
+    struct os_group *groups;
+};
+
+static struct os_db *volatile os_db;    // NULL if no fingerprints could be loaded
+static struct mutex os_db_lock;         // serialize loads (readers do not take it)
+static unsigned os_db_generation;       // protected by os_db_lock
+
+// The hash of a key is computed incrementally so that we can hash each prefix of the options
+static uint32_t os_key_hash_init(uint8_t direction, int olen)
 {
-  if (! tcp->syn) return 0; // we are only interrested in SYNs/SYNACKS
-
-  if (! tcp->ack) { /* client to server */
-    if (ip->version == 4) {
-      if (ip->ttl <= 128 && 128 <= ip->ttl + 20 /* MAX_DIST */) {
-        if (ip->info.head_len - 20 == 0) {
-          if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-            if ((true /* multiple of MTU not implemented */) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 3) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 33;
-                  }
-                }
-              }
-            }
-          }
-        }
-      }
-      if (ip->ttl <= 64 && 64 <= ip->ttl + 20 /* MAX_DIST */) {
-        if (ip->info.head_len - 20 == 0) {
-          if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1024) {
-            if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 35;
-                  }
-                }
-              }
-            }
-          } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1430) {
-            if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 4) &&
-                (2 < tcp->nb_options && tcp->options[2] == 8) &&
-                (3 < tcp->nb_options && tcp->options[3] == 1) &&
-                (4 < tcp->nb_options && tcp->options[4] == 3) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 10;
-                  }
-                }
-              }
-            }
-          } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-            if ((tcp->window == 32768) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 1) &&
-                (3 < tcp->nb_options && tcp->options[3] == 4) &&
-                true) {
-                if (
-                  (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                  (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 42;
-                  }
-                }
-              } else if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 3) &&
-                true) {
-                if (
-                  (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                  (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 36;
-                  }
-                }
-              }
-            } else if ((tcp->window == 61440) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 3) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 34;
-                  }
-                }
-              }
-            }
-          }
-        }
-      }
-    } else if (ip->version == 6) {
+    return (2166136261U ^ direction) * 16777619U ^ (uint32_t)olen;
+}
+
+static uint32_t os_key_hash_next(uint32_t h, uint8_t option)
+{
+    return (h * 16777619U) ^ option;
+}
+
+static uint32_t os_key_hash(struct os_group_key const *key)
+{
+    uint32_t h = os_key_hash_init(key->direction, key->olen);
+    for (unsigned o = 0; o < key->nb_options; o++) h = os_key_hash_next(h, key->options[o]);
+    return h;
+}
+
+static struct os_group *os_db_group(struct os_db const *db, uint32_t hash, uint8_t direction, int olen, unsigned nb_options, uint8_t const *options)
+{
+    for (unsigned g = hash & db->group_mask; ; g = (g + 1) & db->group_mask) {
+        struct os_group *const group = db->groups + g;
+        if (! group->nb_sigs) return NULL;
+        if (
+            group->hash == hash &&
+            group->key.direction == direction &&
+            group->key.olen == olen &&
+            group->key.nb_options == nb_options &&
+            0 == memcmp(group->key.options, options, nb_options)
+        ) return group;
     }
-    /* independant of IP version */
-    if (ip->ttl <= 128 && 128 <= ip->ttl + 20 /* MAX_DIST */) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1452) {
-          if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 1) &&
-              (6 < tcp->nb_options && tcp->options[6] == 8) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 40;
-                }
-              }
-            }
-          }
-        }
-        if ((true) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 22;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 22;
-              }
-            }
-          }
-        } else if ((tcp->window == 16384) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 20;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 20;
-              }
-            }
-          }
-        } else if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 20;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 20;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 1))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 21;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 21;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 8))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          }
-        }
-      }
+}
+
+static void os_db_del(struct ref *ref)
+{
+    struct os_db *db = DOWNCAST(ref, ref, os_db);
+    ref_dtor(&db->ref);
+    for (unsigned l = 0; l < db->nb_labels; l++) FREE(db->labels[l]);
+    if (db->labels) FREE(db->labels);
+    if (db->sigs) FREE(db->sigs);
+    if (db->groups) FREE(db->groups);
+    FREE(db);
+}
+
+/*
+ * Loading p0f.fp
+ */
+
+static MALLOCER_DEF(os_db);
+
+static int os_db_label(struct os_db *db, char const *label)
+{
+    for (unsigned l = 0; l < db->nb_labels; l++) {
+        if (0 == strcmp(db->labels[l], label)) return l;
     }
-    if (ip->ttl <= 192 && 192 <= ip->ttl + 20 /* MAX_DIST */) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1331) {
-          if ((tcp->window == 1337) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 8) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            }
-          } else if ((tcp->window == 1337) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 5))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 4) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 4) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 39;
-                }
-              }
-            }
-          }
+    if (db->nb_labels >= UINT16_MAX) return -1;
+    char **labels = REALLOC(os_db, db->labels, (db->nb_labels + 1) * sizeof(*labels));
+    if (! labels) return -1;
+    db->labels = labels;
+    if (! (db->labels[db->nb_labels] = STRDUP(os_db, label))) return -1;
+    return db->nb_labels ++;
+}
+
+static char *strip(char *s)
+{
+    while (*s == ' ' || *s == '\t') s++;
+    size_t len = strlen(s);
+    while (len > 0 && (s[len-1] == ' ' || s[len-1] == '\t' || s[len-1] == '\n' || s[len-1] == '\r')) s[--len] = '\0';
+    return s;
+}
+
+static int parse_uint(char const *s, unsigned max, unsigned *res)
+{
+    char *end;
+    errno = 0;
+    unsigned long const v = strtoul(s, &end, 10);
+    if (errno || end == s || *end != '\0' || v > max) return -1;
+    *res = v;
+    return 0;
+}
+
+static int parse_quirks(char *s, unsigned *quirks)
+{
+    static struct {
+        char const *name;
+        unsigned quirk;
+    } const names[] = {
+        { "df", QUIRK_DF }, { "id+", QUIRK_ID_P }, { "id-", QUIRK_ID_M },
+        { "ecn", QUIRK_ECN }, { "flow", QUIRK_FLOW }, { "seq-", QUIRK_SEQ_M },
+        { "ack+", QUIRK_ACK_P }, { "ack-", QUIRK_ACK_M }, { "uptr+", QUIRK_UPTR_P },
+        { "urgf+", QUIRK_URGF_P }, { "pushf+", QUIRK_PUSH_P }, { "exws", QUIRK_EXWS },
+    };
+
+    *quirks = 0;
+    for (char *q = strtok(s, ","); q; q = strtok(NULL, ",")) {
+        unsigned n;
+        for (n = 0; n < NB_ELEMS(names); n++) {
+            if (0 == strcmp(q, names[n].name)) break;
         }
-      }
+        // Other quirks (0+, ts1-, ts2+, opt+, bad...) are not checked
+        if (n < NB_ELEMS(names)) *quirks |= names[n].quirk;
     }
-    if (ip->ttl <= 64 && 64 <= ip->ttl + 20 /* MAX_DIST */) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1360) {
-          if ((tcp->window == 32768) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 41;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1380) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 19;
-                }
-              }
-            }
-          } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 7))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 19;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 1) &&
-              (6 < tcp->nb_options && tcp->options[6] == 1) &&
-              (7 < tcp->nb_options && tcp->options[7] == 1) &&
-              (8 < tcp->nb_options && tcp->options[8] == 1) &&
-              (9 < tcp->nb_options && tcp->options[9] == 1) &&
-              (10 < tcp->nb_options && tcp->options[10] == 1) &&
-              (11 < tcp->nb_options && tcp->options[11] == 1) &&
-              (12 < tcp->nb_options && tcp->options[12] == 1) &&
-              (13 < tcp->nb_options && tcp->options[13] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 43;
-                }
-              }
-            }
-          } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 7))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 1) &&
-              (6 < tcp->nb_options && tcp->options[6] == 1) &&
-              (7 < tcp->nb_options && tcp->options[7] == 1) &&
-              (8 < tcp->nb_options && tcp->options[8] == 1) &&
-              (9 < tcp->nb_options && tcp->options[9] == 1) &&
-              (10 < tcp->nb_options && tcp->options[10] == 1) &&
-              (11 < tcp->nb_options && tcp->options[11] == 1) &&
-              (12 < tcp->nb_options && tcp->options[12] == 1) &&
-              (13 < tcp->nb_options && tcp->options[13] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 43;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 16376) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 2)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 7;
-                }
-              }
-            }
-          } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 2)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 4))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 6;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 16396) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 2)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 8;
-                }
-              }
-            }
-          } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 2)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 7;
-                }
-              }
-            }
-          } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 2)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 4))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 6;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 3884) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 8)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 9;
-                }
-              }
-            }
-          }
-        }
-        if ((true) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 15;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 14;
-              }
-            }
-          }
-        } else if ((true) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 16;
-              }
-            }
-          }
-        } else if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 5;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 29;
-              }
-            }
-          }
-        } else if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 3))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 30;
-              }
-            }
-          }
-        } else if ((tcp->window == 32850) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 1))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 3) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 4) &&
-            (8 < tcp->nb_options && tcp->options[8] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 25;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 28;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 1))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 24;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 3))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 27;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 4))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 24;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 26;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 12;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 4))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 5))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 7))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 11)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 4;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 12)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 5;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 20)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 4;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 22)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 4;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 34)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 13;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 1))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 2))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 7))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 8))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 44)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 1))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 11;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 44)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 3))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 11;
-              }
-            }
-          }
+    return 0;
+}
+
+static int parse_layout(char *s, struct os_group_key *key)
+{
+    static struct {
+        char const *name;
+        uint8_t kind;
+    } const names[] = {
+        { "nop", 1 }, { "mss", 2 }, { "ws", 3 }, { "sok", 4 }, { "sack", 5 }, { "ts", 8 },
+    };
+
+    key->nb_options = 0;
+    for (char *o = strtok(s, ","); o; o = strtok(NULL, ",")) {
+        if (0 == strncmp(o, "eol+", 4)) break;  // always last, and we lack the padding length
+        if (key->nb_options >= OS_MAX_OPTIONS) return -1;
+        unsigned kind;
+        if (o[0] == '?') {
+            if (0 != parse_uint(o+1, 255, &kind)) return -1;
+        } else {
+            unsigned n;
+            for (n = 0; n < NB_ELEMS(names); n++) {
+                if (0 == strcmp(o, names[n].name)) break;
+            }
+            if (n >= NB_ELEMS(names)) return -1;
+            kind = names[n].kind;
         }
-      }
+        key->options[key->nb_options++] = kind;
     }
-    if (ip->ttl <= 64) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 0) {
-          if ((tcp->window == 4) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 10))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 4) &&
-              (1 < tcp->nb_options && tcp->options[1] == 8) &&
-              (2 < tcp->nb_options && tcp->options[2] == 3) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1400) {
-          if ((tcp->window == 63) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 4) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-          if ((tcp->window == 1) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 10))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 3) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 2) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              (4 < tcp->nb_options && tcp->options[4] == 4) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          } else if ((tcp->window == 1024) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 37;
-                }
-              }
-            }
-          } else if ((tcp->window == 2048) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 37;
-                }
-              }
-            }
-          } else if ((tcp->window == 3) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 10))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 3) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 2) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 1) &&
-              true) {
-              if (
-                (0 != (ip->traffic_class & IP_TOS_ECN_MASK)) &&
-                (tcp->urg_ptr != 0 && !tcp->urg) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          } else if ((tcp->window == 3072) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 37;
-                }
-              }
-            }
-          } else if ((tcp->window == 4096) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              true) {
-              if (
-                (true) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 37;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 265) {
-          if ((tcp->window == 31337) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 10))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 3) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 2) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              (4 < tcp->nb_options && tcp->options[4] == 4) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          } else if ((tcp->window == 512) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 536) {
-          if ((tcp->window == 16) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 10))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 4) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 3) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          }
-        } else if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 640) {
-          if ((tcp->window == 4) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 5))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 8) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 3) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 2) &&
-              true) {
-              if (
-                (tcp->ack_num != 0 && !tcp->ack) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 38;
-                }
-              }
-            }
-          }
+    return 0;
+}
+
+// sig is ver:ittl:olen:mss:wsize,scale:olayout:quirks:pclass
+static int parse_sig(char *str, struct os_sig *sig, struct os_group_key *key)
+{
+    char *fields[8];
+    unsigned nb_fields = 0;
+    for (char *s = str; nb_fields < NB_ELEMS(fields); nb_fields++) {
+        fields[nb_fields] = s;
+        s = strchr(s, ':');
+        if (! s) {
+            nb_fields ++;
+            break;
         }
-      }
+        *s++ = '\0';
     }
-  } else { /* server to client */
-    if (ip->version == 4) {
-      if (ip->ttl <= 255 && 255 <= ip->ttl + 20 /* MAX_DIST */) {
-        if (ip->info.head_len - 20 == 0) {
-          if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 7)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 55;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 1) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 2) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 55;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 1) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 8) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 3) &&
-              (5 < tcp->nb_options && tcp->options[5] == 2) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 55;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 1) &&
-              (1 < tcp->nb_options && tcp->options[1] == 3) &&
-              (2 < tcp->nb_options && tcp->options[2] == 2) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 55;
-                }
-              }
-            }
-          }
+    if (nb_fields != NB_ELEMS(fields)) return -1;
+
+    unsigned v;
+    if (0 == strcmp(fields[0], "*")) {
+        sig->version = 0;
+    } else if (0 == parse_uint(fields[0], 6, &v) && (v == 4 || v == 6)) {
+        sig->version = v;
+    } else return -1;
+
+    size_t const ttl_len = strlen(fields[1]);
+    sig->ttl_bad = ttl_len > 0 && fields[1][ttl_len-1] == '-';
+    if (sig->ttl_bad) fields[1][ttl_len-1] = '\0';
+    if (0 != parse_uint(fields[1], 255, &v)) return -1;
+    sig->ttl = v;
+
+    if (0 != parse_uint(fields[2], 255, &v)) return -1;
+    key->olen = v;
+
+    if (0 == strcmp(fields[3], "*")) {
+        sig->mss = -1;
+    } else if (0 == parse_uint(fields[3], UINT16_MAX, &v)) {
+        sig->mss = v;
+    } else return -1;
+
+    char *scale = strchr(fields[4], ',');
+    if (! scale) return -1;
+    *scale++ = '\0';
+    char const *wsize = fields[4];
+    if (0 == strcmp(wsize, "*") || 0 == strncmp(wsize, "mtu*", 4)) {   // multiple of MTU not implemented
+        sig->wsize_kind = WSIZE_ANY;
+        v = 0;
+    } else if (wsize[0] == '%') {
+        sig->wsize_kind = WSIZE_MOD;
+        if (0 != parse_uint(wsize+1, UINT16_MAX, &v) || v == 0) return -1;
+    } else if (0 == strncmp(wsize, "mss*", 4)) {
+        sig->wsize_kind = WSIZE_MSS;
+        if (0 != parse_uint(wsize+4, UINT16_MAX, &v)) return -1;
+    } else {
+        sig->wsize_kind = WSIZE_EQ;
+        if (0 != parse_uint(wsize, UINT16_MAX, &v)) return -1;
+    }
+    sig->wsize = v;
+    if (0 == strcmp(scale, "*")) {
+        sig->wsf = -1;
+    } else if (0 == parse_uint(scale, 255, &v)) {
+        sig->wsf = v;
+    } else return -1;
+
+    if (0 != parse_layout(fields[5], key)) return -1;
+    if (0 != parse_quirks(fields[6], &sig->quirks)) return -1;
+
+    if (0 == strcmp(fields[7], "*")) {
+        sig->pclass = PCLASS_ANY;
+    } else if (0 == strcmp(fields[7], "0")) {
+        sig->pclass = PCLASS_ZERO;
+    } else if (0 == strcmp(fields[7], "+")) {
+        sig->pclass = PCLASS_NONZERO;
+    } else return -1;
+
+    return 0;
+}
+
+static struct os_db *os_db_new(char const *filename)
+{
+    MALLOCER_INIT(os_db);
+
+    FILE *file = fopen(filename, "r");
+    if (! file) {
+        SLOG(LOG_ERR, "Cannot open fingerprints file %s: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct os_db *db = MALLOC(os_db, sizeof(*db));
+    if (! db) goto err0;
+    db->nb_labels = 0;
+    db->labels = NULL;
+    db->nb_sigs = 0;
+    db->sigs = NULL;
+    db->group_mask = 0;
+    db->groups = NULL;
+    if (0 != os_db_label(db, "unknown")) goto err1;
+
+    // First read all signatures in file order (with their keys aside)
+    struct os_group_key *keys = NULL;
+    unsigned max_sigs = 0;
+    int label = -1;
+    bool generic = false;
+    int direction = -1;     // -1 when not in a tcp section
+    char *line = NULL;
+    size_t line_sz = 0;
+    unsigned lineno = 0;
+    while (-1 != getline(&line, &line_sz, file)) {
+        lineno ++;
+        char *l = strip(line);
+        if (l[0] == '\0' || l[0] == ';') continue;
+        if (l[0] == '[') {
+            direction =
+                0 == strcmp(l, "[tcp:request]") ? 0 :
+                0 == strcmp(l, "[tcp:response]") ? 1 : -1;
+            continue;
         }
-      }
-      if (ip->ttl <= 64 && 64 <= ip->ttl + 20 /* MAX_DIST */) {
-        if (ip->info.head_len - 20 == 0) {
-          if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-            if ((tcp->window == 3993) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 59;
-                  }
-                }
-              } else if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 3) &&
-                true) {
-                if (
-                  (true) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 59;
-                  }
-                }
-              }
-            } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 25)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-              if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                true) {
-                if (
-                  (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                  (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 36;
-                  }
-                }
-              } else if (
-                (0 < tcp->nb_options && tcp->options[0] == 2) &&
-                (1 < tcp->nb_options && tcp->options[1] == 1) &&
-                (2 < tcp->nb_options && tcp->options[2] == 3) &&
-                true) {
-                if (
-                  (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                  (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                  true) {
-                  if (tcp->info.payload > 0) {
-                  } else if (tcp->info.payload == 0) {
-                    return 36;
-                  }
-                }
-              }
-            }
-          }
+        if (direction < 0) continue;
+        char *eq = strchr(l, '=');
+        if (! eq) continue;
+        *eq = '\0';
+        char const *key = strip(l);
+        char *value = strip(eq+1);
+
+        if (0 == strcmp(key, "label")) {
+            label = os_db_label(db, value);
+            if (label < 0) goto err2;
+            generic = value[0] == 'g';
+        } else if (0 == strcmp(key, "sig")) {
+            if (label < 0) {
+                SLOG(LOG_WARNING, "%s:%u: signature without label", filename, lineno);
+                continue;
+            }
+            if (db->nb_sigs >= max_sigs) {
+                max_sigs = max_sigs ? 2 * max_sigs : 256;
+                struct os_sig *sigs = REALLOC(os_db, db->sigs, max_sigs * sizeof(*sigs));
+                if (! sigs) goto err2;
+                db->sigs = sigs;
+                struct os_group_key *k = REALLOC(os_db, keys, max_sigs * sizeof(*k));
+                if (! k) goto err2;
+                keys = k;
+            }
+            struct os_sig *const sig = db->sigs + db->nb_sigs;
+            struct os_group_key *const k = keys + db->nb_sigs;
+            memset(k, 0, sizeof(*k));   // so that we can memcmp them
+            if (0 != parse_sig(value, sig, k)) {
+                SLOG(LOG_WARNING, "%s:%u: cannot parse signature, skipping", filename, lineno);
+                continue;
+            }
+            k->direction = direction;
+            sig->rank = db->nb_sigs;
+            sig->label = label;
+            sig->generic = generic;
+            db->nb_sigs ++;
         }
-      }
-    } else if (ip->version == 6) {
     }
-    /* independant of IP version */
-    if (ip->ttl <= 128 && 128 <= ip->ttl + 20 /* MAX_DIST */) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              (true) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 17;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          }
-        } else if ((tcp->window == 8192) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 8))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 18;
-              }
-            }
-          }
-        }
-      }
+    if (ferror(file)) {
+        SLOG(LOG_ERR, "Cannot read fingerprints file %s: %s", filename, strerror(errno));
+        goto err2;
     }
-    if (ip->ttl <= 64 && 64 <= ip->ttl + 20 /* MAX_DIST */) {
-      if (ip->info.head_len - 20 == 0) {
-        if ((tcp->set_values & TCP_MSS_SET) && tcp->mss == 1460) {
-          if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 1) &&
-              (6 < tcp->nb_options && tcp->options[6] == 8) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 8) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            }
-          } else if ((tcp->window == 16384) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 3))) {
-            if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 1) &&
-              (3 < tcp->nb_options && tcp->options[3] == 4) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 3) &&
-              (6 < tcp->nb_options && tcp->options[6] == 1) &&
-              (7 < tcp->nb_options && tcp->options[7] == 1) &&
-              (8 < tcp->nb_options && tcp->options[8] == 8) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 3) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            } else if (
-              (0 < tcp->nb_options && tcp->options[0] == 2) &&
-              (1 < tcp->nb_options && tcp->options[1] == 1) &&
-              (2 < tcp->nb_options && tcp->options[2] == 3) &&
-              (3 < tcp->nb_options && tcp->options[3] == 1) &&
-              (4 < tcp->nb_options && tcp->options[4] == 1) &&
-              (5 < tcp->nb_options && tcp->options[5] == 8) &&
-              true) {
-              if (
-                (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-                (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-                true) {
-                if (tcp->info.payload > 0) {
-                } else if (tcp->info.payload == 0) {
-                  return 53;
-                }
-              }
-            }
-          }
+
+    // Then group them
+    unsigned nb_groups = 1;
+    while (nb_groups < 2 * db->nb_sigs) nb_groups <<= 1;
+    db->group_mask = nb_groups - 1;
+    db->groups = MALLOC(os_db, nb_groups * sizeof(*db->groups));
+    unsigned *sig_group = MALLOC(os_db, (db->nb_sigs + 1) * sizeof(*sig_group));
+    struct os_sig *sigs = MALLOC(os_db, (db->nb_sigs + 1) * sizeof(*sigs));
+    if (! db->groups || ! sig_group || ! sigs) goto err3;
+    memset(db->groups, 0, nb_groups * sizeof(*db->groups));
+
+    for (unsigned s = 0; s < db->nb_sigs; s++) {
+        struct os_group_key const *const k = keys + s;
+        uint32_t const hash = os_key_hash(k);
+        struct os_group *group = os_db_group(db, hash, k->direction, k->olen, k->nb_options, k->options);
+        if (! group) {  // take the empty slot
+            unsigned g;
+            for (g = hash & db->group_mask; db->groups[g].nb_sigs; g = (g + 1) & db->group_mask) ;
+            group = db->groups + g;
+            group->key = *k;
+            group->hash = hash;
         }
-        if ((tcp->window == 32768) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 3) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 3) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 58;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 23;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 52;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 3))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 27;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 27;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 27;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 27;
-              }
-            }
-          }
-        } else if ((tcp->window == 65535) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 6))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 26;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 26;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 26;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 26;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 10)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 1;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 19)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 4) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            (6 < tcp->nb_options && tcp->options[6] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            (5 < tcp->nb_options && tcp->options[5] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 4) &&
-            (8 < tcp->nb_options && tcp->options[8] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 3) &&
-            (2 < tcp->nb_options && tcp->options[2] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 3) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 4) &&
-            (5 < tcp->nb_options && tcp->options[5] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 31;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 37)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 1) &&
-            (6 < tcp->nb_options && tcp->options[6] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 1) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 2) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            (6 < tcp->nb_options && tcp->options[6] == 1) &&
-            (7 < tcp->nb_options && tcp->options[7] == 1) &&
-            (8 < tcp->nb_options && tcp->options[8] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              (ip->version == 6 || (ip->fragmentation == IP_DONTFRAG && ip->id != 0)) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 32;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && (true)) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 2;
-              }
-            }
-          }
-        } else if (((tcp->set_values & TCP_MSS_SET) && (tcp->window == tcp->mss * 4)) && ((!(tcp->set_values & TCP_WSF_SET)) || (tcp->wsf == 0))) {
-          if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 45;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 45;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 4) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 45;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 1) &&
-            (3 < tcp->nb_options && tcp->options[3] == 8) &&
-            (4 < tcp->nb_options && tcp->options[4] == 1) &&
-            (5 < tcp->nb_options && tcp->options[5] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 1) &&
-            (2 < tcp->nb_options && tcp->options[2] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 45;
-              }
-            }
-          } else if (
-            (0 < tcp->nb_options && tcp->options[0] == 2) &&
-            (1 < tcp->nb_options && tcp->options[1] == 4) &&
-            (2 < tcp->nb_options && tcp->options[2] == 8) &&
-            (3 < tcp->nb_options && tcp->options[3] == 1) &&
-            (4 < tcp->nb_options && tcp->options[4] == 3) &&
-            true) {
-            if (
-              (ip->version == 6 || ip->fragmentation == IP_DONTFRAG) &&
-              true) {
-              if (tcp->info.payload > 0) {
-              } else if (tcp->info.payload == 0) {
-                return 3;
-              }
+        group->nb_sigs ++;
+        sig_group[s] = group - db->groups;
+    }
+
+    unsigned first_sig = 0;
+    for (unsigned g = 0; g < nb_groups; g++) {
+        db->groups[g].first_sig = first_sig;
+        first_sig += db->groups[g].nb_sigs;
+        db->groups[g].nb_sigs = 0;  // will be counted again while storing them
+    }
+    for (unsigned s = 0; s < db->nb_sigs; s++) {
+        struct os_group *const group = db->groups + sig_group[s];
+        sigs[group->first_sig + group->nb_sigs++] = db->sigs[s];
+    }
+
+    FREE(db->sigs);
+    db->sigs = sigs;
+    FREE(sig_group);
+    if (keys) FREE(keys);
+    if (line) free(line);
+    fclose(file);
+
+    ref_ctor(&db->ref, os_db_del);
+    SLOG(LOG_INFO, "Loaded %u fingerprints for %u OSes from %s", db->nb_sigs, db->nb_labels - 1, filename);
+    return db;
+
+err3:
+    if (sigs) FREE(sigs);
+    if (sig_group) FREE(sig_group);
+err2:
+    if (keys) FREE(keys);
+    if (line) free(line);
+err1:
+    for (unsigned l = 0; l < db->nb_labels; l++) FREE(db->labels[l]);
+    if (db->labels) FREE(db->labels);
+    if (db->sigs) FREE(db->sigs);
+    if (db->groups) FREE(db->groups);
+    FREE(db);
+err0:
+    fclose(file);
+    return NULL;
+}
+
+int os_detect_load(char const *filename)
+{
+    // Build under the lock as well, so that concurrent loads are published in generation order
+    mutex_lock(&os_db_lock);
+    struct os_db *db = os_db_new(filename);
+    if (! db) {
+        mutex_unlock(&os_db_lock);
+        return -1;
+    }
+    db->generation = ++ os_db_generation;
+
+    struct os_db *const prev = os_db;
+    __sync_synchronize();   // publish the database only once it's complete
+    os_db = db;
+    mutex_unlock(&os_db_lock);
+
+    if (prev) unref(&prev->ref);
+    return 0;
+}
+
+/*
+ * Matching
+ */
+
+static bool os_sig_match(struct os_sig const *sig, struct os_features const *f)
+{
+    if (sig->version && sig->version != f->version) return false;
+    if (sig->ttl_bad) {
+        if (f->ttl > sig->ttl) return false;
+    } else {
+        if (f->ttl > sig->ttl || sig->ttl > f->ttl + 20 /* MAX_DIST */) return false;
+    }
+    if (sig->mss >= 0 && (! f->mss_set || f->mss != sig->mss)) return false;
+    switch (sig->wsize_kind) {
+        case WSIZE_ANY:
+            break;
+        case WSIZE_EQ:
+            if (f->window != sig->wsize) return false;
+            break;
+        case WSIZE_MOD:
+            if (f->window % sig->wsize != 0) return false;
+            break;
+        case WSIZE_MSS:
+            if (! f->mss_set || f->window != f->mss * sig->wsize) return false;
+            break;
+    }
+    if (sig->wsf >= 0 && f->wsf_set && f->wsf != sig->wsf) return false;
+    if (sig->quirks & ~f->quirks) return false;
+    switch (sig->pclass) {
+        case PCLASS_ANY:
+            break;
+        case PCLASS_ZERO:
+            if (f->payload) return false;
+            break;
+        case PCLASS_NONZERO:
+            if (! f->payload) return false;
+            break;
+    }
+    return true;
+}
+
+static unsigned os_db_lookup(struct os_db const *db, struct os_features const *f)
+{
+    struct os_sig const *best = NULL, *best_generic = NULL;
+
+    uint32_t h = os_key_hash_init(f->direction, f->olen);
+    for (unsigned o = 0; ; o++) {
+        struct os_group const *const group = os_db_group(db, h, f->direction, f->olen, o, f->options);
+        if (group) {
+            for (unsigned s = 0; s < group->nb_sigs; s++) {
+                struct os_sig const *const sig = db->sigs + group->first_sig + s;
+                struct os_sig const **const b = sig->generic ? &best_generic : &best;
+                if (*b && (*b)->rank < sig->rank) continue; // cannot do better
+                if (os_sig_match(sig, f)) *b = sig;
             }
-          }
         }
-      }
+        if (o >= f->nb_options) break;
+        h = os_key_hash_next(h, f->options[o]);
+    }
+
+    if (best) return best->label;
+    if (best_generic) return best_generic->label;
+    return 0;
+}
+
+/*
+ * Per host cache
+ *
+ * Hosts usually send all their SYNs alike, so we remember the last result for each
+ * host. The cache is per thread, so that it needs no locking.
+ */
+
+#define OS_CACHE_SIZE 256   // must be a power of 2
+
+struct os_cache_entry {
+    unsigned generation;    // of the database this result comes from (0 for unused entries)
+    unsigned os;
+    struct ip_addr addr;
+    struct os_features features;
+};
+
+static __thread struct os_cache_entry os_cache[OS_CACHE_SIZE];
+
+static struct os_cache_entry *os_cache_entry(struct ip_addr const *addr)
+{
+    uint32_t h;
+    if (addr->family == AF_INET) {
+        h = addr->u.v4.s_addr;
+    } else {
+        uint32_t w[4];
+        memcpy(w, &addr->u.v6, sizeof(w));
+        h = w[0] ^ w[1] ^ w[2] ^ w[3];
+    }
+    h *= 2654435761U;
+    return os_cache + (h >> 24) % OS_CACHE_SIZE;
+}
+
+unsigned os_detect(struct ip_proto_info const *ip, struct tcp_proto_info const *tcp)
+{
+    if (! tcp->syn) return 0; // we are only interrested in SYNs/SYNACKS
+
+    // We are in the multi region, so the database can not be deleted under our feet
+    struct os_db const *const db = os_db;
+    if (! db) return 0;
+
+    struct os_features f;
+    os_features_ctor(&f, ip, tcp);
+
+    struct ip_addr const src = ip->key.addr[0];
+    struct os_cache_entry *const entry = os_cache_entry(&src);
+    if (
+        entry->generation == db->generation &&
+        ip_addr_eq(&entry->addr, &src) &&
+        0 == memcmp(&entry->features, &f, sizeof(f))
+    ) return entry->os;
+
+    unsigned const os = os_db_lookup(db, &f);
+    entry->generation = db->generation;
+    entry->os = os;
+    entry->addr = src;
+    entry->features = f;
+    return os;
+}
+
+char const *os_name(unsigned id)
+{
+    struct os_db const *const db = os_db;
+    if (! db) return id == 0 ? "unknown" : "INVALID";
+    if (id >= db->nb_labels) return "INVALID";
+    return db->labels[id];
+}
+
+/*
+ * Extension functions
+ */
+
+static struct ext_function sg_os_detect_load;
+static SCM g_os_detect_load(SCM filename_)
+{
+    char const *filename = scm_to_tempstr(filename_);
+    return scm_from_bool(0 == os_detect_load(filename));
+}
+
+static struct ext_function sg_os_detect_stats;
+static SCM nb_fingerprints_sym, nb_oses_sym, nb_groups_sym;
+static SCM g_os_detect_stats(void)
+{
+    enter_multi_region();
+    struct os_db const *const db = os_db;
+    unsigned nb_groups = 0;
+    if (db) {
+        for (unsigned g = 0; g <= db->group_mask; g++) nb_groups += db->groups[g].nb_sigs > 0;
     }
-  }
+    SCM ret = scm_list_3(
+        scm_cons(nb_fingerprints_sym, scm_from_uint(db ? db->nb_sigs : 0)),
+        scm_cons(nb_oses_sym, scm_from_uint(db ? db->nb_labels - 1 : 0)),
+        scm_cons(nb_groups_sym, scm_from_uint(nb_groups)));
+    leave_protected_region();
+    return ret;
+}
 
-  return 0;
+/*
+ * Init
+ */
+
+void os_detect_init(void)
+{
+    log_category_proto_os_detect_init();
+    mutex_ctor(&os_db_lock, "os_db");
+    os_db = NULL;
+
+    // Do not bark if p0f.fp was not installed
+    if (0 == access(default_fp_file, R_OK)) {
+        (void)os_detect_load(default_fp_file);
+    } else {
+        SLOG(LOG_INFO, "No fingerprints in %s, OS detection disabled until some are loaded", default_fp_file);
+    }
+
+    nb_fingerprints_sym = scm_permanent_object(scm_from_latin1_symbol("nb-fingerprints"));
+    nb_oses_sym         = scm_permanent_object(scm_from_latin1_symbol("nb-oses"));
+    nb_groups_sym       = scm_permanent_object(scm_from_latin1_symbol("nb-groups"));
+
+    ext_function_ctor(&sg_os_detect_load,
+        "os-detect-load", 1, 0, 0, g_os_detect_load,
+        "(os-detect-load \"p0f.fp\"): replace the fingerprints used for OS detection with those of this file.\n"
+        "Only the [tcp:request] and [tcp:response] sections are used.\n"
+        "Returns #f if the file cannot be read, in which case previous fingerprints are kept.\n");
+    ext_function_ctor(&sg_os_detect_stats,
+        "os-detect-stats", 0, 0, 0, g_os_detect_stats,
+        "(os-detect-stats): returns some informations about the fingerprints used for OS detection.\n");
 }
 
-void os_detect_init(void) {}
+void os_detect_fini(void)
+{
+    if (os_db) {
+        unref(&os_db->ref);
+        os_db = NULL;
+    }
+    mutex_dtor(&os_db_lock);
+    log_category_proto_os_detect_fini();
+}
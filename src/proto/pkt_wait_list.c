@@ -23,6 +23,8 @@
 #include "junkie/tools/log.h"
 #include "junkie/tools/ext.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/arena.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/tools/mallocer.h"  // for overweight
 #include "junkie/tools/bench.h"
 #include "junkie/proto/pkt_wait_list.h"
@@ -33,64 +35,203 @@
 LOG_CATEGORY_DEF(pkt_wait_list);
 
 /*
- * Destruction of a pending packet
+ * Tree of pending packets
  */
 
-/* There is no such thing as a destructor for proto_info, since they are constructed on the stack.
- * Also, notice that normaly the pointer to parser is not a counted ref since these proto_info are normaly
- * build on the stack, but for our copies on the heap we need a proper ref, so we unref them here. */
-static void proto_info_del_rec(struct proto_info *info)
+/* Pending packets are kept in an AVL tree ordered by offset, packets with equal offsets being
+ * ordered by arrival (so that the age of a WL, estimated from the cap_tv of its first packet,
+ * is more accurate). Each node also knows the max next_offset of its subtree, so that we can
+ * tell in O(log n) whether a new packet is covered by the pending ones. */
+
+static unsigned node_height(struct pkt_wait const *pkt)
 {
-    void *start = (void *)info->parser->proto->ops->info_addr(info, NULL);
+    return pkt ? pkt->node.height : 0;
+}
 
-    parser_unref(&info->parser);
+static void node_update(struct pkt_wait *pkt)
+{
+    struct pkt_wait const *const l = pkt->node.left, *const r = pkt->node.right;
+    pkt->node.height = 1 + MAX(node_height(l), node_height(r));
+    pkt->node.max_next_offset = pkt->next_offset;
+    if (l) pkt->node.max_next_offset = MAX(pkt->node.max_next_offset, l->node.max_next_offset);
+    if (r) pkt->node.max_next_offset = MAX(pkt->node.max_next_offset, r->node.max_next_offset);
+}
 
-    if (info->parent) {
-        proto_info_del_rec(info->parent);
-        info->parent = NULL;
+// Put new in place of old in the tree (new may be NULL)
+static void node_replace(struct pkt_wait_list *pkt_wl, struct pkt_wait *old, struct pkt_wait *new)
+{
+    struct pkt_wait *const up = old->node.up;
+    if (new) new->node.up = up;
+    if (! up) {
+        pkt_wl->root = new;
+    } else if (up->node.left == old) {
+        up->node.left = new;
+    } else {
+        assert(up->node.right == old);
+        up->node.right = new;
     }
+}
 
-    objfree(start);
+// Returns the new root of the subtree
+static struct pkt_wait *node_rotate_left(struct pkt_wait_list *pkt_wl, struct pkt_wait *pkt)
+{
+    struct pkt_wait *const r = pkt->node.right;
+    pkt->node.right = r->node.left;
+    if (r->node.left) r->node.left->node.up = pkt;
+    node_replace(pkt_wl, pkt, r);
+    r->node.left = pkt;
+    pkt->node.up = r;
+    node_update(pkt);
+    node_update(r);
+    return r;
+}
+
+static struct pkt_wait *node_rotate_right(struct pkt_wait_list *pkt_wl, struct pkt_wait *pkt)
+{
+    struct pkt_wait *const l = pkt->node.left;
+    pkt->node.left = l->node.right;
+    if (l->node.right) l->node.right->node.up = pkt;
+    node_replace(pkt_wl, pkt, l);
+    l->node.right = pkt;
+    pkt->node.up = l;
+    node_update(pkt);
+    node_update(l);
+    return l;
+}
+
+// Update heights and max_next_offsets from pkt up to the root, rebalancing on the way
+static void node_rebalance(struct pkt_wait_list *pkt_wl, struct pkt_wait *pkt)
+{
+    while (pkt) {
+        node_update(pkt);
+        struct pkt_wait *const l = pkt->node.left, *const r = pkt->node.right;
+        if (node_height(l) > node_height(r) + 1) {
+            if (node_height(l->node.left) < node_height(l->node.right)) node_rotate_left(pkt_wl, l);
+            pkt = node_rotate_right(pkt_wl, pkt);
+        } else if (node_height(r) > node_height(l) + 1) {
+            if (node_height(r->node.right) < node_height(r->node.left)) node_rotate_right(pkt_wl, r);
+            pkt = node_rotate_left(pkt_wl, pkt);
+        }
+        pkt = pkt->node.up;
+    }
 }
 
-static struct proto_info *copy_info_rec(struct proto_info *info)
+static struct pkt_wait *pkt_wait_next(struct pkt_wait *pkt)
 {
-    if (! info) return NULL;
+    if (pkt->node.right) {
+        pkt = pkt->node.right;
+        while (pkt->node.left) pkt = pkt->node.left;
+        return pkt;
+    }
+    while (pkt->node.up && pkt->node.up->node.right == pkt) pkt = pkt->node.up;
+    return pkt->node.up;
+}
 
-    struct proto_info *parent = copy_info_rec(info->parent);
+// Returns the last pkt which offset is <= offset, ie the one a new packet at this offset would be inserted after
+static struct pkt_wait *pkt_wait_list_prev(struct pkt_wait_list *pkt_wl, unsigned offset)
+{
+    struct pkt_wait *prev = NULL;
+    for (struct pkt_wait *pkt = pkt_wl->root; pkt; ) {
+        if (pkt->offset <= offset) {
+            prev = pkt;
+            pkt = pkt->node.right;
+        } else {
+            pkt = pkt->node.left;
+        }
+    }
+    return prev;
+}
 
-    size_t size;
-    void *start = (void *)info->parser->proto->ops->info_addr(info, &size);
-    void *copy = objalloc_nice(size, "waiting infos");
-    if (! copy) {
-        SLOG(LOG_WARNING, "Cannot alloc for pending info");
-        if (parent) proto_info_del_rec(parent);
-        return NULL;
+// Tells whether some pending packet starting at or before offset reaches next_offset
+static bool pkt_wait_list_covers(struct pkt_wait_list *pkt_wl, unsigned offset, unsigned next_offset)
+{
+    for (struct pkt_wait *pkt = pkt_wl->root; pkt; ) {
+        if (pkt->offset <= offset) {
+            if (pkt->next_offset >= next_offset) return true;
+            if (pkt->node.left && pkt->node.left->node.max_next_offset >= next_offset) return true;
+            pkt = pkt->node.right;
+        } else {
+            pkt = pkt->node.left;
+        }
     }
-    memcpy(copy, start, size);
+    return false;
+}
 
-    struct proto_info *copy_info = (struct proto_info *)(((char *)copy) + ((char *)info - (char *)start));
-    copy_info->parent = parent;
-    copy_info->parser = parser_ref(info->parser);
+// caller must own list->mutex
+static void pkt_wait_insert(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
+{
+    pkt->node.left = pkt->node.right = NULL;
+    pkt->node.height = 1;
+    pkt->node.max_next_offset = pkt->next_offset;
+
+    struct pkt_wait *up = NULL;
+    struct pkt_wait **where = &pkt_wl->root;
+    bool leftmost = true;
+    while (*where) {
+        up = *where;
+        if (pkt->offset < up->offset) {
+            where = &up->node.left;
+        } else {    // equal offsets: after the older packet
+            where = &up->node.right;
+            leftmost = false;
+        }
+    }
+    pkt->node.up = up;
+    *where = pkt;
+    if (leftmost) pkt_wl->first = pkt;
+    node_rebalance(pkt_wl, up);
 
-    return copy_info;
+    (void)__sync_add_and_fetch(&pkt_wl->nb_pkts, 1);    // see pkt_wait_list_parse_in_order()
+    pkt_wl->tot_payload += pkt->cap_len;
 }
 
 // caller must own list->mutex
-static void pkt_wait_dtor(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
+static void pkt_wait_remove(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
 {
-    SLOG(LOG_DEBUG, "Destruct pkt@%p", pkt);
+    if (pkt_wl->first == pkt) pkt_wl->first = pkt_wait_next(pkt);
+
+    struct pkt_wait *rebalance_from;
+    if (pkt->node.left && pkt->node.right) {
+        // Replace pkt by its successor, which has no left child
+        struct pkt_wait *succ = pkt->node.right;
+        while (succ->node.left) succ = succ->node.left;
+        if (succ->node.up == pkt) {
+            rebalance_from = succ;
+        } else {
+            rebalance_from = succ->node.up;
+            rebalance_from->node.left = succ->node.right;
+            if (succ->node.right) succ->node.right->node.up = rebalance_from;
+            succ->node.right = pkt->node.right;
+            succ->node.right->node.up = succ;
+        }
+        succ->node.left = pkt->node.left;
+        succ->node.left->node.up = succ;
+        node_replace(pkt_wl, pkt, succ);
+    } else {
+        rebalance_from = pkt->node.up;
+        node_replace(pkt_wl, pkt, pkt->node.left ? pkt->node.left : pkt->node.right);
+    }
+    node_rebalance(pkt_wl, rebalance_from);
 
     assert(pkt_wl->nb_pkts > 0);
     assert(pkt_wl->tot_payload >= pkt->cap_len);
-    LIST_REMOVE(pkt, entry);
-    pkt_wl->nb_pkts --;
     pkt_wl->tot_payload -= pkt->cap_len;
+    (void)__sync_sub_and_fetch(&pkt_wl->nb_pkts, 1);    // last, once we are done with this list
+}
 
-    if (pkt->parent) {
-        proto_info_del_rec(pkt->parent);
-        pkt->parent = NULL;
-    }
+/*
+ * Destruction of a pending packet
+ */
+
+// caller must own list->mutex
+static void pkt_wait_dtor(struct pkt_wait *pkt, struct pkt_wait_list *pkt_wl)
+{
+    SLOG(LOG_DEBUG, "Destruct pkt@%p", pkt);
+
+    pkt_wait_remove(pkt, pkt_wl);
+
+    pkt->parent = NULL;
+    arena_unref(&pkt->arena);
 }
 
 // caller must own list->mutex
@@ -144,9 +285,10 @@ static enum proto_parse_status pkt_wait_finalize(struct pkt_wait *pkt, struct pk
         SLOG(LOG_DEBUG, "Advertise a gap of %zu bytes", gap);
         pkt_wl->next_offset = pkt->offset;
         // We can't merely borrow pkt parent since proto_parse is going to flag it when calling subscribers (which would prevent callback of subscribers for actual packet)
-        struct proto_info *copy = copy_info_rec(pkt->parent);
+        struct arena *arena;
+        struct proto_info *copy = proto_info_copy_stack(pkt->parent, 0, &arena);
         enum proto_parse_status status = proto_parse_or_die(&pkt_wl->parser, copy, pkt->way, NULL, 0, gap, &pkt->cap_tv, 0, NULL);
-        proto_info_del_rec(copy);
+        arena_unref(&arena);
         return status;
     }
 
@@ -196,10 +338,12 @@ static int pkt_wait_ctor(struct pkt_wait *pkt, unsigned offset, unsigned next_of
     memcpy(pkt->packet, tot_packet, tot_cap_len);
 
     if (parent) {
-        pkt->parent = copy_info_rec(parent);
+        // Of its own, or each waiting packet would pin the whole arena of its packet
+        pkt->parent = proto_info_copy_stack_exact(parent, 0, &pkt->arena, NULL);
         if (! pkt->parent) return -1;
     } else {
         pkt->parent = NULL;
+        pkt->arena = NULL;
     }
 
     return 0;
@@ -235,7 +379,8 @@ static void *pkt_wl_config_timeouter_thread_(void *config_)
     (void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &dummy_oldstate);
 
     while (1) {
-        enter_mono_region();
+        // Deleted waiting lists and parsers are reclaimed by the doomer, so we need not stop parsing
+        enter_multi_region();
         static struct bench_event timeouting_wl = BENCH("timeout waiting lists");
         uint64_t start = bench_event_start();
         for (unsigned h = 0; h < NB_ELEMS(config->lists); h++) {
@@ -274,7 +419,7 @@ static enum proto_parse_status pkt_wait_list_empty(struct pkt_wait_list *pkt_wl)
 {
     enum proto_parse_status last_status = PROTO_OK;
     struct pkt_wait *pkt;
-    while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
+    while (NULL != (pkt = pkt_wl->first)) {
         last_status = pkt_wait_finalize(pkt, pkt_wl);
     }
     assert(pkt_wl->nb_pkts == 0);
@@ -296,8 +441,8 @@ enum proto_parse_status pkt_wait_list_flush(struct pkt_wait_list *pkt_wl, uint8_
         struct parser *parser = pkt_wl->parser; // transfert the ref to this local variable
         pkt_wl->parser = NULL;
         struct pkt_wait *pkt;
-        while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
-            if (LIST_IS_LAST(pkt, entry)) {
+        while (NULL != (pkt = pkt_wl->first)) {
+            if (! pkt_wait_next(pkt)) {
                 last_status = proto_parse(parser, pkt->parent, pkt->way, payload, cap_len, wire_len, &pkt->cap_tv, pkt->tot_cap_len, pkt->packet);   // FIXME: once again, payload not within pkt->packet !
                 pkt_wait_del_nolock(pkt, pkt_wl);
             } else {
@@ -317,7 +462,7 @@ int pkt_wait_list_ctor(struct pkt_wait_list *pkt_wl, unsigned next_offset, struc
 {
     SLOG(LOG_DEBUG, "Construct pkt_wait_list @%p", pkt_wl);
 
-    LIST_INIT(&pkt_wl->pkts);
+    pkt_wl->root = pkt_wl->first = NULL;
     pkt_wl->nb_pkts = 0;
     pkt_wl->tot_payload = 0;
     pkt_wl->next_offset = next_offset;
@@ -428,7 +573,7 @@ static bool pkt_wait_list_try_locked(struct pkt_wait_list *pkt_wl, enum proto_pa
     bool ret = false;
 
     struct pkt_wait *pkt;
-    while (NULL != (pkt = LIST_FIRST(&pkt_wl->pkts))) {
+    while (NULL != (pkt = pkt_wl->first)) {
         SLOG(LOG_DEBUG, "pkt_wait_list_try_locked pkt=%p, force_timeout=%s", pkt, force_timeout?"yes":"no");
 
         bool const wait_same_dir = !pkt_wl->config->allow_partial || pkt->offset > pkt_wl->next_offset;
@@ -479,18 +624,8 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
     SLOG(LOG_DEBUG, "Add a packet of %zu bytes at offset %u to waiting list @%p (currently at %u)", wire_len, offset, pkt_wl, pkt_wl->next_offset);
     if (sync) SLOG(LOG_DEBUG, "  ...waiting for reciprocal waiting list @%p to reach offset %u (currently at %u)", pkt_wl->sync_with, sync_offset, pkt_wl->sync_with->next_offset);
 
-    // Find its location and the previous pkt
-    /* Note that in case of equal seqnums we want the older packet first,
-     * so that age of this WL, estimated from the cap_tv of its first packet, is more accurate. */
-    struct pkt_wait *prev = NULL;
-    struct pkt_wait *next;
-    LIST_FOREACH(next, &pkt_wl->pkts, entry) {
-        // Stop whenever the next packet must be sent after (try to preserve packet numbers and order of arrival for subscribers)
-        if (offset < next->offset) {
-            break;
-        }
-        prev = next;
-    }
+    // Find the previous pkt (in case of equal seqnums we want the older packet first, see pkt_wait_insert)
+    struct pkt_wait *const prev = pkt_wait_list_prev(pkt_wl, offset);
 
     // if previous == NULL and pkt_wl->next_offset == offset _and_ we don't wait for another list then we can call proto_parse directly and then advance next_offset.
     if (! prev && pkt_wl->next_offset == offset && can_parse && (!pkt_wl->sync_with || !sync || pkt_wl->sync_with->next_offset >= sync_offset)) {
@@ -506,7 +641,7 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
         // Now parse as much as we can while advancing next_offset, returning the first error we obtain
         pkt_wl->next_offset = next_offset;
         while (ret == PROTO_OK) {
-            struct pkt_wait *pkt = LIST_FIRST(&pkt_wl->pkts);
+            struct pkt_wait *pkt = pkt_wl->first;
             if (! pkt) break;
             if (pkt->offset > pkt_wl->next_offset) break;
             if (pkt_wl->sync_with && sync && pkt_wl->sync_with->next_offset < pkt->sync_offset) break;
@@ -515,6 +650,16 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
         goto quit;
     }
 
+    // else if its content was already parsed or is pending (retransmission) then call subscribers directly, no need to store it
+    if (
+        offset < next_offset &&
+        (next_offset <= pkt_wl->next_offset || pkt_wait_list_covers(pkt_wl, offset, next_offset))
+    ) {
+        SLOG(LOG_DEBUG, "Packet @(%u:%u) is already covered", offset, next_offset);
+        ret = proto_parse_or_die(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);
+        goto quit;
+    }
+
     // else if gap after previous > acceptable_gap then call subscribers directly and we are done
     unsigned prev_offset = prev ? prev->next_offset : pkt_wl->next_offset;
     if (
@@ -531,13 +676,7 @@ enum proto_parse_status pkt_wait_list_add(struct pkt_wait_list *pkt_wl, unsigned
         goto quit;
     }
 
-    if (prev) {
-        LIST_INSERT_AFTER(prev, pkt, entry);
-    } else {
-        LIST_INSERT_HEAD(&pkt_wl->pkts, pkt, entry);
-    }
-    pkt_wl->nb_pkts ++;
-    pkt_wl->tot_payload += pkt->cap_len;
+    pkt_wait_insert(pkt, pkt_wl);
 
     // Maybe this packet content is enough to allow parsing (we end here in case its content overlap what's already there)
     if (can_parse && pkt->offset <= pkt_wl->next_offset && (! pkt_wl->sync_with || !sync || pkt_wl->sync_with->next_offset >= pkt->sync_offset)) {
@@ -555,6 +694,38 @@ quit:
     return ret;
 }
 
+/* Packets are only ever added by the thread owning the lists (as the caller promised), while
+ * other threads (timeouter, size limits of the other list) can only finalize pending packets,
+ * which they do with the list mutex held until the very end where nb_pkts is decremented.
+ * So once we saw both lists empty, nobody else will touch their parser or next_offset until
+ * we add another packet. */
+bool pkt_wait_list_parse_in_order(struct pkt_wait_list *pkt_wl, enum proto_parse_status *status, unsigned offset, unsigned next_offset, bool sync, unsigned sync_offset, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
+{
+    if (! pkt_wl->list) return false;
+    if (pkt_wl->nb_pkts > 0) return false;
+    if (pkt_wl->sync_with && pkt_wl->sync_with->nb_pkts > 0) return false;
+    __sync_synchronize();   // read next_offset and parsers after nb_pkts
+
+    if (pkt_wl->next_offset != offset) return false;
+    if (! pkt_wl->parser) return false;
+    if (pkt_wl->sync_with && sync && pkt_wl->sync_with->next_offset < sync_offset) return false;
+
+    // The timeouter uses last_used as the current time, but we need not update it more than once a second
+    if (unlikely_(now->tv_sec > pkt_wl->list->last_used.tv_sec) && 0 == supermutex_lock(&pkt_wl->list->mutex)) {
+        timeval_set_max(&pkt_wl->list->last_used, now);
+        supermutex_unlock(&pkt_wl->list->mutex);
+    }
+
+    SLOG(LOG_DEBUG, "Parsing in order packet at offset %u of waiting list @%p", offset, pkt_wl);
+    *status = proto_parse_or_die(&pkt_wl->parser, parent, way, packet, cap_len, wire_len, now, tot_cap_len, tot_packet);
+    pkt_wl->next_offset = next_offset;
+
+    if (*status == PROTO_PARSE_ERR && pkt_wl->sync_with) {
+        parser_unref(&pkt_wl->sync_with->parser);
+    }
+    return true;
+}
+
 // returns true if we processed some packet
 bool pkt_wait_list_try(struct pkt_wait_list *pkt_wl, enum proto_parse_status *status, struct timeval const *now, bool force_timeout)
 {
@@ -588,8 +759,8 @@ bool pkt_wait_list_try_both(struct pkt_wait_list *pkt_wl, enum proto_parse_statu
                 /* If pkt_wl ack_num is beyond pkt_wl->sync_with seq_num then we must start by pkt_wl->sync_with.
                  * In the other way around we must start by pkt_wl. If no ack_num comes after any seq_num then
                  * we don't care. */
-                struct pkt_wait *const pkt = LIST_FIRST(&pkt_wl->pkts);
-                struct pkt_wait *const sync_with_pkt = LIST_FIRST(&pkt_wl->sync_with->pkts);
+                struct pkt_wait *const pkt = pkt_wl->first;
+                struct pkt_wait *const sync_with_pkt = pkt_wl->sync_with->first;
                 if (pkt && sync_with_pkt && pkt->sync_offset > sync_with_pkt->offset) {
                     // We must start with the other direction
                     if (! pkt_wait_list_try(pkt_wl->sync_with, status, now, true)) assert(!"Low battery");
@@ -619,7 +790,7 @@ bool pkt_wait_list_is_complete(struct pkt_wait_list *pkt_wl, unsigned start_offs
     if (! pkt_wl->list) return false;
     if (0 != supermutex_lock(&pkt_wl->list->mutex)) return false;   // will retry later
 
-    LIST_FOREACH(pkt, &pkt_wl->pkts, entry) {
+    for (pkt = pkt_wl->first; pkt; pkt = pkt_wait_next(pkt)) {
         if (pkt->next_offset <= end) continue;
         if (pkt->offset > end) break;
         end = pkt->next_offset;
@@ -651,7 +822,7 @@ uint8_t *pkt_wait_list_reassemble(struct pkt_wait_list *pkt_wl, unsigned start_o
 
     unsigned end = start_offset;   // we filled payload up to there
     struct pkt_wait *pkt;
-    LIST_FOREACH(pkt, &pkt_wl->pkts, entry) {
+    for (pkt = pkt_wl->first; pkt; pkt = pkt_wait_next(pkt)) {
         if (end == end_offset) break;
         if (pkt->next_offset <= end) continue;
         if (pkt->offset > end) break;
@@ -757,6 +928,7 @@ static SCM g_wait_list_set_timeout(SCM name_, SCM timeout_)
 
 void pkt_wait_list_init(void)
 {
+    arena_init();
     log_category_pkt_wait_list_init();
     mutex_ctor(&pkt_wl_configs_mutex, "pkt_wls_list");
 
@@ -798,4 +970,5 @@ void pkt_wait_list_fini(void)
 {
     log_category_pkt_wait_list_fini();
     mutex_dtor(&pkt_wl_configs_mutex);
+    arena_fini();
 }
@@ -298,6 +298,16 @@ static enum proto_parse_status cursor_read_msg(struct cursor *cursor, uint8_t *t
     return PROTO_OK;
 }
 
+// Tells whether a whole (typed) message is available
+static bool pg_msg_ready(struct streambuf_cursor *cursor)
+{
+    uint8_t hdr[5]; // type and length
+    if (0 != streambuf_cursor_read(cursor, hdr, sizeof(hdr))) return false;
+    size_t const len = READ_U32N(hdr+1);
+    if (len < 4) return true;   // let the parser fail
+    return cursor->rem_size >= len - 4;
+}
+
 static enum proto_parse_status pg_parse_init(struct pgsql_parser *pg_parser, struct sql_proto_info *info, unsigned way, uint8_t const *payload, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
 {
     info->msg_type = SQL_STARTUP;
@@ -457,7 +467,7 @@ static enum proto_parse_status pg_parse_query(struct pgsql_parser *pg_parser, st
             else if (status == PROTO_TOO_SHORT) {
                 SLOG(LOG_DEBUG, "Payload too short for parsing message, will restart");
                 status = proto_parse(NULL, &info->info, way, NULL, 0, 0, now, tot_cap_len, tot_packet);    // ack what we had so far
-                streambuf_set_restart(&pg_parser->sbuf, way, msg_start, true);
+                streambuf_set_restart_ready(&pg_parser->sbuf, way, msg_start, pg_msg_ready);
                 return PROTO_OK;
             }
 
@@ -19,6 +19,7 @@
  */
 #include <stdio.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <assert.h>
 #include <string.h>
 #include "junkie/cpp.h"
@@ -28,6 +29,7 @@
 #include "junkie/tools/timeval.h"
 #include "junkie/tools/jhash.h"
 #include "junkie/tools/objalloc.h"
+#include "junkie/tools/arena.h"
 #include "junkie/proto/serialize.h"
 #include "junkie/proto/proto.h"
 #include "junkie/tools/mallocer.h"  // for overweight
@@ -293,6 +295,97 @@ void proto_info_deserialize(struct proto_info *info, uint8_t const **buf)
     info->pkt_sbc_called = false;
 }
 
+/* There is no such thing as a destructor for proto_info, since they are constructed on the stack.
+ * So when an info must outlive the parse (a packet put on hold, an event for an asynchronous
+ * subscriber...) we copy the whole proto_info stack, in one go, into an arena (the one of the
+ * current packet if we are parsing one, unless the copy is to be kept long) that the user then pins.
+ * Also, notice that normaly the pointer to parser is not a counted ref since these proto_info are normaly
+ * build on the stack, but for our copies we need a proper ref, that's released along with the arena. */
+#define MAX_INFO_DEPTH 32
+
+static void info_stack_unref_parsers(void *last_)
+{
+    for (struct proto_info *info = last_; info; info = info->parent) {
+        parser_unref(&info->parser);
+    }
+}
+
+static struct proto_info *proto_info_copy_stack_(struct proto_info const *info, size_t extra, struct arena **arena, bool exact, size_t *size)
+{
+    *arena = NULL;
+    if (! info) return NULL;
+
+    if (overweight) {
+        TIMED_SLOG(LOG_ERR, "Cannot copy infos due to overweight");
+        return NULL;
+    }
+
+    struct proto_info const *infos[MAX_INFO_DEPTH];
+    void const *starts[MAX_INFO_DEPTH];
+    size_t sizes[MAX_INFO_DEPTH];
+    unsigned depth = 0;
+    size_t tot_size = arena_cleanup_size() + (extra ? extra + ARENA_ALIGN : 0);
+    for (; info; info = info->parent) {
+        if (depth >= NB_ELEMS(infos)) {
+            SLOG(LOG_WARNING, "Cannot copy infos: stack too deep");
+            return NULL;
+        }
+        if (! info->parser) {   // then we can't tell its size
+            SLOG(LOG_DEBUG, "Cannot copy infos: no parser");
+            return NULL;
+        }
+        starts[depth] = info->parser->proto->ops->info_addr(info, sizes+depth);
+        infos[depth] = info;
+        tot_size += sizes[depth] + ARENA_ALIGN;  // leave room for alignment
+        depth ++;
+    }
+
+    struct arena *a = NULL;
+    if (exact) {
+        a = arena_new_exact(tot_size);
+        if (size) *size = tot_size;
+    } else {
+        a = arena_packet(tot_size);
+        if (a) {
+            a = arena_ref(a);
+        } else {    // not parsing a packet (or out of memory)
+            a = arena_new(tot_size);
+        }
+    }
+    if (! a) {
+        SLOG(LOG_WARNING, "Cannot alloc for info copy");
+        return NULL;
+    }
+
+    // Copy from the root so that the parent of each copy is known
+    struct proto_info *parent = NULL;
+    for (unsigned d = depth; d-- > 0; ) {
+        void *copy = arena_alloc(a, sizes[d]);
+        assert(copy);   // arena_packet/arena_new did check there was room enough
+        memcpy(copy, starts[d], sizes[d]);
+        struct proto_info *copy_info = (struct proto_info *)(((char *)copy) + ((char const *)infos[d] - (char const *)starts[d]));
+        copy_info->parent = parent;
+        copy_info->parser = parser_ref(infos[d]->parser);
+        parent = copy_info;
+    }
+
+    int err = arena_add_cleanup(a, info_stack_unref_parsers, parent);
+    assert(! err);
+
+    *arena = a;
+    return parent;
+}
+
+struct proto_info *proto_info_copy_stack(struct proto_info const *info, size_t extra, struct arena **arena)
+{
+    return proto_info_copy_stack_(info, extra, arena, false, NULL);
+}
+
+struct proto_info *proto_info_copy_stack_exact(struct proto_info const *info, size_t extra, struct arena **arena, size_t *size)
+{
+    return proto_info_copy_stack_(info, extra, arena, true, size);
+}
+
 /*
  * Parsers
  */
@@ -444,13 +537,322 @@ static struct mutex *mutex_of_subparser(struct mux_subparser *subparser)
     return mutex_of_subparser_(subparser, subparser->h_idx);
 }
 
+/*
+ * Open addressing index of subparsers
+ *
+ * When hash_size is 0, a mux_parser stores its subparsers in a mux_index rather than in a fixed
+ * size hash of STAILQs. The index is split into MUX_INDEX_SHARDS shards, and the shard number is
+ * used as the h_idx of the subparsers so that each shard is protected by its own mux_proto mutex
+ * (and its subparsers timeouted from the corresponding timer wheel) as usual.
+ * Each shard is an open addressing table of cache line sized buckets storing a 16 bits fingerprint
+ * of the key next to each subparser pointer, so that most of the time only the matching subparser
+ * is dereferenced. Each bucket also counts how many entries had to be stored further because it
+ * was full, so that probing stops at the first bucket nobody went past (and this count goes down
+ * as these entries are removed, so that churn does not lengthen the probes).
+ * Shards grow online: when one gets too loaded, a table twice as big is allocated and the buckets
+ * of the former one are moved a few at a time by the following operations.
+ */
+
+#define MUX_INDEX_SHARDS 8U     // must not exceed CPU_MAX
+#define MUX_BUCKET_SLOTS 6      // so that a bucket fits a 64 bytes cache line
+#define MUX_MIGRATE_STEP 4      // nb of former buckets moved by each operation during a resize
+#define MUX_EVICT_SAMPLES 32    // nb of subparsers considered when looking for the least recently used
+
+struct mux_bucket {
+    uint16_t fps[MUX_BUCKET_SLOTS]; // fingerprints of the keys (0 for a free slot)
+    uint32_t nb_displaced;          // nb entries which probe went past this bucket because it was full
+    struct mux_subparser *subparsers[MUX_BUCKET_SLOTS];
+};
+
+struct mux_table {
+    unsigned mask;                  // nb buckets - 1
+    struct mux_bucket *buckets;     // NULL if not allocated yet
+};
+
+struct mux_index {
+    struct mux_shard {
+        unsigned nb_entries;
+        struct mux_table cur;
+        struct mux_table old;       // the table we are moving entries from, if resizing
+        unsigned nb_migrated;       // how many buckets of old were moved already
+        unsigned evict_cursor;      // where mux_index_oldest will start looking next time
+    } shards[MUX_INDEX_SHARDS];
+};
+
+struct mux_hash {
+    uint32_t h;
+    uint16_t fp;
+};
+
+#define ANY_VALUE 0x432317F5U
+static struct mux_hash mux_hash_of_key(void const *key, size_t key_sz)
+{
+    uint32_t h = ANY_VALUE, h2 = 0;
+    hashlittle2(key, key_sz, &h, &h2);
+    struct mux_hash const hash = { .h = h, .fp = (h2 & 0xffffU) ? (h2 & 0xffffU) : 1 };
+    return hash;
+}
+
+static unsigned mux_shard_of_hash(struct mux_hash const *hash)
+{
+    return hash->h % MUX_INDEX_SHARDS;
+}
+
+static unsigned mux_table_home(struct mux_table const *table, struct mux_hash const *hash)
+{
+    return (hash->h / MUX_INDEX_SHARDS) & table->mask;
+}
+
+static int mux_table_ctor(struct mux_table *table, unsigned nb_buckets)
+{
+    assert(0 == (nb_buckets & (nb_buckets-1)));
+    MALLOCER(mux_indexes);
+    table->buckets = MALLOC(mux_indexes, nb_buckets * sizeof(*table->buckets));
+    if (! table->buckets) return -1;
+    memset(table->buckets, 0, nb_buckets * sizeof(*table->buckets));
+    table->mask = nb_buckets - 1;
+    return 0;
+}
+
+static void mux_table_dtor(struct mux_table *table)
+{
+    if (table->buckets) FREE(table->buckets);
+    table->buckets = NULL;
+    table->mask = 0;
+}
+
+static int mux_table_insert(struct mux_table *table, struct mux_hash const *hash, struct mux_subparser *subparser)
+{
+    unsigned const home = mux_table_home(table, hash);
+    unsigned b = home;
+    for (unsigned n = 0; n <= table->mask; n++, b = (b+1) & table->mask) {
+        struct mux_bucket *const bucket = table->buckets + b;
+        for (unsigned s = 0; s < MUX_BUCKET_SLOTS; s++) {
+            if (bucket->fps[s]) continue;
+            bucket->fps[s] = hash->fp;
+            bucket->subparsers[s] = subparser;
+            // Lookups of this entry will have to go past the full buckets in between
+            for (unsigned d = home; d != b; d = (d+1) & table->mask) table->buckets[d].nb_displaced ++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Free the given slot of bucket b, where an entry of this hash was stored
+static void mux_table_unset(struct mux_table *table, struct mux_hash const *hash, unsigned b, unsigned s)
+{
+    table->buckets[b].fps[s] = 0;
+    for (unsigned d = mux_table_home(table, hash); d != b; d = (d+1) & table->mask) {
+        assert(table->buckets[d].nb_displaced > 0);
+        table->buckets[d].nb_displaced --;
+    }
+}
+
+// Returns the first subparser with this key (and this proto, if given)
+static struct mux_subparser *mux_table_find(struct mux_table const *table, struct mux_hash const *hash, size_t key_size, struct proto const *proto, void const *key, unsigned *nb_colls)
+{
+    if (! table->buckets) return NULL;
+
+    unsigned b = mux_table_home(table, hash);
+    for (unsigned n = 0; n <= table->mask; n++, b = (b+1) & table->mask) {
+        struct mux_bucket const *const bucket = table->buckets + b;
+        for (unsigned s = 0; s < MUX_BUCKET_SLOTS; s++) {
+            if (bucket->fps[s] != hash->fp) continue;
+            struct mux_subparser *const subparser = bucket->subparsers[s];
+            if (
+                (!proto || subparser->parser->proto == proto) &&
+                0 == memcmp(subparser->key, key, key_size)
+            ) {
+                return subparser;
+            }
+            (*nb_colls) ++;
+        }
+        if (! bucket->nb_displaced) break;
+        (*nb_colls) ++;
+    }
+    return NULL;
+}
+
+static bool mux_table_remove(struct mux_table *table, struct mux_hash const *hash, struct mux_subparser *subparser)
+{
+    if (! table->buckets) return false;
+
+    unsigned b = mux_table_home(table, hash);
+    for (unsigned n = 0; n <= table->mask; n++, b = (b+1) & table->mask) {
+        struct mux_bucket *const bucket = table->buckets + b;
+        for (unsigned s = 0; s < MUX_BUCKET_SLOTS; s++) {
+            if (bucket->fps[s] != hash->fp || bucket->subparsers[s] != subparser) continue;
+            mux_table_unset(table, hash, b, s);
+            return true;
+        }
+        if (! bucket->nb_displaced) break;
+    }
+    return false;
+}
+
+// Move at most nb_buckets buckets from the former table into the current one
+static void mux_shard_migrate(struct mux_shard *shard, size_t key_size, unsigned nb_buckets)
+{
+    while (shard->old.buckets && nb_buckets--) {
+        struct mux_bucket *const bucket = shard->old.buckets + shard->nb_migrated;
+        for (unsigned s = 0; s < MUX_BUCKET_SLOTS; s++) {
+            if (! bucket->fps[s]) continue;
+            struct mux_subparser *const subparser = bucket->subparsers[s];
+            struct mux_hash const hash = mux_hash_of_key(subparser->key, key_size);
+            int const unused_ err = mux_table_insert(&shard->cur, &hash, subparser);
+            assert(! err);  // the current table is at least twice as big
+            mux_table_unset(&shard->old, &hash, shard->nb_migrated, s);
+        }
+        if (++ shard->nb_migrated > shard->old.mask) mux_table_dtor(&shard->old);
+    }
+}
+
+static int mux_shard_grow(struct mux_shard *shard, struct mux_proto *mux_proto)
+{
+    mux_shard_migrate(shard, mux_proto->key_size, UINT_MAX);  // finish previous resize first
+
+    struct mux_table table;
+    if (0 != mux_table_ctor(&table, shard->cur.buckets ? 2 * (shard->cur.mask + 1) : 1)) return -1;
+
+    if (shard->cur.buckets) {
+        SLOG(LOG_DEBUG, "Growing a shard of %s index to %u buckets", mux_proto->proto.name, table.mask+1);
+        shard->old = shard->cur;
+        shard->nb_migrated = 0;
+#       ifdef __GNUC__
+        (void)__sync_add_and_fetch(&mux_proto->nb_resizes, 1);
+#       else
+        mux_proto->nb_resizes ++;
+#       endif
+    }
+    shard->cur = table;
+    return 0;
+}
+
+static struct mux_index *mux_index_new(void)
+{
+    struct mux_index *index = objalloc_nice(sizeof(*index), "mux_indexes");
+    if (! index) return NULL;
+    for (unsigned s = 0; s < NB_ELEMS(index->shards); s++) {
+        struct mux_shard *const shard = index->shards + s;
+        shard->nb_entries = 0;
+        shard->cur.buckets = shard->old.buckets = NULL;
+        shard->cur.mask = shard->old.mask = 0;
+        shard->nb_migrated = 0;
+        shard->evict_cursor = 0;
+    }
+    return index;
+}
+
+// Caller must have emptied it
+static void mux_index_del(struct mux_index *index)
+{
+    for (unsigned s = 0; s < NB_ELEMS(index->shards); s++) {
+        struct mux_shard *const shard = index->shards + s;
+        assert(shard->nb_entries == 0);
+        mux_table_dtor(&shard->cur);
+        mux_table_dtor(&shard->old);
+    }
+    objfree(index);
+}
+
+// Caller must own the mutex of subparser->h_idx
+static int mux_index_insert(struct mux_index *index, struct mux_subparser *subparser)
+{
+    struct mux_proto *const mux_proto = subparser->mux_proto;
+    struct mux_shard *const shard = index->shards + subparser->h_idx;
+    struct mux_hash const hash = mux_hash_of_key(subparser->key, mux_proto->key_size);
+    assert(mux_shard_of_hash(&hash) == subparser->h_idx);
+
+    mux_shard_migrate(shard, mux_proto->key_size, MUX_MIGRATE_STEP);
+
+    unsigned const capacity = shard->cur.buckets ? (shard->cur.mask + 1) * MUX_BUCKET_SLOTS : 0;
+    if (4 * (shard->nb_entries + 1) > 3 * capacity) {
+        if (0 != mux_shard_grow(shard, mux_proto) && shard->nb_entries >= capacity) return -1;
+    }
+
+    if (0 != mux_table_insert(&shard->cur, &hash, subparser)) return -1;
+    shard->nb_entries ++;
+    return 0;
+}
+
+// Caller must own the mutex of subparser->h_idx
+static void mux_index_remove(struct mux_index *index, struct mux_subparser *subparser)
+{
+    struct mux_shard *const shard = index->shards + subparser->h_idx;
+    struct mux_hash const hash = mux_hash_of_key(subparser->key, subparser->mux_proto->key_size);
+    bool const unused_ found =
+        mux_table_remove(&shard->cur, &hash, subparser) ||
+        mux_table_remove(&shard->old, &hash, subparser);
+    assert(found);
+    assert(shard->nb_entries > 0);
+    shard->nb_entries --;
+}
+
+// Caller must own the mutex of this shard
+static struct mux_subparser *mux_index_find(struct mux_index *index, struct mux_proto *mux_proto, struct mux_hash const *hash, struct proto const *proto, void const *key, unsigned *nb_colls)
+{
+    struct mux_shard *const shard = index->shards + mux_shard_of_hash(hash);
+    mux_shard_migrate(shard, mux_proto->key_size, MUX_MIGRATE_STEP);  // lookups help resizing as well
+
+    struct mux_subparser *subparser = mux_table_find(&shard->cur, hash, mux_proto->key_size, proto, key, nb_colls);
+    if (! subparser) subparser = mux_table_find(&shard->old, hash, mux_proto->key_size, proto, key, nb_colls);
+    return subparser;
+}
+
+/* Returns the least recently used of a few subparsers of this shard (caller must own the mutex of this shard).
+ * The sample starts where the previous one stopped, so that every subparser is considered in turn. */
+static struct mux_subparser *mux_index_oldest(struct mux_index *index, unsigned shard_idx)
+{
+    struct mux_shard *const shard = index->shards + shard_idx;
+    if (shard->nb_entries == 0) return NULL;
+
+    struct mux_subparser *oldest = NULL;
+    unsigned nb_tries = MUX_EVICT_SAMPLES;
+    struct mux_table *const tables[] = { &shard->old, &shard->cur };
+    for (unsigned t = 0; t < NB_ELEMS(tables) && nb_tries > 0; t++) {
+        struct mux_table *const table = tables[t];
+        if (! table->buckets) continue;
+        unsigned b = shard->evict_cursor & table->mask;
+        for (unsigned n = 0; n <= table->mask && nb_tries > 0; n++, b = (b+1) & table->mask) {
+            struct mux_bucket *const bucket = table->buckets + b;
+            for (unsigned s = 0; s < MUX_BUCKET_SLOTS && nb_tries > 0; s++) {
+                if (! bucket->fps[s]) continue;
+                struct mux_subparser *const subparser = bucket->subparsers[s];
+                if (! oldest || timeval_cmp(&subparser->last_used, &oldest->last_used) < 0) oldest = subparser;
+                nb_tries --;
+            }
+        }
+        shard->evict_cursor = b;
+    }
+    assert(oldest);
+    return oldest;
+}
+
+static unsigned h_idx_of_key(struct mux_parser *mux_parser, void const *key)
+{
+    struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
+    if (mux_parser->index) {
+        struct mux_hash const hash = mux_hash_of_key(key, mux_proto->key_size);
+        return mux_shard_of_hash(&hash);
+    }
+    return hashlittle(key, mux_proto->key_size, ANY_VALUE) % mux_parser->hash_size;
+}
+
 // List of all mux_protos used to configure them from Guile
 static LIST_HEAD(mux_protos, mux_proto) mux_protos = LIST_HEAD_INITIALIZER(mux_protos);
 
+// When the timer of a subparser should fire: right after it times out (timer_add postpones past deadlines)
+static time_t mux_subparser_expiry(struct mux_subparser const *subparser, time_t now)
+{
+    // When timeouting is disabled we still check from time to time, in case it's enabled again
+    if (0 == mux_timeout) return now + 60;
+    return subparser->last_used.tv_sec + mux_timeout + 1;
+}
+
 // Caller must own list->mutex
 static void mux_subparser_deindex_locked(struct mux_subparser *subparser)
 {
-    struct subparsers *const h_list = h_list_of_subparser(subparser);
     struct per_mutex *const to_list = to_list_of_subparser(subparser);
 #   ifdef __GNUC__
     unsigned const unused_ n = __sync_fetch_and_sub(&subparser->mux_parser->nb_children, 1);
@@ -460,8 +862,13 @@ static void mux_subparser_deindex_locked(struct mux_subparser *subparser)
     subparser->mux_parser->nb_children --;
     mutex_unlock(&subparser->mux_proto->proto.lock);
 #   endif
-    STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-    TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
+    if (subparser->mux_parser->index) {
+        mux_index_remove(subparser->mux_parser->index, subparser);
+    } else {
+        struct subparsers *const h_list = h_list_of_subparser(subparser);
+        STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
+    }
+    timer_del(&to_list->wheel, &subparser->timer);
     subparser->h_idx = NOT_HASHED;
     unref(&subparser->ref);
 }
@@ -489,13 +896,20 @@ void mux_subparser_deindex(struct mux_subparser *subparser)
 }
 
 // Caller must own subparsers mutex
-static void mux_subparser_index(struct mux_subparser *subparser)
+static int mux_subparser_index(struct mux_subparser *subparser)
 {
-    // Insert the subparser into its mux_parser hash and into the timeout_queue
-    struct subparsers *const h_list = h_list_of_subparser(subparser);
+    // Insert the subparser into its mux_parser hash and arm its timer
     struct per_mutex *const to_list = to_list_of_subparser(subparser);
-    STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry); // most used first
-    TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry); // most used last
+    if (subparser->mux_parser->index) {
+        if (0 != mux_index_insert(subparser->mux_parser->index, subparser)) {
+            SLOG(LOG_WARNING, "Cannot index %s", mux_subparser_name(subparser));
+            return -1;
+        }
+    } else {
+        struct subparsers *const h_list = h_list_of_subparser(subparser);
+        STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry); // most used first
+    }
+    timer_add(&to_list->wheel, &subparser->timer, mux_subparser_expiry(subparser, subparser->last_used.tv_sec));
     // inc nb_children
 #   if __GNUC__
     (void)__sync_fetch_and_add(&subparser->mux_parser->nb_children, 1);
@@ -505,6 +919,7 @@ static void mux_subparser_index(struct mux_subparser *subparser)
     mutex_unlock(&subparser->mux_proto->proto.lock);
 #   endif
     mux_subparser_ref(subparser);
+    return 0;
 }
 
 void mux_subparser_dtor(struct mux_subparser *subparser)
@@ -532,9 +947,15 @@ static bool too_many_children(struct mux_parser *mux_parser)
 }
 
 // Caller must own list->mutex
-static void try_sacrifice_child(struct mux_proto *mux_proto, struct subparsers *h_list)
-{
-    struct mux_subparser *subparser = STAILQ_LAST(&h_list->list, mux_subparser, h_entry);    // killing the least recently used child
+static void try_sacrifice_child(struct mux_proto *mux_proto, struct mux_parser *mux_parser, unsigned h_idx)
+{
+    struct mux_subparser *subparser = NULL;
+    if (mux_parser->index) {
+        subparser = mux_index_oldest(mux_parser->index, h_idx);
+    } else {
+        struct subparsers *const h_list = h_list_of_h_idx(mux_parser, h_idx);
+        subparser = STAILQ_LAST(&h_list->list, mux_subparser, h_entry);    // killing the least recently used child
+    }
     if (! subparser) return;    // empty
 
     SLOG(LOG_DEBUG, "Too many children, killing %s", mux_subparser_name(subparser));
@@ -550,30 +971,35 @@ static void try_sacrifice_child(struct mux_proto *mux_proto, struct subparsers *
 #   endif
 }
 
-static unsigned hash_key(void const *key, size_t key_sz, unsigned hash_size)
+// Called with the mutex of the wheel when the timer of a subparser fires (force is set to timeout it regardless of its last_used)
+static void mux_subparser_timer_cb(struct timer *timer, time_t now, void *force_)
 {
-#   define ANY_VALUE 0x432317F5U
-    return hashlittle(key, key_sz, ANY_VALUE) % hash_size;
-}
+    struct mux_subparser *subparser = DOWNCAST(timer, timer, mux_subparser);
+    bool const force = *(bool *)force_;
 
-// Caller must own list->mutex
-static unsigned mux_subparsers_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, unsigned const timeout_s, time_t const last_used)
-{
-    if (0 == timeout_s) return 0;
+    // The timer was set when the subparser was indexed: check it was not used since then
+    if (! force && likely_(!overweight) && (0 == mux_timeout || now - subparser->last_used.tv_sec <= mux_timeout)) {
+        timer_add(&to_list_of_subparser(subparser)->wheel, timer, mux_subparser_expiry(subparser, now));
+        return;
+    }
 
     // Beware that deletion of a subparser can lead to the creation of new parsers !
-    struct mux_subparser *subparser;
-    unsigned count = 0;
-    while (NULL != (subparser = TAILQ_FIRST(&to_list->timeout_queue))) {
-        // As parsers are sorted by last_used time (least recently used first in the timeout_queue),
-        // we can stop scanning as soon as we met a survivor.
-        if (likely_(!overweight) && likely_(last_used - subparser->last_used.tv_sec <= timeout_s)) break;
-
-        SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
-        mux_subparser_deindex_locked(subparser);
+    SLOG(LOG_DEBUG, "Timeouting subparser %s", mux_subparser_name(subparser));
+    mux_subparser_deindex_locked(subparser);
+}
 
-        count ++;
+// Caller must own list->mutex
+static unsigned mux_subparsers_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, time_t const now, bool force)
+{
+    // Timers also fire for subparsers that were used since they were set, so count only those that were deindexed
+    unsigned const nb_children = to_list->wheel.nb_timers;
+    if (force) {
+        (void)timer_wheel_expire_all(&to_list->wheel, mux_subparser_timer_cb, &force);
+    } else {
+        if (0 == timer_wheel_advance(&to_list->wheel, now, mux_subparser_timer_cb, &force)) return 0;
     }
+    unsigned const count = nb_children - to_list->wheel.nb_timers;
+    if (0 == count) return 0;
 
 #   ifdef __GNUC__
     (void)__sync_add_and_fetch(&mux_proto->nb_timeouts, count);
@@ -604,20 +1030,25 @@ int mux_subparser_ctor(struct mux_subparser *subparser, struct mux_parser *mux_p
     memcpy(subparser->key, key, mux_proto->key_size);
     ref_ctor(&subparser->ref, mux_subparser_del_as_ref);
 
-    subparser->h_idx = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
+    subparser->h_idx = h_idx_of_key(mux_parser, key);
     struct mutex *mutex = mutex_of_subparser(subparser);
-    struct subparsers *list = h_list_of_subparser(subparser);
 
     mutex_lock(mutex);
 
     if (too_many_children(mux_parser)) {
-        try_sacrifice_child(mux_proto, list);
+        try_sacrifice_child(mux_proto, mux_parser, subparser->h_idx);
     }
 
-    mux_subparser_index(subparser);
+    int const err = mux_subparser_index(subparser);
 
     mutex_unlock(mutex);
 
+    if (err) {
+        parser_unref(&subparser->parser);
+        ref_dtor(&subparser->ref);
+        return -1;
+    }
+
     return 0;
 }
 
@@ -668,53 +1099,75 @@ struct mux_subparser *mux_subparser_and_parser_new(struct mux_parser *mux_parser
     return subparser;
 }
 
+/* Expire the subparsers of this wheel that are due, if time went on since the
+ * last lookup (which, given the many lookups per second, is amortized O(1)).
+ * Caller must own to_list->mutex. */
+static void mux_lookup_timeout(struct mux_proto *mux_proto, struct per_mutex *to_list, struct timeval const *now)
+{
+    if (unlikely_(now && now->tv_sec > to_list->wheel.now)) {
+        (void)mux_subparsers_timeout(mux_proto, to_list, now->tv_sec, false);
+    }
+}
+
 struct mux_subparser *mux_subparser_lookup(struct mux_parser *mux_parser, struct proto *create_proto, struct proto *requestor, void const *key, struct timeval const *now)
 {
     struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    unsigned h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
-    struct mutex *mutex = mutex_of_h_idx(mux_parser, h);
-    struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
-
-    mutex_lock(mutex);
-
     unsigned nb_colls = 0;
     struct mux_subparser *subparser;
-    STAILQ_FOREACH(subparser, &h_list->list, h_entry) {
-        if (
-            // Various kind of subparsers might have the same key so we should include proto in any case,
-            // whether or not we intend to create the child if not found (ie. use another flag for that).
-            // But we cannot do that actually, because in case of contracking we want to find whatever the proto
-            // registered the ports.
-            (!create_proto || subparser->parser->proto == create_proto) &&
-            0 == memcmp(subparser->key, key, mux_proto->key_size)
-        ) {
-            break;
+    struct mutex *mutex;
+
+    if (mux_parser->index) {
+        struct mux_hash const hash = mux_hash_of_key(key, mux_proto->key_size);
+        unsigned const h = mux_shard_of_hash(&hash);
+        mutex = mutex_of_h_idx(mux_parser, h);
+        mutex_lock(mutex);
+        mux_lookup_timeout(mux_proto, to_list_of_h_idx(mux_parser, h), now);
+        // Same remark than below regarding create_proto
+        subparser = mux_index_find(mux_parser->index, mux_proto, &hash, create_proto, key, &nb_colls);
+        // No need to reorder anything in the index
+    } else {
+        unsigned h = h_idx_of_key(mux_parser, key);
+        mutex = mutex_of_h_idx(mux_parser, h);
+        struct subparsers *h_list = h_list_of_h_idx(mux_parser, h);
+
+        mutex_lock(mutex);
+        mux_lookup_timeout(mux_proto, to_list_of_h_idx(mux_parser, h), now);
+
+        STAILQ_FOREACH(subparser, &h_list->list, h_entry) {
+            if (
+                // Various kind of subparsers might have the same key so we should include proto in any case,
+                // whether or not we intend to create the child if not found (ie. use another flag for that).
+                // But we cannot do that actually, because in case of contracking we want to find whatever the proto
+                // registered the ports.
+                (!create_proto || subparser->parser->proto == create_proto) &&
+                0 == memcmp(subparser->key, key, mux_proto->key_size)
+            ) {
+                break;
+            }
+            nb_colls ++;
         }
-        nb_colls ++;
-    }
 
-    if (subparser && now) {
-        /* Promote this children both to the head of the h_list (for performance)
-         * and the tail of the timeout_queue (since it is used). */
-        subparser->last_used = *now;
-        struct per_mutex *const to_list = to_list_of_subparser(subparser);
-        TAILQ_REMOVE(&to_list->timeout_queue, subparser, to_entry);
-        TAILQ_INSERT_TAIL(&to_list->timeout_queue, subparser, to_entry);
-        STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
-        STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry);
-    }
+        if (subparser && now && subparser != STAILQ_FIRST(&h_list->list)) {
+            // Promote this children to the head of the h_list (for performance)
+            STAILQ_REMOVE(&h_list->list, subparser, mux_subparser, h_entry);
+            STAILQ_INSERT_HEAD(&h_list->list, subparser, h_entry);
+        }
 
-    if (nb_colls > 8) {
-        SLOG(nb_colls > 100 ? LOG_INFO : LOG_DEBUG, "%u collisions while looking for subparser of %s", nb_colls, mux_parser->parser.proto->name);
-#       ifndef NDEBUG
-        if (unlikely_(nb_colls > 100)) {
-            SLOG(LOG_NOTICE, "Dump of first keys for h = %u :", h);
-            SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->key, mux_proto->key_size);
-            SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->h_entry.stqe_next->key, mux_proto->key_size);
+        if (nb_colls > 8) {
+            SLOG(nb_colls > 100 ? LOG_INFO : LOG_DEBUG, "%u collisions while looking for subparser of %s", nb_colls, mux_parser->parser.proto->name);
+#           ifndef NDEBUG
+            if (unlikely_(nb_colls > 100)) {
+                SLOG(LOG_NOTICE, "Dump of first keys for h = %u :", h);
+                SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->key, mux_proto->key_size);
+                SLOG_HEX(LOG_NOTICE, STAILQ_FIRST(&h_list->list)->h_entry.stqe_next->key, mux_proto->key_size);
+            }
+#           endif
         }
-#       endif
     }
 
+    // Its timer is left untouched: it will notice last_used when it fires
+    if (subparser && now) subparser->last_used = *now;
+
     // get a new ref on the subparser for our caller (*before* releasing the mutex!)
     if (subparser) subparser = ref(&subparser->ref);
 
@@ -743,18 +1196,16 @@ void mux_subparser_change_key(struct mux_subparser *subparser, struct mux_parser
     SLOG(LOG_DEBUG, "Changing key for subparser @%p", subparser);
 
     struct mux_proto *mux_proto = DOWNCAST(mux_parser->parser.proto, proto, mux_proto);
-    unsigned new_h = hash_key(key, mux_proto->key_size, mux_parser->hash_size);
-    struct subparsers *new_list = h_list_of_h_idx(mux_parser, new_h);
+    unsigned new_h = h_idx_of_key(mux_parser, key);
     struct mutex *new_mutex = mutex_of_h_idx(mux_parser, new_h);
-    struct subparsers *cur_list;
     struct mutex *cur_mutex;
 
     // Loop until we grab the two required locks (former list and new list)
     do {
         unsigned const h_idx = subparser->h_idx;
         if (h_idx == NOT_HASHED) return;
-        cur_list = h_list_of_subparser_(subparser, h_idx);
-        if (cur_list == new_list) return;
+        // Within an index the place of the subparser depends on the whole key, not only on its shard
+        if (! mux_parser->index && h_idx == new_h) return;
         cur_mutex = mutex_of_subparser_(subparser, h_idx);
 
         mutex_lock2(cur_mutex, new_mutex);
@@ -772,7 +1223,9 @@ void mux_subparser_change_key(struct mux_subparser *subparser, struct mux_parser
     memcpy(subparser->key, key, mux_proto->key_size);
     subparser->h_idx = new_h;
     // Reindex
-    mux_subparser_index(subparser);
+    if (0 != mux_subparser_index(subparser)) {
+        SLOG(LOG_WARNING, "Subparser @%p lost while changing its key", subparser);
+    }
     mutex_unlock2(cur_mutex, new_mutex);
 }
 
@@ -783,6 +1236,15 @@ int mux_parser_ctor(struct mux_parser *mux_parser, struct mux_proto *mux_proto,
     mux_parser->hash_size = hash_size;
     mux_parser->nb_max_children = nb_max_children;
     mux_parser->nb_children = 0;
+    mux_parser->index = NULL;
+
+    if (hash_size == 0) {
+        mux_parser->index = mux_index_new();
+        if (unlikely_(! mux_parser->index)) {
+            parser_dtor(&mux_parser->parser);
+            return -1;
+        }
+    }
 
     for (unsigned h = 0; h < mux_parser->hash_size; h++) {
         struct subparsers *const h_list = mux_parser->subparsers + h;
@@ -843,6 +1305,28 @@ void mux_parser_dtor(struct mux_parser *mux_parser)
         }
         mutex_unlock(mutex);
     }
+
+    if (mux_parser->index) {
+        for (unsigned s = 0; s < NB_ELEMS(mux_parser->index->shards); s++) {
+            struct mux_shard *const shard = mux_parser->index->shards + s;
+            struct mutex *const mutex = mutex_of_h_idx(mux_parser, s);
+
+            mutex_lock(mutex);
+            // Deindexing merely frees the slot, so we can scan each table once
+            struct mux_table *const tables[] = { &shard->old, &shard->cur };
+            for (unsigned t = 0; t < NB_ELEMS(tables); t++) {
+                for (unsigned b = 0; tables[t]->buckets && b <= tables[t]->mask; b++) {
+                    struct mux_bucket *const bucket = tables[t]->buckets + b;
+                    for (unsigned i = 0; i < MUX_BUCKET_SLOTS; i++) {
+                        if (bucket->fps[i]) mux_subparser_deindex_locked(bucket->subparsers[i]);
+                    }
+                }
+            }
+            mutex_unlock(mutex);
+        }
+        mux_index_del(mux_parser->index);
+        mux_parser->index = NULL;
+    }
     assert(mux_parser->nb_children == 0);
 
     // Then ancestor parser
@@ -867,10 +1351,11 @@ void mux_proto_ctor(struct mux_proto *mux_proto, struct proto_ops const *ops, st
     mux_proto->nb_collisions = 0;
     mux_proto->nb_lookups = 0;
     mux_proto->nb_timeouts = 0;
+    mux_proto->nb_resizes = 0;
     mux_proto->last_used = 0;
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_ctor_with_type(&mux_proto->mutexes[m].mutex, "subparsers", PTHREAD_MUTEX_RECURSIVE);
-        TAILQ_INIT(&mux_proto->mutexes[m].timeout_queue);
+        timer_wheel_ctor(&mux_proto->mutexes[m].wheel, 0);
     }
     LIST_INSERT_HEAD(&mux_protos, mux_proto, entry);
 }
@@ -880,9 +1365,10 @@ void mux_proto_dtor(struct mux_proto *mux_proto)
     LIST_REMOVE(mux_proto, entry);
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
         mutex_dtor(&mux_proto->mutexes[m].mutex);
-        if (! TAILQ_EMPTY(&mux_proto->mutexes[m].timeout_queue)) {
-            SLOG(LOG_NOTICE, "While destructing proto %s, timeout_queue %u not empty", mux_proto->proto.name, m);
+        if (mux_proto->mutexes[m].wheel.nb_timers > 0) {
+            SLOG(LOG_NOTICE, "While destructing proto %s, timer wheel %u not empty", mux_proto->proto.name, m);
         }
+        timer_wheel_dtor(&mux_proto->mutexes[m].wheel);
     }
     proto_dtor(&mux_proto->proto);
 }
@@ -894,17 +1380,24 @@ struct mux_proto_ops mux_proto_ops = {
 
 static pthread_t timeouter_pth;
 
+/* Subparsers are mostly timeouted by the lookups. This thread merely advances the
+ * wheels that were not looked up lately, and empties them all when we are overweight.
+ * Since deindexed subparsers are deleted by the doomer, we need not stop parsing for this. */
 static void mux_proto_timeout(struct mux_proto *mux_proto)
 {
     unsigned count = 0;
+    time_t const now = mux_proto->last_used;    // safe here
+    bool const force = overweight;
 
+    enter_multi_region();
     for (unsigned m = 0; m < NB_ELEMS(mux_proto->mutexes); m++) {
-        enter_mono_region();
-        mutex_lock(&mux_proto->mutexes[m].mutex);
-        count += mux_subparsers_timeout(mux_proto, mux_proto->mutexes+m, mux_timeout, mux_proto->last_used /* safe here */);
-        mutex_unlock(&mux_proto->mutexes[m].mutex);
-        leave_protected_region();
+        struct per_mutex *const to_list = mux_proto->mutexes + m;
+        if (! force && (to_list->wheel.nb_timers == 0 || to_list->wheel.now >= now)) continue;  // racy but harmless
+        mutex_lock(&to_list->mutex);
+        count += mux_subparsers_timeout(mux_proto, to_list, now, force);
+        mutex_unlock(&to_list->mutex);
     }
+    leave_protected_region();
 
     SLOG(count > 0 ? LOG_INFO:LOG_DEBUG, "Timeouted %u subparsers of proto %s", count, mux_proto->proto.name);
 }
@@ -1003,6 +1496,7 @@ static SCM nb_infanticide_sym;
 static SCM nb_collisions_sym;
 static SCM nb_lookups_sym;
 static SCM nb_timeouts_sym;
+static SCM nb_resizes_sym;
 
 static struct ext_function sg_mux_proto_stats;
 static SCM g_mux_proto_stats(SCM name_)
@@ -1017,6 +1511,7 @@ static SCM g_mux_proto_stats(SCM name_)
         scm_cons(nb_collisions_sym,   scm_from_uint64(mux_proto->nb_collisions)),
         scm_cons(nb_lookups_sym,      scm_from_uint64(mux_proto->nb_lookups)),
         scm_cons(nb_timeouts_sym,     scm_from_uint64(mux_proto->nb_timeouts)),
+        scm_cons(nb_resizes_sym,      scm_from_uint64(mux_proto->nb_resizes)),
         SCM_UNDEFINED);
     return alist;
 }
@@ -1066,6 +1561,7 @@ static SCM g_mux_proto_set_hash_size(SCM name_, SCM hash_size_)
     mux_proto->hash_size = hash_size;
     mux_proto->nb_collisions = 0;
     mux_proto->nb_lookups = 0;
+    mux_proto->nb_resizes = 0;
     mutex_unlock(&mux_proto->proto.lock);
 
     return SCM_BOOL_T;
@@ -1105,6 +1601,7 @@ void proto_init(void)
     nb_collisions_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-collisions"));
     nb_lookups_sym      = scm_permanent_object(scm_from_latin1_symbol("nb-lookups"));
     nb_timeouts_sym     = scm_permanent_object(scm_from_latin1_symbol("nb-timeouts"));
+    nb_resizes_sym      = scm_permanent_object(scm_from_latin1_symbol("nb-resizes"));
     enabled_sym         = scm_permanent_object(scm_from_latin1_symbol("enabled"));
     nb_frames_sym       = scm_permanent_object(scm_from_latin1_symbol("nb-frames"));
     nb_bytes_sym        = scm_permanent_object(scm_from_latin1_symbol("nb-bytes"));
@@ -1141,6 +1638,8 @@ void proto_init(void)
     ext_function_ctor(&sg_mux_proto_set_hash_size,
         "set-mux-hash-size", 2, 0, 0, g_mux_proto_set_hash_size,
         "(set-mux-hash-size \"proto-name\" n): sets the hash size for newly created parsers of this protocol.\n"
+        "If n is 0, newly created parsers will use an open addressing index that grows with the\n"
+        "    number of children instead of a fixed size hash.\n"
         "Beware of max allowed childrens whenever you change this value.\n"
         "See also (? 'set-max-children) for setting the max number of allowed child for newly created parsers of a protocol.\n"
         "         (? 'mux-names) for a list of protocol names that are multiplexers.\n");
@@ -22,10 +22,16 @@
 #include "junkie/tools/ext.h"
 #include "junkie/tools/sock.h"
 #include "junkie/tools/queue.h"
+#include "junkie/tools/hash.h"
+#include "junkie/tools/mutex.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/tools/tempstr.h"
 #include "junkie/proto/serialize.h"
 #include "pkt_source.h"
+#ifdef WITH_LZ4
+#   include <lz4.h>
+#endif
 
 /*
  * Serialization
@@ -81,19 +87,24 @@ void serialize_proto_stack(uint8_t **buf, struct proto_info const *last, struct
 #include "junkie/proto/skinny.h"
 #include "junkie/proto/discovery.h"
 
-static void deserialize_proto_info_rec(unsigned depth, uint8_t const **buf, struct proto_info *last, struct timeval const *now)
+// Returns -1 if the stack does not fit before end, in which case the offending layer is not reported
+static int deserialize_proto_info_rec(unsigned depth, uint8_t const **buf, uint8_t const *end, struct proto_info *last, struct timeval const *now)
 {
     if (last) {
         proto_subscribers_call(last->parser->proto, last, 0, NULL, now);
         if (depth == 0) full_pkt_subscribers_call(last, 0, NULL, now);
     }
 
-    if (depth == 0) return;
+    if (depth == 0) return 0;
 
+    if (*buf >= end) {
+        SLOG(LOG_WARNING, "Proto stack is missing %u layers", depth);
+        return -1;
+    }
     enum proto_code code = deserialize_1(buf); // read the code
     if (code >= PROTO_CODE_MAX) {
         SLOG(LOG_WARNING, "Unknown protocol code %u", code);
-        return;
+        return 0;
     }
 
     union {
@@ -150,34 +161,41 @@ static void deserialize_proto_info_rec(unsigned depth, uint8_t const **buf, stru
     }
     if (! info) {
         SLOG(LOG_WARNING, "Unknown proto code %u", code);
-        return;
+        return 0;
     }
 
     assert(proto);
     if (proto->ops->deserialize) {
         proto->ops->deserialize(info, buf);
+        if (*buf > end) {
+            SLOG(LOG_WARNING, "Proto %s overflows its frame by %td bytes", proto->name, *buf - end);
+            return -1;
+        }
         info->parent = last;
         struct parser dummy_parser = { .proto = proto }; // A dummy parser just so that subscribers can dereference info->parser->proto
         info->parser = &dummy_parser;
     } else {
         if (proto->ops->serialize) {
             SLOG(LOG_WARNING, "No deserializer for proto %s", proto->name);
-            return;
+            return 0;
         }
         info = last;    // skip this layer
     }
 
-    deserialize_proto_info_rec(depth-1, buf, info, now);
+    return deserialize_proto_info_rec(depth-1, buf, end, info, now);
 }
 
-void deserialize_proto_stack(uint8_t const **buf)
+int deserialize_proto_stack(uint8_t const **buf, uint8_t const *end)
 {
-    // The msg starts with the protocol stack depth
+    // The msg starts with the protocol stack depth, then the timestamp
+    if (end - *buf < 1 + 8) {
+        SLOG(LOG_WARNING, "Proto stack too short (%td bytes)", end - *buf);
+        return -1;
+    }
     unsigned depth = deserialize_1(buf);
-    // Then the timestamp
     struct timeval now;
     timeval_deserialize(&now, buf);
-    deserialize_proto_info_rec(depth, buf, NULL, &now);
+    return deserialize_proto_info_rec(depth, buf, end, NULL, &now);
 }
 
 /*
@@ -185,35 +203,57 @@ void deserialize_proto_stack(uint8_t const **buf)
  */
 
 struct deserializer_source {
-    LIST_ENTRY(deserializer_source) entry;
+    HASH_ENTRY(deserializer_source) entry;
     uint32_t id;
-    uint64_t nb_rcvd_msgs, nb_lost_msgs;
+    uint64_t nb_rcvd_msgs, nb_lost_msgs;        // proto stacks, according to the MSG_PROTO_STATS of the sender
+    uint64_t nb_rcvd_dgrams, nb_lost_dgrams;    // messages, according to their sequence numbers
+    uint32_t next_seqnum;                       // sequence number of the next message we expect
 };
 
-struct deserializer {
-    LIST_ENTRY(deserializer) entry;
+/* A deserializer has one or several threads, each reading its own socket. When there are several
+ * of them the kernel spreads the datagrams among the sockets according to their sender, so that
+ * all messages of a given source are received by the same thread, which thus owns this source. */
+struct deserializer_shard {
+    struct deserializer *deser;
     struct sock *sock;
     pthread_t server_pth;
     bool running;   // set to false when the thread exits
-    unsigned nb_sources;    // how many sources did we ever saw
-    LIST_HEAD(sources, deserializer_source) sources;
+    struct mutex mutex; // protects sources against the readers of the stats (only the server thread writes it)
+    struct deserializer_source *last_source;    // shortcut for the most probable case, that the next message is from the same source
+    HASH_TABLE(deserializer_sources, deserializer_source) sources;
+};
+
+struct deserializer {
+    LIST_ENTRY(deserializer) entry;
+    unsigned nb_shards;
+    struct deserializer_shard shards[];
 };
 
 static LIST_HEAD(deserializers, deserializer) deserializers;    // FIXME: a mutex should not be necessary in practice but won't hurt either
 
-static int deserializer_source_ctor(struct deserializer_source *source, struct deserializer *deser, uint32_t id)
+static char const *deserializer_name(struct deserializer const *deser)
+{
+    return deser->shards[0].sock->name;
+}
+
+static int deserializer_source_ctor(struct deserializer_source *source, struct deserializer_shard *shard, uint32_t id)
 {
     source->id = id;
     source->nb_rcvd_msgs = source->nb_lost_msgs = 0;
-    LIST_INSERT_HEAD(&deser->sources, source, entry);
+    source->nb_rcvd_dgrams = source->nb_lost_dgrams = 0;
+    source->next_seqnum = 0;
+    WITH_LOCK(&shard->mutex) {
+        HASH_INSERT(&shard->sources, source, &source->id, entry);
+        HASH_TRY_REHASH(&shard->sources, id, entry);
+    }
     return 0;
 }
 
-static struct deserializer_source *deserializer_source_new(struct deserializer *deser, uint32_t id)
+static struct deserializer_source *deserializer_source_new(struct deserializer_shard *shard, uint32_t id)
 {
     struct deserializer_source *source = objalloc(sizeof(*source), "deserializer srcs");
     if (! source) return NULL;
-    if (0 != deserializer_source_ctor(source, deser, id)) {
+    if (0 != deserializer_source_ctor(source, shard, id)) {
         objfree(source);
         return NULL;
     }
@@ -221,142 +261,238 @@ static struct deserializer_source *deserializer_source_new(struct deserializer *
 }
 
 // we not normally deletes any sources
-static void deserializer_source_dtor(struct deserializer_source *source)
+static void deserializer_source_dtor(struct deserializer_source *source, struct deserializer_shard *shard)
 {
-    LIST_REMOVE(source, entry);
+    HASH_REMOVE(&shard->sources, source, entry);
 }
 
-static void unused_ deserializer_source_del(struct deserializer_source *source)
+static void deserializer_source_del(struct deserializer_source *source, struct deserializer_shard *shard)
 {
-    deserializer_source_dtor(source);
+    deserializer_source_dtor(source, shard);
+    objfree(source);
 }
 
-static struct deserializer_source *deserializer_source_lookup(struct deserializer *deser, uint32_t id)
+static struct deserializer_source *deserializer_source_lookup(struct deserializer_shard *shard, uint32_t id)
 {
-    struct deserializer_source *source;
-    // shortcut for the most probable case, that the first source is the one we're looking for
-    if (! LIST_EMPTY(&deser->sources) && LIST_FIRST(&deser->sources)->id == id) {
-        return LIST_FIRST(&deser->sources);
-    }
+    if (likely_(shard->last_source && shard->last_source->id == id)) return shard->last_source;
 
-    LIST_FOREACH(source, &deser->sources, entry) {
-        if (source->id == id) break;
-    }
+    struct deserializer_source *source;
+    HASH_LOOKUP(source, &shard->sources, &id, id, entry);
     if (! source) {
-        source = deserializer_source_new(deser, id);
+        source = deserializer_source_new(shard, id);
         if (! source) return NULL;
     }
 
-    // promotes this source
-    LIST_REMOVE(source, entry);
-    LIST_INSERT_HEAD(&deser->sources, source, entry);
-
+    shard->last_source = source;
     return source;
 }
 
-static int deserializer_receiver(struct sock unused_ *sock, size_t len, uint8_t const *buf, struct ip_addr const unused_ *sender, void *deser_)
+// Messages that far behind are not late but from a restarted sender
+#define DESERIALIZER_MAX_REORDER 1024
+
+static void deserializer_source_seqnum(struct deserializer_source *source, uint32_t seqnum)
 {
-    struct deserializer *deser = deser_;
-    uint8_t const *ptr = buf;
-    uint32_t src_id;
-    struct deserializer_source *source;
+    int32_t const gap = seqnum - source->next_seqnum;  // 2-complement rules!
 
-    while (ptr < buf + len) {
-        switch (*ptr++) {
-            case MSG_PROTO_INFO:;
-                src_id = deserialize_4(&ptr);
-                source = deserializer_source_lookup(deser, src_id);
-                if (! source) break;
-                (void)deserialize_proto_stack(&ptr);
+    if (source->nb_rcvd_dgrams ++ > 0) {
+        if (gap < 0 && gap > -DESERIALIZER_MAX_REORDER) {
+            // A late message, that we counted as lost already
+            if (source->nb_lost_dgrams > 0) source->nb_lost_dgrams --;
+            return;
+        }
+        if (gap > 0) {
+            source->nb_lost_dgrams += gap;
+            SLOG(LOG_DEBUG, "Lost %"PRId32" messages from source %"PRIu32, gap, source->id);
+        }
+    }
+    source->next_seqnum = seqnum + 1;
+}
+
+static void deserializer_frames(struct deserializer_source *source, uint8_t const *ptr, uint8_t const *end)
+{
+    while (ptr + MSG_FRAME_HEADER_SIZE <= end) {
+        uint8_t const type = deserialize_1(&ptr);
+        uint8_t const *const frame_end = ptr + deserialize_2(&ptr);
+        if (frame_end > end) {
+            SLOG(LOG_ERR, "Truncated frame of type %"PRIu8" from source %"PRIu32, type, source->id);
+            return;
+        }
+
+        switch (type) {
+            case MSG_PROTO_INFO:
+                if (0 != deserialize_proto_stack(&ptr, frame_end)) {
+                    SLOG(LOG_WARNING, "Skipping malformed proto stack from source %"PRIu32, source->id);
+                } else if (ptr != frame_end) {
+                    SLOG(LOG_WARNING, "Proto stack from source %"PRIu32" is %td bytes short of its frame", source->id, frame_end - ptr);
+                }
                 source->nb_rcvd_msgs ++;
                 break;
             case MSG_PROTO_STATS:;
-                src_id = deserialize_4(&ptr);
-                uint64_t nb_sent_msgs = deserialize_4(&ptr);
-                source = deserializer_source_lookup(deser, src_id);
-                if (! source) break;
+                if (frame_end - ptr < 8) {
+                    SLOG(LOG_WARNING, "Skipping short stats frame from source %"PRIu32, source->id);
+                    break;
+                }
+                uint64_t nb_sent_msgs = deserialize_8(&ptr);
                 uint64_t new_lost = nb_sent_msgs - source->nb_rcvd_msgs;   // 2-complement rules!
                 if (source->nb_lost_msgs != new_lost) {
                     source->nb_lost_msgs = new_lost;
-                    fprintf(stderr, "deserializer: lost %"PRIu64" msgs from source %"PRIu32"\n", source->nb_lost_msgs, src_id);
+                    fprintf(stderr, "deserializer: lost %"PRIu64" msgs from source %"PRIu32"\n", source->nb_lost_msgs, source->id);
                 }
                 break;
-            default:
-                SLOG(LOG_ERR, "Unknown message of type %"PRIu8, ptr[-1]);
+            default:    // from a more recent sender, presumably
+                SLOG(LOG_DEBUG, "Skipping frame of unknown type %"PRIu8, type);
                 break;
         }
+        ptr = frame_end;
+    }
+}
+
+static int deserializer_receiver(struct sock unused_ *sock, size_t len, uint8_t const *buf, struct ip_addr const unused_ *sender, void *shard_)
+{
+    struct deserializer_shard *shard = shard_;
+    uint8_t const *ptr = buf;
+
+    if (len < MSG_HEADER_SIZE || buf[0] != MSG_MAGIC) {
+        TIMED_SLOG(LOG_ERR, "Received a message of unknown format (%zu bytes)", len);
+        return 0;
+    }
+    ptr ++;
+    uint8_t const version = deserialize_1(&ptr);
+    if (version != MSG_VERSION) {
+        TIMED_SLOG(LOG_ERR, "Received a message of version %"PRIu8" (expected "STRIZE(MSG_VERSION)")", version);
+        return 0;
+    }
+    uint8_t const flags = deserialize_1(&ptr);
+    uint32_t const src_id = deserialize_4(&ptr);
+    uint32_t const seqnum = deserialize_4(&ptr);
+    size_t const payload_len = deserialize_2(&ptr);
+    size_t const wire_len = len - MSG_HEADER_SIZE;
+
+    struct deserializer_source *source = deserializer_source_lookup(shard, src_id);
+    if (! source) return 0;
+    deserializer_source_seqnum(source, seqnum);
+
+    if (flags & MSG_LZ4) {
+#       ifdef WITH_LZ4
+        char payload[SOCK_MAX_MSG_SIZE];
+        int const l = LZ4_decompress_safe((char const *)ptr, payload, wire_len, sizeof(payload));
+        if (l < 0 || (size_t)l != payload_len) {
+            TIMED_SLOG(LOG_ERR, "Cannot decompress message from source %"PRIu32, src_id);
+            return 0;
+        }
+        deserializer_frames(source, (uint8_t const *)payload, (uint8_t const *)payload + payload_len);
+#       else
+        TIMED_SLOG(LOG_ERR, "Received a compressed message but LZ4 support was not compiled in");
+#       endif
+        return 0;
+    }
+
+    if (payload_len != wire_len) {
+        TIMED_SLOG(LOG_ERR, "Message from source %"PRIu32" is %zu bytes long but advertises %zu", src_id, wire_len, payload_len);
+        return 0;
     }
+    deserializer_frames(source, ptr, ptr + payload_len);
 
     return 0;
 }
 
 // The thread serving the deserializer port
-static void *deserializer_thread(void *deser_)
+static void *deserializer_thread(void *shard_)
 {
-    struct deserializer *deser = deser_;
+    struct deserializer_shard *shard = shard_;
+    set_thread_name(tempstr_printf("J-deser-%u", (unsigned)(shard - shard->deser->shards)));
 
-    deser->running = true;
+    shard->running = true;
 
-    while (deser->sock) {
+    while (shard->sock) {
         fd_set set;
-        if (0 != sock_select_single(deser->sock, &set)) break;
-        if (0 != deser->sock->ops->recv(deser->sock, &set, deserializer_receiver, deser)) break;
+        if (0 != sock_select_single(shard->sock, &set)) break;
+        // We can be cancelled while waiting, but not while holding some lock
+        (void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        int const err = shard->sock->ops->recv(shard->sock, &set, deserializer_receiver, shard);
+        (void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        if (err) break;
     }
 
-    deser->running = false;
+    shard->running = false;
     return NULL;
 }
 
-
-static int deserializer_ctor(struct deserializer *deser, struct sock *sock)
+// We are given full responsibility over sock
+static int deserializer_shard_ctor(struct deserializer_shard *shard, struct deserializer *deser, struct sock *sock)
 {
-    deser->sock = sock;
-    deser->running = false;
-    LIST_INIT(&deser->sources);
-
-    int err = pthread_create(&deser->server_pth, NULL, deserializer_thread, deser);
+    shard->deser = deser;
+    shard->sock = sock;
+    shard->running = false;
+    shard->last_source = NULL;
+    mutex_ctor(&shard->mutex, "deserializer shards");
+    HASH_INIT(&shard->sources, 67, "Deserializer sources");
+
+    int err = pthread_create(&shard->server_pth, NULL, deserializer_thread, shard);
     if (err) {
         SLOG(LOG_ERR, "Cannot start server thread: %s", strerror(err));
+        HASH_DEINIT(&shard->sources);
+        mutex_dtor(&shard->mutex);
+        sock->ops->del(sock);
         return -1;
     }
 
-    LIST_INSERT_HEAD(&deserializers, deser, entry);
-
     return 0;
 }
 
-// We are given full responsibility over sock
-static struct deserializer *deserializer_new(struct sock *sock)
+static void deserializer_shard_dtor(struct deserializer_shard *shard)
+{
+    int err = pthread_cancel(shard->server_pth);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot cancel server thread: %s", strerror(err));
+        (void)pthread_detach(shard->server_pth);
+    } else {
+        err = pthread_join(shard->server_pth, NULL);
+        if (err) {
+            SLOG(LOG_ERR, "Cannot join server thread: %s", strerror(err));
+            // so be it
+        }
+    }
+
+    struct deserializer_source *source, *tmp;
+    HASH_FOREACH_SAFE(source, &shard->sources, entry, tmp) {
+        deserializer_source_del(source, shard);
+    }
+    HASH_DEINIT(&shard->sources);
+    mutex_dtor(&shard->mutex);
+    shard->sock->ops->del(shard->sock);
+}
+
+static struct deserializer *deserializer_new(char const *service, unsigned nb_shards)
 {
-    if (! sock) return NULL;
+    if (nb_shards == 0) nb_shards = 1;
 
-    struct deserializer *deser = objalloc(sizeof(*deser), "deserializers");
+    struct deserializer *deser = objalloc(sizeof(*deser) + nb_shards * sizeof(deser->shards[0]), "deserializers");
     if (! deser) return NULL;
 
-    if (0 != deserializer_ctor(deser, sock)) {
-        objfree(deser);
-        sock->ops->del(sock);
-        return NULL;
+    for (deser->nb_shards = 0; deser->nb_shards < nb_shards; deser->nb_shards++) {
+        struct sock *sock = nb_shards > 1 ?
+            sock_udp_server_new_shared(service, 0) :
+            sock_udp_server_new(service, 0);
+        if (! sock) goto err;
+        if (0 != deserializer_shard_ctor(deser->shards + deser->nb_shards, deser, sock)) goto err;
     }
 
+    LIST_INSERT_HEAD(&deserializers, deser, entry);
     return deser;
+
+err:
+    while (deser->nb_shards > 0) deserializer_shard_dtor(deser->shards + (--deser->nb_shards));
+    objfree(deser);
+    return NULL;
 }
 
 static void deserializer_dtor(struct deserializer *deser)
 {
     LIST_REMOVE(deser, entry);
-    int err = pthread_cancel(deser->server_pth);
-    if (err) {
-        SLOG(LOG_ERR, "Cannot cancel server thread: %s", strerror(err));
-        (void)pthread_detach(deser->server_pth);
-    } else {
-        err = pthread_join(deser->server_pth, NULL);
-        if (err) {
-            SLOG(LOG_ERR, "Cannot join server thread: %s", strerror(err));
-            // so be it
-        }
+    for (unsigned s = 0; s < deser->nb_shards; s++) {
+        deserializer_shard_dtor(deser->shards + s);
     }
-    deser->sock->ops->del(deser->sock);
 }
 
 static void deserializer_del(struct deserializer *deser)
@@ -367,7 +503,7 @@ static void deserializer_del(struct deserializer *deser)
 
 // FIXME: instead of a port, should take a sock blob
 static struct ext_function sg_open_deserializer;
-static SCM g_open_deserializer(SCM port_)
+static SCM g_open_deserializer(SCM port_, SCM nb_threads_)
 {
     SCM ret = SCM_BOOL_F;
     scm_dynwind_begin(0);
@@ -381,10 +517,11 @@ static SCM g_open_deserializer(SCM port_)
         }
     }
 
-    struct sock *sock = sock_udp_server_new(service, 0);
-    struct deserializer *deser = deserializer_new(sock);
+    unsigned const nb_threads = SCM_UNBNDP(nb_threads_) ? 1 : scm_to_uint(nb_threads_);
+
+    struct deserializer *deser = deserializer_new(service, nb_threads);
     if (deser) {
-        ret = scm_from_latin1_string(deser->sock->name);
+        ret = scm_from_latin1_string(deserializer_name(deser));
     }
 
     scm_dynwind_end();
@@ -397,7 +534,7 @@ static struct deserializer *deserializer_of_scm(SCM name_)
 
     struct deserializer *deser;
     LIST_FOREACH(deser, &deserializers, entry) {
-        if (0 == strcmp(deser->sock->name, name)) break;
+        if (0 == strcmp(deserializer_name(deser), name)) break;
     }
 
     return deser;
@@ -424,7 +561,7 @@ static SCM g_deserializer_names(void)
 
     struct deserializer *deser;
     LIST_FOREACH(deser, &deserializers, entry) {
-        SCM name = scm_from_latin1_string(deser->sock->name);
+        SCM name = scm_from_latin1_string(deserializer_name(deser));
         ret = scm_cons(name, ret);
     }
 
@@ -433,16 +570,21 @@ static SCM g_deserializer_names(void)
 
 static SCM nb_rcvd_msgs_sym;
 static SCM nb_lost_msgs_sym;
+static SCM nb_rcvd_dgrams_sym;
+static SCM nb_lost_dgrams_sym;
 
 static SCM deserializer_source_stats(struct deserializer_source *source)
 {
-    return scm_list_2(
-        scm_cons(nb_rcvd_msgs_sym,  scm_from_uint64(source->nb_rcvd_msgs)),
-        scm_cons(nb_lost_msgs_sym,  scm_from_uint64(source->nb_lost_msgs)));
+    return scm_list_4(
+        scm_cons(nb_rcvd_msgs_sym,   scm_from_uint64(source->nb_rcvd_msgs)),
+        scm_cons(nb_lost_msgs_sym,   scm_from_uint64(source->nb_lost_msgs)),
+        scm_cons(nb_rcvd_dgrams_sym, scm_from_uint64(source->nb_rcvd_dgrams)),
+        scm_cons(nb_lost_dgrams_sym, scm_from_uint64(source->nb_lost_dgrams)));
 }
 
 static SCM name_sym;
 static SCM running_sym;
+static SCM nb_threads_sym;
 static SCM sources_sym;
 
 static struct ext_function sg_deserializer_stats;
@@ -452,16 +594,24 @@ static SCM g_deserializer_stats(SCM name_)
     if (! deser) return SCM_BOOL_F;
 
     SCM srcs = SCM_EOL;
-    struct deserializer_source *source;
-    LIST_FOREACH(source, &deser->sources, entry) {
-        srcs = scm_cons(
-            scm_cons(scm_from_uint32(source->id), deserializer_source_stats(source)),
-            srcs);
+    bool running = true;
+    for (unsigned s = 0; s < deser->nb_shards; s++) {
+        struct deserializer_shard *shard = deser->shards + s;
+        running &= shard->running;
+        WITH_LOCK(&shard->mutex) {
+            struct deserializer_source *source;
+            HASH_FOREACH(source, &shard->sources, entry) {
+                srcs = scm_cons(
+                    scm_cons(scm_from_uint32(source->id), deserializer_source_stats(source)),
+                    srcs);
+            }
+        }
     }
 
-    return scm_list_3(
-        scm_cons(name_sym,          scm_from_latin1_string(deser->sock->name)),
-        scm_cons(running_sym,       scm_from_bool(deser->running)),
+    return scm_list_4(
+        scm_cons(name_sym,          scm_from_latin1_string(deserializer_name(deser))),
+        scm_cons(running_sym,       scm_from_bool(running)),
+        scm_cons(nb_threads_sym,    scm_from_uint(deser->nb_shards)),
         scm_cons(sources_sym,       srcs));
 }
 
@@ -482,14 +632,18 @@ void serialize_init(void)
     running_sym      = scm_permanent_object(scm_from_latin1_symbol("running?"));
     nb_rcvd_msgs_sym = scm_permanent_object(scm_from_latin1_symbol("nb-rcvd-msgs"));
     nb_lost_msgs_sym = scm_permanent_object(scm_from_latin1_symbol("nb-lost-msgs"));
+    nb_rcvd_dgrams_sym = scm_permanent_object(scm_from_latin1_symbol("nb-rcvd-dgrams"));
+    nb_lost_dgrams_sym = scm_permanent_object(scm_from_latin1_symbol("nb-lost-dgrams"));
+    nb_threads_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-threads"));
     sources_sym      = scm_permanent_object(scm_from_latin1_symbol("sources"));
 
     LIST_INIT(&deserializers);
 
     ext_function_ctor(&sg_open_deserializer,
-        "open-deserializer", 0, 1, 0, g_open_deserializer,
+        "open-deserializer", 0, 2, 0, g_open_deserializer,
         "(open-deserializer): listen on default port (" SERIALIZER_DEFAULT_SERVICE ") and supply received frames info to local plugins.\n"
         "(open-deserializer 28100): listen on alternate port.\n"
+        "(open-deserializer 28100 4): same, with 4 threads each receiving the messages of some of the senders.\n"
         "Will return the name of the deserializer or #f if the operation fails.\n"
         "See also (? 'close-deserializer) and (? 'deserializers).\n");
 
@@ -421,7 +421,7 @@ static enum proto_parse_status sip_parse(struct parser *parser, struct proto_inf
         { STRING_AND_LEN("via"),            sip_extract_via },
     };
 
-    static struct httper const httper = {
+    static struct httper httper = {
         .nb_commands = NB_ELEMS(commands),
         .commands = commands,
         .nb_fields = NB_ELEMS(fields),
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <assert.h>
 #include "junkie/tools/log.h"
+#include "junkie/tools/miscmacs.h"
 #include "junkie/tools/objalloc.h"
 #include "junkie/proto/streambuf.h"
 
@@ -30,6 +31,191 @@
 
 static struct mutex_pool streambuf_locks;
 
+/*
+ * Segments
+ */
+
+static struct streambuf_seg *streambuf_seg_new(size_t room)
+{
+    struct streambuf_seg *seg = objalloc_nice(sizeof(*seg) + room, "streambufs");
+    if (! seg) return NULL;
+    seg->data = seg->bytes;
+    seg->size = 0;
+    seg->room = room;
+    seg->is_malloced = true;
+    return seg;
+}
+
+static void streambuf_seg_del(struct streambuf_seg *seg)
+{
+    if (seg->is_malloced) objfree(seg);
+}
+
+// How much to allocate for storing size bytes, leaving some room for the next packets
+static size_t streambuf_seg_alloc_size(struct streambuf const *sbuf, size_t size)
+{
+    return MIN(2 * size, MAX(size, sbuf->max_size));
+}
+
+static void streambuf_push(struct streambuf_unidir *dir, struct streambuf_seg *seg)
+{
+    assert(seg->size > 0);
+    STAILQ_INSERT_TAIL(&dir->segs, seg, entry);
+    dir->buffer_size += seg->size;
+}
+
+static void streambuf_empty(struct streambuf_unidir *dir)
+{
+    struct streambuf_seg *seg;
+    while (NULL != (seg = STAILQ_FIRST(&dir->segs))) {
+        STAILQ_REMOVE_HEAD(&dir->segs, entry);
+        streambuf_seg_del(seg);
+    }
+    dir->buffer_size = 0;
+}
+
+// Forget the first len bytes of the buffer
+static void streambuf_trim(struct streambuf_unidir *dir, size_t len)
+{
+    assert(len <= dir->buffer_size);
+    dir->buffer_size -= len;
+
+    struct streambuf_seg *seg;
+    while (len > 0 && NULL != (seg = STAILQ_FIRST(&dir->segs))) {
+        if (len < seg->size) {
+            seg->data += len;
+            seg->size -= len;
+            break;
+        }
+        len -= seg->size;
+        STAILQ_REMOVE_HEAD(&dir->segs, entry);
+        streambuf_seg_del(seg);
+    }
+}
+
+// Replace the segments referencing the packet by copies
+static int streambuf_own(struct streambuf *sbuf, struct streambuf_unidir *dir)
+{
+    struct streambuf_seg *prev = NULL, *seg, *tmp;
+    STAILQ_FOREACH_SAFE(seg, &dir->segs, entry, tmp) {
+        if (seg->is_malloced) {
+            prev = seg;
+            continue;
+        }
+        SLOG(LOG_DEBUG, "Copying %zu bytes of packet into streambuf_unidir@%p", seg->size, dir);
+        if (prev && prev->room >= seg->size) {  // append to previous segment
+            memcpy((uint8_t *)prev->data + prev->size, seg->data, seg->size);
+            prev->size += seg->size;
+            prev->room -= seg->size;
+            STAILQ_REMOVE(&dir->segs, seg, streambuf_seg, entry);
+        } else {
+            struct streambuf_seg *copy = streambuf_seg_new(streambuf_seg_alloc_size(sbuf, seg->size));
+            if (! copy) {
+                streambuf_empty(dir);   // never escape from here with a segment referencing a packet
+                return -1;
+            }
+            memcpy(copy->bytes, seg->data, seg->size);
+            copy->size = seg->size;
+            copy->room -= seg->size;
+            STAILQ_INSERT_AFTER(&dir->segs, seg, copy, entry);
+            STAILQ_REMOVE(&dir->segs, seg, streambuf_seg, entry);
+            prev = copy;
+        }
+    }
+
+    return 0;
+}
+
+// Make the buffer contiguous and set dir->buffer accordingly
+static int streambuf_linearize(struct streambuf *sbuf, struct streambuf_unidir *dir)
+{
+    struct streambuf_seg *first = STAILQ_FIRST(&dir->segs);
+    if (! first) {
+        dir->buffer = NULL;
+        return 0;
+    }
+
+    if (STAILQ_NEXT(first, entry)) {
+        SLOG(LOG_DEBUG, "Linearizing %zu bytes of streambuf_unidir@%p", dir->buffer_size, dir);
+        struct streambuf_seg *dst = first;
+        if (first->room < dir->buffer_size - first->size) {
+            dst = streambuf_seg_new(streambuf_seg_alloc_size(sbuf, dir->buffer_size));
+            if (! dst) return -1;
+        } else {
+            STAILQ_REMOVE_HEAD(&dir->segs, entry);
+        }
+
+        struct streambuf_seg *seg;
+        while (NULL != (seg = STAILQ_FIRST(&dir->segs))) {
+            assert(dst->room >= seg->size);
+            memcpy((uint8_t *)dst->data + dst->size, seg->data, seg->size);
+            dst->size += seg->size;
+            dst->room -= seg->size;
+            STAILQ_REMOVE_HEAD(&dir->segs, entry);
+            streambuf_seg_del(seg);
+        }
+        assert(dst->size == dir->buffer_size);
+        STAILQ_INSERT_HEAD(&dir->segs, dst, entry);
+        first = dst;
+    }
+
+    dir->buffer = first->data;
+    return 0;
+}
+
+/*
+ * Cursor
+ */
+
+static void streambuf_cursor_ctor(struct streambuf_cursor *cursor, struct streambuf_unidir const *dir, size_t offset)
+{
+    assert(offset <= dir->buffer_size);
+    cursor->seg = STAILQ_FIRST(&dir->segs);
+    cursor->offset = 0;
+    cursor->rem_size = dir->buffer_size;
+    (void)streambuf_cursor_drop(cursor, offset);
+}
+
+int streambuf_cursor_read(struct streambuf_cursor *cursor, void *dst_, size_t len)
+{
+    if (cursor->rem_size < len) return -1;
+    cursor->rem_size -= len;
+
+    uint8_t *dst = dst_;
+    while (len > 0) {
+        assert(cursor->seg);
+        size_t const n = MIN(len, cursor->seg->size - cursor->offset);
+        if (dst) {
+            memcpy(dst, cursor->seg->data + cursor->offset, n);
+            dst += n;
+        }
+        len -= n;
+        cursor->offset += n;
+        if (cursor->offset >= cursor->seg->size) {
+            cursor->seg = STAILQ_NEXT(cursor->seg, entry);
+            cursor->offset = 0;
+        }
+    }
+
+    return 0;
+}
+
+int streambuf_cursor_drop(struct streambuf_cursor *cursor, size_t len)
+{
+    return streambuf_cursor_read(cursor, NULL, len);
+}
+
+uint8_t const *streambuf_cursor_peek(struct streambuf_cursor const *cursor, size_t *len)
+{
+    if (! cursor->seg) {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = cursor->seg->size - cursor->offset;
+    return cursor->seg->data + cursor->offset;
+}
+
 /*
  * Construction
  */
@@ -43,9 +229,12 @@ int streambuf_ctor(struct streambuf *sbuf, parse_fun *parse, size_t max_size)
     sbuf->mutex = mutex_pool_anyone(&streambuf_locks);
 
     for (unsigned d = 0; d < 2; d++) {
-        sbuf->dir[d].buffer = NULL;
+        STAILQ_INIT(&sbuf->dir[d].segs);
         sbuf->dir[d].buffer_size = 0;
+        sbuf->dir[d].buffer = NULL;
         sbuf->dir[d].restart_offset = 0;
+        sbuf->dir[d].wait = false;
+        sbuf->dir[d].ready = NULL;
     }
 
     return 0;
@@ -56,10 +245,7 @@ void streambuf_dtor(struct streambuf *sbuf)
     SLOG(LOG_DEBUG, "Destructing the streambuf@%p", sbuf);
 
     for (unsigned d = 0; d < 2; d++) {
-        if (sbuf->dir[d].buffer) {
-            if (sbuf->dir[d].buffer_is_malloced) objfree((void*)sbuf->dir[d].buffer);
-            sbuf->dir[d].buffer = NULL;
-        }
+        streambuf_empty(sbuf->dir+d);
     }
 }
 
@@ -85,60 +271,44 @@ void streambuf_set_restart(struct streambuf *sbuf, unsigned way, uint8_t const *
     SLOG(LOG_DEBUG, "Setting restart offset of streambuf@%p[%u] to %zu (while size=%zu)", sbuf, way, offset, sbuf->dir[way].buffer_size);
     sbuf->dir[way].restart_offset = offset;
     sbuf->dir[way].wait = wait;
+    sbuf->dir[way].ready = NULL;
 }
 
-static void streambuf_empty(struct streambuf_unidir *dir)
+void streambuf_set_restart_ready(struct streambuf *sbuf, unsigned way, uint8_t const *p, streambuf_ready *ready)
 {
-    if (dir->buffer) {
-        if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
-        dir->buffer = NULL;
-        dir->buffer_size = 0;
-    } else {
-        assert(0 == dir->buffer_size);
-    }
+    streambuf_set_restart(sbuf, way, p, true);
+    sbuf->dir[way].ready = ready;
 }
 
-static enum proto_parse_status streambuf_append(struct streambuf *sbuf, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len)
+static enum proto_parse_status streambuf_append(struct streambuf *sbuf, unsigned way, struct streambuf_seg *pkt_seg, uint8_t const *packet, size_t cap_len, size_t wire_len)
 {
     assert(way < 2);
     SLOG(LOG_DEBUG, "Append %zu bytes (%zu captured) to streambuf@%p[%u] of size %zu (restart @ %zu)",
-        wire_len, cap_len, sbuf, way, sbuf->dir[way].buffer_size, sbuf->dir[way].buffer_size - sbuf->dir[way].restart_offset);
-    // Naive implementation : each time we add some bytes we realloc buffer
-    // FIXME: use a redim_array ?
-    // FIXME: better yet, rewrite everything using pkt-lists from end to end
+        wire_len, cap_len, sbuf, way, sbuf->dir[way].buffer_size, sbuf->dir[way].restart_offset);
 
     struct streambuf_unidir *dir = sbuf->dir+way;
 
-    if (! dir->buffer) {
-        dir->buffer = packet;
-        dir->buffer_size = cap_len;
-        dir->buffer_is_malloced = false;
+    if (STAILQ_EMPTY(&dir->segs)) {
+        assert(0 == dir->buffer_size);
     } else {
         ssize_t const keep_size = dir->buffer_size - dir->restart_offset;
         ssize_t const new_size = keep_size + cap_len;
 
         if (new_size > 0) { // we restart in captured bytes
             if ((size_t)new_size > sbuf->max_size) return PROTO_PARSE_ERR;
-            uint8_t *new_buffer = objalloc_nice(new_size, "streambufs");
-            if (! new_buffer) return PROTO_PARSE_ERR;
 
-            // Assemble kept buffer and new payload
-            if (keep_size > 0) memcpy(new_buffer, dir->buffer + dir->restart_offset, keep_size);
-            if (keep_size < 0) {
+            if (keep_size > 0) {
+                streambuf_trim(dir, dir->restart_offset);
+            } else {
                 // skip some part of captured bytes
-                size_t const skip_size = keep_size >= 0 ? 0 : -keep_size;
+                size_t const skip_size = -keep_size;
                 assert(skip_size < cap_len);    // since new_size > 0
                 packet += skip_size;
                 cap_len -= skip_size;
                 assert(wire_len >= cap_len);
                 wire_len -= skip_size;
+                streambuf_empty(dir);
             }
-            memcpy(new_buffer + (keep_size > 0 ? keep_size:0), packet, cap_len);
-            assert(dir->buffer);
-            if (dir->buffer_is_malloced) objfree((void*)dir->buffer);
-            dir->buffer = new_buffer;
-            dir->buffer_size = new_size;
-            dir->buffer_is_malloced = true;
             dir->restart_offset = 0;
         } else {    // we restart after captured bytes
             ssize_t new_restart_offset = dir->restart_offset - (dir->buffer_size + wire_len);
@@ -146,38 +316,36 @@ static enum proto_parse_status streambuf_append(struct streambuf *sbuf, unsigned
             if (new_restart_offset < 0) return PROTO_TOO_SHORT;
             dir->restart_offset = new_restart_offset;
             streambuf_empty(dir);
+            return PROTO_OK;
         }
     }
 
+    // Chain the packet itself (it will be copied only if we have to keep it)
+    if (cap_len > 0) {
+        pkt_seg->data = packet;
+        pkt_seg->size = cap_len;
+        pkt_seg->room = 0;
+        pkt_seg->is_malloced = false;
+        streambuf_push(dir, pkt_seg);
+    }
+
     return PROTO_OK;
 }
 
 // Copy the packet into a buffer for later use
-static int streambuf_keep(struct streambuf_unidir *dir)
+static int streambuf_keep(struct streambuf *sbuf, struct streambuf_unidir *dir)
 {
-    if (! dir->buffer) return 0;
-    if (dir->buffer_is_malloced) return 0;  // we already own a copy, do not touch it.
-
-    size_t const keep = dir->buffer_size > dir->restart_offset ? dir->buffer_size - dir->restart_offset : 0;
-    SLOG(LOG_DEBUG, "Keeping only %zu bytes of streambuf_unidir@%p", keep, dir);
-
-    if (keep > 0) {
-        uint8_t *buf = objalloc_nice(keep, "streambufs");
-        if (! buf) {
-            dir->buffer = NULL; // never escape from here with buffer referencing a non malloced packet
-            return -1;
-        }
-        memcpy(buf, dir->buffer + dir->restart_offset, keep);
-        dir->buffer = buf;
-        dir->buffer_is_malloced = true;
-        dir->buffer_size = keep;
-        dir->restart_offset = 0;
-    } else {
+    if (dir->restart_offset >= dir->buffer_size) {
         dir->restart_offset -= dir->buffer_size;
         streambuf_empty(dir);
+        return 0;
     }
 
-    return 0;
+    SLOG(LOG_DEBUG, "Keeping only %zu bytes of streambuf_unidir@%p", dir->buffer_size - dir->restart_offset, dir);
+    streambuf_trim(dir, dir->restart_offset);
+    dir->restart_offset = 0;
+
+    return streambuf_own(sbuf, dir);
 }
 
 enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *parser, struct proto_info *parent, unsigned way, uint8_t const *packet, size_t cap_len, size_t wire_len, struct timeval const *now, size_t tot_cap_len, uint8_t const *tot_packet)
@@ -185,22 +353,42 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
     mutex_lock(sbuf->mutex);
 
     assert(way < 2);
-    enum proto_parse_status status = streambuf_append(sbuf, way, packet, cap_len, wire_len);
+    struct streambuf_seg pkt_seg;
+    enum proto_parse_status status = streambuf_append(sbuf, way, &pkt_seg, packet, cap_len, wire_len);
     if (status != PROTO_OK) goto quit;
 
     struct streambuf_unidir *dir = sbuf->dir+way;
 
     size_t uncap_len = wire_len - cap_len;
+
+    // Do not bother the parser if it already told us it cannot progress with this
+    if (dir->wait && dir->ready && uncap_len == 0 && dir->restart_offset < dir->buffer_size) {
+        struct streambuf_cursor cursor;
+        streambuf_cursor_ctor(&cursor, dir, dir->restart_offset);
+        if (! dir->ready(&cursor)) {
+            SLOG(LOG_DEBUG, "streambuf@%p[%u] is not ready yet with %zu bytes", sbuf, way, dir->buffer_size - dir->restart_offset);
+            (void)proto_parse(NULL, parent, way, NULL, 0, 0, now, tot_cap_len, tot_packet);    // ack this packet on behalf of the parser
+            if (0 != streambuf_keep(sbuf, dir)) status = PROTO_PARSE_ERR;
+            goto quit;
+        }
+    }
+
     unsigned nb_max_restart = 10;
     while (nb_max_restart--) {
         // We may want to restart in the middle of uncaptured bytes (either because we just added a gap or because or a previous set_restart.
         size_t offset = dir->restart_offset;
         dir->wait = false;
+        dir->ready = NULL;
         if (offset < dir->buffer_size) {    // simple case: we restart from the buffer
+            if (0 != streambuf_linearize(sbuf, dir)) {
+                status = PROTO_PARSE_ERR;
+                goto quit;
+            }
         } else if (offset < dir->buffer_size + uncap_len) { // restart from the uncaptured zone: signal the gap (up to the end of uncaptured zone)
             SLOG(LOG_DEBUG, "streambuf@%p[%u] restart is set within uncaptured bytes", sbuf, way);
             uncap_len -= offset - dir->buffer_size;
             streambuf_empty(dir);
+            dir->buffer = NULL;
             offset = 0;
         } else {    // restart from after wire_len: just be patient
             SLOG(LOG_DEBUG, "streambuf@%p[%u] was totally parsed", sbuf, way);
@@ -228,7 +416,7 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
                 goto quit;
             case PROTO_OK:
                 if (dir->wait) {
-                    if (0 != streambuf_keep(dir)) status = PROTO_PARSE_ERR;
+                    if (0 != streambuf_keep(sbuf, dir)) status = PROTO_PARSE_ERR;
                     goto quit;
                 }
                 break;
@@ -245,6 +433,8 @@ enum proto_parse_status streambuf_add(struct streambuf *sbuf, struct parser *par
     // We reach here when we are constantly restarting. Assume the parser is bugged.
     status = PROTO_PARSE_ERR;
 quit:
+    // Whatever happened, the packet must not be referenced any more once we return
+    if (0 != streambuf_own(sbuf, sbuf->dir+way)) status = PROTO_PARSE_ERR;
     mutex_unlock(sbuf->mutex);
     return status;
 }
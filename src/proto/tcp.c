@@ -530,12 +530,18 @@ static enum proto_parse_status tcp_parse(struct parser *parser, struct proto_inf
     // FIXME: Here the parser is chosen before we actually parse anything. If later the parser fails we cannot try another one.
     //        Choice of parser should be delayed until we start actual parse.
     bool const do_sync = info.ack && IS_SET_FOR_WAY(!way, tcp_sub->origin);
-    err = pkt_wait_list_add(tcp_sub->wl+way, offset, next_offset, do_sync, sync_offset, true, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
-    SLOG(LOG_DEBUG, "Waiting list returned %s", proto_parse_status_2_str(err));
-
-    if (err == PROTO_OK) {
-        // Try advancing each WL until we are stuck or met an error
-        pkt_wait_list_try_both(tcp_sub->wl+!way, &err, now, false);
+    // Fast path for in order segments when nothing is pending (we own tcp_sub->mutex, so nobody else can queue anything on our wls)
+    if (pkt_wait_list_parse_in_order(tcp_sub->wl+way, &err, offset, next_offset, do_sync, sync_offset, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet)) {
+        // Both wls were empty so there is nothing else to advance
+        SLOG(LOG_DEBUG, "In order segment parsed at once: %s", proto_parse_status_2_str(err));
+    } else {
+        err = pkt_wait_list_add(tcp_sub->wl+way, offset, next_offset, do_sync, sync_offset, true, &info.info, way, packet + tcphdr_len, cap_len - tcphdr_len, packet_len, now, tot_cap_len, tot_packet);
+        SLOG(LOG_DEBUG, "Waiting list returned %s", proto_parse_status_2_str(err));
+
+        if (err == PROTO_OK) {
+            // Try advancing each WL until we are stuck or met an error
+            pkt_wait_list_try_both(tcp_sub->wl+!way, &err, now, false);
+        }
     }
 
     bool const term = tcp_subparser_term(tcp_sub);
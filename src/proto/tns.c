@@ -126,6 +126,16 @@ static enum proto_parse_status cursor_read_tns_hdr(struct cursor *cursor, size_t
     return PROTO_OK;
 }
 
+// Tells whether a whole PDU is available
+static bool tns_pdu_ready(struct streambuf_cursor *cursor)
+{
+    uint8_t hdr[8];
+    if (0 != streambuf_cursor_read(cursor, hdr, sizeof(hdr))) return false;
+    size_t const len = READ_U16N(hdr);
+    if (len < 8) return true;   // let the parser fail
+    return cursor->rem_size >= len - 8;
+}
+
 static bool is_delim(char c)
 {
     return c == ')' || c == '\0'; // what else?
@@ -373,7 +383,7 @@ static enum proto_parse_status tns_sbuf_parse(struct parser *parser, struct prot
         if (status == PROTO_PARSE_ERR) return PROTO_PARSE_ERR;
         if (status == PROTO_TOO_SHORT) {
             SLOG(LOG_DEBUG, "Payload too short for parsing message, will restart");
-            streambuf_set_restart(&tns_parser->sbuf, way, msg_start, true);
+            streambuf_set_restart_ready(&tns_parser->sbuf, way, msg_start, tns_pdu_ready);
             break;  // will ack what we had so far
         }
         assert(cursor.cap_len >= pdu_len);  // We have the whole msg ready to be read
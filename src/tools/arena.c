@@ -0,0 +1,278 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2010, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include "junkie/tools/arena.h"
+#include "junkie/tools/ext.h"
+#include "junkie/tools/log.h"
+#include "junkie/tools/mallocer.h"
+#include "junkie/tools/miscmacs.h"
+
+#undef LOG_CAT
+#define LOG_CAT arena_log_category
+LOG_CATEGORY_DEF(arena);
+
+static unsigned max_free_arenas = 32;
+EXT_PARAM_RW(max_free_arenas, "arena-cache-size", uint, "How many unused packet arenas each thread keeps for later use")
+
+struct arena_cleanup {
+    struct arena_cleanup *next;
+    void (*fun)(void *);
+    void *data;
+};
+
+/*
+ * Per-thread free list
+ */
+
+struct arena_cache {
+    struct arena *free;     // arenas of ARENA_SIZE bytes only
+    unsigned nb_free;
+    struct arena *packet;   // the arena of the current packet, if any
+    bool in_packet;
+};
+
+static __thread struct arena_cache *my_cache;
+static pthread_key_t cache_key;
+static bool cache_key_ok;
+
+static void arena_cache_del(void *cache_)
+{
+    struct arena_cache *cache = cache_;
+    if (! cache) return;
+
+    if (cache->packet) arena_unref(&cache->packet);
+    // Now that the packet arena may have been recycled, free everything
+    struct arena *arena;
+    while (NULL != (arena = cache->free)) {
+        cache->free = arena->next;
+        FREE(arena);
+    }
+    if (cache == my_cache) my_cache = NULL;
+    free(cache);
+}
+
+static struct arena_cache *arena_cache_get(void)
+{
+    if (likely_(my_cache)) return my_cache;
+    if (! cache_key_ok) return NULL;
+
+    struct arena_cache *cache = calloc(1, sizeof(*cache));
+    if (! cache) return NULL;
+    if (0 != pthread_setspecific(cache_key, cache)) {
+        free(cache);
+        return NULL;
+    }
+    return my_cache = cache;
+}
+
+/*
+ * Arenas
+ */
+
+static uintptr_t align(uintptr_t s)
+{
+    return (s + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1);
+}
+
+static struct arena *arena_malloc(size_t size)
+{
+    MALLOCER(arenas);
+    struct arena *arena = MALLOC(arenas, sizeof(*arena) + size);
+    if (! arena) return NULL;
+    arena->size = size;
+    return arena;
+}
+
+static struct arena *arena_ctor(struct arena *arena)
+{
+    SLOG(LOG_DEBUG, "New arena@%p of %zu bytes", arena, arena->size);
+    arena->nb_refs = 1;
+    arena->used = 0;
+    arena->cleanups = NULL;
+    arena->next = NULL;
+    return arena;
+}
+
+struct arena *arena_new(size_t size)
+{
+    struct arena *arena = NULL;
+    struct arena_cache *cache = arena_cache_get();
+
+    if (size <= ARENA_SIZE && cache && cache->free) {
+        arena = cache->free;
+        cache->free = arena->next;
+        cache->nb_free --;
+    } else {
+        arena = arena_malloc(MAX(size, ARENA_SIZE));
+        if (! arena) return NULL;
+    }
+
+    return arena_ctor(arena);
+}
+
+struct arena *arena_new_exact(size_t size)
+{
+    struct arena *arena = arena_malloc(size);
+    if (! arena) return NULL;
+    return arena_ctor(arena);
+}
+
+static void arena_release(struct arena *arena)
+{
+    SLOG(LOG_DEBUG, "Releasing arena@%p (%zu/%zu bytes used)", arena, arena->used, arena->size);
+
+    struct arena_cleanup *cleanup;
+    while (NULL != (cleanup = arena->cleanups)) {
+        arena->cleanups = cleanup->next;
+        cleanup->fun(cleanup->data);
+    }
+
+    // Recycle it into this thread free list (which is not necessarily the one it came from)
+    struct arena_cache *cache = arena_cache_get();
+    if (cache && arena->size == ARENA_SIZE && cache->nb_free < max_free_arenas) {
+        arena->next = cache->free;
+        cache->free = arena;
+        cache->nb_free ++;
+        return;
+    }
+
+    FREE(arena);
+}
+
+struct arena *arena_ref(struct arena *arena)
+{
+    if (! arena) return NULL;
+    (void)__sync_add_and_fetch(&arena->nb_refs, 1);
+    return arena;
+}
+
+void arena_unref(struct arena **arena_)
+{
+    struct arena *arena = *arena_;
+    if (! arena) return;
+    *arena_ = NULL;
+
+    assert(arena->nb_refs > 0);
+    if (0 == __sync_sub_and_fetch(&arena->nb_refs, 1)) arena_release(arena);
+}
+
+size_t arena_avail(struct arena const *arena)
+{
+    return arena->size - arena->used;
+}
+
+// Note: only the thread that created the arena (or the one owning the packet) allocates from it
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size_t const start = align((uintptr_t)(arena->bytes + arena->used)) - (uintptr_t)arena->bytes;
+    if (start > arena->size || size > arena->size - start) return NULL;
+    arena->used = start + size;
+    return arena->bytes + start;
+}
+
+size_t arena_cleanup_size(void)
+{
+    return sizeof(struct arena_cleanup) + ARENA_ALIGN;
+}
+
+int arena_add_cleanup(struct arena *arena, void (*fun)(void *), void *data)
+{
+    struct arena_cleanup *cleanup = arena_alloc(arena, sizeof(*cleanup));
+    if (! cleanup) return -1;
+
+    cleanup->fun = fun;
+    cleanup->data = data;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+    return 0;
+}
+
+/*
+ * Packet arenas
+ */
+
+void arena_packet_begin(void)
+{
+    struct arena_cache *cache = arena_cache_get();
+    if (! cache) return;
+    assert(! cache->in_packet);
+    cache->in_packet = true;
+    // The packet arena is created only when needed
+}
+
+void arena_packet_end(void)
+{
+    struct arena_cache *cache = my_cache;
+    if (! cache) return;
+    cache->in_packet = false;
+    if (cache->packet) arena_unref(&cache->packet);
+}
+
+struct arena *arena_packet(size_t size)
+{
+    struct arena_cache *cache = my_cache;
+    if (! cache || ! cache->in_packet) return NULL;
+
+    if (cache->packet && arena_avail(cache->packet) >= size) return cache->packet;
+
+    // Leave the previous one to those who pinned it
+    if (cache->packet) arena_unref(&cache->packet);
+    cache->packet = arena_new(size);
+    return cache->packet;
+}
+
+/*
+ * Init
+ */
+
+static unsigned inited;
+void arena_init(void)
+{
+    if (inited++) return;
+    ext_init();
+    mallocer_init();
+    log_category_arena_init();
+    ext_param_max_free_arenas_init();
+
+    cache_key_ok = 0 == pthread_key_create(&cache_key, arena_cache_del);
+    if (! cache_key_ok) SLOG(LOG_WARNING, "Cannot create per-thread arena cache key, arenas won't be recycled");
+}
+
+void arena_fini(void)
+{
+    if (--inited) return;
+
+    if (cache_key_ok) {
+        struct arena_cache *cache = my_cache;
+        (void)pthread_setspecific(cache_key, NULL);
+        arena_cache_del(cache);
+        (void)pthread_key_delete(cache_key);
+        cache_key_ok = false;
+    }
+
+    ext_param_max_free_arenas_fini();
+    log_category_arena_fini();
+    mallocer_fini();
+    ext_fini();
+}
@@ -74,6 +74,18 @@ void mutex_lock(struct mutex *mutex)
     }
 }
 
+int mutex_trylock(struct mutex *mutex)
+{
+    assert(mutex->name);
+    int const err = pthread_mutex_trylock(&mutex->mutex);
+    if (! err) {
+        SLOG(LOG_DEBUG, "Locked %s", mutex_name(mutex));
+        return 0;
+    }
+    if (err != EBUSY) SLOG(LOG_ERR, "Cannot lock %s: %s", mutex_name(mutex), strerror(err));
+    return -1;
+}
+
 void mutex_unlock(struct mutex *mutex)
 {
     assert(mutex->name);
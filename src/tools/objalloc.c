@@ -22,6 +22,8 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include "junkie/cpp.h"
 #include "junkie/tools/ext.h"
 #include "junkie/tools/miscmacs.h"
 #include "junkie/tools/log.h"
@@ -94,6 +96,131 @@ static bool should_specialize_for_size(size_t entry_size)
            spec_objallocs[entry_size].live > specialize_count(preset_entry_size(entry_size));
 }
 
+/*
+ * Per-thread caches
+ *
+ * Each thread keeps a small magazine of free cells per (cached) redim_array,
+ * so that most objalloc/objfree do not touch the redim_array (and its lock) at all.
+ * When a magazine gets empty (resp. full) we refill (resp. flush) half of it
+ * in one go with redim_array_get_bulk (resp. redim_array_free_bulk).
+ * Objects freed by another thread than the one that allocated them merely end up
+ * in the magazine of the freeing thread. Magazines are given back to their arrays
+ * when the thread exits.
+ */
+
+#define MAGAZINE_SIZE 32
+#define MAX_CACHED_ARRAYS 128   // fixed ones plus the first specialized ones
+
+struct magazine {
+    unsigned nb_cells;
+    unsigned nb_hits;   // since last report
+    void *cells[MAGAZINE_SIZE];
+};
+
+struct objcache {
+    struct magazine magazines[MAX_CACHED_ARRAYS];
+};
+
+static struct redim_array *cached_arrays[MAX_CACHED_ARRAYS];
+static unsigned nb_cached_arrays;
+
+static bool use_thread_cache = true;
+EXT_PARAM_RW(use_thread_cache, "mem-thread-cache", bool, "Keep a per-thread cache of free objects in front of each allocator")
+
+static __thread struct objcache *my_objcache;
+static pthread_key_t objcache_key;
+static bool objcache_key_ok;
+
+static void cache_register(struct redim_array *ra)
+{
+#   ifdef __GNUC__
+    unsigned const idx = __sync_fetch_and_add(&nb_cached_arrays, 1);
+#   else
+    unsigned const idx = nb_cached_arrays++;
+#   endif
+    if (idx >= NB_ELEMS(cached_arrays)) return;   // this one will not be cached, then
+    cached_arrays[idx] = ra;
+    ra->cache_idx = idx;
+}
+
+static void magazine_flush(struct magazine *mag, struct redim_array *ra, unsigned nb)
+{
+    assert(nb <= mag->nb_cells);
+    mag->nb_cells -= nb;
+    redim_array_free_bulk(ra, mag->cells + mag->nb_cells, nb);
+    redim_array_cache_report(ra, mag->nb_hits, 1);
+    mag->nb_hits = 0;
+}
+
+static void objcache_del(void *cache_)
+{
+    struct objcache *cache = cache_;
+    if (! cache) return;
+
+    for (unsigned c = 0; c < NB_ELEMS(cache->magazines); c++) {
+        struct magazine *mag = cache->magazines + c;
+        if (mag->nb_cells > 0) magazine_flush(mag, cached_arrays[c], mag->nb_cells);
+    }
+    if (cache == my_objcache) my_objcache = NULL;
+    free(cache);
+}
+
+static struct objcache *objcache_get(void)
+{
+    if (likely_(my_objcache)) return my_objcache;
+    if (! objcache_key_ok) return NULL;
+
+    struct objcache *cache = calloc(1, sizeof(*cache));
+    if (! cache) return NULL;
+    if (0 != pthread_setspecific(objcache_key, cache)) {
+        free(cache);
+        return NULL;
+    }
+    return my_objcache = cache;
+}
+
+static struct magazine *magazine_for(struct redim_array *ra)
+{
+    if (ra->cache_idx < 0 || ! use_thread_cache) return NULL;
+    struct objcache *cache = objcache_get();
+    if (! cache) return NULL;
+    return cache->magazines + ra->cache_idx;
+}
+
+static void *cached_get(struct redim_array *ra)
+{
+    struct magazine *mag = magazine_for(ra);
+    if (! mag) return redim_array_get(ra);
+
+    if (mag->nb_cells == 0) {
+        mag->nb_cells = redim_array_get_bulk(ra, mag->cells, MAGAZINE_SIZE/2);
+        redim_array_cache_report(ra, mag->nb_hits, 1);
+        mag->nb_hits = 0;
+        if (! mag->nb_cells) return NULL;
+    } else {
+        mag->nb_hits ++;
+    }
+
+    return mag->cells[--mag->nb_cells];
+}
+
+static void cached_free(struct redim_array *ra, void *cell)
+{
+    struct magazine *mag = magazine_for(ra);
+    if (! mag) {
+        redim_array_free(ra, cell);
+        return;
+    }
+
+    if (mag->nb_cells >= MAGAZINE_SIZE) {
+        magazine_flush(mag, ra, MAGAZINE_SIZE/2);
+    } else {
+        mag->nb_hits ++;
+    }
+
+    mag->cells[mag->nb_cells++] = cell;
+}
+
 static struct redim_array *spec_objalloc_for_size(size_t entry_size, char const *requestor)
 {
     assert(entry_size < NB_ELEMS(spec_objallocs));
@@ -112,6 +239,7 @@ static struct redim_array *spec_objalloc_for_size(size_t entry_size, char const
         if (ra) {
             SLOG(LOG_NOTICE, "Specializing allocator for %s (%zu bytes)", requestor, entry_size);
             redim_array_ctor(ra, preset_entry_size(entry_size), entry_size, requestor);
+            cache_register(ra);
             spec_objallocs[entry_size].ra = ra;
         }
     }
@@ -170,7 +298,7 @@ void *objalloc(size_t entry_size, char const *requestor)
         ra = spec_objalloc_for_size(spec_size, requestor);
         if (ra) {
             // we have a specialized container, all is well
-            struct obj *obj = redim_array_get(ra);
+            struct obj *obj = cached_get(ra);
             if (! obj) return NULL;
             obj->ra = ra;
             return obj->userdata;
@@ -180,7 +308,7 @@ void *objalloc(size_t entry_size, char const *requestor)
     // use a preset allocator then
     ra = preset_objalloc_for_size(entry_size + sizeof(struct preset_obj), requestor);
     assert(ra);
-    struct preset_obj *p_obj = redim_array_get(ra);
+    struct preset_obj *p_obj = cached_get(ra);
     if (! p_obj) return NULL;
     p_obj->spec_size = spec_size;
     p_obj->obj.ra = (void *)(((intptr_t)ra) | 1); // so that we will recognize it as such when freeing
@@ -218,9 +346,9 @@ void objfree(void *ptr)
 #           endif
             assert(prev_lives > 0);
         }
-        redim_array_free((void *)((intptr_t)p_obj->obj.ra^1), p_obj);
+        cached_free((void *)((intptr_t)p_obj->obj.ra^1), p_obj);
     } else {
-        redim_array_free(obj->ra, obj);
+        cached_free(obj->ra, obj);
     }
 }
 
@@ -246,6 +374,7 @@ void objalloc_init(void)
     ext_param_chunk_size_init();
     ext_param_min_preset_size_init();
     ext_param_max_preset_size_init();
+    ext_param_use_thread_cache_init();
 
     for (unsigned m = 0; m < NB_ELEMS(spec_objallocs_mutex); m++) {
         mutex_ctor(spec_objallocs_mutex+m, "spec_objallocs");
@@ -256,18 +385,33 @@ void objalloc_init(void)
         snprintf(fixed_objallocs[f].name, sizeof(fixed_objallocs[f].name), "fixed_alloc[%zu]", entry_size);
         int err = redim_array_ctor(&fixed_objallocs[f].ra, preset_entry_size(entry_size), entry_size, fixed_objallocs[f].name);
         assert(!err);
+        cache_register(&fixed_objallocs[f].ra);
     }
 
     for (unsigned f = 0; f < NB_ELEMS(spec_objallocs); f++) {
         spec_objallocs[f].ra = NULL;
         spec_objallocs[f].live = 0;
     }
+
+    // Magazines of exiting threads are given back to their arrays
+    objcache_key_ok = 0 == pthread_key_create(&objcache_key, objcache_del);
+    if (! objcache_key_ok) SLOG(LOG_WARNING, "Cannot create per-thread cache key, will do without");
 }
 
 void objalloc_fini(void)
 {
     if (--inited) return;
 
+    // Give back our own cached objects (other threads should be gone by now)
+    if (objcache_key_ok) {
+        struct objcache *cache = my_objcache;
+        (void)pthread_setspecific(objcache_key, NULL);
+        objcache_del(cache);
+        (void)pthread_key_delete(objcache_key);
+        objcache_key_ok = false;
+    }
+    nb_cached_arrays = 0;
+
     // Destruct all precalc objalloc
     for (unsigned f = 0; f < NB_ELEMS(fixed_objallocs); f++) {
         redim_array_dtor(&fixed_objallocs[f].ra);
@@ -286,6 +430,7 @@ void objalloc_fini(void)
         mutex_dtor(spec_objallocs_mutex+m);
     }
 
+    ext_param_use_thread_cache_fini();
     ext_param_max_preset_size_fini();
     ext_param_min_preset_size_fini();
     ext_param_chunk_size_fini();
@@ -101,6 +101,8 @@ int redim_array_ctor(struct redim_array *ra, unsigned alloc_size, size_t entry_s
     ra->alloc_size = alloc_size;
     ra->entry_size = entry_size;
     ra->name = name;
+    ra->cache_idx = -1;
+    ra->nb_cache_hits = ra->nb_cache_misses = 0;
     TAILQ_INIT(&ra->chunks);
     mutex_ctor(&ra->chunks_mutex, "redim_array chunks");
     mutex_lock(&redim_arrays_mutex);
@@ -129,12 +131,11 @@ static void *chunk_entry(struct redim_array_chunk *chunk, unsigned n)
     return chunk->bytes + n * chunk->array->entry_size;
 }
 
-void *redim_array_get(struct redim_array *ra)
+// Caller must own chunks_mutex
+static void *redim_array_get_locked(struct redim_array *ra)
 {
     void *ret = NULL;
 
-    mutex_lock(&ra->chunks_mutex);
-
     // Look for the first chunk with free or unused cells
     struct redim_array_chunk *chunk;
     TAILQ_FOREACH(chunk, &ra->chunks, entry) {  // a specific list for unfilled chunks seams overkill
@@ -159,15 +160,33 @@ void *redim_array_get(struct redim_array *ra)
     ra->nb_used ++;
 quit:
     SLOG(LOG_DEBUG, "Get cell@%p from array@%p", ret, ra);
-    mutex_unlock(&ra->chunks_mutex);
     return ret;
 }
 
-void redim_array_free(struct redim_array *ra, void *cell)
+void *redim_array_get(struct redim_array *ra)
 {
-    SLOG(LOG_DEBUG, "Freeing cell@%p from array@%p", cell, ra);
+    mutex_lock(&ra->chunks_mutex);
+    void *ret = redim_array_get_locked(ra);
+    mutex_unlock(&ra->chunks_mutex);
+    return ret;
+}
 
+unsigned redim_array_get_bulk(struct redim_array *ra, void **cells, unsigned nb)
+{
+    unsigned n;
     mutex_lock(&ra->chunks_mutex);
+    for (n = 0; n < nb; n++) {
+        cells[n] = redim_array_get_locked(ra);
+        if (! cells[n]) break;
+    }
+    mutex_unlock(&ra->chunks_mutex);
+    return n;
+}
+
+// Caller must own chunks_mutex
+static void redim_array_free_locked(struct redim_array *ra, void *cell)
+{
+    SLOG(LOG_DEBUG, "Freeing cell@%p from array@%p", cell, ra);
 
     // Find the relevant chunk
     struct redim_array_chunk *chunk;
@@ -185,10 +204,33 @@ void redim_array_free(struct redim_array *ra, void *cell)
     if (chunk->nb_holes == chunk->nb_used) {
         chunk_del(chunk);
     }
+}
+
+void redim_array_free(struct redim_array *ra, void *cell)
+{
+    mutex_lock(&ra->chunks_mutex);
+    redim_array_free_locked(ra, cell);
+    mutex_unlock(&ra->chunks_mutex);
+}
 
+void redim_array_free_bulk(struct redim_array *ra, void **cells, unsigned nb)
+{
+    mutex_lock(&ra->chunks_mutex);
+    for (unsigned n = 0; n < nb; n++) redim_array_free_locked(ra, cells[n]);
     mutex_unlock(&ra->chunks_mutex);
 }
 
+void redim_array_cache_report(struct redim_array *ra, unsigned nb_hits, unsigned nb_misses)
+{
+#   ifdef __GNUC__
+    if (nb_hits) (void)__sync_add_and_fetch(&ra->nb_cache_hits, nb_hits);
+    if (nb_misses) (void)__sync_add_and_fetch(&ra->nb_cache_misses, nb_misses);
+#   else    // stats only
+    ra->nb_cache_hits += nb_hits;
+    ra->nb_cache_misses += nb_misses;
+#   endif
+}
+
 void redim_array_clear(struct redim_array *ra)
 {
     mutex_lock(&ra->chunks_mutex);
@@ -257,6 +299,9 @@ static SCM nb_holes_sym;
 static SCM nb_chunks_sym;
 static SCM alloc_size_sym;
 static SCM entry_size_sym;
+static SCM cache_hits_sym;
+static SCM cache_misses_sym;
+static SCM cache_hit_ratio_sym;
 
 static struct ext_function sg_array_stats;
 static SCM g_array_stats(SCM name_)
@@ -264,6 +309,8 @@ static SCM g_array_stats(SCM name_)
     struct redim_array *array = array_of_scm_name(name_);
     if (! array) return SCM_UNSPECIFIED;
 
+    uint64_t const hits = array->nb_cache_hits, misses = array->nb_cache_misses;
+
     return scm_list_n(
         scm_cons(nb_used_sym,     scm_from_uint(array->nb_used)),
         scm_cons(nb_malloced_sym, scm_from_uint(array->nb_malloced)),
@@ -271,6 +318,9 @@ static SCM g_array_stats(SCM name_)
         scm_cons(nb_chunks_sym,   scm_from_uint(array->nb_chunks)),
         scm_cons(alloc_size_sym,  scm_from_uint(array->alloc_size)),
         scm_cons(entry_size_sym,  scm_from_size_t(array->entry_size)),
+        scm_cons(cache_hits_sym,  scm_from_uint64(hits)),
+        scm_cons(cache_misses_sym, scm_from_uint64(misses)),
+        scm_cons(cache_hit_ratio_sym, hits + misses > 0 ? scm_from_double((double)hits / (hits + misses)) : SCM_BOOL_F),
         SCM_UNDEFINED);
 }
 
@@ -291,6 +341,9 @@ void redim_array_init(void)
     nb_chunks_sym   = scm_permanent_object(scm_from_latin1_symbol("nb-chunks"));
     alloc_size_sym  = scm_permanent_object(scm_from_latin1_symbol("alloc-size"));
     entry_size_sym  = scm_permanent_object(scm_from_latin1_symbol("entry-size"));
+    cache_hits_sym  = scm_permanent_object(scm_from_latin1_symbol("cache-hits"));
+    cache_misses_sym = scm_permanent_object(scm_from_latin1_symbol("cache-misses"));
+    cache_hit_ratio_sym = scm_permanent_object(scm_from_latin1_symbol("cache-hit-ratio"));
 
     ext_function_ctor(&sg_array_names,
         "array-names", 0, 0, 0, g_array_names,
@@ -300,6 +353,8 @@ void redim_array_init(void)
         "array-stats", 1, 0, 0, g_array_stats,
         "(array-stats \"array-name\"): returns some statistics about this array, such as current number of elements.\n"
         "Note: Beware that alloc-size is given in entries, not bytes !\n"
+        "cache-hit-ratio tells how often cells were got from or given back to a per-thread cache\n"
+        "    instead of the array itself (#f if the array is not cached).\n"
         "See also (? 'array-names) for a list of array names.\n");
 }
 
@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <libguile.h>
+#include "junkie/cpp.h"
 #include "junkie/tools/log.h"
 #include "junkie/tools/ref.h"
 #include "junkie/tools/mutex.h"
@@ -31,74 +32,280 @@ LOG_CATEGORY_DEF(ref)
 #define LOG_CAT ref_log_category
 
 /* We proceed as follow :
- * There is a RW lock that all threads try to take for read, and the doomer
- * thread that takes it for write from time to time.
+ * There is a global epoch that the doomer increments at each run (and so does
+ * wait_grace_period). Every thread entering the multi region publishes the
+ * epoch it saw, and clears it when it leaves (which is thus a quiescent state for this thread). Once the doomer
+ * finds an unreachable object it tags it with the current epoch, and deletes it
+ * on a later run if every thread that is still in the multi region entered it
+ * after that epoch - and the object count was not raised in the meantime.
+ * This way parsing threads never wait for the doomer (nor the doomer for them).
+ *
+ * The mono region is still there for the rare users that really need all other
+ * threads out of the way: it merely makes threads wait before entering the multi
+ * region, then waits until all of them are out.
  */
 
-static struct rwlock rwlock;
+static unsigned long volatile global_epoch = 1;  // 0 is for "out of the multi region"
+
+struct epoch_thread {
+    unsigned long volatile epoch;   // the global epoch when this thread entered the multi region, or 0
+    unsigned depth;                 // nesting level of multi regions
+    bool mono;                      // this thread is in the mono region...
+    unsigned mono_depth;            // ...which it entered at this nesting level of multi regions
+    LIST_ENTRY(epoch_thread) entry; // in the list of all epoch_threads
+};
+
+static LIST_HEAD(epoch_threads, epoch_thread) epoch_threads = LIST_HEAD_INITIALIZER(epoch_threads);
+static struct mutex epoch_threads_mutex;    // protects the above list
+static __thread struct epoch_thread *my_epoch_thread;
+static pthread_key_t epoch_thread_key;
+
+static void epoch_thread_del(void *et_)
+{
+    struct epoch_thread *et = et_;
+    if (! et) return;
+
+    mutex_lock(&epoch_threads_mutex);
+    LIST_REMOVE(et, entry);
+    mutex_unlock(&epoch_threads_mutex);
+    if (et == my_epoch_thread) my_epoch_thread = NULL;
+    free(et);
+}
+
+static struct epoch_thread *epoch_thread_get(void)
+{
+    if (likely_(my_epoch_thread)) return my_epoch_thread;
+
+    struct epoch_thread *et = calloc(1, sizeof(*et));
+    if (! et) {
+        SLOG(LOG_ERR, "Cannot alloc epoch for this thread, deletions won't be safe!");
+        return NULL;
+    }
+    if (0 != pthread_setspecific(epoch_thread_key, et)) {
+        SLOG(LOG_ERR, "Cannot set epoch for this thread, deletions won't be safe!");
+        free(et);
+        return NULL;
+    }
+
+    mutex_lock(&epoch_threads_mutex);
+    LIST_INSERT_HEAD(&epoch_threads, et, entry);
+    mutex_unlock(&epoch_threads_mutex);
+
+    return my_epoch_thread = et;
+}
+
+// The lowest epoch of the threads in the multi region (or the current epoch if there are none)
+static unsigned long min_epoch(void)
+{
+    unsigned long min = global_epoch;
+    mutex_lock(&epoch_threads_mutex);
+    struct epoch_thread *et;
+    LIST_FOREACH(et, &epoch_threads, entry) {
+        unsigned long const e = et->epoch;
+        if (e && e < min) min = e;
+    }
+    mutex_unlock(&epoch_threads_mutex);
+    return min;
+}
+
+/*
+ * Multi and mono regions
+ */
+
+static struct mutex mono_mutex;         // owned by the thread in the mono region
+static bool volatile mono_wanted;
 
 void enter_multi_region(void)
 {
-    rwlock_acquire(&rwlock, false);
+    struct epoch_thread *me = epoch_thread_get();
+    if (unlikely_(! me)) return;
+    if (me->depth++ > 0 || me->mono) return;
+
+    while (1) {
+        me->epoch = global_epoch;
+        __sync_synchronize();   // publish our epoch before reading any pointer (or mono_wanted)
+        if (likely_(! mono_wanted)) break;
+        // Let the mono region go first
+        me->epoch = 0;
+        __sync_synchronize();
+        static struct bench_event waiting_for_mono = BENCH("waiting for mono region");
+        uint64_t const start = bench_event_start();
+        mutex_lock(&mono_mutex);
+        mutex_unlock(&mono_mutex);
+        bench_event_stop(&waiting_for_mono, start);
+    }
 }
 
 void enter_mono_region(void)
 {
-    rwlock_acquire(&rwlock, true);
+    struct epoch_thread *me = epoch_thread_get();
+
+    mutex_lock(&mono_mutex);
+    mono_wanted = true;
+    __sync_synchronize();
+
+    if (me) {
+        me->mono = true;
+        me->mono_depth = me->depth;
+        // So that the doomer does not delete what we are using
+        if (! me->epoch) me->epoch = global_epoch;
+        __sync_synchronize();
+    }
+
+    // Wait for every other thread to leave the multi region
+    while (1) {
+        bool busy = false;
+        mutex_lock(&epoch_threads_mutex);
+        struct epoch_thread *et;
+        LIST_FOREACH(et, &epoch_threads, entry) {
+            if (et != me && et->epoch) {
+                busy = true;
+                break;
+            }
+        }
+        mutex_unlock(&epoch_threads_mutex);
+        if (! busy) break;
+        usleep(100);
+    }
 }
 
 void leave_protected_region(void)
 {
-    rwlock_release(&rwlock);
+    struct epoch_thread *me = my_epoch_thread;
+
+    if (me && me->mono && me->depth == me->mono_depth) {
+        me->mono = false;
+        if (me->depth == 0) {
+            __sync_synchronize();
+            me->epoch = 0;
+        }
+        mono_wanted = false;
+        __sync_synchronize();
+        mutex_unlock(&mono_mutex);
+        return;
+    }
+
+    if (unlikely_(! me)) return;
+    assert(me->depth > 0);
+    if (--me->depth > 0 || me->mono) return;
+    __sync_synchronize();   // we are done with any pointer we had
+    me->epoch = 0;
+}
+
+void wait_grace_period(void)
+{
+    struct epoch_thread *const me = my_epoch_thread;
+    unsigned long const epoch = __sync_add_and_fetch(&global_epoch, 1);
+
+    while (1) {
+        bool busy = false;
+        mutex_lock(&epoch_threads_mutex);
+        struct epoch_thread *et;
+        LIST_FOREACH(et, &epoch_threads, entry) {
+            unsigned long const e = et->epoch;
+            if (et != me && e && e < epoch) {
+                busy = true;
+                break;
+            }
+        }
+        mutex_unlock(&epoch_threads_mutex);
+        if (! busy) break;
+        usleep(100);
+    }
 }
 
+/*
+ * Doomer
+ */
+
 static pthread_t doomer_pth;
 
 extern struct refs death_row;
 extern struct mutex death_row_mutex;
 
-static void delete_doomed(void)
+static struct mutex doomer_mutex;   // so that doomer_run can be called from any thread
+static struct refs limbo;           // unreachable objects waiting for their grace period to end (protected by death_row_mutex)
+
+// Returns the number of objects that were deleted or that were found unreachable
+static unsigned delete_doomed(void)
 {
     static struct bench_event dooming = BENCH("del doomed objs");
     uint64_t start = bench_event_start();
 
     SLOG(LOG_DEBUG, "Deleting doomed objects...");
-    unsigned nb_dels = 0, nb_rescued = 0;
+    unsigned nb_dels = 0, nb_rescued = 0, nb_new = 0, nb_waiting = 0;
+
+    unsigned long const epoch = __sync_add_and_fetch(&global_epoch, 1);
+    unsigned long const min = min_epoch();
 
-    // No need to take the mutex since other threads are not allowed to reenter unsafe region until we are done
+    struct refs doomed, waiting;
+    SLIST_INIT(&doomed);
+    SLIST_INIT(&waiting);
 
     struct ref *r;
+    mutex_lock(&death_row_mutex);
+    // Newly unreachable objects join the limbo
     while (NULL != (r = SLIST_FIRST(&death_row))) {
-        // Beware that r->del() may doom further objects, which will be added at the beginning of the list.
-        SLOG(LOG_DEBUG, "Delete next object on doom list: %p", r);
         SLIST_REMOVE_HEAD(&death_row, entry);
-        r->entry.sle_next = NOT_IN_DEATH_ROW;
-        if (r->count == 0) {
-            r->del(r);
-            nb_dels ++;
-        } else {
+        SLIST_INSERT_HEAD(&limbo, r, entry);
+    }
+    while (NULL != (r = SLIST_FIRST(&limbo))) {
+        SLIST_REMOVE_HEAD(&limbo, entry);
+        if (r->count > 0) {
+            r->entry.sle_next = NOT_IN_DEATH_ROW;
             nb_rescued ++;
+        } else if (r->doom_epoch == 0) {
+            // Unreachable since (at least) now. Threads that entered the multi region already may still use it.
+            r->doom_epoch = epoch;
+            SLIST_INSERT_HEAD(&waiting, r, entry);
+            nb_new ++;
+        } else if (r->doom_epoch < min) {
+            // Every thread still in the multi region entered it when this was unreachable already
+            SLIST_INSERT_HEAD(&doomed, r, entry);
+        } else {
+            SLIST_INSERT_HEAD(&waiting, r, entry);
+            nb_waiting ++;
         }
     }
+    limbo = waiting;
+    mutex_unlock(&death_row_mutex);
 
-    SLOG(nb_dels + nb_rescued > 0 ? LOG_INFO:LOG_DEBUG, "Deleted %u objects, rescued %u", nb_dels, nb_rescued);
+    while (NULL != (r = SLIST_FIRST(&doomed))) {
+        // Beware that r->del() may doom further objects, which will be added onto the death row.
+        SLOG(LOG_DEBUG, "Delete next object on doom list: %p", r);
+        SLIST_REMOVE_HEAD(&doomed, entry);
+        r->entry.sle_next = NOT_IN_DEATH_ROW;
+        assert(r->count == 0);
+        r->del(r);
+        nb_dels ++;
+    }
+
+    SLOG(nb_dels + nb_rescued > 0 ? LOG_INFO:LOG_DEBUG, "Deleted %u objects, rescued %u, %u (+%u new) waiting for their grace period", nb_dels, nb_rescued, nb_waiting, nb_new);
 
     bench_event_stop(&dooming, start);
+
+    return nb_dels + nb_new;
 }
 
 void doomer_run(void)
 {
-    enter_mono_region();
-    delete_doomed();
-    leave_protected_region();
+    mutex_lock(&doomer_mutex);
+    /* Deleting objects may doom others, and new unreachable objects can be deleted on the
+     * next run if no thread prevents the epoch from moving on, so proceed while it's fruitful. */
+    for (unsigned nb_runs = 0; nb_runs < 64 && delete_doomed() > 0; nb_runs++) ;
+    mutex_unlock(&doomer_mutex);
 }
 
 static void *doomer_thread_(void unused_ *dummy)
 {
     set_thread_name("J-doomer");
+    int dummy_oldstate;
 
     while (1) {
+        (void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &dummy_oldstate);
         doomer_run();
+        (void)pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &dummy_oldstate);
+        pthread_testcancel();
         sleep(1);
     }
     return NULL;
@@ -116,10 +323,9 @@ extern inline void unref(struct ref *);
 
 void doomer_stop(void)
 {
-    rwlock_acquire(&rwlock, false);    // wait for doomer-thread to finish its run
+    // The doomer thread can be cancelled only in between two runs
     (void)pthread_cancel(doomer_pth);
     (void)pthread_join(doomer_pth, NULL);
-    rwlock_release(&rwlock);
     SLOG(LOG_DEBUG, "doomer thread was cancelled");
 }
 
@@ -131,10 +337,18 @@ void ref_init(void)
 
     mutex_ctor(&death_row_mutex, "death row");
     SLIST_INIT(&death_row);
+    SLIST_INIT(&limbo);
     log_category_ref_init();
-    rwlock_ctor(&rwlock, "doomer");
+    mutex_ctor(&epoch_threads_mutex, "epoch threads");
+    mutex_ctor(&mono_mutex, "mono region");
+    mutex_ctor(&doomer_mutex, "doomer");
 
-    int err = pthread_create(&doomer_pth, NULL, doomer_thread, NULL);
+    int err = pthread_key_create(&epoch_thread_key, epoch_thread_del);
+    if (err) {
+        SLOG(LOG_ERR, "Cannot pthread_key_create(): %s", strerror(err));
+    }
+
+    err = pthread_create(&doomer_pth, NULL, doomer_thread, NULL);
 
     if (err) {
         SLOG(LOG_ERR, "Cannot pthread_create(): %s", strerror(err));
@@ -145,10 +359,16 @@ void ref_fini(void)
 {
     if (--inited) return;
 
-    rwlock_dtor(&rwlock);
+    struct epoch_thread *me = my_epoch_thread;
+    (void)pthread_setspecific(epoch_thread_key, NULL);
+    epoch_thread_del(me);
+    (void)pthread_key_delete(epoch_thread_key);
+
+    mutex_dtor(&doomer_mutex);
+    mutex_dtor(&mono_mutex);
+    mutex_dtor(&epoch_threads_mutex);
     mutex_dtor(&death_row_mutex);
     log_category_ref_fini();
 
     mutex_fini();
 }
-
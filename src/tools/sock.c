@@ -141,7 +141,7 @@ static int sock_inet_client_ctor(struct sock_inet *s, char const *host, char con
     return res;
 }
 
-static int sock_inet_server_ctor(struct sock_inet *s, char const *service, size_t buf_size, int type, struct sock_ops const *ops)
+static int sock_inet_server_ctor(struct sock_inet *s, char const *service, size_t buf_size, bool reuseport, int type, struct sock_ops const *ops)
 {
     char const *proto = type == SOCK_STREAM ? "tcp":"udp";
     SLOG(LOG_DEBUG, "Construct sock for serving %s/%s", service, proto);
@@ -177,6 +177,12 @@ static int sock_inet_server_ctor(struct sock_inet *s, char const *service, size_
             SLOG(LOG_WARNING, "Cannot socket(): %s", strerror(errno));
             continue;
         }
+        if (reuseport) {
+            int one = 1;
+            if (0 != setsockopt(s->fd[s->nb_fds], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))) {
+                SLOG(LOG_ERR, "Cannot setsockopt(SO_REUSEPORT): %s", strerror(errno));
+            }
+        }
         if (0 != bind(s->fd[s->nb_fds], &srv_addr.a, srv_addrlen)) {
             SLOG(LOG_WARNING, "Cannot bind(): %s", strerror(errno));
             (void)close(s->fd[s->nb_fds]);
@@ -225,8 +231,11 @@ static bool sock_inet_is_opened(struct sock_inet *s)
  * UDP sockets
  */
 
+#define SOCK_UDP_BATCH 8
+
 struct sock_udp {
     struct sock_inet inet;
+    uint8_t (*rcv_bufs)[SOCK_MAX_MSG_SIZE]; ///< SOCK_UDP_BATCH buffers for recvmmsg, allocated on first read
 };
 
 static int sock_udp_send(struct sock *s_, void const *buf, size_t len)
@@ -242,49 +251,90 @@ static int sock_udp_send(struct sock *s_, void const *buf, size_t len)
     return 0;
 }
 
-static ssize_t my_recvfrom(int fd, uint8_t *buf, size_t bufsz, struct ip_addr *sender)
+static unsigned sock_udp_send_batch(struct sock *s_, struct iovec const *msgs, unsigned nb_msgs)
 {
-    union {
-        struct sockaddr a;
-        struct sockaddr_storage placeholder;
-    } src_addr;
-    socklen_t addrlen = sizeof(src_addr);
-    ssize_t r = recvfrom(fd, buf, bufsz, 0, &src_addr.a, &addrlen);
-    if (r < 0) return r;
-    if (! sender) return r;
+    struct sock_inet *i_ = DOWNCAST(s_, sock, sock_inet);
+
+    SLOG(LOG_DEBUG, "Sending %u msgs to %s (fd %d)", nb_msgs, s_->name, i_->fd[0]);
+
+    // Send by chunks of SOCK_UDP_BATCH, so that we do not need more room than that on the stack
+    unsigned sent = 0;
+    while (sent < nb_msgs) {
+        struct mmsghdr hdrs[SOCK_UDP_BATCH];
+        unsigned const nb_hdrs = MIN(nb_msgs - sent, NB_ELEMS(hdrs));
+        memset(hdrs, 0, nb_hdrs * sizeof(hdrs[0]));
+        for (unsigned m = 0; m < nb_hdrs; m++) {
+            hdrs[m].msg_hdr.msg_iov = (struct iovec *)(msgs + sent + m);
+            hdrs[m].msg_hdr.msg_iovlen = 1;
+        }
+        int const r = sendmmsg(i_->fd[0], hdrs, nb_hdrs, MSG_DONTWAIT);
+        if (r < 0) {
+            TIMED_SLOG(LOG_ERR, "Cannot send %u msgs into %s: %s", nb_msgs - sent, s_->name, strerror(errno));
+            break;
+        }
+        sent += r;
+    }
+    return sent;
+}
 
-    if (addrlen > sizeof(src_addr)) {
-        SLOG(LOG_ERR, "Cannot set sender address: size too big (%zu > %zu)", (size_t)addrlen, sizeof(src_addr));
+static void sender_of_sockaddr(struct ip_addr *sender, struct sockaddr const *addr, socklen_t addrlen)
+{
+    if (addrlen > sizeof(union sockaddr_gen)) {
+        SLOG(LOG_ERR, "Cannot set sender address: size too big (%zu > %zu)", (size_t)addrlen, sizeof(union sockaddr_gen));
         *sender = local_ip;
     } else {
-        if (0 != ip_addr_ctor_from_sockaddr(sender, &src_addr.a, addrlen)) {
+        if (0 != ip_addr_ctor_from_sockaddr(sender, addr, addrlen)) {
             *sender = local_ip;
         }
     }
-    return r;
 }
 
 static int sock_udp_recv(struct sock *s_, fd_set *set, sock_receiver *receiver, void *user_data)
 {
     struct sock_inet *i_ = DOWNCAST(s_, sock, sock_inet);
+    struct sock_udp *s = DOWNCAST(i_, inet, sock_udp);
+
+    if (! s->rcv_bufs) {
+        s->rcv_bufs = malloc(SOCK_UDP_BATCH * sizeof(*s->rcv_bufs));
+        if (! s->rcv_bufs) {
+            SLOG(LOG_ERR, "Cannot malloc receive buffers for %s", s_->name);
+            return -1;
+        }
+    }
 
     for (unsigned fdi = 0; fdi < i_->nb_fds; fdi++) {
         if (! FD_ISSET(i_->fd[fdi], set)) return 0;
 
         SLOG(LOG_DEBUG, "Reading on socket %s (fd %d)", s_->name, i_->fd[fdi]);
 
-        uint8_t buf[SOCK_MAX_MSG_SIZE];
-        struct ip_addr sender;
-        ssize_t r = my_recvfrom(i_->fd[fdi], buf, sizeof(buf), &sender);
-        if (r < 0) {
+        // Read all the datagrams that are already there (up to SOCK_UDP_BATCH)
+        struct mmsghdr hdrs[SOCK_UDP_BATCH];
+        struct iovec iovs[SOCK_UDP_BATCH];
+        union sockaddr_gen src_addrs[SOCK_UDP_BATCH];
+        memset(hdrs, 0, sizeof(hdrs));
+        for (unsigned m = 0; m < SOCK_UDP_BATCH; m++) {
+            iovs[m].iov_base = s->rcv_bufs[m];
+            iovs[m].iov_len = sizeof(s->rcv_bufs[m]);
+            hdrs[m].msg_hdr.msg_iov = iovs + m;
+            hdrs[m].msg_hdr.msg_iovlen = 1;
+            hdrs[m].msg_hdr.msg_name = src_addrs + m;
+            hdrs[m].msg_hdr.msg_namelen = sizeof(src_addrs[m]);
+        }
+        int const nb_msgs = recvmmsg(i_->fd[fdi], hdrs, SOCK_UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (nb_msgs < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;  // another thread was quicker
             TIMED_SLOG(LOG_ERR, "Cannot receive datagram from %s: %s", s_->name, strerror(errno));
-            return r;
+            return nb_msgs;
         }
 
-        SLOG(LOG_DEBUG, "read %zd bytes out of %s", r, s_->name);
+        SLOG(LOG_DEBUG, "read %d datagrams out of %s", nb_msgs, s_->name);
 
-        int err = receiver(s_, MIN((size_t)r, sizeof(buf)), buf, &sender, user_data);
-        if (err) return err;
+        for (int m = 0; m < nb_msgs; m++) {
+            struct ip_addr sender;
+            sender_of_sockaddr(&sender, &src_addrs[m].a, hdrs[m].msg_hdr.msg_namelen);
+            int err = receiver(s_, MIN((size_t)hdrs[m].msg_len, sizeof(s->rcv_bufs[m])), s->rcv_bufs[m], &sender, user_data);
+            if (err) return err;
+        }
     }
 
     return 0;
@@ -310,6 +360,7 @@ static bool sock_udp_is_opened(struct sock *s_)
 static void sock_udp_dtor(struct sock_udp *s)
 {
     sock_inet_dtor(&s->inet);
+    free(s->rcv_bufs);
 }
 
 static void sock_udp_del(struct sock *s_)
@@ -322,6 +373,7 @@ static void sock_udp_del(struct sock *s_)
 
 static struct sock_ops sock_udp_ops = {
     .send = sock_udp_send,
+    .send_batch = sock_udp_send_batch,
     .recv = sock_udp_recv,
     .set_fd = sock_udp_set_fd,
     .is_opened = sock_udp_is_opened,
@@ -330,6 +382,7 @@ static struct sock_ops sock_udp_ops = {
 
 static int sock_udp_client_ctor(struct sock_udp *s, char const *host, char const *service, size_t buf_size)
 {
+    s->rcv_bufs = NULL;
     return sock_inet_client_ctor(&s->inet, host, service, buf_size, SOCK_DGRAM, &sock_udp_ops);
 }
 
@@ -344,22 +397,33 @@ struct sock *sock_udp_client_new(char const *host, char const *service, size_t b
     return &s->inet.sock;
 }
 
-static int sock_udp_server_ctor(struct sock_udp *s, char const *service, size_t buf_size)
+static int sock_udp_server_ctor(struct sock_udp *s, char const *service, size_t buf_size, bool reuseport)
 {
-    return sock_inet_server_ctor(&s->inet, service, buf_size, SOCK_DGRAM, &sock_udp_ops);
+    s->rcv_bufs = NULL;
+    return sock_inet_server_ctor(&s->inet, service, buf_size, reuseport, SOCK_DGRAM, &sock_udp_ops);
 }
 
-struct sock *sock_udp_server_new(char const *service, size_t buf_size)
+static struct sock *sock_udp_server_new_(char const *service, size_t buf_size, bool reuseport)
 {
     struct sock_udp *s = objalloc(sizeof(*s), "udp sockets");
     if (! s) return NULL;
-    if (0 != sock_udp_server_ctor(s, service, buf_size)) {
+    if (0 != sock_udp_server_ctor(s, service, buf_size, reuseport)) {
         objfree(s);
         return NULL;
     }
     return &s->inet.sock;
 }
 
+struct sock *sock_udp_server_new(char const *service, size_t buf_size)
+{
+    return sock_udp_server_new_(service, buf_size, false);
+}
+
+struct sock *sock_udp_server_new_shared(char const *service, size_t buf_size)
+{
+    return sock_udp_server_new_(service, buf_size, true);
+}
+
 /*
  * TCP sockets
  */
@@ -537,7 +601,7 @@ static int sock_tcp_server_ctor(struct sock_tcp *s, char const *service, size_t
         s->clients[c].fd = -1;
     }
 
-    int err = sock_inet_server_ctor(&s->inet, service, buf_size, SOCK_STREAM, &sock_tcp_ops);
+    int err = sock_inet_server_ctor(&s->inet, service, buf_size, false, SOCK_STREAM, &sock_tcp_ops);
     if (err) return err;
 
     for (unsigned fds = 0; fds < s->inet.nb_fds; fds++) {
@@ -1080,6 +1144,17 @@ int sock_select_single(struct sock *sock, fd_set *set)
     return 0;
 }
 
+unsigned sock_send_batch(struct sock *sock, struct iovec const *msgs, unsigned nb_msgs)
+{
+    if (sock->ops->send_batch) return sock->ops->send_batch(sock, msgs, nb_msgs);
+
+    unsigned sent = 0;
+    for (unsigned m = 0; m < nb_msgs; m++) {
+        if (0 == sock->ops->send(sock, msgs[m].iov_base, msgs[m].iov_len)) sent ++;
+    }
+    return sent;
+}
+
 
 /*
  * The Sock Smob
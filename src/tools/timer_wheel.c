@@ -0,0 +1,226 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+/* Copyright 2010, SecurActive.
+ *
+ * This file is part of Junkie.
+ *
+ * Junkie is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Junkie is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with Junkie.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include "junkie/cpp.h"
+#include "junkie/tools/timer_wheel.h"
+#include "junkie/tools/miscmacs.h"
+
+/*
+ * Wheels are indexed by absolute time: the slot of a timer on level l is given by the bits
+ * [l*TIMER_WHEEL_BITS, (l+1)*TIMER_WHEEL_BITS[ of its expiry, and the level is the smallest one
+ * which period is larger than the time left before expiry. This way a slot of level l>0 is
+ * emptied exactly when the time reaches the beginning of its period, at which point all its
+ * timers are due within the period of level l-1.
+ */
+
+void timer_wheel_ctor(struct timer_wheel *wheel, time_t now)
+{
+    wheel->now = now;
+    wheel->nb_timers = 0;
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (unsigned s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            LIST_INIT(&wheel->slots[l][s]);
+        }
+    }
+}
+
+void timer_wheel_dtor(struct timer_wheel *wheel)
+{
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (unsigned s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            struct timer *timer;
+            while (NULL != (timer = LIST_FIRST(&wheel->slots[l][s]))) {
+                LIST_REMOVE(timer, entry);
+                timer->set = false;
+            }
+        }
+    }
+    wheel->nb_timers = 0;
+}
+
+void timer_ctor(struct timer *timer)
+{
+    timer->set = false;
+    timer->expiry = 0;
+}
+
+static unsigned slot_of(time_t t, unsigned level)
+{
+    return ((unsigned long long)t >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+}
+
+// Store the timer in the slot it belongs to, given its expiry which must not be in the past
+static void timer_store(struct timer_wheel *wheel, struct timer *timer)
+{
+    assert(timer->expiry >= wheel->now);
+    time_t const delta = timer->expiry - wheel->now;
+
+    // Timers too far away are stored in the furthest slot and will be stored again when it comes up
+    time_t const when = delta < TIMER_WHEEL_SPAN ? timer->expiry : wheel->now + TIMER_WHEEL_SPAN - 1;
+
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS-1 && delta >= (time_t)1 << ((level+1) * TIMER_WHEEL_BITS)) level ++;
+
+    LIST_INSERT_HEAD(&wheel->slots[level][slot_of(when, level)], timer, entry);
+}
+
+void timer_add(struct timer_wheel *wheel, struct timer *timer, time_t expiry)
+{
+    if (timer->set) {
+        LIST_REMOVE(timer, entry);
+    } else {
+        timer->set = true;
+        wheel->nb_timers ++;
+    }
+
+    // The slot of wheel->now was fired already
+    timer->expiry = MAX(expiry, wheel->now + 1);
+    timer_store(wheel, timer);
+}
+
+void timer_del(struct timer_wheel *wheel, struct timer *timer)
+{
+    if (! timer->set) return;
+
+    LIST_REMOVE(timer, entry);
+    timer->set = false;
+    assert(wheel->nb_timers > 0);
+    wheel->nb_timers --;
+}
+
+// Fire all timers of this slot that are due (others are stored again)
+static unsigned timer_fire_slot(struct timer_wheel *wheel, struct timers *slot, timer_cb *cb, void *userdata)
+{
+    unsigned nb_expired = 0;
+
+    // Move the slot aside first, since callbacks may add new timers
+    struct timers fired;
+    LIST_INIT(&fired);
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(slot))) {
+        LIST_REMOVE(timer, entry);
+        LIST_INSERT_HEAD(&fired, timer, entry);
+    }
+
+    while (NULL != (timer = LIST_FIRST(&fired))) {
+        LIST_REMOVE(timer, entry);
+        if (timer->expiry > wheel->now) {   // clamped to the furthest slot
+            timer_store(wheel, timer);
+            continue;
+        }
+        timer->set = false;
+        wheel->nb_timers --;
+        nb_expired ++;
+        cb(timer, wheel->now, userdata);
+    }
+
+    return nb_expired;
+}
+
+// Spread the timers of this slot over the lower levels
+static void timer_cascade(struct timer_wheel *wheel, struct timers *slot)
+{
+    struct timers moved;
+    LIST_INIT(&moved);
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(slot))) {
+        LIST_REMOVE(timer, entry);
+        LIST_INSERT_HEAD(&moved, timer, entry);
+    }
+    while (NULL != (timer = LIST_FIRST(&moved))) {
+        LIST_REMOVE(timer, entry);
+        timer_store(wheel, timer);
+    }
+}
+
+unsigned timer_wheel_advance(struct timer_wheel *wheel, time_t now, timer_cb *cb, void *userdata)
+{
+    if (likely_(now <= wheel->now)) return 0;
+
+    // Nothing to fire: jump
+    if (wheel->nb_timers == 0) {
+        wheel->now = now;
+        return 0;
+    }
+
+    // Every timers are due: do not bother going through each second in between
+    if (now - wheel->now >= TIMER_WHEEL_SPAN) {
+        unsigned nb_expired = 0;
+        struct timers all;
+        LIST_INIT(&all);
+        for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+            for (unsigned s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+                struct timer *timer;
+                while (NULL != (timer = LIST_FIRST(&wheel->slots[l][s]))) {
+                    LIST_REMOVE(timer, entry);
+                    LIST_INSERT_HEAD(&all, timer, entry);
+                }
+            }
+        }
+        wheel->now = now;
+        // Timers that are still not due were clamped and are stored again by timer_fire_slot
+        nb_expired += timer_fire_slot(wheel, &all, cb, userdata);
+        return nb_expired;
+    }
+
+    unsigned nb_expired = 0;
+    while (wheel->now < now) {
+        time_t const t = ++ wheel->now;
+
+        for (unsigned l = 1; l < TIMER_WHEEL_LEVELS; l++) {
+            if (slot_of(t, l-1) != 0) break;    // not the beginning of a period of level l
+            timer_cascade(wheel, &wheel->slots[l][slot_of(t, l)]);
+        }
+
+        nb_expired += timer_fire_slot(wheel, &wheel->slots[0][slot_of(t, 0)], cb, userdata);
+
+        // Once empty, jump to the end
+        if (wheel->nb_timers == 0) wheel->now = now;
+    }
+
+    return nb_expired;
+}
+
+unsigned timer_wheel_expire_all(struct timer_wheel *wheel, timer_cb *cb, void *userdata)
+{
+    struct timers all;
+    LIST_INIT(&all);
+    for (unsigned l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (unsigned s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            struct timer *timer;
+            while (NULL != (timer = LIST_FIRST(&wheel->slots[l][s]))) {
+                LIST_REMOVE(timer, entry);
+                LIST_INSERT_HEAD(&all, timer, entry);
+            }
+        }
+    }
+
+    unsigned nb_expired = 0;
+    struct timer *timer;
+    while (NULL != (timer = LIST_FIRST(&all))) {
+        LIST_REMOVE(timer, entry);
+        timer->set = false;
+        wheel->nb_timers --;
+        nb_expired ++;
+        cb(timer, wheel->now, userdata);
+    }
+
+    return nb_expired;
+}
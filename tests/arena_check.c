@@ -0,0 +1,132 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/cpp.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/log.h>
+#include <junkie/tools/mallocer.h>
+#include <junkie/tools/mutex.h>
+#include "tools/arena.c"
+
+static unsigned nb_cleanups;
+static void cleanup(void *data)
+{
+    assert(data == &nb_cleanups);
+    nb_cleanups ++;
+}
+
+static void alloc_check(void)
+{
+    struct arena *arena = arena_new(100);
+    assert(arena);
+    assert(arena->size == ARENA_SIZE);
+    assert(arena->nb_refs == 1);
+
+    char *a = arena_alloc(arena, 1);
+    char *b = arena_alloc(arena, 17);
+    assert(a && b);
+    assert(((uintptr_t)b & (ARENA_ALIGN-1)) == 0);
+    assert(b >= a + 1);
+    assert(! arena_alloc(arena, ARENA_SIZE));   // not enough room left
+
+    nb_cleanups = 0;
+    assert(0 == arena_add_cleanup(arena, cleanup, &nb_cleanups));
+    assert(0 == arena_add_cleanup(arena, cleanup, &nb_cleanups));
+
+    struct arena *pin = arena_ref(arena);
+    arena_unref(&arena);
+    assert(! arena);
+    assert(nb_cleanups == 0);   // still pinned
+    arena_unref(&pin);
+    assert(nb_cleanups == 2);
+
+    // Once released, it's recycled
+    assert(my_cache && my_cache->nb_free == 1);
+    struct arena *recycled = my_cache->free;
+    arena = arena_new(10);
+    assert(arena == recycled);
+    assert(my_cache->nb_free == 0);
+    assert(arena->used == 0 && ! arena->cleanups);
+    arena_unref(&arena);
+
+    // Big arenas are not recycled
+    unsigned const nb_free = my_cache->nb_free;
+    arena = arena_new(ARENA_SIZE * 2);
+    assert(arena->size >= ARENA_SIZE * 2);
+    arena_unref(&arena);
+    assert(my_cache->nb_free == nb_free);
+}
+
+static void exact_check(void)
+{
+    unsigned const nb_free = my_cache->nb_free;
+    struct arena *arena = arena_new_exact(100);
+    assert(arena && arena->size == 100);
+    assert(arena_alloc(arena, 100));
+    assert(! arena_alloc(arena, 1));
+    nb_cleanups = 0;
+    arena_unref(&arena);
+    assert(my_cache->nb_free == nb_free);   // not recycled
+
+    // But one of the default size is just like the others
+    arena = arena_new_exact(ARENA_SIZE);
+    assert(0 == arena_add_cleanup(arena, cleanup, &nb_cleanups));
+    arena_unref(&arena);
+    assert(nb_cleanups == 1);
+    assert(my_cache->nb_free == nb_free + 1);
+}
+
+static void packet_check(void)
+{
+    // No packet arena outside of a packet
+    assert(! arena_packet(10));
+
+    arena_packet_begin();
+    struct arena *arena = arena_packet(10);
+    assert(arena);
+    assert(arena_packet(10) == arena);  // same arena for the whole packet
+    struct arena *pin = arena_ref(arena);
+    nb_cleanups = 0;
+    assert(0 == arena_add_cleanup(arena, cleanup, &nb_cleanups));
+    arena_packet_end();
+
+    assert(nb_cleanups == 0);   // still pinned after the packet
+    assert(! arena_packet(10));
+    arena_unref(&pin);
+    assert(nb_cleanups == 1);
+
+    // A full packet arena is replaced (possibly recycled)
+    arena_packet_begin();
+    arena = arena_packet(ARENA_SIZE - 100);
+    assert(arena_alloc(arena, ARENA_SIZE - 100));
+    arena = arena_packet(200);
+    assert(arena && arena->used == 0);
+    arena_packet_end();
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mallocer_init();
+    mutex_init();
+    arena_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("arena_check.log");
+
+    alloc_check();
+    exact_check();
+    packet_check();
+
+    arena_fini();
+    mutex_fini();
+    mallocer_fini();
+    ext_fini();
+    log_fini();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,377 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/mallocer.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/files.h>
+#include "proto/capfile.c"
+
+/*
+ * Capfiles only look at the proto of the parsers of the infos they are given,
+ * so we build the info stacks of our fake packets by hand.
+ */
+
+static struct parser cap_parser, ip_parser, tcp_parser;
+
+struct fake_pkt {
+    struct cap_proto_info cap;
+    struct ip_proto_info ip;
+    struct tcp_proto_info tcp;
+    size_t len;
+    uint8_t data[1514];
+};
+
+// Packets belong to two TCP flows, seen in both directions
+static struct fake_flow {
+    char const *addr[2];
+    uint16_t port[2];
+} const fake_flows[] = {
+    { { "192.168.0.1", "192.168.0.2" }, { 1024, 80 } },
+    { { "192.168.0.3", "192.168.0.2" }, { 2000, 443 } },
+};
+
+static unsigned flow_of(unsigned n)
+{
+    return n % 3 == 0;
+}
+
+// Packet n is always the same, with a size between 60 and 1514 bytes
+static struct proto_info const *fake_pkt_ctor(struct fake_pkt *pkt, unsigned n)
+{
+    pkt->len = 60 + (n * 7919) % (sizeof(pkt->data) - 60 + 1);
+    for (unsigned i = 0; i < pkt->len; i++) pkt->data[i] = n + i;
+
+    proto_info_ctor(&pkt->cap.info, &cap_parser, NULL, 0, pkt->len);
+    pkt->cap.dev_id = 0;
+    // Parsers write packets out of order: the first packet of each index chunk comes late
+    unsigned const t = n % PCAPNG_CHUNK_PKTS == 0 ? n + PCAPNG_CHUNK_PKTS/4 : n;
+    pkt->cap.tv = (struct timeval){ .tv_sec = 1000 + t/10, .tv_usec = (t%10) * 100000 };
+
+    struct fake_flow const *flow = fake_flows + flow_of(n);
+    unsigned const way = (n/2) % 2;
+
+    proto_info_ctor(&pkt->ip.info, &ip_parser, &pkt->cap.info, 20, pkt->len - 20);
+    pkt->ip.key.protocol = 6;
+    for (unsigned i = 0; i < 2; i++) {
+        struct ip_addr addr;
+        ip_addr_ctor_from_str_any(&addr, flow->addr[i ^ way]);
+        pkt->ip.key.addr[i] = addr;
+    }
+
+    proto_info_ctor(&pkt->tcp.info, &tcp_parser, &pkt->ip.info, 20, pkt->len - 40);
+    pkt->tcp.key.port[0] = flow->port[way];
+    pkt->tcp.key.port[1] = flow->port[!way];
+
+    return &pkt->tcp.info;
+}
+
+static void write_pkts(struct capfile *capfile, unsigned from, unsigned to, int expected)
+{
+    for (unsigned n = from; n < to; n++) {
+        struct fake_pkt pkt;
+        struct proto_info const *info = fake_pkt_ctor(&pkt, n);
+        assert(expected == capfile->ops->write(capfile, info, pkt.len, pkt.data, &pkt.cap.tv));
+    }
+}
+
+static struct capfile *new_pcap(char const *path, bool async, unsigned max_pkts, unsigned rotation)
+{
+    async_capfiles = async;
+    struct timeval const start = { .tv_sec = 1000 };
+    struct capfile *capfile = capfile_new_pcap(path, max_pkts, 0, 0, 1200, rotation, &start);
+    assert(capfile);
+    return capfile;
+}
+
+// Check both files are the same (or both absent), then remove them. Returns true if they exist.
+static bool compare_files(char const *path1, char const *path2)
+{
+    size_t len1, len2;
+    uint8_t *const content1 = file_load(path1, &len1);
+    uint8_t *const content2 = file_load(path2, &len2);
+    assert(!content1 == !content2);
+    if (content1) {
+        SLOG(LOG_DEBUG, "Comparing %s and %s (%zu bytes)", path1, path2, len1);
+        assert(len1 == len2);
+        assert(0 == memcmp(content1, content2, len1));
+        free(content1);
+        free(content2);
+        assert(0 == file_unlink(path1));
+        assert(0 == file_unlink(path2));
+    }
+    return content1 != NULL;
+}
+
+/*
+ * The asynchronous writer produces the same files than the synchronous one:
+ * each file spans several buffers, the writer thread rotates them, and some packets
+ * are still in a buffer when the capfile is deleted.
+ */
+
+#define MAX_PKTS 2000
+#define ROTATION 8
+
+static void async_rotation_check(void)
+{
+    unsigned const nb_pkts = 4*MAX_PKTS + MAX_PKTS/2;
+    for (unsigned a = 0; a < 2; a++) {
+        bool const async = a == 1;
+        struct capfile *capfile = new_pcap(async ? "capfile_check_async.pcap" : "capfile_check_sync.pcap", async, MAX_PKTS, ROTATION);
+        write_pkts(capfile, 0, nb_pkts, 0);
+        capfile->ops->del(capfile);
+    }
+
+    unsigned nb_files = 0;
+    for (unsigned f = 0; f < ROTATION; f++) {
+        char sync_path[64], async_path[64];
+        snprintf(sync_path, sizeof(sync_path), "capfile_check_sync.pcap.%u", f);
+        snprintf(async_path, sizeof(async_path), "capfile_check_async.pcap.%u", f);
+        if (compare_files(sync_path, async_path)) nb_files ++;
+    }
+    assert(nb_files == 5);
+}
+
+/*
+ * Closing with buffers pending writes them before closing the file, and later packets are refused
+ */
+
+static void async_close_check(void)
+{
+    unsigned const nb_pkts = MAX_PKTS + MAX_PKTS/2;
+    for (unsigned a = 0; a < 2; a++) {
+        bool const async = a == 1;
+        struct capfile *capfile = new_pcap(async ? "capfile_check_async.pcap" : "capfile_check_sync.pcap", async, 0, 0);
+        write_pkts(capfile, 0, nb_pkts, 0);
+        capfile->ops->close(capfile);
+        write_pkts(capfile, nb_pkts, nb_pkts + 10, -1);
+        capfile->ops->del(capfile);
+    }
+
+    assert(compare_files("capfile_check_sync.pcap", "capfile_check_async.pcap"));
+}
+
+/*
+ * The packets of a quiet link eventually reach the disk, without the buffer being full
+ */
+
+static void async_idle_check(void)
+{
+    char const *path = "capfile_check_async.pcap";
+    struct capfile *capfile = new_pcap(path, true, 0, 0);
+    unsigned const nb_pkts = 10;
+    write_pkts(capfile, 0, nb_pkts, 0);
+
+    size_t expected = sizeof(struct pcap_file_header);
+    for (unsigned n = 0; n < nb_pkts; n++) {
+        struct fake_pkt pkt;
+        (void)fake_pkt_ctor(&pkt, n);
+        expected += sizeof(struct pcap_sf_pkthdr) + MIN(pkt.len, 1200U);
+    }
+    // The writer seals an idle buffer after a second
+    unsigned nb_tries;
+    for (nb_tries = 0; nb_tries < 50 && file_size(path) != (ssize_t)expected; nb_tries++) usleep(100000);
+    assert(nb_tries < 50);
+
+    capfile->ops->del(capfile);
+    assert(file_size(path) == (ssize_t)expected);
+    assert(0 == file_unlink(path));
+}
+
+/*
+ * When idle, the writer does not wait for the lock of the capfile, since its owner may be waiting for a free buffer
+ */
+
+static void async_busy_check(void)
+{
+    char const *path = "capfile_check_async.pcap";
+    struct capfile *capfile = new_pcap(path, true, 0, 0);
+    struct capfile_async *async = DOWNCAST(capfile, capfile, capfile_async);
+    write_pkts(capfile, 0, 1, 0);
+
+    alarm(10);  // rather than hanging
+    mutex_lock(&capfile->lock);
+    sleep(2);   // so that the writer finds the capfile idle
+    // Then use all the buffers, as a parsing thread would
+    for (unsigned b = 0; b < 2*CAPFILE_NB_BUFS; b++) {
+        assert(0 == capfile_async_seal(async, KEEP_OPEN, true));
+    }
+    mutex_unlock(&capfile->lock);
+    alarm(0);
+
+    struct fake_pkt pkt;
+    (void)fake_pkt_ctor(&pkt, 0);
+    capfile->ops->del(capfile);
+    assert(file_size(path) == (ssize_t)(sizeof(struct pcap_file_header) + sizeof(struct pcap_sf_pkthdr) + MIN(pkt.len, 1200U)));
+    assert(0 == file_unlink(path));
+}
+
+/*
+ * PCAPNG index: packets can be found back by address, port and time range, even with a truncated index
+ */
+
+#define NB_PCAPNG_PKTS (2*PCAPNG_CHUNK_PKTS + PCAPNG_CHUNK_PKTS/3)
+
+static off_t pkt_offsets[NB_PCAPNG_PKTS];
+
+// Check the returned offsets are those of the expected packets, and that the packets are there
+static void check_lookup(uint8_t const *pcapng, size_t pcapng_len, struct capfile_index_query const *query, bool (*expected)(unsigned, void const *), void const *data)
+{
+    off_t *offsets;
+    ssize_t const nb_offsets = capfile_index_lookup("capfile_check.pcapng", query, &offsets);
+    assert(nb_offsets >= 0);
+
+    ssize_t o = 0;
+    for (unsigned n = 0; n < NB_PCAPNG_PKTS; n++) {
+        if (! expected(n, data)) continue;
+        assert(o < nb_offsets);
+        assert(offsets[o] == pkt_offsets[n]);
+        assert((size_t)offsets[o] + sizeof(struct pcapng_epb) <= pcapng_len);
+        struct pcapng_epb epb;
+        memcpy(&epb, pcapng + offsets[o], sizeof(epb));
+        struct fake_pkt pkt;
+        (void)fake_pkt_ctor(&pkt, n);
+        assert(epb.type == 6);
+        assert(epb.caplen == pkt.len);
+        assert(0 == memcmp(pcapng + offsets[o] + sizeof(epb), pkt.data, pkt.len));
+        o ++;
+    }
+    assert(o == nb_offsets);
+    free(offsets);
+}
+
+static bool any_pkt(unsigned unused_ n, void const unused_ *data)
+{
+    return true;
+}
+
+static bool pkt_of_flow(unsigned n, void const *flow)
+{
+    return flow_of(n) == *(unsigned const *)flow;
+}
+
+static bool pkt_in_chunks(unsigned n, void const *nb_chunks)
+{
+    return n < *(unsigned const *)nb_chunks * PCAPNG_CHUNK_PKTS;
+}
+
+static bool pkt_of_chunk(unsigned n, void const *chunk)
+{
+    return n / PCAPNG_CHUNK_PKTS == *(unsigned const *)chunk;
+}
+
+static void pcapng_index_check(void)
+{
+    char const *const path = "capfile_check.pcapng";
+    char const *const idx_path = "capfile_check.pcapng.idx";
+    struct timeval const start = { .tv_sec = 1000 };
+    struct capfile *capfile = capfile_new_pcapng(path, 0, 0, 0, 0, 0, &start);
+    assert(capfile);
+
+    off_t offset = sizeof(struct pcapng_shb) + sizeof(struct pcapng_idb);
+    for (unsigned n = 0; n < NB_PCAPNG_PKTS; n++) {
+        struct fake_pkt pkt;
+        struct proto_info const *info = fake_pkt_ctor(&pkt, n);
+        assert(0 == capfile->ops->write(capfile, info, pkt.len, pkt.data, &pkt.cap.tv));
+        pkt_offsets[n] = offset;
+        offset += sizeof(struct pcapng_epb) + pkt.len + (4 - pkt.len % 4) % 4 + 4;
+    }
+    capfile->ops->del(capfile);
+
+    size_t pcapng_len;
+    uint8_t *pcapng = file_load(path, &pcapng_len);
+    assert(pcapng);
+    assert(pcapng_len == (size_t)offset);
+
+    // Everything
+    struct capfile_index_query query;
+    memset(&query, 0, sizeof(query));
+    query.addr.family = AF_UNSPEC;
+    check_lookup(pcapng, pcapng_len, &query, any_pkt, NULL);
+
+    // By address, on either end
+    unsigned const flow0 = 0, flow1 = 1;
+    assert(0 == ip_addr_ctor_from_str_any(&query.addr, "192.168.0.1"));
+    check_lookup(pcapng, pcapng_len, &query, pkt_of_flow, &flow0);
+    assert(0 == ip_addr_ctor_from_str_any(&query.addr, "192.168.0.3"));
+    check_lookup(pcapng, pcapng_len, &query, pkt_of_flow, &flow1);
+    assert(0 == ip_addr_ctor_from_str_any(&query.addr, "192.168.0.2"));
+    check_lookup(pcapng, pcapng_len, &query, any_pkt, NULL);
+
+    // By port, alone or on the same side than the address
+    query.port = 443;
+    check_lookup(pcapng, pcapng_len, &query, pkt_of_flow, &flow1);
+    assert(0 == ip_addr_ctor_from_str_any(&query.addr, "192.168.0.1"));
+    query.port = 80;
+    unsigned const no_chunk = 0;
+    check_lookup(pcapng, pcapng_len, &query, pkt_in_chunks, &no_chunk);
+    query.addr.family = AF_UNSPEC;
+    check_lookup(pcapng, pcapng_len, &query, pkt_of_flow, &flow0);
+
+    // By time range, which selects whole chunks
+    query.port = 0;
+    unsigned const chunk = 1;
+    struct fake_pkt pkt;
+    (void)fake_pkt_ctor(&pkt, chunk * PCAPNG_CHUNK_PKTS + 10);
+    query.start = pkt.cap.tv;
+    (void)fake_pkt_ctor(&pkt, chunk * PCAPNG_CHUNK_PKTS + 20);
+    query.stop = pkt.cap.tv;
+    check_lookup(pcapng, pcapng_len, &query, pkt_of_chunk, &chunk);
+    (void)fake_pkt_ctor(&pkt, NB_PCAPNG_PKTS - 1);
+    query.start = pkt.cap.tv;
+    query.start.tv_sec ++;
+    query.stop = (struct timeval){ .tv_sec = 0 };
+    check_lookup(pcapng, pcapng_len, &query, pkt_in_chunks, &no_chunk);
+
+    // A truncated index gives the packets of the complete chunks only
+    memset(&query, 0, sizeof(query));
+    query.addr.family = AF_UNSPEC;
+    ssize_t const idx_len = file_size(idx_path);
+    assert(idx_len > 8);
+    assert(0 == truncate(idx_path, idx_len - 5));
+    unsigned const nb_chunks = NB_PCAPNG_PKTS / PCAPNG_CHUNK_PKTS;
+    check_lookup(pcapng, pcapng_len, &query, pkt_in_chunks, &nb_chunks);
+    assert(0 == truncate(idx_path, 8 + 2));
+    check_lookup(pcapng, pcapng_len, &query, pkt_in_chunks, &no_chunk);
+    assert(0 == truncate(idx_path, 4));
+    off_t *offsets;
+    assert(-1 == capfile_index_lookup(path, &query, &offsets));
+    assert(! offsets);
+
+    free(pcapng);
+    assert(0 == file_unlink(path));
+    assert(0 == file_unlink(idx_path));
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mallocer_init();
+    objalloc_init();
+    capfile_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("capfile_check.log");
+
+    cap_parser.proto = proto_cap;
+    ip_parser.proto = proto_ip;
+    tcp_parser.proto = proto_tcp;
+
+    async_rotation_check();
+    async_close_check();
+    async_idle_check();
+    async_busy_check();
+    pcapng_index_check();
+
+    capfile_fini();
+    objalloc_fini();
+    mallocer_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#undef NDEBUG
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include "digest_queue.c"
+
+/* Micro-benchmark of digest_frame: compare MD4 and the fast digest on a
+ * set of random frames. Also checks that both give distinct digests for all
+ * these frames (ie. that we did not loose any false positive property on
+ * the way). */
+
+#define NB_FRAMES 4096
+#define NB_ROUNDS 256
+
+static uint8_t frames[NB_FRAMES][128];
+static size_t frame_lens[NB_FRAMES];
+static unsigned char digests[NB_FRAMES][DIGEST_SIZE];
+
+static void make_frames(void)
+{
+    for (unsigned f = 0; f < NB_FRAMES; f++) {
+        uint8_t *frame = frames[f];
+        for (unsigned b = 0; b < sizeof(frames[f]); b++) frame[b] = rand();
+        frame[12] = 0x08; frame[13] = 0x00;    // IPv4
+        frame[14] = 0x45;
+        frame_lens[f] = 60 + rand() % (sizeof(frames[f]) - 60);
+    }
+}
+
+static int digest_cmp(void const *a, void const *b)
+{
+    return memcmp(a, b, DIGEST_SIZE);
+}
+
+static void bench(bool fast)
+{
+    fast_digests = fast;
+
+    struct timeval start, stop;
+    timeval_set_now(&start);
+    for (unsigned r = 0; r < NB_ROUNDS; r++) {
+        for (unsigned f = 0; f < NB_FRAMES; f++) {
+            digest_frame(digests[f], frame_lens[f], frames[f]);
+        }
+    }
+    timeval_set_now(&stop);
+
+    int64_t const usecs = timeval_sub(&stop, &start);
+    printf("%s: %.1f ns per frame\n", fast ? "fast digest":"MD4", (usecs * 1000.) / ((double)NB_FRAMES * NB_ROUNDS));
+
+    // No two random frames should have the same digest
+    qsort(digests, NB_FRAMES, DIGEST_SIZE, digest_cmp);
+    for (unsigned f = 1; f < NB_FRAMES; f++) {
+        assert(0 != memcmp(digests[f-1], digests[f], DIGEST_SIZE));
+    }
+}
+
+int main(void)
+{
+    log_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("digest_bench.log");
+
+    make_frames();
+    bench(false);
+    bench(true);
+
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -11,10 +11,15 @@ static void check_hash(uint8_t *data, size_t size, size_t eth_extra_bytes)
 {
     uint8_t hash1[BUFSIZE_TO_HASH] = "";
     uint8_t hash2[BUFSIZE_TO_HASH] = "";
+    uint8_t orig[size];
+    memcpy(orig, data, size);
 
     digest_frame(hash1, size, data);
     size_t iphdr_offset = ETHER_HEADER_SIZE + eth_extra_bytes;
 
+    /* the frame must be left untouched */
+    assert(0 == memcmp(orig, data, size));
+
     /* we modify a mac address, the hash shouldn't change */
     data[0] = 0xff;
     digest_frame(hash2, size, data);
@@ -147,17 +152,60 @@ static void test_digest_frame_lcc_and_vlanid(void)
     check_hash(raw, sizeof raw, 6);
 }
 
+static void test_digest_slabs(void)
+{
+    struct digest_queue *dq = digest_queue_new(0);
+    assert(dq);
+
+    unsigned const delay = 100000;
+    unsigned char d1[DIGEST_SIZE], d2[DIGEST_SIZE];
+    for (unsigned i = 0; i < DIGEST_SIZE; i++) {
+        d1[i] = i;
+        d2[i] = i + 1;
+    }
+    uint64_t const t0 = 1300000000ULL * 1000000ULL + 12345;
+
+    // First time we see d1: not a dup, but stored
+    assert(0 == digest_slabs_find(dq, d1, t0, delay));
+    // Same digest shortly after: a dup, and we are given the time of the original
+    assert(t0 + 1 == digest_slabs_find(dq, d1, t0 + delay/2, delay));
+    // Still a dup within the next window
+    assert(t0 + 1 == digest_slabs_find(dq, d1, t0 + delay, delay));
+    // Another digest is not a dup
+    assert(0 == digest_slabs_find(dq, d2, t0 + delay, delay));
+    // Too late: this is a retransmission (the dups were not promoted)
+    assert(0 == digest_slabs_find(dq, d1, t0 + 3*delay, delay));
+    // But this one was stored
+    assert(t0 + 3*delay + 1 == digest_slabs_find(dq, d1, t0 + 3*delay + 1, delay));
+    // Frames older than the recycled windows are not checked
+    assert(0 == digest_slabs_find(dq, d2, t0 - 3*delay, delay));
+    assert(dq->nb_late == 1);
+
+    reset_digests(dq);
+    assert(0 == digest_slabs_find(dq, d1, t0 + 3*delay + 2, delay));
+
+    digest_queue_del(dq);
+}
+
 int main(void)
 {
     log_init();
     log_set_level(LOG_DEBUG, NULL);
     log_set_file("digest_queue_check.log");
+    ext_init();
+    mallocer_init();
+    objalloc_init();
+
+    for (unsigned fast = 0; fast < 2; fast++) {
+        fast_digests = fast;
+        test_digest_frame_standard();
+        test_digest_frame_vlanid();
 
-    test_digest_frame_standard();
-    test_digest_frame_vlanid();
+        test_digest_frame_lcc();
+        test_digest_frame_lcc_and_vlanid();
+    }
 
-    test_digest_frame_lcc();
-    test_digest_frame_lcc_and_vlanid();
+    test_digest_slabs();
 
     log_fini();
     return EXIT_SUCCESS;
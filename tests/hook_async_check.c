@@ -0,0 +1,205 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <unistd.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/mallocer.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/ref.h>
+#include "hook.c"
+
+/*
+ * Events are sent through a hook of our own, from a proto which infos can be copied.
+ * Each event is numbered by its timestamp.
+ */
+
+#define RING_SIZE 4
+
+static struct uniq_proto test_proto;
+static struct parser *test_parser;
+static struct hook test_hook;
+static struct proto_subscriber subscription;
+
+static bool volatile gate_open;         // the subscriber waits for this before returning
+static bool volatile in_cb;             // set while the subscriber is waiting at the gate
+static unsigned volatile nb_received;
+static time_t received[1000];
+
+static void test_cb(struct proto_subscriber unused_ *sub, struct proto_info const *info, size_t cap_len, uint8_t const *packet, struct timeval const *now)
+{
+    assert(info && info->parser == test_parser);
+    assert(cap_len == sizeof(now->tv_sec));
+    assert(0 == memcmp(packet, &now->tv_sec, cap_len));
+    in_cb = true;
+    while (! gate_open) usleep(100);
+    in_cb = false;
+    assert(nb_received < NB_ELEMS(received));
+    received[nb_received] = now->tv_sec;
+    __sync_synchronize();
+    nb_received ++;
+}
+
+static void send_event(time_t id)
+{
+    struct proto_info info;
+    proto_info_ctor(&info, test_parser, NULL, 0, 0);
+    struct timeval const now = { .tv_sec = id };
+    hook_subscribers_call(&test_hook, &info, sizeof(id), (uint8_t const *)&id, &now);
+}
+
+static void setup(void)
+{
+    static struct proto_ops const ops = {
+        .parse      = NULL,
+        .parser_new = uniq_parser_new,
+        .parser_del = uniq_parser_del,
+        .info_addr  = proto_info_addr,
+    };
+    uniq_proto_ctor(&test_proto, &ops, "Test", PROTO_CODE_DUMMY);
+    test_parser = test_proto.proto.ops->parser_new(&test_proto.proto);
+    assert(test_parser);
+
+    hook_ctor(&test_hook, "test");
+    gate_open = true;
+    in_cb = false;
+    nb_received = 0;
+    assert(0 == hook_subscriber_ctor_async(&test_hook, &subscription, test_cb, RING_SIZE, 0, "test"));
+}
+
+static void teardown(void)
+{
+    hook_dtor(&test_hook);
+    parser_unref(&test_parser);
+    uniq_proto_dtor(&test_proto);
+}
+
+/*
+ * Many more events than slots go through the ring, in order
+ */
+
+static void wraparound_check(void)
+{
+    setup();
+
+    unsigned const nb_events = 25 * RING_SIZE + 1;
+    for (unsigned e = 0; e < nb_events; e++) {
+        send_event(e);
+        // Keep the ring partially filled
+        while (nb_received + RING_SIZE/2 <= e) usleep(100);
+    }
+    while (nb_received < nb_events) usleep(100);
+
+    uint64_t nb_queued, nb_dropped;
+    hook_subscriber_async_stats(&subscription, &nb_queued, &nb_dropped);
+    assert(nb_queued == nb_events);
+    assert(nb_dropped == 0);
+    for (unsigned e = 0; e < nb_events; e++) assert(received[e] == (time_t)e);
+
+    hook_subscriber_dtor(&test_hook, &subscription);
+    teardown();
+}
+
+/*
+ * When the ring is full events are dropped, and those queued are all delivered when unsubscribing
+ */
+
+static void full_check(void)
+{
+    setup();
+
+    // Block the subscriber on the first event, which keeps its slot meanwhile
+    gate_open = false;
+    send_event(0);
+    while (! in_cb) usleep(100);
+
+    // A slow subscriber must not hold back grace periods
+    wait_grace_period();
+
+    unsigned const nb_sent = 3 * RING_SIZE;
+    for (unsigned e = 1; e < nb_sent; e++) send_event(e);
+
+    uint64_t nb_queued, nb_dropped;
+    hook_subscriber_async_stats(&subscription, &nb_queued, &nb_dropped);
+    assert(nb_queued == RING_SIZE);
+    assert(nb_dropped == nb_sent - RING_SIZE);
+    assert(nb_received == 0);
+
+    // Unsubscribing waits for the queued events to be delivered
+    gate_open = true;
+    hook_subscriber_dtor(&test_hook, &subscription);
+    assert(nb_received == RING_SIZE);
+    for (unsigned e = 0; e < RING_SIZE; e++) assert(received[e] == (time_t)e);
+
+    teardown();
+}
+
+/*
+ * Events are also dropped when their copies would take more bytes than allowed, which are given back once delivered
+ */
+
+static size_t event_size(void)
+{
+    struct proto_info info;
+    proto_info_ctor(&info, test_parser, NULL, 0, 0);
+    struct arena *arena;
+    size_t size;
+    assert(proto_info_copy_stack_exact(&info, sizeof(time_t), &arena, &size));
+    arena_unref(&arena);
+    return size;
+}
+
+static void bytes_check(void)
+{
+    setup();
+    size_t const size = event_size();
+    subscription.async->max_bytes = 2 * size;   // before any event is queued
+
+    gate_open = false;
+    send_event(0);
+    while (! in_cb) usleep(100);
+    for (unsigned e = 1; e < RING_SIZE; e++) send_event(e);
+
+    uint64_t nb_queued, nb_dropped;
+    hook_subscriber_async_stats(&subscription, &nb_queued, &nb_dropped);
+    assert(nb_queued == 2);
+    assert(nb_dropped == RING_SIZE - 2);
+    assert(subscription.async->nb_bytes == 2 * size);
+
+    gate_open = true;
+    while (nb_received < 2) usleep(100);
+    while (subscription.async->nb_bytes > 0) usleep(100);
+    send_event(RING_SIZE);
+    while (nb_received < 3) usleep(100);
+    assert(received[2] == RING_SIZE);
+
+    hook_subscriber_dtor(&test_hook, &subscription);
+    teardown();
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mallocer_init();
+    objalloc_init();
+    ref_init();
+    proto_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("hook_async_check.log");
+
+    wraparound_check();
+    full_check();
+    bytes_check();
+
+    proto_fini();
+    doomer_stop();
+    ref_fini();
+    objalloc_fini();
+    mallocer_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -154,6 +154,41 @@ static void check_strtoull(void)
     }
 }
 
+static void check_scan_eol(void)
+{
+    // Compare with a naive scan, for all lengths and positions around the vector size
+    char buf[200];
+    for (unsigned round = 0; round < 10000; round++) {
+        size_t const len = rand() % sizeof(buf);
+        for (unsigned i = 0; i < len; i++) {
+            unsigned const r = rand() % 40;
+            buf[i] = r == 0 ? '\n' : r == 1 ? ':' : r == 2 ? '\r' : 'a';
+        }
+
+        char const *eol = memchr(buf, '\n', len);
+        char const *col = memchr(buf, ':', eol ? (size_t)(eol - buf) : len);
+
+        char const *colon = buf;
+        assert(liner_scan_eol(buf, len, &colon) == eol);
+        assert(colon == col);
+        assert(liner_scan_eol(buf, len, NULL) == eol);
+    }
+
+    // liner_next takes a shortcut for delim_lines, which must prefer CRLF
+    static char const text[] = "GET / HTTP/1.1\r\nHost: 0123456789012345678901234567890123456789\nX:\r\n\r\n";
+    struct liner liner;
+    liner_init(&liner, &delim_lines, text, sizeof(text)-1);
+    assert(liner.tok_size == 14 && liner.delim_size == 2);
+    liner_next(&liner);
+    assert(liner.tok_size == 46 && liner.delim_size == 1);
+    liner_next(&liner);
+    assert(liner.tok_size == 2 && liner.delim_size == 2);
+    liner_next(&liner);
+    assert(liner.tok_size == 0 && liner.delim_size == 2);
+    liner_next(&liner);
+    assert(liner_eof(&liner));
+}
+
 int main(void)
 {
     log_set_level(LOG_DEBUG, NULL);
@@ -166,6 +201,7 @@ int main(void)
     check_restart();
     check_termination();
     check_strtoull();
+    check_scan_eol();
 
     return EXIT_SUCCESS;
 }
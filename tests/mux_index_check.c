@@ -0,0 +1,235 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/objalloc.h>
+#include "proto.c"
+
+/*
+ * We exercise the index directly with fake subparsers, which only need a key, a shard and a mux_proto.
+ */
+
+static struct mux_proto test_mux_proto;
+
+static struct mux_subparser *test_subparser_new(uint32_t key)
+{
+    struct mux_subparser *subparser = malloc(sizeof(*subparser) + sizeof(key));
+    assert(subparser);
+    memset(subparser, 0, sizeof(*subparser));
+    memcpy(subparser->key, &key, sizeof(key));
+    subparser->mux_proto = &test_mux_proto;
+    struct mux_hash const hash = mux_hash_of_key(&key, sizeof(key));
+    subparser->h_idx = mux_shard_of_hash(&hash);
+    return subparser;
+}
+
+static uint32_t key_of(struct mux_subparser const *subparser)
+{
+    uint32_t key;
+    memcpy(&key, subparser->key, sizeof(key));
+    return key;
+}
+
+static struct mux_subparser *find(struct mux_index *index, uint32_t key, unsigned *nb_colls)
+{
+    struct mux_hash const hash = mux_hash_of_key(&key, sizeof(key));
+    return mux_index_find(index, &test_mux_proto, &hash, NULL, &key, nb_colls);
+}
+
+// Recompute the number of displaced entries of each bucket and compare with what the index maintains
+static void check_displaced(struct mux_table const *table)
+{
+    if (! table->buckets) return;
+    unsigned expected[table->mask + 1];
+    memset(expected, 0, sizeof(expected));
+    for (unsigned b = 0; b <= table->mask; b++) {
+        for (unsigned s = 0; s < MUX_BUCKET_SLOTS; s++) {
+            if (! table->buckets[b].fps[s]) continue;
+            struct mux_subparser const *subparser = table->buckets[b].subparsers[s];
+            struct mux_hash const hash = mux_hash_of_key(subparser->key, test_mux_proto.key_size);
+            for (unsigned d = mux_table_home(table, &hash); d != b; d = (d+1) & table->mask) expected[d] ++;
+        }
+    }
+    for (unsigned b = 0; b <= table->mask; b++) {
+        assert(table->buckets[b].nb_displaced == expected[b]);
+    }
+}
+
+static void check_index(struct mux_index *index)
+{
+    for (unsigned s = 0; s < NB_ELEMS(index->shards); s++) {
+        check_displaced(&index->shards[s].cur);
+        check_displaced(&index->shards[s].old);
+    }
+}
+
+/*
+ * Insert many keys (so that shards grow a few times) and find them back, while they are migrated
+ */
+
+#define NB_KEYS 5000
+
+static void grow_check(void)
+{
+    struct mux_index *index = mux_index_new();
+    assert(index);
+    static struct mux_subparser *subparsers[NB_KEYS];
+    unsigned nb_colls = 0;
+
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        subparsers[k] = test_subparser_new(k);
+        assert(0 == mux_index_insert(index, subparsers[k]));
+        // All previous keys are still there, whether they were migrated yet or not
+        if (k % 97 == 0) {
+            for (unsigned j = 0; j <= k; j++) assert(find(index, j, &nb_colls) == subparsers[j]);
+            check_index(index);
+        }
+    }
+    assert(test_mux_proto.nb_resizes > 0);
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        assert(find(index, k, &nb_colls) == subparsers[k]);
+    }
+    assert(! find(index, NB_KEYS, &nb_colls));
+
+    // Remove every other key
+    for (unsigned k = 0; k < NB_KEYS; k += 2) {
+        mux_index_remove(index, subparsers[k]);
+    }
+    check_index(index);
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        struct mux_subparser *const found = find(index, k, &nb_colls);
+        assert(k & 1 ? found == subparsers[k] : !found);
+    }
+
+    for (unsigned k = 1; k < NB_KEYS; k += 2) {
+        mux_index_remove(index, subparsers[k]);
+    }
+    for (unsigned k = 0; k < NB_KEYS; k++) free(subparsers[k]);
+    mux_index_del(index);
+}
+
+/*
+ * A stable number of short lived entries must not lengthen the probes
+ */
+
+#define NB_LIVE 300
+#define NB_CHURN 200000
+
+static void churn_check(void)
+{
+    struct mux_index *index = mux_index_new();
+    assert(index);
+    static struct mux_subparser *live[NB_LIVE];
+
+    for (unsigned k = 0; k < NB_CHURN; k++) {
+        unsigned const l = k % NB_LIVE;
+        if (live[l]) {
+            mux_index_remove(index, live[l]);
+            free(live[l]);
+        }
+        live[l] = test_subparser_new(k);
+        assert(0 == mux_index_insert(index, live[l]));
+    }
+    check_index(index);
+
+    // Lookups after churn: hits are found, and misses stop quickly
+    unsigned nb_colls = 0;
+    for (unsigned l = 0; l < NB_LIVE; l++) {
+        assert(find(index, key_of(live[l]), &nb_colls) == live[l]);
+    }
+    nb_colls = 0;
+    unsigned const nb_misses = 10000;
+    for (unsigned k = NB_CHURN; k < NB_CHURN + nb_misses; k++) {
+        assert(! find(index, k, &nb_colls));
+    }
+    assert(nb_colls < 2 * nb_misses);   // most misses look into a single bucket
+
+    for (unsigned l = 0; l < NB_LIVE; l++) {
+        mux_index_remove(index, live[l]);
+        free(live[l]);
+    }
+    mux_index_del(index);
+}
+
+/*
+ * Eviction eventually considers every subparser, not only the first ones of the table
+ */
+
+static void oldest_check(void)
+{
+    struct mux_index *index = mux_index_new();
+    assert(index);
+    static struct mux_subparser *subparsers[NB_KEYS];
+
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        subparsers[k] = test_subparser_new(k);
+        subparsers[k]->last_used = (struct timeval){ .tv_sec = 1000 + k };
+        assert(0 == mux_index_insert(index, subparsers[k]));
+    }
+    // Make the last inserted subparser of a shard the least recently used
+    unsigned const victim = NB_KEYS - 1;
+    subparsers[victim]->last_used = (struct timeval){ .tv_sec = 1 };
+    unsigned const shard_idx = subparsers[victim]->h_idx;
+    struct mux_shard const *shard = index->shards + shard_idx;
+
+    unsigned const nb_buckets = (shard->cur.mask + 1) + (shard->old.buckets ? shard->old.mask + 1 : 0);
+    bool found = false;
+    for (unsigned t = 0; t < nb_buckets && !found; t++) {
+        found = mux_index_oldest(index, shard_idx) == subparsers[victim];
+    }
+    assert(found);
+
+    for (unsigned k = 0; k < NB_KEYS; k++) {
+        mux_index_remove(index, subparsers[k]);
+        free(subparsers[k]);
+    }
+    mux_index_del(index);
+}
+
+/*
+ * A subparser times out mux_timeout after its last use, whenever its timer was last checked
+ */
+
+static void expiry_check(void)
+{
+    unsigned const prev_timeout = mux_timeout;
+    mux_timeout = 120;
+    struct mux_subparser *subparser = test_subparser_new(0);
+    subparser->last_used = (struct timeval){ .tv_sec = 1000 };
+    assert(mux_subparser_expiry(subparser, 1000) == 1000 + 120 + 1);
+    // When its timer fires before then, it's set again for the same deadline
+    assert(mux_subparser_expiry(subparser, 1110) == 1000 + 120 + 1);
+    mux_timeout = 0;
+    assert(mux_subparser_expiry(subparser, 1110) == 1110 + 60);
+    mux_timeout = prev_timeout;
+    free(subparser);
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mallocer_init();
+    objalloc_init();
+    proto_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("mux_index_check.log");
+
+    test_mux_proto.proto.name = "test";
+    test_mux_proto.key_size = sizeof(uint32_t);
+
+    grow_check();
+    churn_check();
+    oldest_check();
+    expiry_check();
+
+    proto_fini();
+    objalloc_fini();
+    mallocer_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,554 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/tools/miscmacs.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/mallocer.h>
+#include <junkie/tools/objalloc.h>
+#include <junkie/tools/ref.h>
+#include <junkie/proto/proto.h>
+#include "nettrack.c"
+
+/*
+ * Instead of a compiled netmatch library, graphs are built from the match functions below,
+ * the graph finding nb_registers and default_index_size in this very program.
+ */
+
+unsigned nb_registers = 1;
+unsigned default_index_size = 64;
+
+static struct uniq_proto test_proto;
+static struct parser *test_parser;
+
+// Our packets tell what to do with the flow identified by key, which register 0 holds
+struct test_info {
+    struct proto_info info;
+    enum test_op { OP_NEW, OP_MOVE, OP_SPAWN, OP_TOUCH, OP_DEL, OP_IDLE, OP_USE, OP_SLOW, OP_NOP } op;
+    unsigned key, new_key;
+};
+
+static struct test_info const *test_info(struct proto_info const *info)
+{
+    return DOWNCAST(info, info, test_info);
+}
+
+static bool is_op(struct proto_info const *info, enum test_op op, struct npc_register const *regfile)
+{
+    return test_info(info)->op == op && (! regfile || regfile[0].value == test_info(info)->key);
+}
+
+static void bind_key(struct npc_register *regfile, unsigned key)
+{
+    regfile[0].value = key;
+    regfile[0].size = 0;
+}
+
+static uintptr_t match_new(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const unused_ *prev_regfile, struct npc_register *new_regfile)
+{
+    if (! is_op(info, OP_NEW, NULL)) return 0;
+    bind_key(new_regfile, test_info(info)->key);
+    return 1;
+}
+
+// Rebind the flow to a new key, which is also its new location
+static uintptr_t match_idle(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const unused_ *prev_regfile, struct npc_register *new_regfile)
+{
+    if (! is_op(info, OP_IDLE, NULL)) return 0;
+    bind_key(new_regfile, test_info(info)->key);
+    return 1;
+}
+
+static uintptr_t match_slow(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const unused_ *prev_regfile, struct npc_register *new_regfile)
+{
+    if (! is_op(info, OP_SLOW, NULL)) return 0;
+    bind_key(new_regfile, test_info(info)->key);
+    return 1;
+}
+
+static uintptr_t match_use(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const *prev_regfile, struct npc_register unused_ *new_regfile)
+{
+    return is_op(info, OP_USE, prev_regfile);
+}
+
+static uintptr_t match_move(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const *prev_regfile, struct npc_register *new_regfile)
+{
+    if (! is_op(info, OP_MOVE, prev_regfile)) return 0;
+    bind_key(new_regfile, test_info(info)->new_key);
+    return 1;
+}
+
+static uintptr_t match_spawn(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const *prev_regfile, struct npc_register *new_regfile)
+{
+    if (! is_op(info, OP_SPAWN, prev_regfile)) return 0;
+    bind_key(new_regfile, test_info(info)->new_key);
+    return 1;
+}
+
+static uintptr_t match_touch(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const *prev_regfile, struct npc_register unused_ *new_regfile)
+{
+    return is_op(info, OP_TOUCH, prev_regfile);
+}
+
+static uintptr_t match_del(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const *prev_regfile, struct npc_register unused_ *new_regfile)
+{
+    return is_op(info, OP_DEL, prev_regfile);
+}
+
+static uintptr_t index_of_key(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const unused_ *regfile, struct npc_register unused_ *new_regfile)
+{
+    return test_info(info)->key;
+}
+
+static uintptr_t index_of_reg(struct proto_info const unused_ *info, struct npc_register const unused_ rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    return regfile[0].value;
+}
+
+static unsigned volatile nb_touched;
+
+static uintptr_t child_entry(struct proto_info const *info, struct npc_register const unused_ rest, struct npc_register const unused_ *regfile, struct npc_register unused_ *new_regfile)
+{
+    if (test_info(info)->op == OP_TOUCH) __sync_fetch_and_add(&nb_touched, 1);
+    return 0;
+}
+
+/* The graph: root spawns a flow in "flow", which moves to "moved" under a new key, where it
+ * spawns a child in "child" under yet another key. Touching the child calls child_entry,
+ * and deleting the flow kills the child. */
+
+static struct nt_graph *graph;
+static struct nt_vertex *root, *flow, *moved, *child, *end;
+
+static void graph_setup(unsigned shards)
+{
+    nb_shards = shards;
+    graph = nt_graph_new("test", NULL);
+    assert(graph);
+    assert(graph->nb_shards == shards);
+
+    root  = nt_vertex_new("root",  graph, NULL, NULL, 1, 0);
+    flow  = nt_vertex_new("flow",  graph, NULL, NULL, 0, 0);
+    moved = nt_vertex_new("moved", graph, NULL, NULL, 0, 0);
+    child = nt_vertex_new("child", graph, child_entry, NULL, 0, 0);
+    end   = nt_vertex_new("end",   graph, NULL, NULL, 1, 0);
+    assert(root && flow && moved && child && end);
+
+    struct proto *const proto = &test_proto.proto;
+    assert(nt_edge_new(graph, root,  flow,  match_new,   NULL,         index_of_reg, 0, true,  false, proto, false));
+    assert(nt_edge_new(graph, flow,  moved, match_move,  index_of_key, index_of_reg, 0, false, false, proto, false));
+    assert(nt_edge_new(graph, moved, child, match_spawn, index_of_key, index_of_reg, 0, true,  false, proto, false));
+    assert(nt_edge_new(graph, child, child, match_touch, index_of_key, NULL,         0, false, false, proto, false));
+    assert(nt_edge_new(graph, moved, end,   match_del,   index_of_key, NULL,         0, false, false, proto, false));
+
+    nt_graph_start(graph);
+    nb_touched = 0;
+}
+
+static void graph_teardown(void)
+{
+    nt_graph_del(graph);
+    graph = NULL;
+}
+
+static void send_pkt_at(enum test_op op, unsigned key, unsigned new_key, struct timeval now)
+{
+    struct test_info info = { .op = op, .key = key, .new_key = new_key };
+    proto_info_ctor(&info.info, test_parser, NULL, 0, 0);
+    hook_subscribers_call(&test_proto.proto.hook, &info.info, 0, NULL, &now);
+}
+
+static void send_pkt(enum test_op op, unsigned key, unsigned new_key)
+{
+    // All packets of the same second, so that only the first one advances the timer wheels
+    send_pkt_at(op, key, new_key, (struct timeval){ .tv_sec = 1000 });
+}
+
+static unsigned shard_of_key(struct nt_vertex const *vertex, unsigned key)
+{
+    return nt_shard_of(graph, vertex, key);
+}
+
+static unsigned inbox_length(unsigned s)
+{
+    unsigned len = 0;
+    struct nt_handoff *handoff;
+    STAILQ_FOREACH(handoff, &graph->shards[s].inbox, entry) len ++;
+    return len;
+}
+
+// Process all inboxes, then check the shard stats agree with the vertices and edges
+static void check_totals(unsigned expected_nb_states, uint64_t expected_nb_handoffs)
+{
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        nt_shard_lock(graph, s);
+        nt_shard_unlock(graph, s);
+        assert(STAILQ_EMPTY(&graph->shards[s].inbox));
+    }
+
+    unsigned nb_states = 0;
+    uint64_t nb_matches = 0, nb_handoffs = 0;
+    for (unsigned s = 0; s < graph->nb_shards; s++) {
+        nb_states += graph->shards[s].nb_states;
+        nb_matches += graph->shards[s].nb_matches;
+        nb_handoffs += graph->shards[s].nb_handoffs;
+    }
+    assert(nb_states == expected_nb_states);
+    if (expected_nb_handoffs != UINT64_MAX) assert(nb_handoffs == expected_nb_handoffs);
+
+    unsigned nb_vertex_states = 0;
+    struct nt_vertex *vertex;
+    LIST_FOREACH(vertex, &graph->vertices, same_graph) {
+        unsigned nb_indexed = 0;
+        for (unsigned i = 0; i < vertex->index_size; i++) {
+            struct nt_state *state;
+            TAILQ_FOREACH(state, &vertex->index[i], same_index) {
+                assert(state->vertex == vertex);
+                assert(state->shard == i % graph->nb_shards);
+                assert(! state->killed);
+                nb_indexed ++;
+            }
+        }
+        assert(nb_indexed == vertex->nb_states);
+        nb_vertex_states += vertex->nb_states;
+    }
+    assert(nb_vertex_states == nb_states);
+
+    uint64_t nb_edge_matches = 0;
+    struct nt_edge *edge;
+    LIST_FOREACH(edge, &graph->edges, same_graph) nb_edge_matches += edge->nb_matches;
+    assert(nb_edge_matches == nb_matches);
+}
+
+/*
+ * Follow a few flows from shard to shard, checking what's waiting in the inboxes
+ */
+
+static void shards_check(void)
+{
+    graph_setup(4);
+    // With 4 shards, a key sits in shard key%4. Root (and so shard 0) is visited by every packet.
+    // Bring the timer wheels to the current second first, which would otherwise process all inboxes.
+    send_pkt(OP_NOP, 0, 0);
+
+    // A spawn into another shard (root is in shard 0)
+    send_pkt(OP_NEW, 5, 0);
+    assert(shard_of_key(flow, 5) == 1);
+    assert(inbox_length(1) == 1);
+    assert(flow->nb_states == 1);
+
+    // A move across shards
+    send_pkt(OP_MOVE, 5, 6);
+    assert(shard_of_key(moved, 6) == 2);
+    assert(inbox_length(1) == 0);
+    assert(inbox_length(2) == 1);
+    assert(flow->nb_states == 0 && moved->nb_states == 1);
+
+    // Spawn a child into yet another shard, and delete its parent while the child is still in its inbox
+    send_pkt(OP_SPAWN, 6, 7);
+    assert(shard_of_key(child, 7) == 3);
+    assert(inbox_length(3) == 1);
+    assert(child->nb_states == 1);
+    send_pkt(OP_DEL, 6, 0);
+    assert(moved->nb_states == 0);
+    assert(inbox_length(3) == 2);   // its store and its kill
+    send_pkt(OP_TOUCH, 7, 0);
+    assert(inbox_length(3) == 0);
+    assert(nb_touched == 0);
+    assert(child->nb_states == 0);
+    check_totals(1, 4);
+
+    // Same with a child that's used before its parent is deleted
+    send_pkt(OP_NEW, 9, 0);
+    send_pkt(OP_MOVE, 9, 10);
+    send_pkt(OP_SPAWN, 10, 11);
+    send_pkt(OP_TOUCH, 11, 0);
+    assert(nb_touched == 1);
+    check_totals(3, 4 + 3);
+    send_pkt(OP_DEL, 10, 0);
+    assert(inbox_length(3) == 1);
+    assert(child->nb_states == 1);  // until its kill is processed
+    check_totals(1, 4 + 4);
+
+    graph_teardown();
+}
+
+/* Another graph for timers: root spawns flows in "pending", "idle" or "slow".
+ * A pending flow is answered when touched, or else is aged after 1.5s. An idle flow
+ * is timeouted after 2s without use. A slow flow is aged after 1s, or late after 3s.
+ * Entry and timeout functions log the transitions of each flow. */
+
+static struct nt_vertex *pending, *idle, *slow, *answered, *aged, *late;
+static struct nt_edge *slow_aged;
+static char transitions[256];
+
+static void log_transition(char what, struct npc_register const *regfile)
+{
+    size_t const len = strlen(transitions);
+    snprintf(transitions + len, sizeof(transitions) - len, "%c%u ", what, (unsigned)regfile[0].value);
+}
+
+static uintptr_t answered_entry(struct proto_info const unused_ *info, struct npc_register const unused_ rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    log_transition('A', regfile);
+    return 0;
+}
+
+static uintptr_t aged_entry(struct proto_info const unused_ *info, struct npc_register const unused_ rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    log_transition('G', regfile);
+    return 0;
+}
+
+static uintptr_t late_entry(struct proto_info const unused_ *info, struct npc_register const unused_ rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    log_transition('L', regfile);
+    return 0;
+}
+
+static uintptr_t idle_timeout(struct proto_info const unused_ *info, struct npc_register const unused_ rest, struct npc_register const *regfile, struct npc_register unused_ *new_regfile)
+{
+    log_transition('T', regfile);
+    return 0;
+}
+
+static void timers_setup(void)
+{
+    nb_shards = 1;
+    graph = nt_graph_new("timers", NULL);
+    assert(graph);
+
+    root     = nt_vertex_new("root",     graph, NULL, NULL, 1, 0);
+    pending  = nt_vertex_new("pending",  graph, NULL, NULL, 0, 0);
+    idle     = nt_vertex_new("idle",     graph, NULL, idle_timeout, 0, 2000000);
+    slow     = nt_vertex_new("slow",     graph, NULL, NULL, 0, 0);
+    answered = nt_vertex_new("answered", graph, answered_entry, NULL, 1, 0);
+    aged     = nt_vertex_new("aged",     graph, aged_entry, NULL, 1, 0);
+    late     = nt_vertex_new("late",     graph, late_entry, NULL, 1, 0);
+    assert(root && pending && idle && slow && answered && aged && late);
+
+    struct proto *const proto = &test_proto.proto;
+    assert(nt_edge_new(graph, root,    pending,  match_new,   NULL,         index_of_reg, 0,       true,  false, proto, false));
+    assert(nt_edge_new(graph, root,    idle,     match_idle,  NULL,         index_of_reg, 0,       true,  false, proto, false));
+    assert(nt_edge_new(graph, root,    slow,     match_slow,  NULL,         index_of_reg, 0,       true,  false, proto, false));
+    assert(nt_edge_new(graph, pending, answered, match_touch, index_of_key, NULL,         0,       false, false, proto, false));
+    assert(nt_edge_new(graph, pending, aged,     NULL,        NULL,         NULL,         1500000, false, false, proto, false));
+    assert(nt_edge_new(graph, idle,    idle,     match_use,   index_of_key, NULL,         0,       false, false, proto, false));
+    slow_aged = nt_edge_new(graph, slow, aged, NULL, NULL, NULL, 1000000, false, false, proto, false);
+    assert(slow_aged);
+    assert(nt_edge_new(graph, slow,    late,     NULL,        NULL,         NULL,         3000000, false, false, proto, false));
+
+    nt_graph_start(graph);
+    transitions[0] = '\0';
+}
+
+static void check_transitions(char const *expected)
+{
+    assert(0 == strcmp(transitions, expected));
+}
+
+#define AT(s, ms) ((struct timeval){ .tv_sec = (s), .tv_usec = (ms)*1000 })
+
+/*
+ * States age at the first packet once they are old enough (with usec precision), and after
+ * this packet went through the edges, so that a graph takes the same transitions as when
+ * each vertex kept a list of states sorted by age.
+ */
+
+static void ageing_check(void)
+{
+    timers_setup();
+
+    send_pkt_at(OP_NEW, 1, 0, AT(1000, 200));
+    send_pkt_at(OP_NEW, 2, 0, AT(1000, 200));
+    assert(pending->nb_states == 2);
+    // Both are old enough by now, but this packet answers flow 1 before it's aged
+    send_pkt_at(OP_TOUCH, 1, 0, AT(1001, 800));
+    check_transitions("A1 G2 ");
+    send_pkt_at(OP_TOUCH, 2, 0, AT(1001, 900));
+    check_transitions("A1 G2 ");
+    assert(pending->nb_states == 0);
+
+    // Answered on the very second it's due
+    send_pkt_at(OP_NEW, 3, 0, AT(1002, 500));
+    send_pkt_at(OP_NOP, 0, 0, AT(1003, 900));
+    check_transitions("A1 G2 ");
+    send_pkt_at(OP_TOUCH, 3, 0, AT(1004, 0));
+    check_transitions("A1 G2 A3 ");
+
+    // Due in the middle of a second: aged by the first packet after 1007.1, not before nor at the next second
+    send_pkt_at(OP_NEW, 5, 0, AT(1005, 600));
+    send_pkt_at(OP_NOP, 0, 0, AT(1007, 0));
+    send_pkt_at(OP_NOP, 0, 0, AT(1007, 50));
+    check_transitions("A1 G2 A3 ");
+    send_pkt_at(OP_NOP, 0, 0, AT(1007, 150));
+    check_transitions("A1 G2 A3 G5 ");
+    send_pkt_at(OP_TOUCH, 5, 0, AT(1007, 200));
+    check_transitions("A1 G2 A3 G5 ");
+    check_totals(1, 0);
+
+    graph_teardown();
+}
+
+/*
+ * A timeout timer that fires for a state that was used meanwhile is set again
+ */
+
+static void rearm_check(void)
+{
+    timers_setup();
+
+    send_pkt_at(OP_IDLE, 10, 0, AT(2000, 0));
+    send_pkt_at(OP_USE, 10, 0, AT(2001, 500));
+    send_pkt_at(OP_NOP, 0, 0, AT(2002, 100));
+    assert(idle->nb_states == 1);
+    assert(timer_is_set(&TAILQ_FIRST(&idle->index[10 % idle->index_size])->timeout_timer));
+    send_pkt_at(OP_NOP, 0, 0, AT(2003, 900));
+    check_transitions("");
+    send_pkt_at(OP_NOP, 0, 0, AT(2004, 0));
+    check_transitions("T10 ");
+    assert(idle->nb_states == 0);
+
+    graph_teardown();
+}
+
+/*
+ * When its vertex loses its youngest ageing edge, a state is aged along the remaining one
+ */
+
+static void lose_ageing_edge_check(void)
+{
+    timers_setup();
+
+    send_pkt_at(OP_SLOW, 20, 0, AT(3000, 0));
+    nt_edge_del(slow_aged);
+    assert(slow->min_age == 3000000);
+    // Its age timer still fires after 1s, and is set again
+    send_pkt_at(OP_NOP, 0, 0, AT(3001, 500));
+    assert(slow->nb_states == 1);
+    send_pkt_at(OP_NOP, 0, 0, AT(3002, 900));
+    check_transitions("");
+    send_pkt_at(OP_NOP, 0, 0, AT(3003, 0));
+    check_transitions("L20 ");
+    assert(slow->nb_states == 0);
+
+    graph_teardown();
+}
+
+/*
+ * The wheels start at time 0, and the first packets jump to the actual time
+ */
+
+static void first_jump_check(void)
+{
+    timers_setup();
+    time_t const t0 = 1400000000;
+    assert(graph->shards[0].age_wheel.now == 0);
+
+    send_pkt_at(OP_NEW, 30, 0, AT(t0, 300));
+    send_pkt_at(OP_IDLE, 31, 0, AT(t0, 400));
+    assert(graph->shards[0].age_wheel.now == t0);
+    assert(graph->shards[0].timeout_wheel.now == t0);
+    send_pkt_at(OP_NOP, 0, 0, AT(t0+1, 700));
+    check_transitions("");
+    send_pkt_at(OP_NOP, 0, 0, AT(t0+1, 900));
+    check_transitions("G30 ");
+    send_pkt_at(OP_NOP, 0, 0, AT(t0+2, 900));
+    assert(idle->nb_states == 1);
+    send_pkt_at(OP_NOP, 0, 0, AT(t0+3, 0));
+    check_transitions("G30 T31 ");
+    check_totals(1, 0);
+
+    graph_teardown();
+}
+
+/*
+ * Several parser threads updating the same graph, with flows spread over all shards
+ */
+
+#define NB_THREADS 2
+#define NB_FLOWS 1000
+
+static void *parser_thread(void *t_)
+{
+    unsigned const t = (uintptr_t)t_;
+    for (unsigned f = 0; f < NB_FLOWS; f++) {
+        unsigned const id = t * NB_FLOWS + f;
+        unsigned const key = 3*id + 1;
+        send_pkt(OP_NEW, key, 0);
+        send_pkt(OP_MOVE, key, key + 1);
+        send_pkt(OP_SPAWN, key + 1, key + 2);
+        send_pkt(OP_TOUCH, key + 2, 0);
+        if (id & 1) send_pkt(OP_DEL, key + 1, 0);
+    }
+    return NULL;
+}
+
+static void threads_check(void)
+{
+    graph_setup(8);
+
+    pthread_t pth[NB_THREADS];
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_create(pth+t, NULL, parser_thread, (void *)(uintptr_t)t));
+    }
+    for (unsigned t = 0; t < NB_ELEMS(pth); t++) {
+        assert(0 == pthread_join(pth[t], NULL));
+    }
+
+    unsigned const nb_flows = NB_THREADS * NB_FLOWS;
+    assert(nb_touched == nb_flows);
+    check_totals(1 + 2*(nb_flows/2), UINT64_MAX);
+    assert(moved->nb_states == nb_flows/2);
+    assert(child->nb_states == nb_flows/2);
+
+    graph_teardown();
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mallocer_init();
+    objalloc_init();
+    ref_init();
+    proto_init();
+    log_category_nettrack_init();
+    log_set_level(LOG_INFO, NULL);
+    log_set_file("nettrack_check.log");
+    assert(0 == lt_dlinit());
+
+    static struct proto_ops const ops = {
+        .parse      = NULL,
+        .parser_new = uniq_parser_new,
+        .parser_del = uniq_parser_del,
+        .info_addr  = proto_info_addr,
+    };
+    uniq_proto_ctor(&test_proto, &ops, "Test", PROTO_CODE_DUMMY);
+    test_parser = test_proto.proto.ops->parser_new(&test_proto.proto);
+    assert(test_parser);
+
+    shards_check();
+    threads_check();
+    ageing_check();
+    rearm_check();
+    lose_ageing_edge_check();
+    first_jump_check();
+
+    parser_unref(&test_parser);
+    uniq_proto_dtor(&test_proto);
+
+    (void)lt_dlexit();
+    log_category_nettrack_fini();
+    proto_fini();
+    doomer_stop();
+    ref_fini();
+    objalloc_fini();
+    mallocer_fini();
+    ext_fini();
+    log_fini();
+    return EXIT_SUCCESS;
+}
@@ -101,7 +101,7 @@ static void simple_check(void)
         int len = strlen(packets[p]) + 1;
         assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset+len, false, 0, true, NULL, 0, (uint8_t *)packets[p], len, len, &now, len, (uint8_t *)packets[p]));
         offset += len;
-        assert(LIST_EMPTY(&wl.pkts));
+        assert(! wl.first);
     }
 
     // Check we parsed everything
@@ -110,6 +110,33 @@ static void simple_check(void)
     wl_check_teardown();
 }
 
+// Same as simple_check, but using the fast path
+static void in_order_check(void)
+{
+    wl_check_setup();
+    char *packets[] = {
+        "0. La cigale ayant chante",
+        "1. Tout l'ete,",
+        "2. Se trouva fort depourvue",
+    };
+    enum proto_parse_status status;
+    unsigned const len0 = strlen(packets[0]) + 1, len1 = strlen(packets[1]) + 1, len2 = strlen(packets[2]) + 1;
+    assert(pkt_wait_list_parse_in_order(&wl, &status, 0, len0, false, 0, NULL, 0, (uint8_t *)packets[0], len0, len0, &now, len0, (uint8_t *)packets[0]));
+    assert(status == PROTO_OK);
+    assert(wl.next_offset == len0);
+    // Not the one we are waiting for
+    unsigned const offset2 = len0 + len1;
+    assert(! pkt_wait_list_parse_in_order(&wl, &status, offset2, offset2+len2, false, 0, NULL, 0, (uint8_t *)packets[2], len2, len2, &now, len2, (uint8_t *)packets[2]));
+    assert(PROTO_OK == pkt_wait_list_add(&wl, offset2, offset2+len2, false, 0, true, NULL, 0, (uint8_t *)packets[2], len2, len2, &now, len2, (uint8_t *)packets[2]));
+    // Now that a packet is pending we must use the waiting list even for the one we are waiting for
+    assert(! pkt_wait_list_parse_in_order(&wl, &status, len0, offset2, false, 0, NULL, 0, (uint8_t *)packets[1], len1, len1, &now, len1, (uint8_t *)packets[1]));
+    assert(PROTO_OK == pkt_wait_list_add(&wl, len0, offset2, false, 0, true, NULL, 0, (uint8_t *)packets[1], len1, len1, &now, len1, (uint8_t *)packets[1]));
+    assert(! wl.first);
+    assert(next_msg == 3);
+
+    wl_check_teardown();
+}
+
 // Now we send every packets out of order and check that the parse function receives them in correct order
 static void reorder_check(void)
 {
@@ -130,7 +157,7 @@ static void reorder_check(void)
     }
 
     // Check we parsed everything
-    assert(LIST_EMPTY(&wl.pkts));
+    assert(! wl.first);
     assert(next_msg == 4);
 
     wl_check_teardown();
@@ -146,12 +173,99 @@ static void gap_check(void)
     char packet[] = "0. Maitre corbeau sur un arbre perche tenait en son bec un fromage";
     int const len = strlen(packet) + 1;
     assert(PROTO_OK == pkt_wait_list_add(&wl, 0, 0+len, false, 0, true, NULL, 0, (uint8_t *)packet, len, len, &now, len, (uint8_t *)packet));
-    assert(LIST_EMPTY(&wl.pkts));
+    assert(! wl.first);
     assert(next_msg == 1);
 
     wl_check_teardown();
 }
 
+// Check that retransmitted packets are not stored
+static void retransmission_check(void)
+{
+    wl_check_setup();
+
+    char packet[] = "1. Le Lion et le Rat";
+    int const len = strlen(packet) + 1;
+    assert(PROTO_OK == pkt_wait_list_add(&wl, 100, 100+len, false, 0, true, NULL, 0, (uint8_t *)packet, len, len, &now, len, (uint8_t *)packet));
+    assert(wl.nb_pkts == 1);
+    assert(PROTO_OK == pkt_wait_list_add(&wl, 100, 100+len, false, 0, true, NULL, 0, (uint8_t *)packet, len, len, &now, len, (uint8_t *)packet));
+    assert(PROTO_OK == pkt_wait_list_add(&wl, 101, 100+len-1, false, 0, true, NULL, 0, (uint8_t *)packet+1, len-2, len-2, &now, len, (uint8_t *)packet));
+    assert(wl.nb_pkts == 1);
+    // But partially overlapping ones are
+    assert(PROTO_OK == pkt_wait_list_add(&wl, 101, 101+len, false, 0, true, NULL, 0, (uint8_t *)packet, len, len, &now, len, (uint8_t *)packet));
+    assert(wl.nb_pkts == 2);
+
+    pkt_wait_list_dtor(&wl);
+    wl_check_teardown();
+}
+
+/*
+ * Tree checks
+ */
+
+// Check the AVL invariants and return the number of nodes
+static unsigned check_node(struct pkt_wait *pkt)
+{
+    if (! pkt) return 0;
+    struct pkt_wait *const l = pkt->node.left, *const r = pkt->node.right;
+    unsigned max_next_offset = pkt->next_offset;
+    if (l) {
+        assert(l->node.up == pkt);
+        assert(l->offset <= pkt->offset);
+        max_next_offset = MAX(max_next_offset, l->node.max_next_offset);
+    }
+    if (r) {
+        assert(r->node.up == pkt);
+        assert(r->offset >= pkt->offset);
+        max_next_offset = MAX(max_next_offset, r->node.max_next_offset);
+    }
+    assert(pkt->node.max_next_offset == max_next_offset);
+    assert(pkt->node.height == 1 + MAX(node_height(l), node_height(r)));
+    assert(node_height(l) <= node_height(r) + 1 && node_height(r) <= node_height(l) + 1);
+    return 1 + check_node(l) + check_node(r);
+}
+
+static void check_tree(void)
+{
+    assert(! wl.root || ! wl.root->node.up);
+    assert(check_node(wl.root) == wl.nb_pkts);
+    unsigned nb_pkts = 0;
+    for (struct pkt_wait *pkt = wl.first; pkt; pkt = pkt_wait_next(pkt)) {
+        struct pkt_wait *const next = pkt_wait_next(pkt);
+        assert(! next || next->offset > pkt->offset || (next->offset == pkt->offset && timeval_cmp(&next->cap_tv, &pkt->cap_tv) >= 0));
+        nb_pkts ++;
+    }
+    assert(nb_pkts == wl.nb_pkts);
+}
+
+static void tree_check(void)
+{
+    wl_check_setup();
+
+    // Many packets that are never parsable, with frequent equal offsets
+    for (unsigned p = 0; p < 3000; p++) {
+        unsigned const offset = 1 + rand() % 900;
+        now.tv_sec = p;
+        assert(PROTO_OK == pkt_wait_list_add(&wl, offset, offset, false, 0, false, NULL, 0, (uint8_t *)"X", 1, 1, &now, 1, (uint8_t *)"X"));
+        if (p % 100 == 0) check_tree();
+    }
+    check_tree();
+    assert(wl.nb_pkts == 3000);
+
+    // Delete them at random
+    while (wl.nb_pkts > 0) {
+        struct pkt_wait *pkt = wl.first;
+        for (unsigned n = rand() % wl.nb_pkts; n > 0; n--) pkt = pkt_wait_next(pkt);
+        pkt_wait_del(pkt, &wl);
+        if (wl.nb_pkts % 100 == 0) check_tree();
+    }
+    assert(! wl.root && ! wl.first);
+    timeval_reset(&now);
+
+    pkt_wait_list_dtor(&wl);
+    wl_check_teardown();
+}
+
 /*
  * Reassembly checks
  */
@@ -250,8 +364,11 @@ int main(void)
 
     ctor_dtor_check();
     simple_check();
+    in_order_check();
     reorder_check();
     gap_check();
+    retransmission_check();
+    tree_check();
     for (unsigned t = 0; t < 1000; t++) {
         reassembly_check();
     }
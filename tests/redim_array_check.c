@@ -142,6 +142,25 @@ static void check_stress(unsigned nb_entries, unsigned alloc_size)
     redim_array_dtor(&ra);
 }
 
+static void check_bulk(void)
+{
+    struct redim_array ra;
+    assert(0 == redim_array_ctor(&ra, 10, sizeof(struct my_obj), __func__));
+
+    void *cells[25];
+    assert(NB_ELEMS(cells) == redim_array_get_bulk(&ra, cells, NB_ELEMS(cells)));
+    assert(ra.nb_used == NB_ELEMS(cells));
+    for (unsigned c = 1; c < NB_ELEMS(cells); c++) assert(cells[c] != cells[c-1]);
+    check_ra(&ra);
+
+    redim_array_free_bulk(&ra, cells, NB_ELEMS(cells));
+    assert(ra.nb_used == 0);
+    assert(ra.nb_malloced == 0);
+    check_ra(&ra);
+
+    redim_array_dtor(&ra);
+}
+
 int main(void)
 {
     log_init();
@@ -153,6 +172,7 @@ int main(void)
     log_set_file("redim_array_check.log");
 
     check_empty();
+    check_bulk();
     check_stress(10, 1);
     check_stress(100, 10);
     check_stress(1000, 100);
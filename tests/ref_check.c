@@ -0,0 +1,171 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/cpp.h>
+#include <junkie/tools/ext.h>
+#include <junkie/tools/log.h>
+#include <junkie/tools/mutex.h>
+#include <junkie/tools/ref.h>
+
+struct obj {
+    struct ref ref;
+    struct obj *child;  // we own a ref on it
+    bool deleted;
+};
+
+static void obj_del(struct ref *ref)
+{
+    struct obj *obj = DOWNCAST(ref, ref, obj);
+    assert(! obj->deleted);
+    ref_dtor(&obj->ref);
+    obj->deleted = true;
+    if (obj->child) unref(&obj->child->ref);
+}
+
+static void obj_ctor(struct obj *obj, struct obj *child)
+{
+    ref_ctor(&obj->ref, obj_del);
+    obj->child = child ? ref(&child->ref) : NULL;
+    obj->deleted = false;
+}
+
+static void grace_check(void)
+{
+    struct obj a;
+    obj_ctor(&a, NULL);
+
+    // While we are in the multi region we may still use it
+    enter_multi_region();
+    unref(&a.ref);
+    doomer_run();
+    assert(! a.deleted);
+    leave_protected_region();
+
+    doomer_run();
+    assert(a.deleted);
+}
+
+static void nested_check(void)
+{
+    struct obj a;
+    obj_ctor(&a, NULL);
+
+    enter_multi_region();
+    enter_multi_region();
+    unref(&a.ref);
+    leave_protected_region();
+    doomer_run();
+    assert(! a.deleted);    // still in the outer multi region
+    leave_protected_region();
+
+    doomer_run();
+    assert(a.deleted);
+}
+
+static void rescue_check(void)
+{
+    struct obj a;
+    obj_ctor(&a, NULL);
+
+    enter_multi_region();
+    unref(&a.ref);
+    doomer_run();
+    (void)ref(&a.ref);  // from 0 to 1
+    leave_protected_region();
+
+    doomer_run();
+    assert(! a.deleted);
+
+    // Once unreachable again, it's deleted as usual
+    unref(&a.ref);
+    doomer_run();
+    assert(a.deleted);
+}
+
+static void cascade_check(void)
+{
+    struct obj a, b, c;
+    obj_ctor(&c, NULL);
+    obj_ctor(&b, &c);
+    obj_ctor(&a, &b);
+    unref(&c.ref);
+    unref(&b.ref);
+    assert(! b.deleted && ! c.deleted);
+
+    unref(&a.ref);
+    doomer_run();
+    assert(a.deleted && b.deleted && c.deleted);
+}
+
+static bool volatile in_multi, left_multi;
+
+static void *multi_thread(void unused_ *dummy)
+{
+    enter_multi_region();
+    in_multi = true;
+    usleep(10000);
+    left_multi = true;
+    leave_protected_region();
+    return NULL;
+}
+
+static void mono_check(void)
+{
+    pthread_t pth;
+    in_multi = left_multi = false;
+    assert(0 == pthread_create(&pth, NULL, multi_thread, NULL));
+    while (! in_multi) usleep(100);
+
+    enter_mono_region();
+    assert(left_multi);
+    leave_protected_region();
+
+    assert(0 == pthread_join(pth, NULL));
+}
+
+static void grace_period_check(void)
+{
+    pthread_t pth;
+    in_multi = left_multi = false;
+    assert(0 == pthread_create(&pth, NULL, multi_thread, NULL));
+    while (! in_multi) usleep(100);
+
+    // Our own multi region does not count
+    enter_multi_region();
+    wait_grace_period();
+    assert(left_multi);
+    leave_protected_region();
+
+    assert(0 == pthread_join(pth, NULL));
+}
+
+int main(void)
+{
+    log_init();
+    ext_init();
+    mutex_init();
+    ref_init();
+    log_set_level(LOG_DEBUG, NULL);
+    log_set_file("ref_check.log");
+
+    doomer_stop();  // we will run it ourself
+
+    grace_check();
+    nested_check();
+    rescue_check();
+    cascade_check();
+    mono_check();
+    grace_period_check();
+
+    ref_fini();
+    mutex_fini();
+    ext_fini();
+    log_fini();
+
+    return EXIT_SUCCESS;
+}
@@ -19,10 +19,9 @@ static struct streambuf sbuf;
 static unsigned nb_calls = 0;
 static unsigned nb_chunks = 0;
 
-enum proto_parse_status parse(struct parser *parser, struct proto_info unused_ *info, unsigned way, uint8_t const *packet, size_t cap_len, size_t unused_ wire_len, struct timeval const unused_ *now, size_t unused_ tot_cap_len, uint8_t const unused_ *tot_packet)
+// Count the sentences, and return the offset of the end of the last one
+static size_t parse_sentences(uint8_t const *packet, size_t cap_len)
 {
-    struct streambuf *sbuf = (struct streambuf *)parser;
-
     assert(cap_len > 0);
     SLOG(LOG_DEBUG, "Parse called on payload '%.*s'", (int)cap_len, packet);
     assert(packet[0] >= 'A' && packet[0] <= 'Z');   // Since we ask for the sentences to be given in full.
@@ -38,19 +37,59 @@ enum proto_parse_status parse(struct parser *parser, struct proto_info unused_ *
         }
     }
 
+    return last_punct+1;
+}
+
+enum proto_parse_status parse(struct parser *parser, struct proto_info unused_ *info, unsigned way, uint8_t const *packet, size_t cap_len, size_t unused_ wire_len, struct timeval const unused_ *now, size_t unused_ tot_cap_len, uint8_t const unused_ *tot_packet)
+{
+    struct streambuf *sbuf = (struct streambuf *)parser;
+
     // we are probably in the middle of a chunk. Remember up to last_punct seen
-    streambuf_set_restart(sbuf, way, packet + (last_punct+1), true);
+    streambuf_set_restart(sbuf, way, packet + parse_sentences(packet, cap_len), true);
 
     return PROTO_OK;
 }
 
-static void setup(void)
+// Tells whether a '.' or a ':' was received, reading all segments
+static bool has_punct(struct streambuf_cursor *cursor)
+{
+    uint8_t first;
+    assert(0 == streambuf_cursor_read(cursor, &first, 1));
+    assert(first >= 'A' && first <= 'Z');
+
+    uint8_t const *chunk;
+    size_t len;
+    while (NULL != (chunk = streambuf_cursor_peek(cursor, &len))) {
+        if (memchr(chunk, '.', len) || memchr(chunk, ':', len)) return true;
+        assert(0 == streambuf_cursor_drop(cursor, len));
+    }
+    assert(cursor->rem_size == 0);
+    assert(0 != streambuf_cursor_drop(cursor, 1));
+    return false;
+}
+
+enum proto_parse_status parse_ready(struct parser *parser, struct proto_info unused_ *info, unsigned way, uint8_t const *packet, size_t cap_len, size_t unused_ wire_len, struct timeval const unused_ *now, size_t unused_ tot_cap_len, uint8_t const unused_ *tot_packet)
+{
+    struct streambuf *sbuf = (struct streambuf *)parser;
+
+    // Same as above, but do not call us again before a punctuation is received
+    streambuf_set_restart_ready(sbuf, way, packet + parse_sentences(packet, cap_len), has_punct);
+
+    return PROTO_OK;
+}
+
+static void setup_with(parse_fun *parse)
 {
     nb_calls = 0;
     nb_chunks = 0;
     assert(0 == streambuf_ctor(&sbuf, parse, 80));
 }
 
+static void setup(void)
+{
+    setup_with(parse);
+}
+
 static void teardown(void)
 {
     streambuf_dtor(&sbuf);
@@ -91,6 +130,25 @@ static void check_vicious(void)
     teardown();
 }
 
+// Same as above, but with a streambuf_ready function so that we are called only when needed
+static void check_ready(void)
+{
+    setup_with(parse_ready);
+
+    for (unsigned p = 0; p < NB_ELEMS(payloads); p++) {
+        size_t len = strlen(payloads[p]);
+        for (unsigned c = 0; c < len; c++) {
+            enum proto_parse_status status = streambuf_add(&sbuf, (struct parser *)&sbuf, NULL, 0, (uint8_t *)(payloads[p]+c), 1, 1, NULL, 1, (uint8_t *)(payloads[p]+c));
+            assert(status == PROTO_OK);
+        }
+    }
+
+    assert(nb_chunks == 2);
+    assert(nb_calls == 3);  // the very first byte, then each punctuation
+
+    teardown();
+}
+
 // Now we check that we do not buffer more than 80 bytes (see streambuf_ctor)
 static void check_drop(void)
 {
@@ -119,6 +177,7 @@ int main(void)
 
     check_simple();
     check_vicious();
+    check_ready();
     check_drop();
 
     streambuf_fini();
@@ -0,0 +1,133 @@
+// -*- c-basic-offset: 4; c-backslash-column: 79; indent-tabs-mode: nil -*-
+// vim:sw=4 ts=4 sts=4 expandtab
+#include <stdlib.h>
+#undef NDEBUG
+#include <assert.h>
+#include <junkie/cpp.h>
+#include "tools/timer_wheel.c"
+
+struct my_timer {
+    struct timer timer;
+    time_t expiry;  // when we expect it to fire
+    time_t fired;   // when it fired (or 0)
+};
+
+static void fire(struct timer *timer, time_t now, void *userdata)
+{
+    struct my_timer *t = DOWNCAST(timer, timer, my_timer);
+    assert(! timer_is_set(timer));
+    assert(t->fired == 0);
+    t->fired = now;
+    (*(unsigned *)userdata) ++;
+}
+
+static void basic_check(void)
+{
+    struct timer_wheel wheel;
+    time_t const start = 1371700000;
+    timer_wheel_ctor(&wheel, start);
+
+    struct my_timer a = { .expiry = start + 1 }, b = { .expiry = start + 100 }, c = { .expiry = start + 5 };
+    timer_ctor(&a.timer);
+    timer_ctor(&b.timer);
+    timer_ctor(&c.timer);
+    timer_add(&wheel, &a.timer, a.expiry);
+    timer_add(&wheel, &b.timer, b.expiry);
+    timer_add(&wheel, &c.timer, start - 10);    // in the past, so due next second
+    assert(wheel.nb_timers == 3);
+
+    unsigned count = 0;
+    assert(0 == timer_wheel_advance(&wheel, start, fire, &count));
+    assert(2 == timer_wheel_advance(&wheel, start + 1, fire, &count));
+    assert(a.fired == start + 1 && c.fired == start + 1);
+
+    // Rescheduling
+    timer_add(&wheel, &b.timer, start + 200);
+    timer_del(&wheel, &a.timer);    // no-op
+    assert(0 == timer_wheel_advance(&wheel, start + 199, fire, &count));
+    assert(1 == timer_wheel_advance(&wheel, start + 1000, fire, &count));
+    assert(b.fired == start + 200);
+    assert(count == 3);
+    assert(wheel.nb_timers == 0);
+
+    // Jumps over the whole span
+    b.fired = 0;
+    timer_add(&wheel, &b.timer, start + 1010);
+    timer_add(&wheel, &c.timer, start + 1000 + 2*TIMER_WHEEL_SPAN);
+    c.fired = 0;
+    assert(1 == timer_wheel_advance(&wheel, start + 1000 + TIMER_WHEEL_SPAN, fire, &count));
+    assert(b.fired == start + 1000 + TIMER_WHEEL_SPAN);
+    assert(c.fired == 0 && timer_is_set(&c.timer));
+    timer_del(&wheel, &c.timer);
+    assert(wheel.nb_timers == 0);
+
+    timer_wheel_dtor(&wheel);
+}
+
+// Compare with a brute force implementation
+static void random_check(void)
+{
+    struct timer_wheel wheel;
+    time_t now = 1371700000;
+    timer_wheel_ctor(&wheel, now);
+
+    static struct my_timer timers[2000];
+    for (unsigned t = 0; t < NB_ELEMS(timers); t++) {
+        timer_ctor(&timers[t].timer);
+        timers[t].expiry = 0;
+    }
+
+    unsigned count = 0;
+    for (unsigned round = 0; round < 20000; round++) {
+        struct my_timer *t = timers + (rand() % NB_ELEMS(timers));
+        switch (rand() % 4) {
+            case 0:
+            case 1:;
+                // Favor short delays, but also test the upper levels
+                time_t const delay = rand() % 3 ? rand() % 100 : rand() % (TIMER_WHEEL_SPAN + 10000);
+                t->expiry = now + 1 + delay;
+                t->fired = 0;
+                timer_add(&wheel, &t->timer, t->expiry);
+                break;
+            case 2:
+                timer_del(&wheel, &t->timer);
+                t->expiry = 0;
+                break;
+            case 3:;
+                time_t const step = rand() % 10 ? rand() % 5 : rand() % 100000;
+                for (unsigned i = 0; i < NB_ELEMS(timers); i++) timers[i].fired = 0;
+                unsigned nb_expired = 0, nb_fired = 0;
+                nb_expired = timer_wheel_advance(&wheel, now + step, fire, &nb_fired);
+                assert(nb_expired == nb_fired);
+                unsigned nb_due = 0;
+                for (unsigned i = 0; i < NB_ELEMS(timers); i++) {
+                    struct my_timer *const tt = timers + i;
+                    if (! tt->expiry) continue;
+                    if (tt->expiry <= now + step) {
+                        // Must have fired, on time unless we jumped over the whole span
+                        nb_due ++;
+                        assert(tt->fired);
+                        assert(step >= TIMER_WHEEL_SPAN || tt->fired == tt->expiry);
+                        tt->expiry = 0;
+                    } else {
+                        assert(! tt->fired);
+                        assert(timer_is_set(&tt->timer));
+                    }
+                }
+                assert(nb_due == nb_expired);
+                count += nb_expired;
+                now += step;
+                break;
+        }
+    }
+    assert(count > 0);
+
+    timer_wheel_dtor(&wheel);
+}
+
+int main(void)
+{
+    basic_check();
+    random_check();
+    return EXIT_SUCCESS;
+}